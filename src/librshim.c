@@ -0,0 +1,179 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2019 Mellanox Technologies. All Rights Reserved.
+ *
+ */
+
+#define _GNU_SOURCE     /* for POLLRDHUP */
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "librshim.h"
+
+#ifdef __FreeBSD__
+#define LIBRSHIM_SOCK_DIR       "/var/run/rshim"
+#else
+#define LIBRSHIM_SOCK_DIR       "/run/rshim"
+#endif
+
+/* Receive the response and the BAR fd of a lease request. */
+static int librshim_lease_recv(int sock, rshim_lease_rsp_t *rsp, int *bar_fd)
+{
+  char cbuf[CMSG_SPACE(sizeof(int))];
+  struct cmsghdr *cmsg;
+  struct msghdr msg;
+  struct iovec iov;
+  ssize_t len;
+
+  *bar_fd = -1;
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = rsp;
+  iov.iov_len = sizeof(*rsp);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+
+  do {
+    len = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  } while (len < 0 && errno == EINTR);
+  if (len < 0)
+    return -errno;
+
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+      memcpy(bar_fd, CMSG_DATA(cmsg), sizeof(int));
+  }
+
+  if (len != sizeof(*rsp) || rsp->magic != RSHIM_LEASE_MAGIC)
+    return -EPROTO;
+
+  if (rsp->status)
+    return rsp->status;
+
+  return *bar_fd >= 0 ? 0 : -EPROTO;
+}
+
+librshim_lease_t *librshim_lease_open(int index, const char *const *regs,
+                                      int count, int flags)
+{
+  struct sockaddr_un addr;
+  librshim_lease_t *lease;
+  rshim_lease_req_t req;
+  rshim_lease_rsp_t rsp;
+  int i, rc, bar_fd = -1;
+
+  if (count <= 0 || count > RSHIM_LEASE_MAX_REGS) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  memset(&req, 0, sizeof(req));
+  req.magic = RSHIM_LEASE_MAGIC;
+  req.version = RSHIM_LEASE_VERSION;
+  req.count = count;
+  for (i = 0; i < count; i++) {
+    if (strlen(regs[i]) >= RSHIM_LEASE_NAME_LEN) {
+      errno = EINVAL;
+      return NULL;
+    }
+    strcpy(req.reg[i].name, regs[i]);
+    req.reg[i].flags = flags & RSHIM_LEASE_WRITE;
+  }
+
+  lease = calloc(1, sizeof(*lease));
+  if (!lease)
+    return NULL;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/rshim%d.lease",
+           LIBRSHIM_SOCK_DIR, index);
+
+  lease->sock_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (lease->sock_fd < 0) {
+    rc = -errno;
+    goto fail;
+  }
+
+  if (connect(lease->sock_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+      send(lease->sock_fd, &req, sizeof(req), MSG_NOSIGNAL) != sizeof(req)) {
+    rc = -errno;
+    goto fail;
+  }
+
+  rc = librshim_lease_recv(lease->sock_fd, &rsp, &bar_fd);
+  if (rc)
+    goto fail;
+
+  for (i = 0; i < count; i++) {
+    if (rsp.offset[i] + sizeof(uint64_t) > rsp.bar_size) {
+      rc = -EPROTO;
+      goto fail;
+    }
+  }
+
+  lease->map_size = rsp.bar_size;
+  lease->map = mmap(NULL, lease->map_size,
+                    PROT_READ |
+                    ((flags & RSHIM_LEASE_WRITE) ? PROT_WRITE : 0),
+                    MAP_SHARED, bar_fd, (off_t)rsp.map_offset);
+  if (lease->map == MAP_FAILED) {
+    rc = -errno;
+    lease->map = NULL;
+    goto fail;
+  }
+
+  /* The mapping keeps the BAR open. */
+  close(bar_fd);
+
+  lease->ver_id = rsp.ver_id;
+  lease->count = count;
+  for (i = 0; i < count; i++)
+    lease->reg[i] = (volatile uint8_t *)lease->map + rsp.offset[i];
+
+  return lease;
+
+fail:
+  if (bar_fd >= 0)
+    close(bar_fd);
+  if (lease->sock_fd >= 0)
+    close(lease->sock_fd);
+  free(lease);
+  errno = -rc;
+  return NULL;
+}
+
+int librshim_lease_check(librshim_lease_t *lease)
+{
+  struct pollfd pfd;
+
+  pfd.fd = lease->sock_fd;
+  pfd.events = POLLIN | POLLRDHUP;
+  pfd.revents = 0;
+
+  if (poll(&pfd, 1, 0) > 0 && pfd.revents)
+    return -ESHUTDOWN;
+
+  return 0;
+}
+
+void librshim_lease_close(librshim_lease_t *lease)
+{
+  if (!lease)
+    return;
+
+  if (lease->map)
+    munmap(lease->map, lease->map_size);
+  close(lease->sock_fd);
+  free(lease);
+}
@@ -0,0 +1,75 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Copyright (C) 2019 Mellanox Technologies. All Rights Reserved.
+ *
+ */
+
+#ifndef _LIBRSHIM_H
+#define _LIBRSHIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rshim_lease.h"
+
+/*
+ * librshim: direct access to RShim registers leased from the rshim daemon.
+ *
+ * librshim_lease_open() asks the daemon for the registers, each by name or
+ * as "<channel>:<offset>" (see rshim_lease.h), and maps the BAR of the
+ * device into the process. The registers are then accessed with
+ * librshim_readq() and librshim_writeq() without any system call, by their
+ * index in the request. Only the registers of the lease must be accessed,
+ * as the daemon and the other clients keep using the rest of the BAR.
+ *
+ * The daemon ends the leases when it stops using the BAR, such as when
+ * the device enters drop mode, a NIC or DPU reset starts or the daemon
+ * exits. It only shuts the connection down: the BAR stays mapped and the
+ * registers still look accessible, but must not be used anymore. So a
+ * client must call librshim_lease_check() before each burst of accesses,
+ * and close the lease promptly once it fails; the device can't be detached
+ * from VFIO while it's still mapped.
+ */
+
+typedef struct {
+  int sock_fd;                          /* connection to the daemon */
+  void *map;
+  size_t map_size;
+  int ver_id;                           /* BlueField version */
+  int count;
+  volatile uint8_t *reg[RSHIM_LEASE_MAX_REGS];
+} librshim_lease_t;
+
+/*
+ * Lease <count> registers of device rshim<index>, for reading, or also for
+ * writing with RSHIM_LEASE_WRITE in <flags>. Returns NULL with errno set
+ * on failure, such as EACCES if a register is not on the LEASE_REG list
+ * of the daemon or EBUSY if another client leased it.
+ */
+librshim_lease_t *librshim_lease_open(int index, const char *const *regs,
+                                      int count, int flags);
+
+/*
+ * Returns 0 if the lease is still valid, or -ESHUTDOWN. To be called before
+ * each burst of accesses.
+ */
+int librshim_lease_check(librshim_lease_t *lease);
+
+/* Unmap the BAR and give the registers back to the daemon. */
+void librshim_lease_close(librshim_lease_t *lease);
+
+static inline uint64_t librshim_readq(const librshim_lease_t *lease, int i)
+{
+  uint64_t value = *(const volatile uint64_t *)lease->reg[i];
+  __sync_synchronize();
+  return value;
+}
+
+static inline void librshim_writeq(const librshim_lease_t *lease, int i,
+                                   uint64_t value)
+{
+  __sync_synchronize();
+  *(volatile uint64_t *)lease->reg[i] = value;
+}
+
+#endif /* _LIBRSHIM_H */
@@ -4,6 +4,10 @@
  *
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE     /* for pthread_setaffinity_np() */
+#endif
+
 #include <arpa/inet.h>
 #include <getopt.h>
 #include <netinet/in.h>
@@ -22,15 +26,17 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#ifdef __linux__
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
 
 #include "rshim.h"
 #include "rshim_regs.h"
 
 #define REVISION "19"
 
-/* Maximum number of devices supported (currently it's limited to 64). */
-#define RSHIM_MAX_DEV 64
-
 /* RShim timer interval in milliseconds. */
 #define RSHIM_TIMER_INTERVAL 1
 
@@ -196,6 +202,13 @@ bool rshim_has_pcie_reset_delay = false;
 int rshim_pcie_enable_vfio = 1;
 int rshim_pcie_enable_uio = 1;
 int rshim_pcie_intr_poll_interval = 10;  /* Interrupt polling in milliseconds */
+int rshim_fuse_threads = 4;  /* CUSE worker threads per device file */
+bool rshim_cons_sock_enable = false;
+bool rshim_cons_ts_enable = false;
+static char rshim_cpu_affinity[64];  /* "auto", CPU list or empty */
+int rshim_peer_refresh_interval;     /* seconds, 0 to refresh on read */
+static volatile sig_atomic_t rshim_reload_pending;
+static volatile sig_atomic_t rshim_trace_dump_pending;
 
 /* Array of devices and device names. */
 rshim_backend_t *rshim_devs[RSHIM_MAX_DEV];
@@ -419,6 +432,8 @@ static ssize_t rshim_write_delayed(rshim_backend_t *bd, int devtype,
       if (avail > 0)
         break;
 
+      RSHIM_PROBE3(fifo_full, bd->index, devtype, (int)(reg & size_mask));
+
       if (devtype == RSH_DEV_TYPE_BOOT)
         goto done;
 
@@ -494,6 +509,16 @@ static ssize_t rshim_write_default(rshim_backend_t *bd, int devtype,
   }
 }
 
+/*
+ * Whether the backend has its own bulk transfers. Otherwise they go through
+ * the register path, whose accesses are seen by the wrappers of read_rshim
+ * and write_rshim.
+ */
+bool rshim_has_bulk(rshim_backend_t *bd)
+{
+  return bd->read && bd->read != rshim_read_default;
+}
+
 /* Boot file operations routines */
 
 /*
@@ -546,40 +571,6 @@ static int wait_for_boot_done(rshim_backend_t *bd)
   return 0;
 }
 
-static inline uint64_t
-readq(const volatile void *addr)
-{
-  uint64_t value = *(const volatile uint64_t *)addr;
-  __sync_synchronize();
-  return value;
-}
-
-static inline void
-writeq(uint64_t value, volatile void *addr)
-{
-  __sync_synchronize();
-  *(volatile uint64_t *)addr = value;
-}
-
-static int reg_indirect_wait(uint8_t *dev_regs, uint64_t resp_count){
-  int rc, retries = 1000;
-  uint64_t count;
-
-  while (retries--) {
-    // rc = bd->read_rshim(bd, RSHIM_CHANNEL, bd->regs->mem_acc_rsp_cnt, &count, RSHIM_REG_SIZE_8B);
-    uint32_t chan = RSH_MMIO_ADDRESS_SPACE__CHANNEL_VAL_RSHIM;
-    uint32_t addr = RSH_MEM_ACC_RSP_CNT | (chan << 16);
-    count = readq(dev_regs + addr);
-    // if (rc)
-    //   return rc;
-    if (count != resp_count)
-      return 0;
-  }
-  RSHIM_DBG("Rshim byte access widget timeout\n");
-  return -1;
-
-}    
-
 static int rshim_reg_indirect_wait(rshim_backend_t *bd, uint64_t resp_count)
 {
   int rc, retries = 1000;
@@ -596,129 +587,256 @@ static int rshim_reg_indirect_wait(rshim_backend_t *bd, uint64_t resp_count)
   return -1;
 }
 
-static int mmio_write(uint8_t *dev_regs, uintptr_t pa,
-                                    uint8_t size, uint64_t data)
+/* Control word of a MEM_ACC request. */
+static inline uint64_t rshim_mem_acc_ctl(uintptr_t pa, uint8_t size,
+                                         bool write)
 {
-  uint64_t reg, resp_count;
-
-  // bd->read_rshim(bd, RSHIM_CHANNEL, bd->regs->device_mstr_priv_lvl, &reg, RSHIM_REG_SIZE_8B);
-  uint32_t chan = RSH_MMIO_ADDRESS_SPACE__CHANNEL_VAL_RSHIM;
-  uint32_t addr = RSH_DEVICE_MSTR_PRIV_LVL | (chan << 16);
-  reg = readq(dev_regs + addr);
-  reg |= 0x1ULL << RSH_DEVICE_MSTR_PRIV_LVL__MEM_ACC_LVL_SHIFT;
-
-  // bd->write_rshim(bd, RSHIM_CHANNEL, bd->regs->device_mstr_priv_lvl, reg, RSHIM_REG_SIZE_8B);
-  writeq(reg, dev_regs + addr);
-
-  // bd->read_rshim(bd, RSHIM_CHANNEL, bd->regs->mem_acc_rsp_cnt, &resp_count, RSHIM_REG_SIZE_8B);
-  addr = RSH_MEM_ACC_RSP_CNT | (chan << 16);
-  resp_count = readq(dev_regs + addr);
-
-  // bd->write_rshim(bd, RSHIM_CHANNEL, bd->regs->mem_acc_data_first_word, data, RSHIM_REG_SIZE_8B);
-  addr = RSH_MEM_ACC_DATA__FIRST_WORD | (chan << 16);
-  writeq(data, dev_regs + addr);
-
-  reg = (((uint64_t)pa & RSH_MEM_ACC_CTL__ADDRESS_RMASK) <<
-           RSH_MEM_ACC_CTL__ADDRESS_SHIFT) |
-        (((uint64_t)size & RSH_MEM_ACC_CTL__SIZE_RMASK) <<
-          RSH_MEM_ACC_CTL__SIZE_SHIFT) |
-        (1ULL << RSH_MEM_ACC_CTL__WRITE_SHIFT) |
-        (1ULL << RSH_MEM_ACC_CTL__SEND_SHIFT);
+  return (((uint64_t)pa & RSH_MEM_ACC_CTL__ADDRESS_RMASK) <<
+            RSH_MEM_ACC_CTL__ADDRESS_SHIFT) |
+         (((uint64_t)size & RSH_MEM_ACC_CTL__SIZE_RMASK) <<
+            RSH_MEM_ACC_CTL__SIZE_SHIFT) |
+         ((uint64_t)write << RSH_MEM_ACC_CTL__WRITE_SHIFT) |
+         (1ULL << RSH_MEM_ACC_CTL__SEND_SHIFT);
+}
 
-  // bd->write_rshim(bd, RSHIM_CHANNEL, bd->regs->mem_acc_ctl, reg, RSHIM_REG_SIZE_8B);
-  addr = RSH_MEM_ACC_CTL | (chan << 16);
-  writeq(reg, dev_regs +addr);
+/* Give the MEM_ACC widget the privilege to access the memory. */
+static int rshim_mem_acc_enable(rshim_backend_t *bd)
+{
+  uint64_t reg;
+  int rc;
 
-  // return rshim_reg_indirect_wait(bd, resp_count);
-  printf("start waiting\n");
-  return reg_indirect_wait(dev_regs, resp_count);
+  rc = bd->read_rshim(bd, RSHIM_CHANNEL, bd->regs->device_mstr_priv_lvl, &reg, RSHIM_REG_SIZE_8B);
+  if (rc)
+    return rc;
+  reg |= 0x1ULL << bd->regs->device_mstr_priv_lvl_shift;
+  return bd->write_rshim(bd, RSHIM_CHANNEL, bd->regs->device_mstr_priv_lvl, reg, RSHIM_REG_SIZE_8B);
 }
 
 static int rshim_mmio_write_common(rshim_backend_t *bd, uintptr_t pa,
                                     uint8_t size, uint64_t data)
 {
-  uint64_t reg, resp_count;
+  uint64_t resp_count;
 
-  bd->read_rshim(bd, RSHIM_CHANNEL, bd->regs->device_mstr_priv_lvl, &reg, RSHIM_REG_SIZE_8B);
-  reg |= 0x1ULL << bd->regs->device_mstr_priv_lvl_shift;
-  bd->write_rshim(bd, RSHIM_CHANNEL, bd->regs->device_mstr_priv_lvl, reg, RSHIM_REG_SIZE_8B);
+  rshim_mem_acc_enable(bd);
 
   bd->read_rshim(bd, RSHIM_CHANNEL, bd->regs->mem_acc_rsp_cnt, &resp_count, RSHIM_REG_SIZE_8B);
   bd->write_rshim(bd, RSHIM_CHANNEL, bd->regs->mem_acc_data_first_word, data, RSHIM_REG_SIZE_8B);
-  reg = (((uint64_t)pa & RSH_MEM_ACC_CTL__ADDRESS_RMASK) <<
-           RSH_MEM_ACC_CTL__ADDRESS_SHIFT) |
-        (((uint64_t)size & RSH_MEM_ACC_CTL__SIZE_RMASK) <<
-          RSH_MEM_ACC_CTL__SIZE_SHIFT) |
-        (1ULL << RSH_MEM_ACC_CTL__WRITE_SHIFT) |
-        (1ULL << RSH_MEM_ACC_CTL__SEND_SHIFT);
-  bd->write_rshim(bd, RSHIM_CHANNEL, bd->regs->mem_acc_ctl, reg, RSHIM_REG_SIZE_8B);
+  bd->write_rshim(bd, RSHIM_CHANNEL, bd->regs->mem_acc_ctl,
+                  rshim_mem_acc_ctl(pa, size, true), RSHIM_REG_SIZE_8B);
   return rshim_reg_indirect_wait(bd, resp_count);
 }
 
-static int mmio_read(uint8_t *dev_regs, uintptr_t pa,
-                                    uint8_t size, uint64_t *data)
+static int rshim_mmio_read_common(rshim_backend_t *bd, uintptr_t pa,
+                                  uint8_t size, uint64_t *data)
 {
   uint64_t reg, resp_count;
-  
-  // bd->read_rshim(bd, RSHIM_CHANNEL, bd->regs->device_mstr_priv_lvl, &reg, RSHIM_REG_SIZE_8B);
-  uint32_t chan = RSH_MMIO_ADDRESS_SPACE__CHANNEL_VAL_RSHIM;
-  uint32_t addr = RSH_DEVICE_MSTR_PRIV_LVL | (chan << 16);
-  reg = readq(dev_regs + addr);
-  reg |= 0x1ULL << RSH_DEVICE_MSTR_PRIV_LVL__MEM_ACC_LVL_SHIFT;
-
-  //bd->write_rshim(bd, RSHIM_CHANNEL, bd->regs->device_mstr_priv_lvl, reg, RSHIM_REG_SIZE_8B);
-  writeq(reg, dev_regs + addr);
-
-  // bd->read_rshim(bd, RSHIM_CHANNEL, bd->regs->mem_acc_rsp_cnt, &resp_count, RSHIM_REG_SIZE_8B);
-  addr = RSH_MEM_ACC_RSP_CNT | (chan << 16);
-  resp_count = readq(dev_regs + addr);
-
-  reg = (((uint64_t)pa & RSH_MEM_ACC_CTL__ADDRESS_RMASK) <<
-           RSH_MEM_ACC_CTL__ADDRESS_SHIFT) |
-        (((uint64_t)size & RSH_MEM_ACC_CTL__SIZE_RMASK) <<
-          RSH_MEM_ACC_CTL__SIZE_SHIFT) |
-        (1ULL << RSH_MEM_ACC_CTL__SEND_SHIFT);
-
-  // bd->write_rshim(bd, RSHIM_CHANNEL, bd->regs->mem_acc_ctl, reg, RSHIM_REG_SIZE_8B);
-  addr = RSH_MEM_ACC_CTL | (chan << 16);
-  writeq(reg, addr);
-
-  if (reg_indirect_wait(dev_regs, resp_count))
+
+  rshim_mem_acc_enable(bd);
+
+  bd->read_rshim(bd, RSHIM_CHANNEL, bd->regs->mem_acc_rsp_cnt, &resp_count, RSHIM_REG_SIZE_8B);
+  bd->write_rshim(bd, RSHIM_CHANNEL, bd->regs->mem_acc_ctl,
+                  rshim_mem_acc_ctl(pa, size, false), RSHIM_REG_SIZE_8B);
+
+  if (rshim_reg_indirect_wait(bd, resp_count))
     return -1;
 
-  // bd->read_rshim(bd, RSHIM_CHANNEL, bd->regs->mem_acc_data_first_word, &reg, RSHIM_REG_SIZE_8B);
-  addr = RSH_MEM_ACC_DATA__FIRST_WORD | (chan << 16);
-  *data = readq(dev_regs + addr);
+  bd->read_rshim(bd, RSHIM_CHANNEL, bd->regs->mem_acc_data_first_word, &reg, RSHIM_REG_SIZE_8B);
+  *data = reg;
 
   return 0;
+}
+
+/*
+ * Bulk transfers through the MEM_ACC widget, for /dev/rshim<N>/mem.
+ *
+ * Unlike rshim_mmio_read_common() and rshim_mmio_write_common(), which
+ * cost six register accesses per 4-byte word, the widget privilege is set
+ * once per chunk and the response count is tracked instead of read before
+ * each request, so an 8-byte word costs a request, one or more response
+ * count polls and the data access. The requests and the data writes are
+ * posted when the backend supports it (USB), as they stay ordered against
+ * the blocking reads; the MEM_ACC data register holds one word, so a
+ * request can't be issued before the previous one has completed. The
+ * device mutex is released between chunks so a long transfer doesn't hold
+ * up the console and the network.
+ */
+#define RSHIM_MEM_CHUNK_WORDS   64
+
+/*
+ * Response polling: a few back-to-back reads, as the response is usually
+ * there by then, then sleeps doubling up to RSHIM_MEM_ACC_MAX_DELAY until
+ * RSHIM_MEM_ACC_TIMEOUT has been slept (in us).
+ */
+#define RSHIM_MEM_ACC_SPINS     16
+#define RSHIM_MEM_ACC_MAX_DELAY 1000
+#define RSHIM_MEM_ACC_TIMEOUT   100000
+
+static int rshim_mem_acc_post(rshim_backend_t *bd, uint32_t addr,
+                              uint64_t value)
+{
+  if (bd->write_rshim_posted &&
+      !bd->write_rshim_posted(bd, RSHIM_CHANNEL, addr, value,
+                              RSHIM_REG_SIZE_8B))
+    return 0;
 
+  return bd->write_rshim(bd, RSHIM_CHANNEL, addr, value, RSHIM_REG_SIZE_8B);
 }
 
-static int rshim_mmio_read_common(rshim_backend_t *bd, uintptr_t pa,
-                                  uint8_t size, uint64_t *data)
+/* Wait for the response of the last request, updating the count. */
+static int rshim_mem_acc_wait(rshim_backend_t *bd, uint64_t *resp_count)
 {
-  uint64_t reg, resp_count;
+  int rc, spins = RSHIM_MEM_ACC_SPINS, delay = 1, slept = 0;
+  uint64_t count;
 
-  bd->read_rshim(bd, RSHIM_CHANNEL, bd->regs->device_mstr_priv_lvl, &reg, RSHIM_REG_SIZE_8B);
-  reg |= 0x1ULL << bd->regs->device_mstr_priv_lvl_shift;
-  bd->write_rshim(bd, RSHIM_CHANNEL, bd->regs->device_mstr_priv_lvl, reg, RSHIM_REG_SIZE_8B);
+  while (slept < RSHIM_MEM_ACC_TIMEOUT) {
+    rc = bd->read_rshim(bd, RSHIM_CHANNEL, bd->regs->mem_acc_rsp_cnt, &count, RSHIM_REG_SIZE_8B);
+    if (rc)
+      return rc;
+    if (count != *resp_count) {
+      *resp_count = count;
+      return 0;
+    }
 
-  bd->read_rshim(bd, RSHIM_CHANNEL, bd->regs->mem_acc_rsp_cnt, &resp_count, RSHIM_REG_SIZE_8B);
+    if (spins) {
+      spins--;
+      continue;
+    }
+    usleep(delay);
+    slept += delay;
+    delay = MIN(delay * 2, RSHIM_MEM_ACC_MAX_DELAY);
+  }
+
+  RSHIM_DBG("rshim%d MEM_ACC timeout\n", bd->index);
+  return -ETIMEDOUT;
+}
 
-  reg = (((uint64_t)pa & RSH_MEM_ACC_CTL__ADDRESS_RMASK) <<
-           RSH_MEM_ACC_CTL__ADDRESS_SHIFT) |
-        (((uint64_t)size & RSH_MEM_ACC_CTL__SIZE_RMASK) <<
-          RSH_MEM_ACC_CTL__SIZE_SHIFT) |
-        (1ULL << RSH_MEM_ACC_CTL__SEND_SHIFT);
-  bd->write_rshim(bd, RSHIM_CHANNEL, bd->regs->mem_acc_ctl, reg, RSHIM_REG_SIZE_8B);
+/* Read or write up to RSHIM_MEM_CHUNK_WORDS aligned words. */
+static int rshim_mem_chunk(rshim_backend_t *bd, uint64_t pa, uint64_t *words,
+                           int num, bool write)
+{
+  uint64_t resp_count;
+  int i = 0, rc;
 
-  if (rshim_reg_indirect_wait(bd, resp_count))
-    return -1;
+  pthread_mutex_lock(&bd->mutex);
 
-  bd->read_rshim(bd, RSHIM_CHANNEL, bd->regs->mem_acc_data_first_word, &reg, RSHIM_REG_SIZE_8B);
-  *data = reg;
+  if (!bd->has_rshim || bd->drop_mode) {
+    rc = -ENODEV;
+    goto done;
+  }
 
-  return 0;
+  rc = rshim_mem_acc_enable(bd);
+  if (rc)
+    goto done;
+
+  rc = bd->read_rshim(bd, RSHIM_CHANNEL, bd->regs->mem_acc_rsp_cnt, &resp_count, RSHIM_REG_SIZE_8B);
+  if (rc)
+    goto done;
+
+  for (i = 0; i < num; i++, pa += sizeof(uint64_t)) {
+    if (write) {
+      rc = rshim_mem_acc_post(bd, bd->regs->mem_acc_data_first_word,
+                              le64toh(words[i]));
+      if (rc)
+        break;
+    }
+
+    rc = rshim_mem_acc_post(bd, bd->regs->mem_acc_ctl,
+                            rshim_mem_acc_ctl(pa, RSH_MEM_ACC_CTL__SIZE_VAL_SZ8,
+                                              write));
+    if (rc)
+      break;
+
+    rc = rshim_mem_acc_wait(bd, &resp_count);
+    if (rc)
+      break;
+
+    if (!write) {
+      rc = bd->read_rshim(bd, RSHIM_CHANNEL, bd->regs->mem_acc_data_first_word, &words[i], RSHIM_REG_SIZE_8B);
+      if (rc)
+        break;
+      words[i] = htole64(words[i]);
+    }
+  }
+
+done:
+  pthread_mutex_unlock(&bd->mutex);
+
+  /* Report the words done before a failure. */
+  return i ? i : rc;
+}
+
+/*
+ * Read <len> bytes of DPU memory at physical address <pa>. Returns the
+ * number of bytes read, which is short if an access failed part way, or a
+ * negative error code.
+ */
+ssize_t rshim_mem_read(rshim_backend_t *bd, uint64_t pa, void *buf,
+                       size_t len)
+{
+  uint64_t words[RSHIM_MEM_CHUNK_WORDS], start;
+  size_t done = 0, head, n;
+  int num, rc;
+
+  while (done < len) {
+    start = (pa + done) & ~7ULL;
+    head = pa + done - start;
+    num = MIN((head + len - done + 7) / 8, RSHIM_MEM_CHUNK_WORDS);
+
+    rc = rshim_mem_chunk(bd, start, words, num, false);
+    if (rc <= 0)
+      return done ? (ssize_t)done : rc;
+
+    n = MIN((size_t)rc * 8 - head, len - done);
+    memcpy((uint8_t *)buf + done, (uint8_t *)words + head, n);
+    done += n;
+    if (rc < num)
+      break;
+  }
+
+  return done;
+}
+
+/*
+ * Write <len> bytes of DPU memory at physical address <pa>. The partial
+ * words at the ends are read, merged and written back.
+ */
+ssize_t rshim_mem_write(rshim_backend_t *bd, uint64_t pa, const void *buf,
+                        size_t len)
+{
+  uint64_t words[RSHIM_MEM_CHUNK_WORDS], start;
+  size_t done = 0, head, n;
+  int num, rc;
+
+  while (done < len) {
+    start = (pa + done) & ~7ULL;
+    head = pa + done - start;
+    num = MIN((head + len - done + 7) / 8, RSHIM_MEM_CHUNK_WORDS);
+    n = MIN((size_t)num * 8 - head, len - done);
+
+    /* Partial first or last word. */
+    if (head) {
+      rc = rshim_mem_chunk(bd, start, &words[0], 1, false);
+      if (rc <= 0)
+        return done ? (ssize_t)done : rc;
+    }
+    if ((head + n) & 7 && (num > 1 || !head)) {
+      rc = rshim_mem_chunk(bd, start + (num - 1) * 8, &words[num - 1], 1,
+                           false);
+      if (rc <= 0)
+        return done ? (ssize_t)done : rc;
+    }
+
+    memcpy((uint8_t *)words + head, (const uint8_t *)buf + done, n);
+
+    rc = rshim_mem_chunk(bd, start, words, num, true);
+    if (rc <= 0)
+      return done ? (ssize_t)done : rc;
+    if (rc < num)
+      return done + (size_t)rc * 8 - head;
+    done += n;
+  }
+
+  return done;
 }
 
 int rshim_mmio_write32(rshim_backend_t *bd, uintptr_t addr, uint32_t value)
@@ -827,6 +945,16 @@ int rshim_boot_open(rshim_backend_t *bd)
     return -ENODEV;
   }
 
+  /* Both boot buffers come from one allocation made on first use. */
+  if (!bd->boot_buf[0]) {
+    bd->boot_buf[0] = rshim_dev_alloc(bd, 2 * BOOT_BUF_SIZE);
+    if (!bd->boot_buf[0]) {
+      pthread_mutex_unlock(&bd->mutex);
+      return -ENOMEM;
+    }
+    bd->boot_buf[1] = bd->boot_buf[0] + BOOT_BUF_SIZE;
+  }
+
   RSHIM_INFO("rshim%d boot open\n", bd->index);
   bd->is_booting = 1;
   bd->boot_rem_cnt = 0;
@@ -952,6 +1080,7 @@ int rshim_boot_write(rshim_backend_t *bd, const char *user_buffer, size_t count,
       break;
 
     rc = bd->write(bd, RSH_DEV_TYPE_BOOT, buf, buf_bytes);
+    RSHIM_PROBE3(boot_write, bd->index, buf_bytes, rc);
     if (rc > bd->boot_rem_cnt) {
       len = rc - bd->boot_rem_cnt;
       count -= len;
@@ -1129,15 +1258,30 @@ static void rshim_fifo_ctrl_rx(rshim_backend_t *bd, rshim_tmfifo_msg_hdr_t *hdr)
     break;
   case TMFIFO_MSG_PXE_ID:
     bd->pxe_client_id = ntohl(hdr->pxe_id);
-    /* Last info to receive, set the flag. */
-    bd->peer_ctrl_resp = 1;
-    pthread_cond_broadcast(&bd->ctrl_wait_cond);
+    /* Last info to receive, the cache is complete. */
+    bd->peer_info_time = rshim_mono_time();
     break;
   default:
     return;
   }
 }
 
+time_t rshim_mono_time(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+void rshim_peer_refresh(rshim_backend_t *bd)
+{
+  bd->peer_req_time = rshim_mono_time();
+  bd->peer_ctrl_req = 1;
+  bd->has_cons_work = 1;
+  rshim_work_signal(bd);
+}
+
 static int rshim_fifo_ctrl_tx(rshim_backend_t *bd)
 {
   rshim_tmfifo_msg_hdr_t hdr;
@@ -1193,18 +1337,52 @@ static int rshim_got_peer_signal(void)
 #endif
 }
 
-static void rshim_input_notify(rshim_backend_t *bd)
+static void rshim_input_notify(rshim_backend_t *bd, int chan)
 {
 #ifdef HAVE_RSHIM_FUSE
-    rshim_fuse_input_notify(bd);
+    rshim_fuse_input_notify(bd, chan);
 #endif
 }
 
+/*
+ * Wake up the readers once per demux pass instead of once per chunk. Poll
+ * waiters only need to know about empty -> non-empty transitions since the
+ * poll status is re-checked anyway; threads sleeping on the 'operable'
+ * condition are woken for every channel which received data in this pass.
+ */
+static void rshim_fifo_input_wakeup(rshim_backend_t *bd, uint8_t *rx_data,
+                                    uint8_t *rx_ready)
+{
+  uint8_t tmp = 1;
+  int chan, rc;
+
+  if (*rx_data)
+    bd->last_traffic = rshim_timer_ticks;
+
+  for (chan = 0; chan < TMFIFO_MAX_CHAN; chan++) {
+    if (*rx_ready & (1 << chan))
+      rshim_input_notify(bd, chan);
+    if (*rx_data & (1 << chan))
+      pthread_cond_broadcast(&bd->read_fifo[chan].operable);
+  }
+
+  /* Let the main loop send the console data to the socket clients. */
+  if ((*rx_data & (1 << TMFIFO_CONS_CHAN)) && bd->cons_clients &&
+      __sync_bool_compare_and_swap(&bd->cons_rx_pending, false, true)) {
+    do {
+      rc = write(bd->cons_notify_fd[1], &tmp, sizeof(tmp));
+    } while (rc == -1 && (errno == EINTR || errno == EAGAIN));
+  }
+
+  *rx_data = 0;
+  *rx_ready = 0;
+}
+
 /* Drain the read buffer, and start another read/interrupt if needed. */
 static void rshim_fifo_input(rshim_backend_t *bd)
 {
   rshim_tmfifo_msg_hdr_t *hdr;
-  uint8_t rx_avail = 0;
+  uint8_t rx_avail = 0, rx_data = 0, rx_ready = 0;
   time_t t0, t1;
   int rc;
 
@@ -1259,6 +1437,10 @@ again:
 
       RSHIM_DBG("drain: hdr, nxt %d rem %d chn %d\n",
                 bd->read_buf_next, bd->read_buf_pkt_rem, bd->rx_chan);
+      rshim_trace_event(bd, RSHIM_TRACE_RX_PKT, bd->rx_chan, hdr->type,
+                        ntohs(hdr->len));
+      RSHIM_PROBE4(rx_pkt, bd->index, bd->rx_chan, hdr->type,
+                   ntohs(hdr->len));
       bd->drop_pkt = 0;
     }
 
@@ -1297,24 +1479,39 @@ again:
       break;
     }
 
+    /* Watch and timestamp the console even if nobody has it open. */
+    if (bd->rx_chan == TMFIFO_CONS_CHAN) {
+      if (bd->watch)
+        rshim_watch_input(bd, &bd->read_buf[bd->read_buf_next], copysize);
+      if (bd->cons_ts_clients)
+        rshim_cons_ts_input(bd, &bd->read_buf[bd->read_buf_next], copysize);
+    }
+
     if (!bd->drop_pkt) {
+      if (read_empty(bd, bd->rx_chan))
+        rx_ready |= 1 << bd->rx_chan;
+      rx_data |= 1 << bd->rx_chan;
       memcpy(read_space_ptr(bd, bd->rx_chan), &bd->read_buf[bd->read_buf_next],
              copysize);
       read_add_bytes(bd, bd->rx_chan, copysize);
+      rshim_trace_event(bd, RSHIM_TRACE_RX_FIFO, bd->rx_chan,
+                        bd->read_fifo[bd->rx_chan].head,
+                        bd->read_fifo[bd->rx_chan].tail);
     }
 
     bd->read_buf_next += copysize;
     bd->read_buf_pkt_rem -= copysize;
 
-    rshim_input_notify(bd);
-    pthread_cond_broadcast(&bd->read_fifo[bd->rx_chan].operable);
-
     if (bd->read_buf_pkt_rem <= 0) {
       bd->read_buf_next = bd->read_buf_next + bd->read_buf_pkt_padding;
       rx_avail = 1;
     }
   }
 
+  /* Notify the readers before launching another read. */
+  if (rx_data)
+    rshim_fifo_input_wakeup(bd, &rx_data, &rx_ready);
+
   /*
    * We've processed all of the data we can, so now we decide if we
    * need to launch another I/O.  If there's still data in the read
@@ -1335,6 +1532,7 @@ again:
     /* Process it if more data is received. */
     len = bd->read(bd, RSH_DEV_TYPE_TMFIFO, (char *)bd->read_buf,
                    READ_BUF_SIZE);
+    RSHIM_PROBE2(fifo_input, bd->index, len);
     if (len > 0) {
       bd->read_buf_bytes = len;
       bd->read_buf_next = 0;
@@ -1459,6 +1657,106 @@ ssize_t rshim_fifo_read(rshim_backend_t *bd, char *buffer, size_t count,
   return rd_cnt;
 }
 
+/*
+ * Read from the FIFO without an intermediate copy. Once the channel has data
+ * (or immediately if nonblock), up to 'count' bytes are handed to 'reply' as
+ * at most two segments pointing directly into the ring, one up to the wrap
+ * point and one from the start of the ring. The span is reserved by marking
+ * the channel busy, so 'reply' runs without the device mutex and ringlock;
+ * the rx path only writes past the head and other readers wait. The bytes
+ * are consumed only if 'reply' succeeds and the ring wasn't reset meanwhile.
+ * Returns the number of bytes consumed or negative errno.
+ */
+ssize_t rshim_fifo_read_iov(rshim_backend_t *bd, size_t count, int chan,
+                            bool nonblock,
+                            int (*reply)(void *arg, const struct iovec *iov,
+                                         int iovcnt),
+                            void *arg)
+{
+  struct iovec iov[2];
+  struct timespec ts;
+  uint8_t rx_data, rx_ready;
+  size_t readsize;
+  unsigned int gen;
+  int iovcnt, rc;
+
+  if (!count)
+    return 0;
+
+  pthread_mutex_lock(&bd->mutex);
+
+  while (1) {
+    /* The device could get disconnected while waiting for data. */
+    if (!bd->has_tm) {
+      pthread_mutex_unlock(&bd->mutex);
+      return -ENODEV;
+    }
+
+    if (bd->tmfifo_error) {
+      rc = bd->tmfifo_error;
+      pthread_mutex_unlock(&bd->mutex);
+      return rc;
+    }
+
+    if (!read_empty(bd, chan) && !bd->read_fifo[chan].busy)
+      break;
+
+    if (nonblock) {
+      pthread_mutex_lock(&bd->ringlock);
+      rshim_fifo_input(bd);
+      pthread_mutex_unlock(&bd->ringlock);
+      pthread_mutex_unlock(&bd->mutex);
+      return -EAGAIN;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += 1;
+    if (pthread_cond_timedwait(&bd->read_fifo[chan].operable,
+                               &bd->mutex, &ts) ||
+        rshim_got_peer_signal() == 0) {
+      pthread_mutex_unlock(&bd->mutex);
+      return -EINTR;
+    }
+  }
+
+  pthread_mutex_lock(&bd->ringlock);
+  readsize = MIN(count, (size_t)read_cnt(bd, chan));
+  iov[0].iov_base = read_data_ptr(bd, chan);
+  iov[0].iov_len = MIN(readsize, (size_t)read_cnt_to_end(bd, chan));
+  iov[1].iov_base = bd->read_fifo[chan].data;
+  iov[1].iov_len = readsize - iov[0].iov_len;
+  iovcnt = iov[1].iov_len ? 2 : 1;
+  bd->read_fifo[chan].busy = true;
+  gen = bd->read_fifo[chan].gen;
+
+  RSHIM_DBG("fifo_read_iov: readsize %zd, head %d, tail %d\n",
+            readsize, bd->read_fifo[chan].head, bd->read_fifo[chan].tail);
+  pthread_mutex_unlock(&bd->ringlock);
+  pthread_mutex_unlock(&bd->mutex);
+
+  rc = reply(arg, iov, iovcnt);
+
+  pthread_mutex_lock(&bd->mutex);
+  pthread_mutex_lock(&bd->ringlock);
+  if (!rc && gen == bd->read_fifo[chan].gen) {
+    read_consume_bytes(bd, chan, readsize);
+    rshim_fifo_input(bd);
+  }
+  bd->read_fifo[chan].busy = false;
+
+  /* Let the readers which found the channel busy try again. */
+  if (!read_empty(bd, chan)) {
+    rx_data = rx_ready = 1 << chan;
+    rshim_fifo_input_wakeup(bd, &rx_data, &rx_ready);
+  } else {
+    pthread_cond_broadcast(&bd->read_fifo[chan].operable);
+  }
+  pthread_mutex_unlock(&bd->ringlock);
+  pthread_mutex_unlock(&bd->mutex);
+
+  return rc ? rc : (ssize_t)readsize;
+}
+
 static void rshim_fifo_output(rshim_backend_t *bd)
 {
   int writesize, write_buf_next = 0, write_avail;
@@ -1528,6 +1826,9 @@ static void rshim_fifo_output(rshim_backend_t *bd)
       }
 
       bd->write_buf_pkt_rem = ntohs(hdr->len) + sizeof(*hdr);
+      rshim_trace_event(bd, RSHIM_TRACE_TX_PKT, chan, hdr->type,
+                        ntohs(hdr->len));
+      RSHIM_PROBE4(tx_pkt, bd->index, chan, hdr->type, ntohs(hdr->len));
     }
 
     /* Send out the packet header for the console data. */
@@ -1579,6 +1880,8 @@ static void rshim_fifo_output(rshim_backend_t *bd)
              bd->write_fifo[chan].data, pass2);
 
       write_consume_bytes(bd, chan, writesize);
+      rshim_trace_event(bd, RSHIM_TRACE_TX_FIFO, chan,
+                        bd->write_fifo[chan].head, bd->write_fifo[chan].tail);
       write_buf_next += writesize;
       bd->write_buf_pkt_rem -= writesize;
       /* Add padding at the end. */
@@ -1591,27 +1894,57 @@ static void rshim_fifo_output(rshim_backend_t *bd)
     }
   }
 
+  if (bd->net_tx_paused &&
+      write_cnt(bd, TMFIFO_NET_CHAN) <= RSHIM_NET_TX_LOW_WM)
+    rshim_net_tx_resume(bd);
+
   /* Drop the data if it is still booting. */
   if (bd->is_boot_open || bd->drop_mode || !bd->has_rshim || !bd->has_tm)
     return;
 
   /* If we actually put anything in the buffer, send it. */
   if (write_buf_next)
-    bd->write(bd, RSH_DEV_TYPE_TMFIFO, (char *)bd->write_buf, write_buf_next);
+    RSHIM_PROBE2(fifo_output, bd->index, write_buf_next);
+  if (write_buf_next &&
+      bd->write(bd, RSH_DEV_TYPE_TMFIFO, (char *)bd->write_buf,
+                write_buf_next) >= 0)
+    bd->last_traffic = rshim_timer_ticks;
 }
 
+/* Size of the FIFO arena. */
+#define RSHIM_FIFO_ARENA_SIZE \
+  (TMFIFO_MAX_CHAN * (RSHIM_ALIGN(READ_FIFO_SIZE) + \
+                      RSHIM_ALIGN(WRITE_FIFO_SIZE)) + \
+   RSHIM_ALIGN(READ_BUF_SIZE) + RSHIM_ALIGN(WRITE_BUF_SIZE))
+
+/*
+ * Allocate the FIFOs and the read/write buffers from one cache-line aligned
+ * arena so that the TMFIFO path touches a compact region of memory.
+ */
 int rshim_fifo_alloc(rshim_backend_t *bd)
 {
+  unsigned char *p;
   int i;
 
-  for (i = 0; i < TMFIFO_MAX_CHAN; i++) {
-    if (!bd->read_fifo[i].data)
-      bd->read_fifo[i].data = malloc(READ_FIFO_SIZE);
+  if (bd->fifo_arena)
+    return 0;
+
+  bd->fifo_arena = rshim_dev_alloc(bd, RSHIM_FIFO_ARENA_SIZE);
+  if (!bd->fifo_arena)
+    return -ENOMEM;
+  p = bd->fifo_arena;
 
-    if (!bd->write_fifo[i].data)
-      bd->write_fifo[i].data = malloc(WRITE_FIFO_SIZE);
+  for (i = 0; i < TMFIFO_MAX_CHAN; i++) {
+    bd->read_fifo[i].data = p;
+    p += RSHIM_ALIGN(READ_FIFO_SIZE);
+    bd->write_fifo[i].data = p;
+    p += RSHIM_ALIGN(WRITE_FIFO_SIZE);
   }
 
+  bd->read_buf = p;
+  p += RSHIM_ALIGN(READ_BUF_SIZE);
+  bd->write_buf = p;
+
   return 0;
 }
 
@@ -1630,6 +1963,7 @@ void rshim_fifo_reset(rshim_backend_t *bd)
   bd->spin_flags &= ~(RSH_SFLG_WRITING | RSH_SFLG_READING);
   for (i = 0; i < TMFIFO_MAX_CHAN; i++) {
     read_reset(bd, i);
+    bd->read_fifo[i].gen++;
     write_reset(bd, i);
   }
   pthread_mutex_unlock(&bd->ringlock);
@@ -1640,11 +1974,13 @@ void rshim_fifo_free(rshim_backend_t *bd)
   int i;
 
   for (i = 0; i < TMFIFO_MAX_CHAN; i++) {
-    free(bd->read_fifo[i].data);
     bd->read_fifo[i].data = NULL;
-    free(bd->write_fifo[i].data);
     bd->write_fifo[i].data = NULL;
   }
+  bd->read_buf = NULL;
+  bd->write_buf = NULL;
+  rshim_dev_free(bd->fifo_arena, RSHIM_FIFO_ARENA_SIZE);
+  bd->fifo_arena = NULL;
 
   rshim_fifo_reset(bd);
   bd->has_tm = 0;
@@ -1752,11 +2088,7 @@ static void rshim_work_handler(rshim_backend_t *bd)
 
   bd->work_pending = false;
 
-  if (bd->keepalive && bd->has_rshim) {
-    bd->write_rshim(bd, RSHIM_CHANNEL, bd->regs->scratchpad1,
-                    RSHIM_KEEPALIVE_MAGIC_NUM, RSHIM_REG_SIZE_8B);
-    bd->keepalive = 0;
-  }
+  rshim_watch_work(bd);
 
   if (bd->boot_work_buf != NULL) {
     bd->boot_work_buf_actual_len = rshim_write_delayed(bd,
@@ -2053,8 +2385,11 @@ int rshim_notify(rshim_backend_t *bd, int event, int code)
   case RSH_EVENT_ATTACH:
     rshim_boot_done(bd);
 
-    /* Sync-up the tmfifo if reprobe is not supported. */
-    if (!bd->has_reprobe && bd->has_rshim)
+    /*
+     * Sync-up the tmfifo if reprobe is not supported. A handed-over device
+     * continues the stream of the previous daemon instead.
+     */
+    if (!bd->has_reprobe && bd->has_rshim && !bd->handover)
       rshim_fifo_sync(bd);
 
     __sync_synchronize();
@@ -2088,6 +2423,11 @@ static int rshim_find_index(char *dev_name)
   if (rshim_static_index >= 0)
     return rshim_static_index;
 
+  /* Keep the index of a device handed over by the previous daemon. */
+  i = rshim_handover_index(dev_name);
+  if (i >= 0)
+    return i;
+
   /* First look for a match with a previous device name. */
   for (i = 0; i < RSHIM_MAX_DEV; i++) {
     if (rshim_dev_names[i] && !strcmp(dev_name, rshim_dev_names[i])) {
@@ -2143,28 +2483,94 @@ rshim_backend_t *rshim_find_by_dev(void *dev)
 /* House-keeping timer. */
 static void rshim_timer_func(rshim_backend_t *bd)
 {
-  int period = rshim_keepalive_period;
+  /* Refresh the peer info in the background; retry later if busy. */
+  if (rshim_peer_refresh_interval && bd->has_tm && !bd->drop_mode &&
+      !bd->is_boot_open &&
+      rshim_mono_time() - bd->peer_req_time >= rshim_peer_refresh_interval &&
+      !pthread_mutex_trylock(&bd->mutex)) {
+    rshim_peer_refresh(bd);
+    pthread_mutex_unlock(&bd->mutex);
+  }
 
   if (bd->has_cons_work)
     rshim_work_signal(bd);
 
-  /* Request keepalive update and restart the ~300ms timer. */
-  if (rshim_timer_ticks - (bd->last_keepalive + period) > 0) {
-    bd->keepalive = 1;
+  /* Restart the ~300ms timer. */
+  bd->timer = rshim_timer_ticks + rshim_keepalive_period;
+}
+
+/*
+ * Update the keepalive of all the devices in one pass. A device which had
+ * TMFIFO traffic within the last period skips one keepalive, but not two in
+ * a row so that rshim_access_check() of another driver still sees the magic
+ * number within its one second window. Returns false if some device was
+ * busy and needs to be retried; a retry pass only updates these devices.
+ */
+static bool rshim_keepalive_run(bool retry)
+{
+  int i, period = rshim_keepalive_period;
+  rshim_backend_t *bd;
+  bool done = true;
+
+  for (i = 0; i < RSHIM_MAX_DEV; i++) {
+    bd = rshim_devs[i];
+    if (!bd || !bd->has_rshim)
+      continue;
+
+    if (retry && !bd->keepalive_retry)
+      continue;
+
+    if (!retry && rshim_timer_ticks - bd->last_traffic < period &&
+        rshim_timer_ticks - bd->last_keepalive < 2 * period)
+      continue;
+
+    /* Don't stall the timer on a device which is busy; retry it later. */
+    if (pthread_mutex_trylock(&bd->mutex)) {
+      bd->keepalive_retry = true;
+      done = false;
+      continue;
+    }
+    bd->keepalive_retry = false;
+
+    /*
+     * Post the keepalive if the backend supports it so a slow or hung device
+     * doesn't block the main loop. It's simply retried next period if the
+     * backend's queue of posted writes is full.
+     */
+    if (bd->write_rshim_posted)
+      bd->write_rshim_posted(bd, RSHIM_CHANNEL, bd->regs->scratchpad1,
+                             RSHIM_KEEPALIVE_MAGIC_NUM, RSHIM_REG_SIZE_8B);
+    else
+      bd->write_rshim(bd, RSHIM_CHANNEL, bd->regs->scratchpad1,
+                      RSHIM_KEEPALIVE_MAGIC_NUM, RSHIM_REG_SIZE_8B);
     bd->last_keepalive = rshim_timer_ticks;
-    rshim_work_signal(bd);
+
+    pthread_mutex_unlock(&bd->mutex);
   }
 
-  bd->timer = rshim_timer_ticks + period;
+  return done;
 }
 
 static void rshim_timer_run(void)
 {
+  static int keepalive_timer, keepalive_next;
   rshim_backend_t *bd;
+  bool retry;
   int i;
 
   rshim_timer_ticks++;
 
+  /* Full pass every period, and retries of the busy devices in between. */
+  if (rshim_timer_ticks - keepalive_timer > 0) {
+    if (rshim_timer_ticks - keepalive_next > 0) {
+      keepalive_next = rshim_timer_ticks + rshim_keepalive_period;
+      retry = !rshim_keepalive_run(false);
+    } else {
+      retry = !rshim_keepalive_run(true);
+    }
+    keepalive_timer = retry ? rshim_timer_ticks + 1 : keepalive_next;
+  }
+
   for (i = 0; i < RSHIM_MAX_DEV; i++) {
     bd = rshim_devs[i];
     if (bd) {
@@ -2176,6 +2582,10 @@ static void rshim_timer_run(void)
         rshim_net_tx(bd);
         rshim_net_rx(bd);
       }
+      if (bd->cons_clients) {
+        rshim_cons_sock_tx(bd);
+        rshim_cons_sock_rx(bd);
+      }
     }
   }
 }
@@ -2307,9 +2717,9 @@ static int rshim_bf2_a0_wa(rshim_backend_t *bd)
   return 0;
 }
 
-int rshim_access_check(rshim_backend_t *bd)
+/* Wait for the rshim to be ready and clear scratchpad1. */
+static int rshim_access_ready(rshim_backend_t *bd)
 {
-  rshim_backend_t *other_bd;
   uint64_t value = 0;
   int i, rc;
 
@@ -2320,16 +2730,8 @@ int rshim_access_check(rshim_backend_t *bd)
    * rshim device.
    */
   for (i = 0; i < 10; i++) {
-    struct timeval start, end;
-    gettimeofday(&start, NULL);
-    
-    for (int j = 0; j < 100000; ++j) 
-      rc = bd->read_rshim(bd, RSHIM_CHANNEL, bd->regs->fabric_dim, &value, RSHIM_REG_SIZE_8B);
-
-    gettimeofday(&end, NULL);
-    double time_taken = (end.tv_sec - start.tv_sec) * 1000000.0+ (end.tv_usec - start.tv_usec);
-
-    RSHIM_INFO("bd->read_rshim %ld %f\n", value, time_taken / 100000 * 1000);
+    rc = bd->read_rshim(bd, RSHIM_CHANNEL, bd->regs->fabric_dim, &value,
+                        RSHIM_REG_SIZE_8B);
     if (!rc && value && !RSHIM_BAD_CTRL_REG(value))
       break;
     usleep(100000);
@@ -2359,23 +2761,22 @@ int rshim_access_check(rshim_backend_t *bd)
   }
 
   /* Write value 0 to RSH_SCRATCHPAD1. */
-  struct timeval start, end;
-  gettimeofday(&start, NULL);
-  
-  for (int j = 0; j < 100000; ++j) 
-    rc = bd->write_rshim(bd, RSHIM_CHANNEL, bd->regs->scratchpad1, 0, RSHIM_REG_SIZE_8B);
-  
-  gettimeofday(&end, NULL);
-  double time_taken = (end.tv_sec - start.tv_sec) * 1000000.0+ (end.tv_usec - start.tv_usec);
-
-  RSHIM_INFO("bd->write_rshim %ld %f\n", value, time_taken / 100000 * 1000);
-
+  rc = bd->write_rshim(bd, RSHIM_CHANNEL, bd->regs->scratchpad1, 0,
+                       RSHIM_REG_SIZE_8B);
   if (rc < 0) {
     RSHIM_ERR("failed to write rshim rc=%d\n", rc);
     return -ENODEV;
   }
 
-  /* Write magic number to all the other backends. */
+  return 0;
+}
+
+/* Write magic number to all the other backends. Called with rshim_lock. */
+static void rshim_access_mark_others(rshim_backend_t *bd)
+{
+  rshim_backend_t *other_bd;
+  int i;
+
   for (i = 0; i < RSHIM_MAX_DEV; i++) {
     other_bd = rshim_devs[i];
     if (!other_bd || other_bd == bd)
@@ -2385,6 +2786,13 @@ int rshim_access_check(rshim_backend_t *bd)
                     RSHIM_KEEPALIVE_MAGIC_NUM, RSHIM_REG_SIZE_8B);
     pthread_mutex_unlock(&other_bd->mutex);
   }
+}
+
+/* Check whether another backend writes its keepalive to the device. */
+static int rshim_access_wait(rshim_backend_t *bd)
+{
+  uint64_t value;
+  int i, rc;
 
   /*
    * Poll RSH_SCRATCHPAD1 up to one second to check whether it's reset to
@@ -2413,6 +2821,23 @@ int rshim_access_check(rshim_backend_t *bd)
   return 0;
 }
 
+/*
+ * Check that the device is ready and that no other backend driver is
+ * attached to it. Called with rshim_lock and the device mutex held.
+ */
+int rshim_access_check(rshim_backend_t *bd)
+{
+  int rc;
+
+  rc = rshim_access_ready(bd);
+  if (rc)
+    return rc;
+
+  rshim_access_mark_others(bd);
+
+  return rshim_access_wait(bd);
+}
+
 int rshim_register(rshim_backend_t *bd)
 {
   int i, rc, index;
@@ -2429,9 +2854,12 @@ int rshim_register(rshim_backend_t *bd)
     return -EINVAL;
   }
 
-  rc = rshim_access_check(bd);
-  if (rc)
-    return rc;
+  /* The previous daemon has already checked a handed-over device. */
+  if (rshim_handover_index(bd->dev_name) < 0) {
+    rc = rshim_access_check(bd);
+    if (rc)
+      return rc;
+  }
 
   if (!bd->write)
     bd->write = rshim_write_default;
@@ -2448,7 +2876,6 @@ int rshim_register(rshim_backend_t *bd)
   pthread_cond_init(&bd->fifo_write_complete_cond, NULL);
   pthread_cond_init(&bd->boot_complete_cond, NULL);
   pthread_cond_init(&bd->boot_write_complete_cond, NULL);
-  pthread_cond_init(&bd->ctrl_wait_cond, NULL);
   memcpy(&bd->cons_termios, &init_console_termios,
          sizeof(init_console_termios));
 
@@ -2456,35 +2883,43 @@ int rshim_register(rshim_backend_t *bd)
   if (rshim_dev_names[index])
     free(rshim_dev_names[index]);
   rshim_dev_names[index] = strdup(bd->dev_name);
-  rshim_devs[index] = bd;
 
-  for (i = 0; i < 2; i++) {
-    bd->boot_buf[i] = malloc(BOOT_BUF_SIZE);
-    if (!bd->boot_buf[i]) {
-      if (i == 1) {
-        free(bd->boot_buf[0]);
-        bd->boot_buf[0] = NULL;
-      }
-    }
+  /* The boot buffers are allocated in rshim_boot_open() when needed. */
+  rc = rshim_fifo_alloc(bd);
+  if (rc) {
+    RSHIM_ERR("rshim%d failed to allocate FIFOs\n", index);
+    return rc;
   }
 
-  rshim_fifo_alloc(bd);
-
-  if (!bd->read_buf)
-    bd->read_buf = calloc(1, READ_BUF_SIZE);
-
-  if (!bd->write_buf)
-    bd->write_buf = calloc(1, WRITE_BUF_SIZE);
+  rshim_devs[index] = bd;
 
   bd->net_fd = -1;
+  bd->handover_net_fd = -1;
+  bd->handover = rshim_handover_restore(bd);
+
+  /*
+   * The flight recorder is optional, so don't fail the registration. The
+   * recorder of the backend traffic goes first so it sees the backend APIs
+   * rather than the flight recorder.
+   */
+  if (rshim_record_init(bd))
+    RSHIM_WARN("rshim%d failed to start recording\n", bd->index);
+  if (rshim_trace_init(bd))
+    RSHIM_WARN("rshim%d flight recorder not available\n", bd->index);
+  if (rshim_watch_init(bd))
+    RSHIM_WARN("rshim%d console watcher not available\n", bd->index);
   bd->net_notify_fd[0] = -1;
   bd->net_notify_fd[1] = -1;
+  bd->cons_sock_fd = -1;
+  bd->cons_ts_sock_fd = -1;
+  bd->cons_ts_clients = 0;
   bd->registered = 1;
   bd->boot_timeout = rshim_boot_timeout;
   bd->display_level = rshim_display_level;
 
   /* Start the keepalive timer. */
   bd->last_keepalive = rshim_timer_ticks;
+  bd->last_traffic = rshim_timer_ticks - rshim_keepalive_period;
   bd->timer = rshim_timer_ticks + 1;
 
   /* create character devices. */
@@ -2496,6 +2931,16 @@ int rshim_register(rshim_backend_t *bd)
   }
 #endif
 
+  /* The console socket is optional, so don't fail the registration. */
+  if (rshim_cons_sock_init(bd))
+    RSHIM_WARN("rshim%d console socket not available\n", bd->index);
+  if (rshim_cons_ts_init(bd))
+    RSHIM_WARN("rshim%d console_ts socket not available\n", bd->index);
+  if (rshim_mbox_init(bd))
+    RSHIM_WARN("rshim%d mailbox not available\n", bd->index);
+  if (rshim_lease_init(bd))
+    RSHIM_WARN("rshim%d register leases not available\n", bd->index);
+
   rshim_dev_bitmask |= (1ULL << index);
 
   return 0;
@@ -2503,29 +2948,28 @@ int rshim_register(rshim_backend_t *bd)
 
 void rshim_deregister(rshim_backend_t *bd)
 {
-  int i;
-
   if (!bd->registered)
     return;
 
   rshim_dev_bitmask &= ~(1ULL << bd->index);
 
+  rshim_lease_del(bd);
+  rshim_mbox_del(bd);
+  rshim_cons_sock_del(bd);
+  rshim_cons_ts_del(bd);
+
 #ifdef HAVE_RSHIM_FUSE
   rshim_fuse_del(bd);
 #endif
 
-  for (i = 0; i < 2; i++) {
-    free(bd->boot_buf[i]);
-    bd->boot_buf[i] = NULL;
-  }
-
-  free(bd->read_buf);
-  bd->read_buf = NULL;
-
-  free(bd->write_buf);
-  bd->write_buf = NULL;
+  rshim_dev_free(bd->boot_buf[0], 2 * BOOT_BUF_SIZE);
+  bd->boot_buf[0] = NULL;
+  bd->boot_buf[1] = NULL;
 
   rshim_fifo_free(bd);
+  rshim_watch_free(bd);
+  rshim_trace_free(bd);
+  rshim_record_free(bd);
 
   rshim_devs[bd->index] = NULL;
   bd->registered = 0;
@@ -2544,20 +2988,236 @@ void rshim_deref(rshim_backend_t *bd)
   }
 }
 
+#ifdef __linux__
+/* Parse a CPU list such as "0-3,8,10-11". */
+static int rshim_parse_cpulist(const char *str, cpu_set_t *set)
+{
+  long first, last;
+  char *end;
+
+  CPU_ZERO(set);
+
+  for (;;) {
+    first = strtol(str, &end, 10);
+    if (end == str || first < 0)
+      return -EINVAL;
+    last = first;
+    if (*end == '-') {
+      str = end + 1;
+      last = strtol(str, &end, 10);
+      if (end == str || last < first)
+        return -EINVAL;
+    }
+    for (; first <= last && first < CPU_SETSIZE; first++)
+      CPU_SET(first, set);
+
+    str = end;
+    if (*str != ',')
+      break;
+    str++;
+  }
+
+  if ((*str && *str != '\n') || !CPU_COUNT(set))
+    return -EINVAL;
+
+  return 0;
+}
+
+static int rshim_read_sysfs(const char *path, char *buf, int len)
+{
+  int fd, n;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -errno;
+
+  n = read(fd, buf, len - 1);
+  close(fd);
+  if (n <= 0)
+    return -EIO;
+
+  buf[n] = 0;
+  if (buf[n - 1] == '\n')
+    buf[n - 1] = 0;
+
+  return 0;
+}
+#endif
+
+/* Record the CPUs and the NUMA node local to a PCI device. */
+void rshim_pci_locality(rshim_backend_t *bd, int domain, int bus, int dev,
+                        int func)
+{
+#ifdef __linux__
+  char path[128], node[16];
+
+  snprintf(path, sizeof(path),
+           "/sys/bus/pci/devices/%04x:%02x:%02x.%1u/local_cpulist",
+           domain, bus, dev, func);
+  if (rshim_read_sysfs(path, bd->local_cpus, sizeof(bd->local_cpus)))
+    bd->local_cpus[0] = 0;
+
+  snprintf(path, sizeof(path),
+           "/sys/bus/pci/devices/%04x:%02x:%02x.%1u/numa_node",
+           domain, bus, dev, func);
+  if (rshim_read_sysfs(path, node, sizeof(node)))
+    bd->numa_node = -1;
+  else
+    bd->numa_node = atoi(node);
+#endif
+}
+
+/*
+ * Bind a thread serving 'bd', or all the devices if NULL, to the CPUs set
+ * by CPU_AFFINITY. With "auto" only device threads are bound, to the CPUs
+ * local to the device.
+ */
+int rshim_set_affinity(rshim_backend_t *bd, pthread_t thread)
+{
+#ifdef __linux__
+  const char *cpus = rshim_cpu_affinity;
+  cpu_set_t set;
+  int rc;
+
+  if (!cpus[0])
+    return 0;
+
+  if (!strcmp(cpus, "auto")) {
+    if (!bd || !bd->local_cpus[0])
+      return 0;
+    cpus = bd->local_cpus;
+  }
+
+  if (rshim_parse_cpulist(cpus, &set)) {
+    RSHIM_WARN("invalid CPU list %s\n", cpus);
+    return -EINVAL;
+  }
+
+  rc = pthread_setaffinity_np(thread, sizeof(set), &set);
+  if (rc) {
+    RSHIM_WARN("failed to set CPU affinity %s: %d\n", cpus, rc);
+    return -rc;
+  }
+#endif
+
+  return 0;
+}
+
+static size_t rshim_dev_alloc_size(size_t size)
+{
+  size_t page = sysconf(_SC_PAGESIZE);
+
+  return (size + page - 1) & ~(page - 1);
+}
+
+/*
+ * Allocate zeroed per-device memory in pages of its own. With "auto"
+ * affinity the pages prefer the NUMA node of the device; the policy is set
+ * before they are first touched, so they are placed there when faulted in.
+ * Freed with rshim_dev_free() and the same size.
+ */
+void *rshim_dev_alloc(rshim_backend_t *bd, size_t size)
+{
+  void *ptr;
+#ifdef __linux__
+  unsigned long mask;
+#endif
+
+  size = rshim_dev_alloc_size(size);
+  ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+             -1, 0);
+  if (ptr == MAP_FAILED)
+    return NULL;
+
+#ifdef __linux__
+  if (!strcmp(rshim_cpu_affinity, "auto") && bd->local_cpus[0] &&
+      bd->numa_node >= 0 && bd->numa_node < (int)sizeof(mask) * 8) {
+    mask = 1UL << bd->numa_node;
+    if (syscall(SYS_mbind, ptr, size, MPOL_PREFERRED, &mask,
+                sizeof(mask) * 8 + 1, 0))
+      RSHIM_DBG("rshim%d mbind failed: %m\n", bd->index);
+  }
+#endif
+
+  return ptr;
+}
+
+void rshim_dev_free(void *ptr, size_t size)
+{
+  if (ptr)
+    munmap(ptr, rshim_dev_alloc_size(size));
+}
+
+/* Enter or leave drop mode. Called without any lock held. */
+void rshim_set_drop_mode(rshim_backend_t *bd, int drop_mode)
+{
+  int old_value, rc;
+
+  pthread_mutex_lock(&bd->mutex);
+  old_value = (int)bd->drop_mode;
+  bd->drop_mode = !!drop_mode;
+  if (bd->drop_mode == old_value) {
+    pthread_mutex_unlock(&bd->mutex);
+    return;
+  }
+
+  if (bd->enable_device) {
+    if (bd->enable_device(bd, bd->drop_mode ? false : true))
+      bd->drop_mode = 1;
+  }
+
+  if (bd->drop_mode)
+    bd->drop_pkt = 1;
+  pthread_mutex_unlock(&bd->mutex);
+  /*
+   * Check if another endpoint driver has already attached to the
+   * same rshim device before enabling it. The polls take up to a second
+   * each, so rshim_lock is only held to mark the other backends.
+   */
+  if (!bd->drop_mode) {
+    pthread_mutex_lock(&bd->mutex);
+    rc = rshim_access_ready(bd);
+    pthread_mutex_unlock(&bd->mutex);
+
+    if (!rc) {
+      rshim_lock();
+      rshim_access_mark_others(bd);
+      rshim_unlock();
+
+      pthread_mutex_lock(&bd->mutex);
+      rc = rshim_access_wait(bd);
+      pthread_mutex_unlock(&bd->mutex);
+    }
+
+    if (rc) {
+      RSHIM_WARN("rshim%d is not accessible\n", bd->index);
+      pthread_mutex_lock(&bd->mutex);
+      bd->drop_mode = 1;
+      pthread_mutex_unlock(&bd->mutex);
+    }
+  }
+}
+
 bool rshim_allow_device(const char *devname)
 {
+  bool allow = true;
   int i;
 
   if (rshim_static_dev_name && strcmp(rshim_static_dev_name, devname))
     return false;
 
+  /* The list could be rebuilt by rshim_reload_cfg(). */
+  rshim_lock();
   for (i = 0; i < RSHIM_MAX_DEV; i++) {
     if (rshim_blocked_dev_names[i] &&
-        !strcmp(rshim_blocked_dev_names[i], devname))
-      return false;
+        !strcmp(rshim_blocked_dev_names[i], devname)) {
+      allow = false;
+      break;
+    }
   }
+  rshim_unlock();
 
-  return true;
+  return allow;
 }
 
 static void *rshim_stop_thread(void *arg)
@@ -2608,9 +3268,156 @@ static void rshim_set_timer(int timer_fd, int interval)
   timerfd_settime(timer_fd, 0, &ts, NULL);
 }
 
+static void rshim_reload_cfg(void);
+
+/*
+ * Slow work on a set of devices, such as polling them or writing files,
+ * which is done by a detached thread instead of the main loop. Each device
+ * is referenced until it's handled.
+ */
+typedef struct {
+  void (*handler)(rshim_backend_t *bd, int arg);
+  int arg;
+  int num;
+  rshim_backend_t *bd[RSHIM_MAX_DEV];
+} rshim_dev_work_t;
+
+static void *rshim_dev_work_thread(void *arg)
+{
+  rshim_dev_work_t *work = arg;
+  int i;
+
+  for (i = 0; i < work->num; i++) {
+    work->handler(work->bd[i], work->arg);
+    rshim_deref(work->bd[i]);
+  }
+  free(work);
+
+  return NULL;
+}
+
+/* Start the thread for 'work', which is freed by it. */
+static void rshim_dev_work_start(rshim_dev_work_t *work, const char *name)
+{
+  pthread_t thread;
+  int i;
+
+  if (pthread_create(&thread, NULL, rshim_dev_work_thread, work)) {
+    RSHIM_WARN("failed to create the %s thread\n", name);
+    for (i = 0; i < work->num; i++)
+      rshim_deref(work->bd[i]);
+    free(work);
+    return;
+  }
+  pthread_detach(thread);
+}
+
+static void rshim_trace_dump_dev(rshim_backend_t *bd, int arg)
+{
+  (void)arg;
+
+  rshim_trace_dump(bd);
+}
+
+/*
+ * Dump the flight recorders. A ring could be tens of MB, so each one is
+ * copied and written by a thread, and rshim_lock is only held here to
+ * reference the devices.
+ */
+static void rshim_trace_dump_all(void)
+{
+  rshim_dev_work_t *work;
+  rshim_backend_t *bd;
+  int i;
+
+  rshim_trace_dump_pending = 0;
+
+  work = calloc(1, sizeof(*work));
+  if (!work) {
+    RSHIM_WARN("trace not dumped: out of memory\n");
+    return;
+  }
+  work->handler = rshim_trace_dump_dev;
+
+  rshim_lock();
+  for (i = 0; i < RSHIM_MAX_DEV; i++) {
+    bd = rshim_devs[i];
+    if (bd && bd->trace) {
+      rshim_ref(bd);
+      work->bd[work->num++] = bd;
+    }
+  }
+  rshim_unlock();
+
+  if (!work->num) {
+    free(work);
+    return;
+  }
+
+  rshim_dev_work_start(work, "trace dump");
+}
+
+/*
+ * Hand all devices over to a new daemon and stop. The connection is closed
+ * when this process exits, which tells the new daemon to start probing.
+ */
+static void rshim_handover(void)
+{
+  int i, sock;
+
+  sock = rshim_handover_accept();
+  if (sock < 0)
+    return;
+
+  rshim_lock();
+  for (i = 0; i < RSHIM_MAX_DEV; i++) {
+    if (rshim_devs[i])
+      rshim_handover_send(sock, rshim_devs[i]);
+  }
+  rshim_unlock();
+
+  rshim_handover_send(sock, NULL);
+  rshim_run = false;
+}
+
+/* Handle an epoll event of a per-device fd. */
+static void rshim_dev_event(rshim_backend_t *bd, int tag, int fd,
+                            uint32_t events)
+{
+  uint8_t tmp;
+
+  switch (tag) {
+  case RSHIM_EPOLL_CONS:
+    /* The console sockets handle their own errors and hangups. */
+    rshim_cons_sock_event(bd, fd, events);
+    break;
+
+  case RSHIM_EPOLL_LEASE:
+    rshim_lease_event(bd, fd, events);
+    break;
+
+  case RSHIM_EPOLL_NET:
+    if (events & (EPOLLERR | EPOLLHUP)) {
+      RSHIM_DBG("epoll error\n");
+      epoll_ctl(rshim_epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    } else if (fd == bd->net_notify_fd[0]) {
+      /* Rx. */
+      if (read(fd, &tmp, sizeof(tmp)) == sizeof(tmp))
+        rshim_net_rx(bd);
+    } else if (fd == bd->net_fd) {
+      /* Tx. */
+      rshim_net_tx(bd);
+    }
+    break;
+
+  default:
+    break;
+  }
+}
+
 static void rshim_main(int argc, char *argv[])
 {
-  int i, fd, num, rc, epoll_fd, timer_fd;
+  int i, fd, num, rc, epoll_fd, timer_fd, handover_fd, watch_fd;
   bool rshim_pcie_lf_init_done = false;
   uint8_t index;
 #ifdef __FreeBSD__
@@ -2622,7 +3429,7 @@ static void rshim_main(int argc, char *argv[])
   struct epoll_event event;
   rshim_backend_t *bd;
   time_t t0, t1;
-  uint8_t tmp;
+  uint64_t data;
 
   memset(&event, 0, sizeof(event));
   memset(events, 0, sizeof(events));
@@ -2681,6 +3488,12 @@ static void rshim_main(int argc, char *argv[])
     exit(1);
   }
 
+  /* Listen for a new daemon to take over; not fatal if unavailable. */
+  handover_fd = rshim_handover_listen();
+
+  /* Console watch notifications, if any pattern is configured. */
+  watch_fd = rshim_watch_listen();
+
   /* Scan rshim backends. */
   rc = 0;
   if (!rshim_backend_name && rshim_static_dev_name) {
@@ -2690,17 +3503,21 @@ static void rshim_main(int argc, char *argv[])
       rshim_backend_name = "pcie";
     else if (!strncmp(rshim_static_dev_name, "pcie_lf", 7))
       rshim_backend_name = "pcie_lf";
+    else if (!strncmp(rshim_static_dev_name, "replay-", 7))
+      rshim_backend_name = "replay";
   }
   if (!rshim_backend_name) {
     rshim_pcie_init();
-    rshim_usb_init(epoll_fd);
+    rshim_usb_init();
   } else {
     if (!strcmp(rshim_backend_name, "usb"))
-      rc = rshim_usb_init(epoll_fd);
+      rc = rshim_usb_init();
     else if (!strcmp(rshim_backend_name, "pcie"))
       rc = rshim_pcie_init();
     else if (!strcmp(rshim_backend_name, "pcie_lf"))
       rc = rshim_pcie_lf_init();
+    else if (!strcmp(rshim_backend_name, "replay"))
+      rc = rshim_replay_init();
   }
   if (rc) {
     RSHIM_ERR("failed to initialize rshim backend\n");
@@ -2718,7 +3535,30 @@ static void rshim_main(int argc, char *argv[])
     }
 
     for (i = 0; i < num; i++) {
-      fd = events[i].data.fd;
+      data = events[i].data.u64;
+      fd = RSHIM_EPOLL_FD(data);
+
+      /*
+       * Per-device fds. The device could have been removed by an earlier
+       * event of this batch, so each handler checks the fd is still its own.
+       */
+      if (RSHIM_EPOLL_TAG(data) != RSHIM_EPOLL_MISC) {
+        bd = RSHIM_EPOLL_INDEX(data) < RSHIM_MAX_DEV ?
+             rshim_devs[RSHIM_EPOLL_INDEX(data)] : NULL;
+        if (bd)
+          rshim_dev_event(bd, RSHIM_EPOLL_TAG(data), fd, events[i].events);
+        continue;
+      }
+
+      if (fd == handover_fd) {
+        rshim_handover();
+        continue;
+      }
+
+      if (fd == watch_fd) {
+        rshim_watch_accept();
+        continue;
+      }
 
       if ((events[i].events & EPOLLERR) || (events[i].events & EPOLLHUP)) {
         RSHIM_DBG("epoll error\n");
@@ -2739,29 +3579,17 @@ static void rshim_main(int argc, char *argv[])
             rshim_work_handler(bd);
         }
         continue;
-      } else {
-        /* Network. */
-        for (index = 0; index < RSHIM_MAX_DEV; index++) {
-          bd = rshim_devs[index];
-          if (!bd)
-            continue;
-
-          if (fd == bd->net_notify_fd[0]) {
-            /* Rx. */
-            if (read(fd, &tmp, sizeof(tmp)) == sizeof(tmp))
-              rshim_net_rx(bd);
-            break;
-          } else if (fd == rshim_devs[index]->net_fd) {
-            /* Tx. */
-            rshim_net_tx(bd);
-            break;
-          }
-        }
-        if (index != RSHIM_MAX_DEV)
-          continue;
       }
     }
 
+    /* Apply the configuration reloaded on SIGHUP. */
+    if (rshim_reload_pending)
+      rshim_reload_cfg();
+
+    /* Dump the flight recorders on SIGUSR1. */
+    if (rshim_trace_dump_pending)
+      rshim_trace_dump_all();
+
     /* Delayed initialization for livefish probe. */
     if (!rshim_pcie_lf_init_done) {
       time(&t1);
@@ -2779,12 +3607,15 @@ static void rshim_main(int argc, char *argv[])
           rshim_set_timer(timer_fd, 0);
       }
 
-      /* Check USB for timeout or unhandled fd. */
-      rshim_usb_poll(rshim_dev_bitmask ? false : true);
+      /* Handle the USB devices which were plugged or unplugged. */
+      rshim_usb_poll();
     }
   }
 
+  rshim_usb_exit();
   rshim_stop();
+  rshim_handover_close();
+  rshim_watch_close();
 }
 
 int rshim_fifo_size(rshim_backend_t *bd, int chan, bool is_rx)
@@ -2883,7 +3714,107 @@ int rshim_set_opn(rshim_backend_t *bd, const char *opn, int len)
   return 0;
 }
 
-static int rshim_load_cfg(void)
+/* Parse 'CONSOLE_WATCH <name> <text>', where the text is the rest of line. */
+static void rshim_load_watch_cfg(char *line)
+{
+  char name[RSHIM_WATCH_NAME_LEN];
+  int len, off = 0;
+
+  if (sscanf(line, "%*s %15s %n", name, &off) != 1 || !off)
+    return;
+
+  len = strlen(line + off);
+  while (len && (line[off + len - 1] == '\n' || line[off + len - 1] == '\r' ||
+                 line[off + len - 1] == ' ' || line[off + len - 1] == '\t'))
+    line[off + --len] = 0;
+
+  rshim_watch_add(name, line + off);
+}
+
+/* Parse 'LEASE_REG <name> [rw]'. */
+static void rshim_load_lease_cfg(char *line)
+{
+  char name[RSHIM_LEASE_NAME_LEN], mode[8] = "";
+
+  if (sscanf(line, "%*s %23s %7s", name, mode) < 1)
+    return;
+
+  if (mode[0] && strcmp(mode, "ro") && strcmp(mode, "rw")) {
+    RSHIM_WARN("lease register '%s': unknown mode '%s'\n", name, mode);
+    return;
+  }
+
+  rshim_lease_add(name, !strcmp(mode, "rw"));
+}
+
+/*
+ * Save the built-in values of the keys which could be reloaded before the
+ * file is read first, and restore them before it's reloaded so a key removed
+ * from the file goes back to its default.
+ */
+static void rshim_cfg_defaults(bool reload)
+{
+  static struct {
+    int rshim_display_level;
+    int rshim_boot_timeout;
+    int rshim_drop_mode;
+    int rshim_usb_reset_delay;
+    bool rshim_has_usb_reset_delay;
+    int rshim_pcie_reset_delay;
+    bool rshim_has_pcie_reset_delay;
+    int rshim_pcie_intr_poll_interval;
+    int rshim_pcie_enable_vfio;
+    int rshim_pcie_enable_uio;
+    int rshim_fuse_threads;
+    bool rshim_cons_sock_enable;
+    bool rshim_mbox_enable;
+    int rshim_mbox_poll_interval;
+    bool rshim_cons_ts_enable;
+    int rshim_peer_refresh_interval;
+    char rshim_record_dir[RSHIM_RECORD_DIR_LEN];
+    bool rshim_watch_snapshot;
+    int rshim_trace_size;
+    char rshim_cpu_affinity[sizeof(rshim_cpu_affinity)];
+  } dflt;
+
+#define RSHIM_CFG_DEFAULT(var) \
+  do { \
+    if (reload) \
+      memcpy(&(var), &dflt.var, sizeof(var)); \
+    else \
+      memcpy(&dflt.var, &(var), sizeof(var)); \
+  } while (0)
+
+  RSHIM_CFG_DEFAULT(rshim_display_level);
+  RSHIM_CFG_DEFAULT(rshim_boot_timeout);
+  RSHIM_CFG_DEFAULT(rshim_drop_mode);
+  RSHIM_CFG_DEFAULT(rshim_usb_reset_delay);
+  RSHIM_CFG_DEFAULT(rshim_has_usb_reset_delay);
+  RSHIM_CFG_DEFAULT(rshim_pcie_reset_delay);
+  RSHIM_CFG_DEFAULT(rshim_has_pcie_reset_delay);
+  RSHIM_CFG_DEFAULT(rshim_pcie_intr_poll_interval);
+  RSHIM_CFG_DEFAULT(rshim_pcie_enable_vfio);
+  RSHIM_CFG_DEFAULT(rshim_pcie_enable_uio);
+  RSHIM_CFG_DEFAULT(rshim_fuse_threads);
+  RSHIM_CFG_DEFAULT(rshim_cons_sock_enable);
+  RSHIM_CFG_DEFAULT(rshim_mbox_enable);
+  RSHIM_CFG_DEFAULT(rshim_mbox_poll_interval);
+  RSHIM_CFG_DEFAULT(rshim_cons_ts_enable);
+  RSHIM_CFG_DEFAULT(rshim_peer_refresh_interval);
+  RSHIM_CFG_DEFAULT(rshim_record_dir);
+  RSHIM_CFG_DEFAULT(rshim_watch_snapshot);
+  RSHIM_CFG_DEFAULT(rshim_trace_size);
+  RSHIM_CFG_DEFAULT(rshim_cpu_affinity);
+
+#undef RSHIM_CFG_DEFAULT
+}
+
+/*
+ * Load the configuration file. On reload the keys missing from the file go
+ * back to their defaults, the list of blocked devices is rebuilt, and the
+ * static mapping of an index in use is left alone.
+ */
+static int rshim_load_cfg(bool reload)
 {
   char key[32] = "", value[64] = "";
   char *buf = NULL;
@@ -2895,6 +3826,15 @@ static int rshim_load_cfg(void)
   if (!file)
     return -ENOENT;
 
+  rshim_cfg_defaults(reload);
+
+  if (reload) {
+    for (index = 0; index < RSHIM_MAX_DEV; index++) {
+      free(rshim_blocked_dev_names[index]);
+      rshim_blocked_dev_names[index] = NULL;
+    }
+  }
+
   while (getline(&buf, &n, file) != -1) {
     if (sscanf(buf, "%31s%63s", key, value) != 2)
       continue;
@@ -2925,6 +3865,54 @@ static int rshim_load_cfg(void)
     } else if (!strcmp(key, "PCIE_HAS_UIO")) {
       rshim_pcie_enable_uio = atoi(value);
       continue;
+    } else if (!strcmp(key, "FUSE_THREADS")) {
+      rshim_fuse_threads = atoi(value);
+      if (rshim_fuse_threads < 1)
+        rshim_fuse_threads = 1;
+      else if (rshim_fuse_threads > RSHIM_FUSE_MAX_THREADS)
+        rshim_fuse_threads = RSHIM_FUSE_MAX_THREADS;
+      continue;
+    } else if (!strcmp(key, "CONSOLE_SOCKET")) {
+      rshim_cons_sock_enable = (atoi(value) > 0) ? true : false;
+      continue;
+    } else if (!strcmp(key, "MAILBOX")) {
+      rshim_mbox_enable = (atoi(value) > 0) ? true : false;
+      continue;
+    } else if (!strcmp(key, "MAILBOX_POLL_INTERVAL")) {
+      rshim_mbox_poll_interval = atoi(value);
+      if (rshim_mbox_poll_interval < 0)
+        rshim_mbox_poll_interval = 0;
+      continue;
+    } else if (!strcmp(key, "CONSOLE_TS")) {
+      rshim_cons_ts_enable = (atoi(value) > 0) ? true : false;
+      continue;
+    } else if (!strcmp(key, "PEER_REFRESH_INTERVAL")) {
+      rshim_peer_refresh_interval = atoi(value);
+      if (rshim_peer_refresh_interval < 0)
+        rshim_peer_refresh_interval = 0;
+      continue;
+    } else if (!strcmp(key, "RECORD_DIR")) {
+      snprintf(rshim_record_dir, sizeof(rshim_record_dir), "%s", value);
+      continue;
+    } else if (!strcmp(key, "CONSOLE_WATCH")) {
+      /* The scanner is fixed once the devices are running. */
+      if (!reload)
+        rshim_load_watch_cfg(buf);
+      continue;
+    } else if (!strcmp(key, "LEASE_REG")) {
+      /* The allow-list is fixed once the devices are running. */
+      if (!reload)
+        rshim_load_lease_cfg(buf);
+      continue;
+    } else if (!strcmp(key, "CONSOLE_WATCH_SNAPSHOT")) {
+      rshim_watch_snapshot = (atoi(value) > 0) ? true : false;
+      continue;
+    } else if (!strcmp(key, "TRACE_SIZE")) {
+      rshim_trace_size = atoi(value);
+      continue;
+    } else if (!strcmp(key, "CPU_AFFINITY")) {
+      snprintf(rshim_cpu_affinity, sizeof(rshim_cpu_affinity), "%s", value);
+      continue;
     }
 
     if (strncmp(key, "rshim", 5) && strcmp(key, "none"))
@@ -2946,7 +3934,7 @@ static int rshim_load_cfg(void)
 
     /* Static mapping of rshim device to index. */
     index = atoi(key + 5);
-    if (index < 0 || index >= RSHIM_MAX_DEV)
+    if (index < 0 || index >= RSHIM_MAX_DEV || (reload && rshim_devs[index]))
       continue;
     if (rshim_dev_names[index])
       free(rshim_dev_names[index]);
@@ -2960,6 +3948,98 @@ static int rshim_load_cfg(void)
   return 0;
 }
 
+/*
+ * Apply the reloaded configuration to the attached devices. Only settings
+ * which have changed in the file are applied, so values set through the
+ * misc file are kept otherwise.
+ */
+static void rshim_reload_cfg(void)
+{
+  int display_level = rshim_display_level, boot_timeout = rshim_boot_timeout;
+  int drop_mode = rshim_drop_mode, usb_reset_delay = rshim_usb_reset_delay;
+  int pcie_reset_delay = rshim_pcie_reset_delay;
+  char cpu_affinity[sizeof(rshim_cpu_affinity)];
+  rshim_dev_work_t *work = NULL;
+  rshim_backend_t *bd;
+  bool affinity_changed;
+  int i, j, k;
+
+  rshim_reload_pending = 0;
+  memcpy(cpu_affinity, rshim_cpu_affinity, sizeof(cpu_affinity));
+
+  rshim_lock();
+
+  if (rshim_load_cfg(true)) {
+    rshim_unlock();
+    RSHIM_WARN("failed to reload %s\n", rshim_cfg_file);
+    return;
+  }
+  RSHIM_INFO("reloaded %s\n", rshim_cfg_file);
+
+  affinity_changed = strcmp(cpu_affinity, rshim_cpu_affinity) != 0;
+  if (affinity_changed)
+    rshim_set_affinity(NULL, pthread_self());
+
+  for (i = 0; i < RSHIM_MAX_DEV; i++) {
+    bd = rshim_devs[i];
+    if (!bd)
+      continue;
+
+    for (j = 0; j < RSHIM_MAX_DEV; j++) {
+      if (rshim_blocked_dev_names[j] &&
+          !strcmp(rshim_blocked_dev_names[j], bd->dev_name))
+        RSHIM_INFO("rshim%d blocked, effective after detach\n", bd->index);
+    }
+
+    pthread_mutex_lock(&bd->mutex);
+    if (display_level != rshim_display_level)
+      bd->display_level = rshim_display_level;
+    if (boot_timeout != rshim_boot_timeout)
+      bd->boot_timeout = rshim_boot_timeout;
+    if (!strncmp(bd->dev_name, "usb-", 4)) {
+      if (usb_reset_delay != rshim_usb_reset_delay)
+        bd->reset_delay = rshim_usb_reset_delay;
+    } else if (pcie_reset_delay != rshim_pcie_reset_delay) {
+      bd->reset_delay = rshim_pcie_reset_delay;
+    }
+    pthread_mutex_unlock(&bd->mutex);
+
+    if (affinity_changed) {
+      for (j = 0; j < RSH_DEV_TYPES; j++) {
+        for (k = 0; k < RSHIM_FUSE_MAX_THREADS; k++) {
+          if (bd->fuse_thread[j][k])
+            rshim_set_affinity(bd, bd->fuse_thread[j][k]);
+        }
+      }
+    }
+
+    /*
+     * Leaving drop mode polls the device for up to a couple of seconds, so
+     * it's done by a thread. A DROP_MODE removed from the file (-1) means
+     * the default, which is 0.
+     */
+    if ((drop_mode > 0) != (rshim_drop_mode > 0)) {
+      if (!work) {
+        work = calloc(1, sizeof(*work));
+        if (!work) {
+          RSHIM_WARN("drop mode not changed: out of memory\n");
+          drop_mode = rshim_drop_mode;
+          continue;
+        }
+        work->handler = rshim_set_drop_mode;
+        work->arg = rshim_drop_mode > 0;
+      }
+      rshim_ref(bd);
+      work->bd[work->num++] = bd;
+    }
+  }
+
+  rshim_unlock();
+
+  if (work)
+    rshim_dev_work_start(work, "drop mode");
+}
+
 void rshim_sig_hup(int sig)
 {
   rshim_backend_t *bd;
@@ -2975,6 +4055,10 @@ void rshim_sig_hup(int sig)
       pthread_cond_broadcast(&bd->write_fifo[i].operable);
     }
   }
+
+  /* Reload the configuration file from the main loop. */
+  rshim_reload_pending = 1;
+  rshim_work_signal(NULL);
 }
 
 static void rshim_sig_handler(int sig)
@@ -2988,6 +4072,11 @@ static void rshim_sig_handler(int sig)
     rshim_run = false;
     rshim_work_signal(NULL);
     break;
+
+  case SIGUSR1:
+    rshim_trace_dump_pending = 1;
+    rshim_work_signal(NULL);
+    break;
   }
 }
 
@@ -3001,6 +4090,7 @@ static void set_signals(void)
   sigaction(SIGINT, &sa, NULL);
   sigaction(SIGTERM, &sa, NULL);
   sigaction(SIGPIPE, &sa, NULL);
+  sigaction(SIGUSR1, &sa, NULL);
 }
 
 static void print_help(void)
@@ -3008,31 +4098,38 @@ static void print_help(void)
   printf("Usage: rshim [options]\n");
   printf("\n");
   printf("OPTIONS:\n");
-  printf("  -b, --backend     backend name (usb, pcie or pcie_lf)\n");
+  printf("  -b, --backend     backend name (usb, pcie, pcie_lf or replay)\n");
   printf("  -d, --device      device to attach\n");
   printf("  -f, --foreground  run in foreground\n");
+  printf("  -H, --handover    take over devices from the running daemon\n");
   printf("  -i, --index       use device path /dev/rshim<i>/\n");
   printf("  -l, --log-level   log level");
   printf("(0:none, 1:error, 2:warning, 3:notice, 4:debug)\n");
   printf("  -n, --nonet       no network interface\n");
+  printf("  -p, --probe[=N]   time N register accesses of the PCIe device");
+  printf(" given\n                    with -d, then exit\n");
   printf("  -v, --version     version\n");
 }
 
 int main(int argc, char *argv[])
 {
-  static const char short_options[] = "b:d:fhi:l:nv";
+  static const char short_options[] = "b:d:fHhi:l:np::v";
   static struct option long_options[] = {
     { "backend", required_argument, NULL, 'b' },
     { "device", required_argument, NULL, 'd' },
     { "foreground", no_argument, NULL, 'f' },
+    { "handover", no_argument, NULL, 'H' },
     { "help", no_argument, NULL, 'h' },
     { "index", required_argument, NULL, 'i' },
     { "log-level", required_argument, NULL, 'l' },
     { "nonet", no_argument, NULL, 'n' },
+    { "probe", optional_argument, NULL, 'p' },
+    { "bench-bar", optional_argument, NULL, 'p' },
     { "version", no_argument, NULL, 'v' },
     { NULL, 0, NULL, 0 }
   };
-  int c;
+  bool handover = false, probe = false;
+  int c, probe_count = 0;
 
   /* Parse arguments. */
   while ((c = getopt_long(argc, argv, short_options, long_options, NULL))
@@ -3047,6 +4144,9 @@ int main(int argc, char *argv[])
     case 'f':
       rshim_daemon_mode = false;
       break;
+    case 'H':
+      handover = true;
+      break;
     case 'i':
       rshim_static_index = atoi(optarg);
       if (rshim_static_index >= RSHIM_MAX_DEV) {
@@ -3068,6 +4168,11 @@ int main(int argc, char *argv[])
     case 'n':
       rshim_no_net = true;
       break;
+    case 'p':
+      probe = true;
+      if (optarg)
+        probe_count = atoi(optarg);
+      break;
     case 'v':
 #if defined(PACKAGE_NAME) && defined(VERSION)
       printf(PACKAGE_NAME " " VERSION "-" REVISION "\n");
@@ -3082,172 +4187,13 @@ int main(int argc, char *argv[])
     }
   }
 
-  /* Test */
-  char path[] = "/sys/bus/pci/devices/0000:98:00.2/resource0";
-  // char path[] = "/sys/bus/pci/devices/0000:98:00.0/resource0";
-  int dev_fd = open(path,  O_RDWR | O_SYNC);
-  if(dev_fd < 0){
-    RSHIM_ERR("Failed to open %s\n", path);
-    return -ENODEV;
-  }else{
-    RSHIM_INFO("Successfully open %s\n", path);
+  /* Measure the register accesses of one device and exit. */
+  if (probe) {
+    rshim_daemon_mode = false;
+    rshim_load_cfg(false);
+    return rshim_pcie_bar_probe(rshim_static_dev_name, probe_count) ? 1 : 0;
   }
 
-  volatile uint8_t *dev_regs = mmap(NULL, 0x100000,
-                         PROT_READ | PROT_WRITE,
-                         MAP_SHARED | MAP_LOCKED,
-                         dev_fd,
-                         0);
-  if (dev_regs == MAP_FAILED) {
-    RSHIM_ERR("Failed to map RShim registers\n");
-    return -ENOMEM;
-  }else{
-     RSHIM_INFO("Successfully map RShim registers\n");
-  }
-
-  // From rshim_pcie_read 
-  uint32_t chan = RSH_MMIO_ADDRESS_SPACE__CHANNEL_VAL_RSHIM;
-  uint32_t addr = RSH_UPTIME | (chan << 16);
-  addr = 0;
-  uint64_t result;
-
-  struct timeval start, end;
-  writeq(456, dev_regs + addr);
-
-
-  gettimeofday(&start, NULL);
-  for (int j = 0; j < 1; ++j) 
-    result = readq(dev_regs + addr);
-  gettimeofday(&end, NULL);
-  double time_taken = (end.tv_sec - start.tv_sec) * 1000000.0+ (end.tv_usec - start.tv_usec);
-  RSHIM_INFO("TEST Read Uptime %lu %.2fns\n", result, time_taken / 100000 * 1000);
-
-  printf("RSH_UPTIME %ld\n", result);
-
-  // /* On Host Side*/
-  int count  = 1;
-  gettimeofday(&start, NULL);
-  for (int j = 0; j < count; ++j){
-    uint64_t value = htole64(520 + j);
-    // uint32_t region_addr = RSH_TM_HOST_TO_TILE_DATA  | (chan << 16);
-    // RSH_MEM_ACC_DATA__FIRST_WORD
-    // uint32_t region_addr = RSH_MEM_ACC_DATA__FIRST_WORD | (chan << 16);
-    // RSH_SCRATCHPAD6
-    // uint32_t region_addr = RSH_SCRATCHPAD1 | (chan << 16);
-    // writeq(value, dev_regs + region_addr + 0x4);
-
-
-
-
-  
-  // /* Calculate available size. */
-  // uint64_t word = readq(dev_regs + RSH_TM_HOST_TO_TILE_STS);
-  // int avail = RSH_TM_FIFO_SIZE - (int)(word & RSH_TM_HOST_TO_TILE_STS__COUNT_MASK) -
-  //         RSHIM_FIFO_SPACE_RESERV;
-  // printf("avail %d\n", avail);
-
-    // uint32_t region_addr = 0xa20| (chan << 16);
-    // for(int offset = 0; offset < 1; ++offset){
-    //   writeq(555, dev_regs + region_addr + offset * 8);
-    //    usleep(1);
-    //    writeq(556, dev_regs + region_addr + offset * 8);
-    //    usleep(1);
-    //     writeq(557, dev_regs + region_addr + offset * 8);
-    // }
-   
-
-    mmio_write(dev_regs, RSH_SCRATCHPAD1, RSHIM_REG_SIZE_8B, 456);
-  }
-  return;
-  gettimeofday(&end, NULL);
-  time_taken = (end.tv_sec - start.tv_sec) * 1000000.0 + (end.tv_usec - start.tv_usec);
-  RSHIM_INFO("TEST Write  %.2fns\n", result, time_taken / count * 1000);
-
-
- /* On BF2 Side*/
-//   int mem_fd = open("/dev/mem", O_RDWR | O_SYNC);
-//   if(mem_fd < 0){
-//     RSHIM_ERR("Failed to open mem_fd\n");
-//     return -ENODEV;
-//   }else{
-//     RSHIM_INFO("Successfully open mem_fd\n");
-//   }
-
-//   // const uint32_t mem_address = 0x00800a20;Z
-//   // uint32_t alloc_mem_size=0x18, page_mask, page_size;
-//   // page_size = sysconf(_SC_PAGESIZE);
-//   // page_mask = (page_size - 1);
-//   // volatile uint8_t *region0_reg = mmap(NULL, alloc_mem_size,
-//   //                       PROT_READ | PROT_WRITE,
-//   //                       MAP_SHARED | MAP_LOCKED,
-//   //                       mem_fd ,
-//   //                       0x00800a20);
-//   // result = readq(mem_pointer);
-
-// #define MAP_SIZE 4096UL
-// #define MAP_MASK (MAP_SIZE - 1)
-
-//   const off_t mem_address = 0x00800a20;
-//   const size_t mem_size = 0x18;
-//   uint32_t alloc_mem_size, page_mask, page_size;
-//   void *mem_pointer, *virt_addr;
-//   page_size = sysconf(_SC_PAGESIZE);
-//   alloc_mem_size = (((mem_size / page_size) + 1) * page_size);
-//   page_mask = (page_size - 1);
-//   mem_pointer = mmap(0,
-//                     MAP_SIZE,
-//                     PROT_READ | PROT_WRITE,
-//                     MAP_SHARED,
-//                     mem_fd,
-//                     (mem_address & ~MAP_MASK)
-//                     );
-//   if(mem_pointer == MAP_FAILED)
-//   {  
-//      perror("mmap failed");
-//     RSHIM_ERR("Failed to map region 0 %d \n", page_size);
-    
-//     return -ENODEV;
-//   }
-//   virt_addr = (mem_pointer  + (mem_address & MAP_MASK));
-//   // *((unsigned long *) virt_addr) = 123;
-
-//   writeq(456UL, virt_addr);
-//   while(1){
-//     //result = readq(virt_addr);
-//     result = *((unsigned long *) virt_addr);
-//     __sync_synchronize();
-
-//     // result = le64toh(result);
-//     // result =  *((unsigned long *) virt_addr);
-//     if (result != 18446744073709551615UL)
-//       printf("Value at address 0x%X (%p): 0x%X %lu\n", mem_address, virt_addr, result, result); 
-//   }
-//   printf("Region0 %lu %d %d %p\n", result, page_size, (mem_address & MAP_MASK), virt_addr);
-//   for (int i = 0; i < mem_size; ++i)
-//       printf("%02x \n", (int)((char*)virt_addr)[i]);
-
-
-  // off_t offset = 0x00800a20;
-  // size_t len = 0x18;
-  // size_t pagesize = sysconf(_SC_PAGE_SIZE);
-  // off_t page_base = (offset / pagesize) * pagesize;
-  // off_t page_offset = offset - page_base;
-
-  // int fd = open("/dev/mem", O_SYNC);
-  // unsigned char *mem = mmap(NULL, page_offset + len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, page_base);
-  // if (mem == MAP_FAILED) {
-  //       perror("Can't map memory");
-  //       return -1;
-  // }
-  // size_t i;
-  // for (i = 0; i < len; ++i)
-  //   printf("%d \n", (int)mem[page_offset + i]);
-  // result = readq(mem + page_offset + len);
-  // printf("Region0 %lu \n", result);
-
-
-  /* End of Test*/
-
   /* Put into daemon mode. */
   if (rshim_daemon_mode) {
     int pid = fork();
@@ -3276,10 +4222,17 @@ int main(int argc, char *argv[])
   openlog("rshim", LOG_CONS, LOG_USER);
 #endif
 
-  rshim_load_cfg();
+  rshim_load_cfg(false);
+
+  /* Threads created later inherit the affinity of the main thread. */
+  rshim_set_affinity(NULL, pthread_self());
 
   set_signals();
 
+  /* Wait for the running daemon to hand over its devices and exit. */
+  if (handover)
+    rshim_handover_receive();
+
   rshim_main(argc, argv);
 
   closelog();
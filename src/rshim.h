@@ -25,7 +25,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #ifdef HAVE_CONFIG_H
 #include <config.h>
@@ -33,8 +35,14 @@
 #ifdef HAVE_SYSLOG_H
 #include <syslog.h>
 #endif
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#endif
 
 #include "rshim_regs.h"
+#include "rshim_lease.h"
+#include "rshim_mbox.h"
+#include "rshim_trace.h"
 
 /* Global variables. */
 extern int rshim_log_level;
@@ -47,6 +55,17 @@ extern bool rshim_has_pcie_reset_delay;
 extern int rshim_pcie_intr_poll_interval;
 extern int rshim_pcie_enable_vfio;
 extern int rshim_pcie_enable_uio;
+extern int rshim_fuse_threads;
+extern bool rshim_cons_sock_enable;
+extern bool rshim_cons_ts_enable;
+extern bool rshim_mbox_enable;
+extern int rshim_mbox_poll_interval;
+extern int rshim_peer_refresh_interval;
+extern char *rshim_static_dev_name;
+extern int rshim_trace_size;
+#define RSHIM_RECORD_DIR_LEN  64
+extern char rshim_record_dir[RSHIM_RECORD_DIR_LEN];
+extern bool rshim_watch_snapshot;
 
 #ifndef offsetof
 #define offsetof(TYPE, MEMBER)	((size_t)&((TYPE *)0)->MEMBER)
@@ -82,6 +101,24 @@ extern int rshim_pcie_enable_uio;
 #define RSHIM_INFO(fmt...)     RSHIM_LOG(LOG_NOTICE, fmt)
 #define RSHIM_DBG(fmt...)      RSHIM_LOG(LOG_DEBUG, fmt)
 
+/*
+ * USDT tracepoints of provider 'rshim' for perf/bpftrace, which are nops
+ * until attached. Compiled out if sys/sdt.h is not available.
+ */
+#ifdef HAVE_SYS_SDT_H
+#define RSHIM_PROBE2(name, a1, a2) DTRACE_PROBE2(rshim, name, a1, a2)
+#define RSHIM_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(rshim, name, a1, a2, a3)
+#define RSHIM_PROBE4(name, a1, a2, a3, a4) \
+  DTRACE_PROBE4(rshim, name, a1, a2, a3, a4)
+#define RSHIM_PROBE5(name, a1, a2, a3, a4, a5) \
+  DTRACE_PROBE5(rshim, name, a1, a2, a3, a4, a5)
+#else
+#define RSHIM_PROBE2(name, a1, a2) do { } while (0)
+#define RSHIM_PROBE3(name, a1, a2, a3) do { } while (0)
+#define RSHIM_PROBE4(name, a1, a2, a3, a4) do { } while (0)
+#define RSHIM_PROBE5(name, a1, a2, a3, a4, a5) do { } while (0)
+#endif
+
 /* Spin flag values. */
 #define RSH_SFLG_READING    0x1  /* read is active. */
 #define RSH_SFLG_WRITING    0x2  /* write_urb is active. */
@@ -98,8 +135,26 @@ extern int rshim_pcie_enable_uio;
 #define WRITE_FIFO_SIZE   (4 * 1024)
 #define BOOT_BUF_SIZE     (16 * 1024)
 
+/* Alignment of the per-device buffers. */
+#define RSHIM_CACHE_LINE_SIZE  64
+#define RSHIM_ALIGN(size) \
+  (((size) + RSHIM_CACHE_LINE_SIZE - 1) & ~(size_t)(RSHIM_CACHE_LINE_SIZE - 1))
+
 #define BF3_MAX_BOOT_FIFO_SIZE 8192 /* bytes */
 
+/* Maximum number of CUSE worker threads per device file. */
+#define RSHIM_FUSE_MAX_THREADS 16
+
+/* Console socket. */
+#ifdef __FreeBSD__
+#define RSHIM_CONS_SOCK_DIR    "/var/run/rshim"
+#else
+#define RSHIM_CONS_SOCK_DIR    "/run/rshim"
+#endif
+#define RSHIM_CONS_MAX_CLIENTS 8
+#define RSHIM_CONS_TX_BUF_SIZE 256
+#define RSHIM_CONS_TS_MAX_IOV  64
+
 #define RSHIM_BAD_CTRL_REG(v) \
   (((v) == 0xbad00acce55) || ((v) == (uint64_t)-1) || ((v) == 0xbadacce55))
 
@@ -109,6 +164,7 @@ enum {
   RSH_DEV_TYPE_BOOT,
   RSH_DEV_TYPE_TMFIFO,
   RSH_DEV_TYPE_MISC,
+  RSH_DEV_TYPE_MEM,
   RSH_DEV_TYPES
 };
 
@@ -210,6 +266,8 @@ typedef struct {
   unsigned int head;
   unsigned int tail;
   pthread_cond_t operable;
+  bool busy;                    /* A reader is replying from the ring. */
+  unsigned int gen;             /* Bumped when the ring is reset. */
 } rshim_fifo_t;
 
 /* RShim network packet. */
@@ -219,8 +277,20 @@ typedef struct {
   char buf[ETH_PKT_SIZE];       /* packet buffer */
 } rshim_net_pkt_t;
 
+/*
+ * Tap reads stop once the network write FIFO can't take another full frame
+ * and resume when it drains below half.
+ */
+#define RSHIM_NET_TX_HIGH_WM  (WRITE_FIFO_SIZE - (int)sizeof(rshim_net_pkt_t))
+#define RSHIM_NET_TX_LOW_WM   (WRITE_FIFO_SIZE / 2)
+
 #define RSHIM_DEV_NAME_LEN   64
 
+/* Maximum number of devices supported (currently it's limited to 64). */
+#define RSHIM_MAX_DEV 64
+
+#define RSHIM_CPULIST_LEN    256
+
 /* Bluefield Version. */
 #define RSHIM_BLUEFIELD_1 1
 #define RSHIM_BLUEFIELD_2 2
@@ -230,6 +300,13 @@ typedef struct {
 #define BLUEFIELD_REV0 0
 #define BLUEFIELD_REV1 1
 
+/* BAR of a device as handed out to the register leases. */
+typedef struct {
+  int fd;                       /* owned by the backend */
+  uint64_t map_offset;          /* mmap offset of the BAR in the fd */
+  uint64_t size;
+} rshim_bar_info_t;
+
 /* RShim backend. */
 typedef struct rshim_backend rshim_backend_t;
 struct rshim_backend {
@@ -239,13 +316,23 @@ struct rshim_backend {
   /* Backend device. */
   void *dev;
 
+  /* CPUs and NUMA node local to the device, if known. */
+  char local_cpus[RSHIM_CPULIST_LEN];
+  int numa_node;
+
+  /* Min interval of background register polls in us, 0 for no limit. */
+  int reg_poll_min;
+
   /* BlueField version / revision. */
   uint16_t ver_id;
   uint16_t rev_id;
 
-  /* FUSE sessions & poll handles. */
+  /*
+   * FUSE sessions, worker threads & poll handles. The poll handles are
+   * protected by ringlock since they're used from rshim_fifo_input().
+   */
   void *fuse_session[RSH_DEV_TYPES];
-  pthread_t fuse_thread[RSH_DEV_TYPES];
+  pthread_t fuse_thread[RSH_DEV_TYPES][RSHIM_FUSE_MAX_THREADS];
   void *fuse_poll_handle[TMFIFO_MAX_CHAN];
 
   /* Networking handler and packets. */
@@ -255,6 +342,34 @@ struct rshim_backend {
   int net_tx_len;
   int net_rx_len;
   bool net_rx_pending;
+  int handover_net_fd;          /* tap fd from the previous daemon */
+
+  /* Tap back-pressure state and total time in ms, protected by ringlock. */
+  bool net_tx_paused;
+  uint64_t net_tx_pause_start;
+  uint64_t net_tx_pause_ms;
+
+  /* Console socket and its clients. */
+  int cons_sock_fd, cons_notify_fd[2];
+  int cons_client_fd[RSHIM_CONS_MAX_CLIENTS];
+  int cons_clients;
+  bool cons_rx_pending;
+  bool cons_tx_blocked;
+  int cons_tx_len;
+  char cons_tx_buf[RSHIM_CONS_TX_BUF_SIZE];
+
+  /*
+   * Timestamped console stream and its clients. The clients are protected
+   * by ringlock since they're served from rshim_fifo_input().
+   */
+  int cons_ts_sock_fd;
+  int cons_ts_client_fd[RSHIM_CONS_MAX_CLIENTS];
+  /* Client lost output and waits for the next line to resume. */
+  bool cons_ts_client_skip[RSHIM_CONS_MAX_CLIENTS];
+  /* The last byte the client got isn't a newline. */
+  bool cons_ts_client_midline[RSHIM_CONS_MAX_CLIENTS];
+  int cons_ts_clients;
+  bool cons_ts_bol;             /* next byte starts a line */
 
   /* State flags. */
   uint32_t is_booting : 1;        /* Waiting for device to come back. */
@@ -271,20 +386,25 @@ struct rshim_backend {
   uint32_t has_reprobe : 1;       /* Reprobe support after SW reset. */
   uint32_t drop_pkt : 1;          /* Drop the rest of the packet. */
   uint32_t registered : 1;        /* Backend has been registered. */
-  uint32_t keepalive : 1;         /* A flag to update keepalive. */
   uint32_t peer_ctrl_req : 1;     /* A flag to send ctrl request. */
-  uint32_t peer_ctrl_resp : 1;    /* A flag to indicate MAC response rcvd. */
   uint32_t peer_mac_set : 1;      /* A flag to send MAC-set request. */
   uint32_t peer_pxe_id_set : 1;   /* A flag to send pxe-id-set request. */
   uint32_t peer_vlan_set : 1;     /* A flag to set vlan IDs. */
   uint32_t drop_mode : 1;         /* A flag to drop all input/output. */
   uint32_t skip_boot_reset : 1;   /* Skip SW_RESET while pushing boot stream. */
+  uint32_t handover : 1;          /* State handed over by previous daemon. */
 
   /* reference count. */
   volatile int ref;
 
   /* Last keepalive time. */
   int last_keepalive;
+
+  /* Keepalive skipped as the device was busy, only used by the timer. */
+  bool keepalive_retry;
+
+  /* Last time of TMFIFO traffic. */
+  int last_traffic;
   int net_init_time;
 
   /* timer. */
@@ -317,6 +437,9 @@ struct rshim_backend {
   /* Write FIFOs. */
   rshim_fifo_t write_fifo[TMFIFO_MAX_CHAN];
 
+  /* Arena of the FIFOs and the read/write buffers. */
+  void *fifo_arena;
+
   /* Read buffer. */
   unsigned char *read_buf;
 
@@ -332,7 +455,7 @@ struct rshim_backend {
   /* First error encountered during read or write. */
   int tmfifo_error;
 
-  /* Buffers used for boot writes.  Allocated at startup. */
+  /* Buffers used for boot writes.  Allocated on the first boot open. */
   char *boot_buf[2];
 
   /* Buffer to store the remaining data when it's not 8B unaligned. */
@@ -367,9 +490,6 @@ struct rshim_backend {
   /* State for our outstanding boot write. */
   pthread_cond_t boot_write_complete_cond;
 
-  /* Wait condition for control messages. */
-  pthread_cond_t ctrl_wait_cond;
-
   /* Current termios settings for the console. */
   struct termios cons_termios;
 
@@ -405,6 +525,25 @@ struct rshim_backend {
   /* Up to two VLAN IDs for PXE purpose. */
   uint16_t vlan[2];
 
+  /* Monotonic time of the last peer info response and request. */
+  time_t peer_info_time;
+  time_t peer_req_time;
+
+  /* Flight recorder, or NULL if disabled. */
+  struct rshim_trace *trace;
+
+  /* Recorder of the backend calls for replay, or NULL if disabled. */
+  struct rshim_record *record;
+
+  /* Console pattern watcher, or NULL if no pattern is configured. */
+  struct rshim_watch *watch;
+
+  /* Scratchpad mailbox, or NULL if disabled. */
+  struct rshim_mbox *mbox;
+
+  /* Register leases, or NULL if no register could be leased. */
+  struct rshim_lease *lease;
+
   /* APIs provided by backend. */
 
   /* API to write bulk data to RShim via the backend. */
@@ -428,9 +567,22 @@ struct rshim_backend {
   int (*write_rshim)(rshim_backend_t *bd, uint32_t chan, uint32_t addr,
                      uint64_t value, int size);
 
+  /*
+   * API to write <size> bytes to RShim without waiting for the completion
+   * (optional). Used by the main loop to avoid blocking on a slow device.
+   */
+  int (*write_rshim_posted)(rshim_backend_t *bd, uint32_t chan, uint32_t addr,
+                            uint64_t value, int size);
+
   /* API to enable the device. */
   int (*enable_device)(rshim_backend_t *bd, bool enable);
 
+  /* API to get the file descriptor and mapping of the BAR (optional). */
+  int (*get_bar)(rshim_backend_t *bd, rshim_bar_info_t *info);
+
+  /* API to get the BAR offset of a register, or -1 (optional). */
+  int64_t (*bar_offset)(rshim_backend_t *bd, uint32_t chan, uint32_t addr);
+
   /* Platform specific register addresses */
   const struct rshim_regs *regs;
 };
@@ -467,9 +619,28 @@ struct rshim_regs {
 extern const struct rshim_regs bf1_bf2_rshim_regs;
 extern const struct rshim_regs bf3_rshim_regs;
 
+/*
+ * epoll data of the per-device fds: what the fd is for, the device index
+ * and the fd, so the main loop dispatches the event without looking for the
+ * device. The other fds are added with 'data.fd' and a zero tag.
+ */
+enum {
+  RSHIM_EPOLL_MISC,
+  RSHIM_EPOLL_CONS,
+  RSHIM_EPOLL_LEASE,
+  RSHIM_EPOLL_NET,
+};
+
+#define RSHIM_EPOLL_DATA(tag, index, fd) \
+  (((uint64_t)(tag) << 48) | ((uint64_t)(index) << 32) | (uint32_t)(fd))
+#define RSHIM_EPOLL_TAG(data)   ((int)((data) >> 48))
+#define RSHIM_EPOLL_INDEX(data) ((int)(((data) >> 32) & 0xffff))
+#define RSHIM_EPOLL_FD(data)    ((int)(uint32_t)(data))
+
 /* Global variables. */
 extern int rshim_epoll_fd;
 extern volatile bool rshim_run;
+extern rshim_backend_t *rshim_devs[RSHIM_MAX_DEV];
 
 /* Common APIs. */
 
@@ -504,20 +675,107 @@ ssize_t rshim_fifo_read(rshim_backend_t *bd, char *buffer,
 ssize_t rshim_fifo_write(rshim_backend_t *bd, const char *buffer,
                          size_t count, int chan, bool nonblock);
 
+/* Read from the FIFO by passing the ring segments to a reply callback. */
+ssize_t rshim_fifo_read_iov(rshim_backend_t *bd, size_t count, int chan,
+                            bool nonblock,
+                            int (*reply)(void *arg, const struct iovec *iov,
+                                         int iovcnt),
+                            void *arg);
+
 /* Alloc/free the FIFO. */
 int rshim_fifo_alloc(rshim_backend_t *bd);
 void rshim_fifo_free(rshim_backend_t *bd);
 
+/* Read / write DPU memory through the MEM_ACC widget. */
+ssize_t rshim_mem_read(rshim_backend_t *bd, uint64_t pa, void *buf,
+                       size_t len);
+ssize_t rshim_mem_write(rshim_backend_t *bd, uint64_t pa, const void *buf,
+                        size_t len);
+
 /* Console APIs. */
 /* Enable early console. */
 int rshim_cons_early_enable(rshim_backend_t *bd);
 
+/* Console socket APIs. */
+int rshim_cons_sock_init(rshim_backend_t *bd);
+void rshim_cons_sock_del(rshim_backend_t *bd);
+void rshim_cons_sock_rx(rshim_backend_t *bd);
+void rshim_cons_sock_tx(rshim_backend_t *bd);
+bool rshim_cons_sock_event(rshim_backend_t *bd, int fd, uint32_t events);
+int rshim_cons_ts_init(rshim_backend_t *bd);
+void rshim_cons_ts_del(rshim_backend_t *bd);
+void rshim_cons_ts_input(rshim_backend_t *bd, const uint8_t *data, int len);
+
+/* Flight recorder APIs. */
+int rshim_trace_init(rshim_backend_t *bd);
+void rshim_trace_free(rshim_backend_t *bd);
+void rshim_trace_add(rshim_backend_t *bd, int type, int chan, uint32_t addr,
+                     uint64_t value, uint64_t start, int rc);
+uint64_t rshim_trace_count(rshim_backend_t *bd);
+int rshim_trace_dump(rshim_backend_t *bd);
+
+/* Record an event without latency if the recorder is enabled. */
+static inline void rshim_trace_event(rshim_backend_t *bd, int type, int chan,
+                                     uint32_t addr, uint64_t value)
+{
+  if (bd->trace)
+    rshim_trace_add(bd, type, chan, addr, value, 0, 0);
+}
+
+/* Record and replay APIs. */
+int rshim_record_init(rshim_backend_t *bd);
+bool rshim_has_bulk(rshim_backend_t *bd);
+void rshim_record_free(rshim_backend_t *bd);
+int rshim_replay_init(void);
+
+/* Console pattern watcher APIs. */
+#define RSHIM_WATCH_MAX           32    /* patterns, one bit each */
+#define RSHIM_WATCH_NAME_LEN      16
+#define RSHIM_WATCH_PATTERN_LEN   64
+#define RSHIM_WATCH_LINE_LEN      128
+int rshim_watch_add(const char *name, const char *text);
+int rshim_watch_init(rshim_backend_t *bd);
+void rshim_watch_free(rshim_backend_t *bd);
+void rshim_watch_input(rshim_backend_t *bd, const uint8_t *data, int len);
+void rshim_watch_work(rshim_backend_t *bd);
+int rshim_watch_show(rshim_backend_t *bd, char *buf, int len);
+int rshim_watch_listen(void);
+void rshim_watch_accept(void);
+void rshim_watch_close(void);
+
+/* Scratchpad mailbox APIs. */
+int rshim_mbox_init(rshim_backend_t *bd);
+void rshim_mbox_del(rshim_backend_t *bd);
+int rshim_mbox_send(rshim_backend_t *bd, const rshim_mbox_msg_t *msg);
+int rshim_mbox_recv(rshim_backend_t *bd, rshim_mbox_msg_t *msg);
+int rshim_mbox_show(rshim_backend_t *bd, char *buf, int len);
+
+/* Register lease APIs. */
+#define RSHIM_LEASE_MAX_ALLOW     32    /* LEASE_REG lines, one bit each */
+int rshim_lease_add(const char *name, bool write);
+int rshim_lease_init(rshim_backend_t *bd);
+void rshim_lease_del(rshim_backend_t *bd);
+bool rshim_lease_event(rshim_backend_t *bd, int fd, uint32_t events);
+void rshim_lease_revoke(rshim_backend_t *bd);
+int rshim_lease_show(rshim_backend_t *bd, char *buf, int len);
+
+/* Daemon handover APIs. */
+#define RSHIM_HANDOVER_TIMEOUT  10  /* seconds to wait for the old daemon */
+int rshim_handover_listen(void);
+void rshim_handover_close(void);
+int rshim_handover_accept(void);
+int rshim_handover_send(int sock, rshim_backend_t *bd);
+int rshim_handover_receive(void);
+int rshim_handover_index(const char *dev_name);
+bool rshim_handover_restore(rshim_backend_t *bd);
+
 /* Network APIs. */
 #ifdef HAVE_RSHIM_NET
 int rshim_net_init(rshim_backend_t *bd);
 int rshim_net_del(rshim_backend_t *bd);
 void rshim_net_rx(rshim_backend_t *bd);
 void rshim_net_tx(rshim_backend_t *bd);
+void rshim_net_tx_resume(rshim_backend_t *bd);
 #else
 static inline int rshim_net_init(rshim_backend_t *bd)
 {
@@ -533,6 +791,9 @@ static inline void rshim_net_rx(rshim_backend_t *bd)
 static inline void rshim_net_tx(rshim_backend_t *bd)
 {
 }
+static inline void rshim_net_tx_resume(rshim_backend_t *bd)
+{
+}
 #endif
 
 void rshim_ref(rshim_backend_t *bd);
@@ -558,18 +819,34 @@ int rshim_log_show(rshim_backend_t *bd, char *buf, int len);
 
 bool rshim_allow_device(const char *devname);
 
+/* Monotonic time in seconds. */
+time_t rshim_mono_time(void);
+
+/* Request the peer info (MAC, PXE ID, VLAN). Called with bd->mutex held. */
+void rshim_peer_refresh(rshim_backend_t *bd);
+
+/* CPU/NUMA placement of the per-device threads and buffers. */
+void rshim_pci_locality(rshim_backend_t *bd, int domain, int bus, int dev,
+                        int func);
+int rshim_set_affinity(rshim_backend_t *bd, pthread_t thread);
+void *rshim_dev_alloc(rshim_backend_t *bd, size_t size);
+void rshim_dev_free(void *ptr, size_t size);
+
 /* USB backend APIs. */
 #ifdef HAVE_RSHIM_USB
-int rshim_usb_init(int epoll_fd);
-void rshim_usb_poll(bool blocking);
+int rshim_usb_init(void);
+void rshim_usb_poll(void);
+void rshim_usb_exit(void);
 #else
-static inline int rshim_usb_init(int epoll_fd)
+static inline int rshim_usb_init(void)
 {
   return -1;
 }
-static inline void rshim_usb_poll(bool blocking)
+static inline void rshim_usb_poll(void)
+{
+}
+static inline void rshim_usb_exit(void)
 {
-  (void)blocking;
 }
 #endif
 
@@ -577,12 +854,19 @@ static inline void rshim_usb_poll(bool blocking)
 #ifdef HAVE_RSHIM_PCIE
 int rshim_pcie_init(void);
 int rshim_pcie_lf_init(void);
+int rshim_pcie_bar_probe(const char *dev_name, int count);
 #else
 static inline int rshim_pcie_init(void)
 {
   return -1;
 }
 
+static inline int rshim_pcie_bar_probe(const char *dev_name, int count)
+{
+  RSHIM_ERR("Probe needs the PCIe backend\n");
+  return -ENOTSUP;
+}
+
 static inline int rshim_pcie_lf_init(void)
 {
   return -1;
@@ -592,7 +876,7 @@ static inline int rshim_pcie_lf_init(void)
 #ifdef HAVE_RSHIM_FUSE
 int rshim_fuse_init(rshim_backend_t *bd);
 int rshim_fuse_del(rshim_backend_t *bd);
-void rshim_fuse_input_notify(rshim_backend_t *bd);
+void rshim_fuse_input_notify(rshim_backend_t *bd, int chan);
 int rshim_fuse_got_peer_signal(void);
 #endif
 
@@ -605,5 +889,6 @@ int rshim_set_opn(rshim_backend_t *bd, const char *opn, int len);
 
 /* Check whether rshim backend is accessible or not. */
 int rshim_access_check(rshim_backend_t *bd);
+void rshim_set_drop_mode(rshim_backend_t *bd, int drop_mode);
 
 #endif /* _RSHIM_H */
@@ -0,0 +1,1109 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2019 Mellanox Technologies. All Rights Reserved.
+ *
+ */
+
+/*
+ * rshim-bench: host <-> DPU ping-pong latency and throughput.
+ *
+ * The host side sends messages of each size over a transport and waits for
+ * them to be echoed by the responder, which is started on the DPU with
+ * '-R'. The round-trip time of each message is recorded, and the
+ * distribution and the message rate are printed per size. Transports:
+ *
+ *   console     /dev/rshim<N>/console on the host, /dev/hvc0 on the DPU
+ *   net         UDP over tmfifo_net0
+ *   mbox        the daemon's mailbox socket on the host (MAILBOX 1), the
+ *               scratchpad registers on the DPU
+ *   scratchpad  the mailbox protocol driven by the host itself through
+ *               /dev/rshim<N>/rshim (MAILBOX 0), the scratchpad registers
+ *               on the DPU
+ *   memacc      words of DPU memory written and read back by the host with
+ *               the MEM_ACC window through /dev/rshim<N>/rshim, polled by
+ *               the DPU through /dev/mem
+ *
+ * With '-m <file>' both sides use the file as an emulated RShim block
+ * followed by the emulated DPU memory, so the scratchpad and memacc paths
+ * could be exercised on a single Linux box; the responder then also plays
+ * the MEM_ACC widget. The console could be emulated with a pty pair and the
+ * net transport with the loopback interface.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rshim_mbox.h"
+#include "rshim_regs.h"
+
+#ifdef __FreeBSD__
+#define RSHIM_BENCH_SOCK_DIR    "/var/run/rshim"
+#else
+#define RSHIM_BENCH_SOCK_DIR    "/run/rshim"
+#endif
+
+#define RSHIM_BENCH_CONSOLE     "/dev/hvc0"
+#define RSHIM_BENCH_NET_ADDR    "192.168.100.2"
+#define RSHIM_BENCH_NET_PORT    5210
+#define RSHIM_BENCH_COUNT       1000
+#define RSHIM_BENCH_TIMEOUT     1000            /* ms */
+#define RSHIM_BENCH_MAX_SIZE    65000
+
+/* Layout of the emulated device file. */
+#define RSHIM_BENCH_EMU_REGS    0x1000
+#define RSHIM_BENCH_EMU_MEM     0x10000
+
+/* Memory window: host and DPU sequence words, then the payload. */
+#define RSHIM_BENCH_MEM_H2D     0x0
+#define RSHIM_BENCH_MEM_D2H     0x8
+#define RSHIM_BENCH_MEM_DATA    0x10
+
+/* Same as the ioctl of /dev/rshim<N>/rshim in rshim_fuse.c. */
+typedef struct {
+  uint32_t addr;
+  uint64_t data;
+} __attribute__((packed)) rshim_bench_ioctl_msg;
+
+#define RSHIM_BENCH_IOC_READ    _IOWR('R', 0, rshim_bench_ioctl_msg)
+#define RSHIM_BENCH_IOC_WRITE   _IOWR('R', 1, rshim_bench_ioctl_msg)
+
+/* Register offsets of a chip. */
+typedef struct {
+  unsigned long base;
+  int scratchpad1;
+  int mem_acc_ctl;
+  int mem_acc_rsp_cnt;
+  int mem_acc_data;
+  int priv_lvl;
+  int priv_lvl_shift;
+} rshim_bench_chip_t;
+
+static const rshim_bench_chip_t rshim_bench_bf2 = {
+  .base = RSHIM_MBOX_BF2_BASE,
+  .scratchpad1 = RSH_SCRATCHPAD1,
+  .mem_acc_ctl = RSH_MEM_ACC_CTL,
+  .mem_acc_rsp_cnt = RSH_MEM_ACC_RSP_CNT,
+  .mem_acc_data = RSH_MEM_ACC_DATA__FIRST_WORD,
+  .priv_lvl = RSH_DEVICE_MSTR_PRIV_LVL,
+  .priv_lvl_shift = RSH_DEVICE_MSTR_PRIV_LVL__MEM_ACC_LVL_SHIFT,
+};
+
+static const rshim_bench_chip_t rshim_bench_bf3 = {
+  .base = RSHIM_MBOX_BF3_BASE,
+  .scratchpad1 = BF3_RSH_SCRATCHPAD1,
+  .mem_acc_ctl = BF3_RSH_MEM_ACC_CTL,
+  .mem_acc_rsp_cnt = BF3_RSH_MEM_ACC_RSP_CNT,
+  .mem_acc_data = BF3_RSH_MEM_ACC_DATA__FIRST_WORD,
+  .priv_lvl = BF3_RSH_DEVICE_MSTR_PRIV_LVL,
+  .priv_lvl_shift = BF3_RSH_DEVICE_MSTR_PRIV_LVL__MEM_ACC_LVL_SHIFT,
+};
+
+typedef struct {
+  const char *name;
+  const char *sizes;            /* default message sizes */
+  int min_size;
+  int max_size;
+  int align;
+  bool window;                  /* several messages could be in flight */
+  int (*open)(void);
+  int (*send)(uint32_t seq, int size);
+  int (*recv)(uint32_t *seq, int size);     /* 1, 0 on timeout or -errno */
+  int (*respond)(void);
+} rshim_bench_transport_t;
+
+/* Options. */
+static const rshim_bench_chip_t *rshim_bench_chip = &rshim_bench_bf2;
+static bool rshim_bench_responder;
+static int rshim_bench_index;
+static const char *rshim_bench_path;
+static const char *rshim_bench_addr;
+static int rshim_bench_port = RSHIM_BENCH_NET_PORT;
+static unsigned long rshim_bench_base;
+static uint64_t rshim_bench_pa;
+static const char *rshim_bench_emu;
+static int rshim_bench_poll_us;
+
+static int rshim_bench_fd = -1;
+static volatile uint8_t *rshim_bench_regs;      /* NULL to use the ioctl */
+static volatile uint8_t *rshim_bench_mem;
+static uint8_t rshim_bench_buf[RSHIM_BENCH_MAX_SIZE + 64];
+
+static uint64_t rshim_bench_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void rshim_bench_wait(void)
+{
+  struct timespec ts = { 0, rshim_bench_poll_us * 1000L };
+
+  if (rshim_bench_poll_us)
+    nanosleep(&ts, NULL);
+}
+
+static bool rshim_bench_expired(uint64_t start)
+{
+  return rshim_bench_now() - start > RSHIM_BENCH_TIMEOUT * 1000000ULL;
+}
+
+/* Wait for input on an fd. Returns 1 if readable, 0 on timeout. */
+static int rshim_bench_poll(int fd)
+{
+  struct pollfd pfd = { .fd = fd, .events = POLLIN };
+  int rc;
+
+  rc = poll(&pfd, 1, RSHIM_BENCH_TIMEOUT);
+  return rc < 0 ? -errno : rc;
+}
+
+/*
+ * Register access, either mapped (DPU side or emulated) or through the
+ * ioctl of the daemon's rshim device.
+ */
+static uint64_t rshim_bench_readq(int off)
+{
+  rshim_bench_ioctl_msg msg;
+  uint64_t value;
+
+  if (rshim_bench_regs) {
+    value = *(volatile uint64_t *)(rshim_bench_regs + off);
+    __sync_synchronize();
+    return value;
+  }
+
+  msg.addr = (RSH_MMIO_ADDRESS_SPACE__CHANNEL_VAL_RSHIM << 16) | off;
+  msg.data = 0;
+  if (ioctl(rshim_bench_fd, RSHIM_BENCH_IOC_READ, &msg))
+    return ~0ULL;
+
+  return msg.data;
+}
+
+static void rshim_bench_writeq(int off, uint64_t value)
+{
+  rshim_bench_ioctl_msg msg;
+
+  if (rshim_bench_regs) {
+    __sync_synchronize();
+    *(volatile uint64_t *)(rshim_bench_regs + off) = value;
+    return;
+  }
+
+  msg.addr = (RSH_MMIO_ADDRESS_SPACE__CHANNEL_VAL_RSHIM << 16) | off;
+  msg.data = value;
+  ioctl(rshim_bench_fd, RSHIM_BENCH_IOC_WRITE, &msg);
+}
+
+static void *rshim_bench_map(int fd, off_t off, size_t len)
+{
+  void *ptr;
+
+  ptr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, off);
+  return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+/*
+ * Open the register block: the emulated device file, /dev/mem on the DPU
+ * or the daemon's rshim device on the host. The DPU memory for the memacc
+ * transport is mapped too when 'mem' is set.
+ */
+static int rshim_bench_regs_open(bool mem)
+{
+  char path[64];
+  int fd;
+
+  if (rshim_bench_emu) {
+    fd = open(rshim_bench_emu, O_RDWR | (rshim_bench_responder ? O_CREAT : 0),
+              0600);
+    if (fd < 0)
+      return -errno;
+    if (rshim_bench_responder &&
+        ftruncate(fd, RSHIM_BENCH_EMU_REGS + RSHIM_BENCH_EMU_MEM)) {
+      close(fd);
+      return -errno;
+    }
+    rshim_bench_regs = rshim_bench_map(fd, 0, RSHIM_BENCH_EMU_REGS);
+    if (mem)
+      rshim_bench_mem = rshim_bench_map(fd, RSHIM_BENCH_EMU_REGS,
+                                        RSHIM_BENCH_EMU_MEM);
+    close(fd);
+    return rshim_bench_regs && (!mem || rshim_bench_mem) ? 0 : -errno;
+  }
+
+  if (rshim_bench_responder) {
+    fd = open("/dev/mem", O_RDWR | O_SYNC);
+    if (fd < 0)
+      return -errno;
+    rshim_bench_regs = rshim_bench_map(fd, rshim_bench_base,
+                                       RSHIM_BENCH_EMU_REGS);
+    if (mem)
+      rshim_bench_mem = rshim_bench_map(fd, rshim_bench_pa,
+                                        RSHIM_BENCH_EMU_MEM);
+    close(fd);
+    return rshim_bench_regs && (!mem || rshim_bench_mem) ? 0 : -errno;
+  }
+
+  if (!rshim_bench_path) {
+    snprintf(path, sizeof(path), "/dev/rshim%d/rshim", rshim_bench_index);
+    rshim_bench_path = path;
+  }
+  rshim_bench_fd = open(rshim_bench_path, O_RDWR);
+  rshim_bench_path = NULL;
+  return rshim_bench_fd < 0 ? -errno : 0;
+}
+
+/* Set a tty to raw mode so that the echoed bytes are passed as is. */
+static void rshim_bench_tty_raw(int fd)
+{
+  struct termios tio;
+
+  if (!isatty(fd) || tcgetattr(fd, &tio))
+    return;
+
+  cfmakeraw(&tio);
+  tcsetattr(fd, TCSANOW, &tio);
+  tcflush(fd, TCIOFLUSH);
+}
+
+/*
+ * Console transport. Each message is a line starting with the sequence
+ * number in hex; the responder echoes the bytes back as they come.
+ */
+static char rshim_bench_line[RSHIM_BENCH_MAX_SIZE * 2];
+static int rshim_bench_line_len;
+
+static int rshim_bench_console_open(void)
+{
+  char path[64];
+
+  if (!rshim_bench_path) {
+    snprintf(path, sizeof(path), "/dev/rshim%d/console", rshim_bench_index);
+    rshim_bench_path = path;
+  }
+
+  rshim_bench_fd = open(rshim_bench_path, O_RDWR | O_NOCTTY);
+  rshim_bench_path = NULL;
+  if (rshim_bench_fd < 0)
+    return -errno;
+
+  rshim_bench_tty_raw(rshim_bench_fd);
+  return 0;
+}
+
+static int rshim_bench_write_all(int fd, const void *buf, size_t len)
+{
+  const uint8_t *p = buf;
+  ssize_t n;
+
+  while (len) {
+    n = write(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return n < 0 ? -errno : -EIO;
+    p += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+static int rshim_bench_console_send(uint32_t seq, int size)
+{
+  char *p = (char *)rshim_bench_buf;
+  int i;
+
+  snprintf(p, size, "%08x", seq);
+  for (i = 8; i < size - 1; i++)
+    p[i] = 'a' + i % 26;
+  p[size - 1] = '\n';
+
+  return rshim_bench_write_all(rshim_bench_fd, p, size);
+}
+
+static int rshim_bench_console_recv(uint32_t *seq, int size)
+{
+  char *eol, hex[9];
+  int rc, len;
+  ssize_t n;
+
+  while (true) {
+    eol = memchr(rshim_bench_line, '\n', rshim_bench_line_len);
+    if (eol) {
+      len = eol - rshim_bench_line;
+      memcpy(hex, rshim_bench_line, 8);
+      hex[8] = 0;
+      rshim_bench_line_len -= len + 1;
+      memmove(rshim_bench_line, eol + 1, rshim_bench_line_len);
+
+      /* Skip anything else printed on the console. */
+      if (len == size - 1 && strspn(hex, "0123456789abcdef") == 8) {
+        *seq = strtoul(hex, NULL, 16);
+        return 1;
+      }
+      continue;
+    }
+
+    if (rshim_bench_line_len == sizeof(rshim_bench_line))
+      rshim_bench_line_len = 0;
+
+    rc = rshim_bench_poll(rshim_bench_fd);
+    if (rc <= 0)
+      return rc;
+    n = read(rshim_bench_fd, rshim_bench_line + rshim_bench_line_len,
+             sizeof(rshim_bench_line) - rshim_bench_line_len);
+    if (n <= 0)
+      return n < 0 ? -errno : -EPIPE;
+    rshim_bench_line_len += n;
+  }
+}
+
+static int rshim_bench_console_respond(void)
+{
+  char path[64];
+  ssize_t n;
+  int rc;
+
+  if (!rshim_bench_path) {
+    snprintf(path, sizeof(path), "%s", RSHIM_BENCH_CONSOLE);
+    rshim_bench_path = path;
+  }
+  rc = rshim_bench_console_open();
+  if (rc)
+    return rc;
+
+  while ((n = read(rshim_bench_fd, rshim_bench_buf,
+                   sizeof(rshim_bench_buf))) > 0) {
+    rc = rshim_bench_write_all(rshim_bench_fd, rshim_bench_buf, n);
+    if (rc)
+      return rc;
+  }
+
+  return n < 0 ? -errno : 0;
+}
+
+/* Net transport: UDP datagrams starting with the sequence number. */
+static int rshim_bench_net_socket(struct sockaddr_in *addr, const char *ip)
+{
+  int fd;
+
+  memset(addr, 0, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  addr->sin_port = htons(rshim_bench_port);
+  if (inet_pton(AF_INET, ip, &addr->sin_addr) != 1)
+    return -EINVAL;
+
+  fd = socket(AF_INET, SOCK_DGRAM, 0);
+  return fd < 0 ? -errno : fd;
+}
+
+static int rshim_bench_net_open(void)
+{
+  struct sockaddr_in addr;
+
+  rshim_bench_fd = rshim_bench_net_socket(&addr, rshim_bench_addr ?
+                                          rshim_bench_addr :
+                                          RSHIM_BENCH_NET_ADDR);
+  if (rshim_bench_fd < 0)
+    return rshim_bench_fd;
+
+  if (connect(rshim_bench_fd, (struct sockaddr *)&addr, sizeof(addr)))
+    return -errno;
+
+  return 0;
+}
+
+static int rshim_bench_net_send(uint32_t seq, int size)
+{
+  memset(rshim_bench_buf, 0x5a, size);
+  memcpy(rshim_bench_buf, &seq, sizeof(seq));
+
+  return send(rshim_bench_fd, rshim_bench_buf, size, 0) == size ? 0 : -errno;
+}
+
+static int rshim_bench_net_recv(uint32_t *seq, int size)
+{
+  ssize_t n;
+  int rc;
+
+  while (true) {
+    rc = rshim_bench_poll(rshim_bench_fd);
+    if (rc <= 0)
+      return rc;
+    n = recv(rshim_bench_fd, rshim_bench_buf, sizeof(rshim_bench_buf), 0);
+    if (n < 0)
+      return -errno;
+    if (n == size)
+      break;
+  }
+
+  memcpy(seq, rshim_bench_buf, sizeof(*seq));
+  return 1;
+}
+
+static int rshim_bench_net_respond(void)
+{
+  struct sockaddr_in addr, peer;
+  socklen_t peer_len;
+  ssize_t n;
+  int fd;
+
+  fd = rshim_bench_net_socket(&addr, rshim_bench_addr ?
+                              rshim_bench_addr : "0.0.0.0");
+  if (fd < 0)
+    return fd;
+
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)))
+    return -errno;
+
+  while (true) {
+    peer_len = sizeof(peer);
+    n = recvfrom(fd, rshim_bench_buf, sizeof(rshim_bench_buf), 0,
+                 (struct sockaddr *)&peer, &peer_len);
+    if (n < 0 && errno != EINTR)
+      return -errno;
+    if (n > 0)
+      sendto(fd, rshim_bench_buf, n, 0, (struct sockaddr *)&peer, peer_len);
+  }
+}
+
+/*
+ * Scratchpad mailbox endpoint (see rshim_mbox.h), used by the host for the
+ * scratchpad transport and by the DPU responder.
+ */
+static rshim_mbox_ep_t rshim_bench_mbox;
+
+static int rshim_bench_mbox_readq(void *ctx, uint32_t off, uint64_t *value)
+{
+  *value = rshim_bench_readq(off);
+  return 0;
+}
+
+static int rshim_bench_mbox_writeq(void *ctx, uint32_t off, uint64_t value)
+{
+  rshim_bench_writeq(off, value);
+  return 0;
+}
+
+static int rshim_bench_mbox_ep_open(void)
+{
+  int rc;
+
+  rc = rshim_bench_regs_open(false);
+  if (rc)
+    return rc;
+
+  rshim_mbox_ep_init(&rshim_bench_mbox, rshim_bench_responder,
+                     rshim_bench_chip->scratchpad1, NULL,
+                     rshim_bench_mbox_readq, rshim_bench_mbox_writeq);
+  return rshim_mbox_ep_sync(&rshim_bench_mbox);
+}
+
+static int rshim_bench_mbox_ep_send(const rshim_mbox_msg_t *msg)
+{
+  uint64_t start = rshim_bench_now();
+  int rc;
+
+  while ((rc = rshim_mbox_ep_send(&rshim_bench_mbox, msg)) == -EBUSY) {
+    if (rshim_bench_expired(start))
+      return -ETIMEDOUT;
+    rshim_bench_wait();
+  }
+
+  return rc;
+}
+
+static int rshim_bench_mbox_ep_recv(rshim_mbox_msg_t *msg, bool wait)
+{
+  uint64_t start = rshim_bench_now();
+  int rc;
+
+  while (!(rc = rshim_mbox_ep_recv(&rshim_bench_mbox, msg))) {
+    if (!wait && rshim_bench_expired(start))
+      return 0;
+    rshim_bench_wait();
+  }
+
+  return rc;
+}
+
+static void rshim_bench_mbox_msg(rshim_mbox_msg_t *msg, uint32_t seq, int size)
+{
+  memset(msg, 0, sizeof(*msg));
+  msg->type = RSHIM_MBOX_TYPE_ECHO_REQ;
+  msg->len = size;
+  memcpy(msg->data, &seq, sizeof(seq));
+}
+
+static int rshim_bench_scratchpad_send(uint32_t seq, int size)
+{
+  rshim_mbox_msg_t msg;
+
+  rshim_bench_mbox_msg(&msg, seq, size);
+  return rshim_bench_mbox_ep_send(&msg);
+}
+
+static int rshim_bench_scratchpad_recv(uint32_t *seq, int size)
+{
+  rshim_mbox_msg_t msg;
+  int rc;
+
+  do {
+    rc = rshim_bench_mbox_ep_recv(&msg, false);
+  } while (rc > 0 && msg.type != RSHIM_MBOX_TYPE_ECHO_RSP);
+
+  if (rc > 0)
+    memcpy(seq, msg.data, sizeof(*seq));
+  return rc;
+}
+
+/* Also the responder of the mbox transport. */
+static int rshim_bench_scratchpad_respond(void)
+{
+  rshim_mbox_msg_t msg;
+  int rc;
+
+  rc = rshim_bench_mbox_ep_open();
+  if (rc)
+    return rc;
+
+  while (rshim_bench_mbox_ep_recv(&msg, true) > 0) {
+    if (msg.type != RSHIM_MBOX_TYPE_ECHO_REQ)
+      continue;
+    msg.type = RSHIM_MBOX_TYPE_ECHO_RSP;
+    rc = rshim_bench_mbox_ep_send(&msg);
+    if (rc)
+      return rc;
+  }
+
+  return 0;
+}
+
+/* Mbox transport: the same messages through the daemon. */
+static int rshim_bench_mbox_open(void)
+{
+  struct sockaddr_un addr;
+
+  if (rshim_bench_emu)
+    return -EOPNOTSUPP;
+
+  rshim_bench_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if (rshim_bench_fd < 0)
+    return -errno;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (rshim_bench_path)
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", rshim_bench_path);
+  else
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/rshim%d.mbox",
+             RSHIM_BENCH_SOCK_DIR, rshim_bench_index);
+  if (connect(rshim_bench_fd, (struct sockaddr *)&addr, sizeof(addr)))
+    return -errno;
+
+  return 0;
+}
+
+static int rshim_bench_mbox_send(uint32_t seq, int size)
+{
+  rshim_mbox_msg_t msg;
+
+  rshim_bench_mbox_msg(&msg, seq, size);
+  return send(rshim_bench_fd, &msg, sizeof(msg), 0) == sizeof(msg) ?
+    0 : -errno;
+}
+
+static int rshim_bench_mbox_recv(uint32_t *seq, int size)
+{
+  rshim_mbox_msg_t msg;
+  ssize_t n;
+  int rc;
+
+  do {
+    rc = rshim_bench_poll(rshim_bench_fd);
+    if (rc <= 0)
+      return rc;
+    n = recv(rshim_bench_fd, &msg, sizeof(msg), 0);
+    if (n != sizeof(msg))
+      return n < 0 ? -errno : -EPIPE;
+  } while (msg.type != RSHIM_MBOX_TYPE_ECHO_RSP);
+
+  memcpy(seq, msg.data, sizeof(*seq));
+  return 1;
+}
+
+/*
+ * Memacc transport. The host writes the payload then its sequence word
+ * into the DPU memory at '-A', and the DPU answers by writing the sequence
+ * into its own word; the host then reads the payload back. Sequence words
+ * start from 1 so that a zeroed memory isn't taken as a message.
+ */
+static uint64_t rshim_bench_mem_seq;
+
+static int rshim_bench_memacc(uint64_t addr, bool write, uint64_t *data)
+{
+  const rshim_bench_chip_t *chip = rshim_bench_chip;
+  uint64_t start = rshim_bench_now(), count, ctl;
+
+  count = rshim_bench_readq(chip->mem_acc_rsp_cnt);
+  if (write)
+    rshim_bench_writeq(chip->mem_acc_data, *data);
+
+  ctl = ((addr & RSH_MEM_ACC_CTL__ADDRESS_RMASK) <<
+          RSH_MEM_ACC_CTL__ADDRESS_SHIFT) |
+        ((uint64_t)RSH_MEM_ACC_CTL__SIZE_VAL_SZ8 <<
+          RSH_MEM_ACC_CTL__SIZE_SHIFT) |
+        ((uint64_t)write << RSH_MEM_ACC_CTL__WRITE_SHIFT) |
+        (1ULL << RSH_MEM_ACC_CTL__SEND_SHIFT);
+  rshim_bench_writeq(chip->mem_acc_ctl, ctl);
+
+  while (rshim_bench_readq(chip->mem_acc_rsp_cnt) == count) {
+    if (rshim_bench_expired(start))
+      return -ETIMEDOUT;
+    rshim_bench_wait();
+  }
+
+  if (!write)
+    *data = rshim_bench_readq(chip->mem_acc_data);
+
+  return 0;
+}
+
+static int rshim_bench_memacc_open(void)
+{
+  const rshim_bench_chip_t *chip = rshim_bench_chip;
+  int rc;
+
+  if (!rshim_bench_pa && !rshim_bench_emu)
+    return -EINVAL;
+
+  rc = rshim_bench_regs_open(false);
+  if (rc)
+    return rc;
+
+  rshim_bench_writeq(chip->priv_lvl, rshim_bench_readq(chip->priv_lvl) |
+                     (1ULL << chip->priv_lvl_shift));
+  return 0;
+}
+
+static int rshim_bench_memacc_send(uint32_t seq, int size)
+{
+  uint64_t data;
+  int i, rc;
+
+  for (i = 0; i < size; i += 8) {
+    data = ((uint64_t)seq << 32) | i;
+    rc = rshim_bench_memacc(rshim_bench_pa + RSHIM_BENCH_MEM_DATA + i, true,
+                            &data);
+    if (rc)
+      return rc;
+  }
+
+  rshim_bench_mem_seq = (uint64_t)seq + 1;
+  return rshim_bench_memacc(rshim_bench_pa + RSHIM_BENCH_MEM_H2D, true,
+                            &rshim_bench_mem_seq);
+}
+
+static int rshim_bench_memacc_recv(uint32_t *seq, int size)
+{
+  uint64_t start = rshim_bench_now(), data;
+  int i, rc;
+
+  do {
+    if (rshim_bench_expired(start))
+      return 0;
+    rc = rshim_bench_memacc(rshim_bench_pa + RSHIM_BENCH_MEM_D2H, false,
+                            &data);
+    if (rc)
+      return rc;
+  } while (data != rshim_bench_mem_seq);
+
+  for (i = 0; i < size; i += 8) {
+    rc = rshim_bench_memacc(rshim_bench_pa + RSHIM_BENCH_MEM_DATA + i, false,
+                            &data);
+    if (rc)
+      return rc;
+  }
+
+  *seq = rshim_bench_mem_seq - 1;
+  return 1;
+}
+
+/* Play the MEM_ACC widget of an emulated device. */
+static bool rshim_bench_memacc_emulate(void)
+{
+  const rshim_bench_chip_t *chip = rshim_bench_chip;
+  uint64_t ctl, addr, data;
+
+  ctl = rshim_bench_readq(chip->mem_acc_ctl);
+  if (!(ctl >> RSH_MEM_ACC_CTL__SEND_SHIFT))
+    return false;
+
+  addr = ((ctl >> RSH_MEM_ACC_CTL__ADDRESS_SHIFT) &
+          RSH_MEM_ACC_CTL__ADDRESS_RMASK) - rshim_bench_pa;
+  if (addr <= RSHIM_BENCH_EMU_MEM - 8) {
+    if ((ctl >> RSH_MEM_ACC_CTL__WRITE_SHIFT) & RSH_MEM_ACC_CTL__WRITE_RMASK) {
+      data = rshim_bench_readq(chip->mem_acc_data);
+      *(volatile uint64_t *)(rshim_bench_mem + addr) = data;
+    } else {
+      data = *(volatile uint64_t *)(rshim_bench_mem + addr);
+      rshim_bench_writeq(chip->mem_acc_data, data);
+    }
+  }
+
+  rshim_bench_writeq(chip->mem_acc_ctl,
+                     ctl & ~(1ULL << RSH_MEM_ACC_CTL__SEND_SHIFT));
+  rshim_bench_writeq(chip->mem_acc_rsp_cnt,
+                     rshim_bench_readq(chip->mem_acc_rsp_cnt) + 1);
+  return true;
+}
+
+static int rshim_bench_memacc_respond(void)
+{
+  volatile uint64_t *h2d, *d2h;
+  uint64_t seq, last;
+  bool busy;
+  int rc;
+
+  if (!rshim_bench_pa && !rshim_bench_emu)
+    return -EINVAL;
+
+  rc = rshim_bench_regs_open(true);
+  if (rc)
+    return rc;
+
+  h2d = (volatile uint64_t *)(rshim_bench_mem + RSHIM_BENCH_MEM_H2D);
+  d2h = (volatile uint64_t *)(rshim_bench_mem + RSHIM_BENCH_MEM_D2H);
+  last = *h2d;
+
+  while (true) {
+    busy = rshim_bench_emu && rshim_bench_memacc_emulate();
+
+    seq = *h2d;
+    if (seq != last) {
+      /* The payload is left in place for the host to read back. */
+      __sync_synchronize();
+      *d2h = seq;
+      last = seq;
+    } else if (!busy) {
+      rshim_bench_wait();
+    }
+  }
+
+  return 0;
+}
+
+static const rshim_bench_transport_t rshim_bench_transports[] = {
+  {
+    .name = "console",
+    .sizes = "16,64,256,1024",
+    .min_size = 10,
+    .max_size = RSHIM_BENCH_MAX_SIZE / 2,
+    .align = 1,
+    .window = true,
+    .open = rshim_bench_console_open,
+    .send = rshim_bench_console_send,
+    .recv = rshim_bench_console_recv,
+    .respond = rshim_bench_console_respond,
+  },
+  {
+    .name = "net",
+    .sizes = "16,64,256,1024,4096",
+    .min_size = sizeof(uint32_t),
+    .max_size = RSHIM_BENCH_MAX_SIZE,
+    .align = 1,
+    .window = true,
+    .open = rshim_bench_net_open,
+    .send = rshim_bench_net_send,
+    .recv = rshim_bench_net_recv,
+    .respond = rshim_bench_net_respond,
+  },
+  {
+    .name = "mbox",
+    .sizes = "8",
+    .min_size = sizeof(uint32_t),
+    .max_size = RSHIM_MBOX_DATA_LEN,
+    .align = 1,
+    .open = rshim_bench_mbox_open,
+    .send = rshim_bench_mbox_send,
+    .recv = rshim_bench_mbox_recv,
+    .respond = rshim_bench_scratchpad_respond,
+  },
+  {
+    .name = "scratchpad",
+    .sizes = "8",
+    .min_size = sizeof(uint32_t),
+    .max_size = RSHIM_MBOX_DATA_LEN,
+    .align = 1,
+    .open = rshim_bench_mbox_ep_open,
+    .send = rshim_bench_scratchpad_send,
+    .recv = rshim_bench_scratchpad_recv,
+    .respond = rshim_bench_scratchpad_respond,
+  },
+  {
+    .name = "memacc",
+    .sizes = "8,64,256",
+    .min_size = 8,
+    .max_size = RSHIM_BENCH_EMU_MEM - RSHIM_BENCH_MEM_DATA,
+    .align = 8,
+    .open = rshim_bench_memacc_open,
+    .send = rshim_bench_memacc_send,
+    .recv = rshim_bench_memacc_recv,
+    .respond = rshim_bench_memacc_respond,
+  },
+};
+
+static int rshim_bench_cmp(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+static double rshim_bench_pct(const uint64_t *rtt, int n, int pct)
+{
+  int i = (int)((int64_t)n * pct / 100);
+
+  return rtt[i < n ? i : n - 1] / 1000.0;
+}
+
+/* Run 'count' round trips of one size, with up to 'window' in flight. */
+static int rshim_bench_run(const rshim_bench_transport_t *tp, int size,
+                           int count, int window)
+{
+  uint64_t *sent, *rtt, start, elapsed, sum = 0;
+  int next = 0, done = 0, first = 0, lost = 0, n = 0, rc = 0, i;
+  uint8_t *got;
+  uint32_t seq;
+  double secs;
+
+  sent = calloc(count, sizeof(*sent));
+  rtt = calloc(count, sizeof(*rtt));
+  got = calloc(count, 1);
+  if (!sent || !rtt || !got) {
+    rc = -ENOMEM;
+    goto out;
+  }
+
+  start = rshim_bench_now();
+  while (done < count) {
+    while (next < count && next - done < window) {
+      sent[next] = rshim_bench_now();
+      rc = tp->send(next, size);
+      if (rc)
+        goto out;
+      next++;
+    }
+
+    rc = tp->recv(&seq, size);
+    if (rc < 0)
+      goto out;
+
+    if (!rc) {
+      /*
+       * Timed out: give up on everything in flight, so a late echo of
+       * these isn't taken for a round trip.
+       */
+      for (i = first; i < next; i++) {
+        if (!got[i]) {
+          got[i] = 1;
+          lost++;
+        }
+      }
+      first = next;
+      done = next;
+      continue;
+    }
+
+    if (seq < (uint32_t)first || seq >= (uint32_t)next || got[seq])
+      continue;
+    got[seq] = 1;
+    rtt[n++] = rshim_bench_now() - sent[seq];
+    done++;
+  }
+  elapsed = rshim_bench_now() - start;
+  rc = 0;
+
+  if (!n) {
+    printf("%-10s %6d %7d %6d  no response\n", tp->name, size, count, lost);
+    goto out;
+  }
+
+  qsort(rtt, n, sizeof(*rtt), rshim_bench_cmp);
+  for (i = 0; i < n; i++)
+    sum += rtt[i];
+  secs = elapsed / 1e9;
+
+  printf("%-10s %6d %7d %6d %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %10.0f %8.2f\n",
+         tp->name, size, n, lost, rtt[0] / 1000.0, sum / 1000.0 / n,
+         rshim_bench_pct(rtt, n, 50), rshim_bench_pct(rtt, n, 90),
+         rshim_bench_pct(rtt, n, 99), rtt[n - 1] / 1000.0, n / secs,
+         (double)n * size / secs / 1e6);
+  fflush(stdout);
+
+out:
+  free(sent);
+  free(rtt);
+  free(got);
+  return rc;
+}
+
+static void print_help(void)
+{
+  printf("Usage: rshim-bench [options] <transport>\n");
+  printf("\n");
+  printf("Measure the round-trip time of messages echoed by the DPU.\n");
+  printf("Transports: console, net, mbox, scratchpad, memacc\n");
+  printf("\n");
+  printf("OPTIONS:\n");
+  printf("  -R            run the responder (DPU side)\n");
+  printf("  -d <index>    rshim device index (default 0)\n");
+  printf("  -p <path>     console device or mailbox socket to use\n");
+  printf("  -a <addr>     net: DPU address (default %s), or the address\n"
+         "                to bind on the DPU\n", RSHIM_BENCH_NET_ADDR);
+  printf("  -P <port>     net: UDP port (default %d)\n", RSHIM_BENCH_NET_PORT);
+  printf("  -n <count>    messages per size (default %d)\n",
+         RSHIM_BENCH_COUNT);
+  printf("  -s <sizes>    comma-separated message sizes in bytes\n");
+  printf("  -W <window>   messages in flight for console and net "
+         "(default 1)\n");
+  printf("  -3            BlueField-3\n");
+  printf("  -b <addr>     physical address of the RShim block (DPU side)\n");
+  printf("  -A <addr>     memacc: physical address of the DPU memory\n");
+  printf("  -m <file>     use the file as an emulated device\n");
+  printf("  -I <us>       register poll interval (default 0, busy-poll)\n");
+  printf("  -h            help\n");
+}
+
+int main(int argc, char *argv[])
+{
+  const rshim_bench_transport_t *tp = NULL;
+  int count = RSHIM_BENCH_COUNT, window = 1, size, c, rc, i;
+  const char *sizes = NULL;
+  bool bf3 = false;
+  char *list, *tok;
+
+  while ((c = getopt(argc, argv, "3A:a:b:d:hI:m:n:P:p:Rs:W:")) != -1) {
+    switch (c) {
+    case '3':
+      bf3 = true;
+      break;
+    case 'A':
+      rshim_bench_pa = strtoull(optarg, NULL, 0);
+      break;
+    case 'a':
+      rshim_bench_addr = optarg;
+      break;
+    case 'b':
+      rshim_bench_base = strtoul(optarg, NULL, 0);
+      break;
+    case 'd':
+      rshim_bench_index = atoi(optarg);
+      break;
+    case 'I':
+      rshim_bench_poll_us = atoi(optarg);
+      break;
+    case 'm':
+      rshim_bench_emu = optarg;
+      break;
+    case 'n':
+      count = atoi(optarg);
+      break;
+    case 'P':
+      rshim_bench_port = atoi(optarg);
+      break;
+    case 'p':
+      rshim_bench_path = optarg;
+      break;
+    case 'R':
+      rshim_bench_responder = true;
+      break;
+    case 's':
+      sizes = optarg;
+      break;
+    case 'W':
+      window = atoi(optarg);
+      break;
+    case 'h':
+    default:
+      print_help();
+      return c == 'h' ? 0 : 1;
+    }
+  }
+
+  if (optind >= argc || count <= 0 || window <= 0) {
+    print_help();
+    return 1;
+  }
+
+  for (i = 0; i < sizeof(rshim_bench_transports) /
+                  sizeof(rshim_bench_transports[0]); i++) {
+    if (!strcmp(argv[optind], rshim_bench_transports[i].name))
+      tp = &rshim_bench_transports[i];
+  }
+  if (!tp) {
+    fprintf(stderr, "unknown transport %s\n", argv[optind]);
+    return 1;
+  }
+
+  if (bf3)
+    rshim_bench_chip = &rshim_bench_bf3;
+  if (!rshim_bench_base)
+    rshim_bench_base = rshim_bench_chip->base;
+
+  if (rshim_bench_responder) {
+    rc = tp->respond();
+    if (rc)
+      fprintf(stderr, "%s responder: %s\n", tp->name, strerror(-rc));
+    return rc ? 1 : 0;
+  }
+
+  rc = tp->open();
+  if (rc) {
+    fprintf(stderr, "failed to open %s: %s\n", tp->name, strerror(-rc));
+    return 1;
+  }
+
+  if (!tp->window)
+    window = 1;
+
+  printf("%-10s %6s %7s %6s %9s %9s %9s %9s %9s %9s %10s %8s\n",
+         "transport", "size", "count", "lost", "min(us)", "avg", "p50", "p90",
+         "p99", "max", "msg/s", "MB/s");
+
+  list = strdup(sizes ? sizes : tp->sizes);
+  for (tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+    size = atoi(tok);
+    if (size < tp->min_size || size > tp->max_size || size % tp->align) {
+      fprintf(stderr, "%s: skipping size %d (%d to %d, multiple of %d)\n",
+              tp->name, size, tp->min_size, tp->max_size, tp->align);
+      continue;
+    }
+    rc = rshim_bench_run(tp, size, count, window);
+    if (rc) {
+      fprintf(stderr, "%s: %s\n", tp->name, strerror(-rc));
+      break;
+    }
+  }
+  free(list);
+
+  return rc ? 1 : 0;
+}
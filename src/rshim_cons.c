@@ -0,0 +1,613 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2019 Mellanox Technologies. All Rights Reserved.
+ *
+ */
+
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "rshim.h"
+
+/*
+ * Console over a Unix-domain socket.
+ *
+ * Each rshim device could listen on RSHIM_CONS_SOCK_DIR/rshim<N>.console,
+ * which is served by the main epoll loop without going through CUSE. Output
+ * from the target is sent to all connected clients, and input from any of
+ * the clients is merged into the console channel. The socket clients share
+ * the console with /dev/rshim<N>/console the same way two openers of the
+ * device file would, i.e. only one of them could have it open at a time.
+ */
+
+/* Set non-blocking and close-on-exec. */
+static int rshim_cons_set_flags(int fd)
+{
+  int flags;
+
+  flags = fcntl(fd, F_GETFL, 0);
+  if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    RSHIM_ERR("fcntl %m\n");
+    return -1;
+  }
+
+  flags = fcntl(fd, F_GETFD, 0);
+  if (flags == -1 || fcntl(fd, F_SETFD, flags | FD_CLOEXEC) == -1) {
+    RSHIM_ERR("fcntl %m\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+static void rshim_cons_epoll_ctl(rshim_backend_t *bd, int op, int fd,
+                                 uint32_t events)
+{
+  struct epoll_event event;
+
+  memset(&event, 0, sizeof(event));
+  event.data.u64 = RSHIM_EPOLL_DATA(RSHIM_EPOLL_CONS, bd->index, fd);
+  event.events = events;
+  if (epoll_ctl(rshim_epoll_fd, op, fd, &event) == -1 && op != EPOLL_CTL_DEL)
+    RSHIM_ERR("epoll_ctl failed: %d %d\n", rshim_epoll_fd, fd);
+}
+
+/* Enable or disable input from all the clients. */
+static void rshim_cons_sock_arm(rshim_backend_t *bd, bool enable)
+{
+  int i;
+
+  if (bd->cons_tx_blocked == !enable)
+    return;
+
+  bd->cons_tx_blocked = !enable;
+  for (i = 0; i < RSHIM_CONS_MAX_CLIENTS; i++) {
+    if (bd->cons_client_fd[i] >= 0)
+      rshim_cons_epoll_ctl(bd, EPOLL_CTL_MOD, bd->cons_client_fd[i],
+                           enable ? (EPOLLIN | EPOLLRDHUP) : EPOLLRDHUP);
+  }
+}
+
+static void rshim_cons_sock_close_client(rshim_backend_t *bd, int idx,
+                                         bool release)
+{
+  int fd = bd->cons_client_fd[idx];
+
+  rshim_cons_epoll_ctl(bd, EPOLL_CTL_DEL, fd, 0);
+  close(fd);
+  bd->cons_client_fd[idx] = -1;
+
+  RSHIM_DBG("rshim%d console client %d disconnected\n", bd->index, idx);
+
+  /*
+   * Release the console when the last client is gone. Note that this could
+   * drop the last reference and free the device.
+   */
+  if (--bd->cons_clients == 0) {
+    bd->cons_tx_len = 0;
+    bd->cons_tx_blocked = false;
+    if (release)
+      rshim_console_release(bd, NULL);
+  }
+}
+
+static void rshim_cons_sock_accept(rshim_backend_t *bd)
+{
+  int fd, i;
+
+  fd = accept(bd->cons_sock_fd, NULL, NULL);
+  if (fd < 0)
+    return;
+
+  for (i = 0; i < RSHIM_CONS_MAX_CLIENTS; i++) {
+    if (bd->cons_client_fd[i] < 0)
+      break;
+  }
+
+  if (i == RSHIM_CONS_MAX_CLIENTS) {
+    RSHIM_WARN("rshim%d too many console clients\n", bd->index);
+    close(fd);
+    return;
+  }
+
+  if (rshim_cons_set_flags(fd)) {
+    close(fd);
+    return;
+  }
+
+  /* The first client opens the console. */
+  if (!bd->cons_clients && rshim_console_open(bd)) {
+    RSHIM_WARN("rshim%d console is busy\n", bd->index);
+    close(fd);
+    return;
+  }
+
+  bd->cons_client_fd[i] = fd;
+  bd->cons_clients++;
+  rshim_cons_epoll_ctl(bd, EPOLL_CTL_ADD, fd, bd->cons_tx_blocked ?
+                       EPOLLRDHUP : (EPOLLIN | EPOLLRDHUP));
+
+  RSHIM_DBG("rshim%d console client %d connected\n", bd->index, i);
+}
+
+/* Send the ring segments to all the clients. */
+static int rshim_cons_sock_send(void *arg, const struct iovec *iov,
+                                int iovcnt)
+{
+  rshim_backend_t *bd = arg;
+  struct msghdr msg;
+  size_t len;
+  ssize_t rc;
+  int i;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = (struct iovec *)iov;
+  msg.msg_iovlen = iovcnt;
+  len = iov[0].iov_len + (iovcnt > 1 ? iov[1].iov_len : 0);
+
+  for (i = 0; i < RSHIM_CONS_MAX_CLIENTS; i++) {
+    if (bd->cons_client_fd[i] < 0)
+      continue;
+
+    /* A slow client loses data instead of stalling the others. */
+    rc = sendmsg(bd->cons_client_fd[i], &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (rc != (ssize_t)len)
+      RSHIM_DBG("rshim%d console client %d dropped %zd bytes\n",
+                bd->index, i, rc < 0 ? (ssize_t)len : (ssize_t)len - rc);
+  }
+
+  return 0;
+}
+
+/* Push pending client input into the console FIFO. */
+static int rshim_cons_sock_flush(rshim_backend_t *bd)
+{
+  int rc;
+
+  if (!bd->cons_tx_len)
+    return 0;
+
+  rc = rshim_fifo_write(bd, bd->cons_tx_buf, bd->cons_tx_len,
+                        TMFIFO_CONS_CHAN, true);
+  if (rc > 0) {
+    bd->cons_tx_len -= rc;
+    memmove(bd->cons_tx_buf, bd->cons_tx_buf + rc, bd->cons_tx_len);
+  }
+
+  return bd->cons_tx_len;
+}
+
+static void rshim_cons_sock_client_rx(rshim_backend_t *bd, int idx)
+{
+  int len;
+
+  /* Wait until the previous input has been taken by the FIFO. */
+  if (rshim_cons_sock_flush(bd)) {
+    rshim_cons_sock_arm(bd, false);
+    return;
+  }
+
+  len = read(bd->cons_client_fd[idx], bd->cons_tx_buf,
+             sizeof(bd->cons_tx_buf));
+  if (len == 0 || (len < 0 && errno != EAGAIN && errno != EINTR)) {
+    rshim_cons_sock_close_client(bd, idx, true);
+    return;
+  }
+
+  if (len > 0) {
+    bd->cons_tx_len = len;
+    if (rshim_cons_sock_flush(bd))
+      rshim_cons_sock_arm(bd, false);
+  }
+}
+
+void rshim_cons_sock_rx(rshim_backend_t *bd)
+{
+  ssize_t rc;
+
+  bd->cons_rx_pending = false;
+
+  if (!bd->cons_clients)
+    return;
+
+  do {
+    rc = rshim_fifo_read_iov(bd, READ_FIFO_SIZE, TMFIFO_CONS_CHAN, true,
+                             rshim_cons_sock_send, bd);
+  } while (rc > 0);
+}
+
+void rshim_cons_sock_tx(rshim_backend_t *bd)
+{
+  if (bd->cons_tx_blocked && !rshim_cons_sock_flush(bd))
+    rshim_cons_sock_arm(bd, true);
+}
+
+static void rshim_cons_ts_accept(rshim_backend_t *bd);
+
+/*
+ * Handle epoll events. Returns true if the fd belongs to the console sockets
+ * of this device, in which case the device might have been freed already.
+ */
+bool rshim_cons_sock_event(rshim_backend_t *bd, int fd, uint32_t events)
+{
+  uint8_t tmp;
+  int i;
+
+  if (bd->cons_ts_sock_fd >= 0 && fd == bd->cons_ts_sock_fd) {
+    rshim_cons_ts_accept(bd);
+    return true;
+  }
+
+  if (bd->cons_sock_fd < 0)
+    return false;
+
+  if (fd == bd->cons_sock_fd) {
+    rshim_cons_sock_accept(bd);
+    return true;
+  }
+
+  if (fd == bd->cons_notify_fd[0]) {
+    if (read(fd, &tmp, sizeof(tmp)) == sizeof(tmp))
+      rshim_cons_sock_rx(bd);
+    return true;
+  }
+
+  for (i = 0; i < RSHIM_CONS_MAX_CLIENTS; i++) {
+    if (fd != bd->cons_client_fd[i])
+      continue;
+
+    if ((events & EPOLLIN) && !bd->cons_tx_blocked)
+      rshim_cons_sock_client_rx(bd, i);
+    else if (events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+      rshim_cons_sock_close_client(bd, i, true);
+    return true;
+  }
+
+  return false;
+}
+
+int rshim_cons_sock_init(rshim_backend_t *bd)
+{
+  struct sockaddr_un addr;
+  int i, rc, fd[2];
+
+  bd->cons_sock_fd = -1;
+  bd->cons_notify_fd[0] = -1;
+  bd->cons_notify_fd[1] = -1;
+  bd->cons_clients = 0;
+  bd->cons_tx_len = 0;
+  bd->cons_tx_blocked = false;
+  for (i = 0; i < RSHIM_CONS_MAX_CLIENTS; i++)
+    bd->cons_client_fd[i] = -1;
+
+  if (!rshim_cons_sock_enable)
+    return 0;
+
+  if (mkdir(RSHIM_CONS_SOCK_DIR, 0755) && errno != EEXIST) {
+    RSHIM_ERR("Failed to create %s: %m\n", RSHIM_CONS_SOCK_DIR);
+    return -errno;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/rshim%d.console",
+           RSHIM_CONS_SOCK_DIR, bd->index);
+  unlink(addr.sun_path);
+
+  bd->cons_sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (bd->cons_sock_fd < 0) {
+    RSHIM_ERR("socket failed: %m\n");
+    return -errno;
+  }
+
+  if (rshim_cons_set_flags(bd->cons_sock_fd) ||
+      bind(bd->cons_sock_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+      chmod(addr.sun_path, 0600) ||
+      listen(bd->cons_sock_fd, RSHIM_CONS_MAX_CLIENTS)) {
+    RSHIM_ERR("Failed to listen on %s: %m\n", addr.sun_path);
+    rc = -errno;
+    goto fail;
+  }
+
+  rc = pipe(fd);
+  if (rc == -1) {
+    RSHIM_ERR("Failed to create console pipe");
+    rc = -errno;
+    goto fail;
+  }
+  bd->cons_notify_fd[0] = fd[0];
+  bd->cons_notify_fd[1] = fd[1];
+
+  rshim_cons_epoll_ctl(bd, EPOLL_CTL_ADD, bd->cons_sock_fd, EPOLLIN);
+  rshim_cons_epoll_ctl(bd, EPOLL_CTL_ADD, bd->cons_notify_fd[0], EPOLLIN);
+
+  return 0;
+
+fail:
+  close(bd->cons_sock_fd);
+  bd->cons_sock_fd = -1;
+  unlink(addr.sun_path);
+  return rc;
+}
+
+void rshim_cons_sock_del(rshim_backend_t *bd)
+{
+  char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+  int i;
+
+  if (bd->cons_sock_fd < 0)
+    return;
+
+  /* The device is going away, no need to release the console. */
+  for (i = 0; i < RSHIM_CONS_MAX_CLIENTS; i++) {
+    if (bd->cons_client_fd[i] >= 0)
+      rshim_cons_sock_close_client(bd, i, false);
+  }
+
+  rshim_cons_epoll_ctl(bd, EPOLL_CTL_DEL, bd->cons_notify_fd[0], 0);
+  close(bd->cons_notify_fd[0]);
+  close(bd->cons_notify_fd[1]);
+  bd->cons_notify_fd[0] = -1;
+  bd->cons_notify_fd[1] = -1;
+
+  rshim_cons_epoll_ctl(bd, EPOLL_CTL_DEL, bd->cons_sock_fd, 0);
+  close(bd->cons_sock_fd);
+  bd->cons_sock_fd = -1;
+
+  snprintf(path, sizeof(path), "%s/rshim%d.console", RSHIM_CONS_SOCK_DIR,
+           bd->index);
+  unlink(path);
+}
+
+/*
+ * Timestamped console stream.
+ *
+ * With CONSOLE_TS enabled, each device also listens on
+ * RSHIM_CONS_SOCK_DIR/rshim<N>.console_ts, a read-only copy of the console
+ * output where every line is prefixed with the host CLOCK_MONOTONIC time at
+ * which its first byte was demultiplexed, in the same format as dmesg. The
+ * lines are sent from rshim_fifo_input() straight out of the read buffer,
+ * so the stream doesn't depend on the console being open and adds neither
+ * a copy of the data nor a hop through the main loop. A client which
+ * doesn't keep up loses output rather than stalling the FIFO; its torn line
+ * is ended with a newline and it resumes at the start of a later line, so
+ * every line it reads still has its timestamp.
+ */
+
+static void rshim_cons_ts_path(rshim_backend_t *bd, char *path, int len)
+{
+  snprintf(path, len, "%s/rshim%d.console_ts", RSHIM_CONS_SOCK_DIR,
+           bd->index);
+}
+
+/* Called with the ringlock held. */
+static void rshim_cons_ts_close_client(rshim_backend_t *bd, int idx)
+{
+  close(bd->cons_ts_client_fd[idx]);
+  bd->cons_ts_client_fd[idx] = -1;
+  bd->cons_ts_clients--;
+}
+
+static void rshim_cons_ts_accept(rshim_backend_t *bd)
+{
+  int fd, i;
+
+  fd = accept(bd->cons_ts_sock_fd, NULL, NULL);
+  if (fd < 0)
+    return;
+
+  if (rshim_cons_set_flags(fd)) {
+    close(fd);
+    return;
+  }
+
+  /* Nothing is read from the clients. */
+  shutdown(fd, SHUT_RD);
+
+  pthread_mutex_lock(&bd->ringlock);
+  for (i = 0; i < RSHIM_CONS_MAX_CLIENTS; i++) {
+    if (bd->cons_ts_client_fd[i] < 0)
+      break;
+  }
+  if (i < RSHIM_CONS_MAX_CLIENTS) {
+    bd->cons_ts_client_fd[i] = fd;
+    if (!bd->cons_ts_clients++)
+      bd->cons_ts_bol = true;
+    /* Join the stream at the start of a line. */
+    bd->cons_ts_client_skip[i] = !bd->cons_ts_bol;
+    bd->cons_ts_client_midline[i] = false;
+  }
+  pthread_mutex_unlock(&bd->ringlock);
+
+  if (i == RSHIM_CONS_MAX_CLIENTS) {
+    RSHIM_WARN("rshim%d too many console_ts clients\n", bd->index);
+    close(fd);
+  }
+}
+
+/* Byte at offset <off> of an iovec array. */
+static char rshim_cons_ts_byte(const struct iovec *iov, size_t off)
+{
+  while (off >= iov->iov_len)
+    off -= iov++->iov_len;
+
+  return ((const char *)iov->iov_base)[off];
+}
+
+/*
+ * Send a batch of output to the clients. The lines start at the iovecs
+ * pointing to <prefix>. A client which takes only part of the batch, or
+ * none of it, skips output until the start of a line, after a newline if
+ * it got a partial line.
+ */
+static void rshim_cons_ts_send(rshim_backend_t *bd, struct iovec *iov,
+                               int iovcnt, const char *prefix)
+{
+  struct iovec resync[RSHIM_CONS_TS_MAX_IOV + 1], *v;
+  struct msghdr msg;
+  ssize_t total, sent;
+  int i, j, cnt;
+
+  for (i = 0; i < RSHIM_CONS_MAX_CLIENTS; i++) {
+    if (bd->cons_ts_client_fd[i] < 0)
+      continue;
+
+    v = iov;
+    cnt = iovcnt;
+    if (bd->cons_ts_client_skip[i]) {
+      for (j = 0; j < iovcnt && iov[j].iov_base != prefix; j++)
+        ;
+      if (j == iovcnt)
+        continue;
+
+      v = resync;
+      cnt = 0;
+      if (bd->cons_ts_client_midline[i]) {
+        resync[cnt].iov_base = "\n";
+        resync[cnt++].iov_len = 1;
+      }
+      memcpy(&resync[cnt], &iov[j], (iovcnt - j) * sizeof(*iov));
+      cnt += iovcnt - j;
+    }
+
+    for (total = 0, j = 0; j < cnt; j++)
+      total += v[j].iov_len;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = v;
+    msg.msg_iovlen = cnt;
+    sent = sendmsg(bd->cons_ts_client_fd[i], &msg,
+                   MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      rshim_cons_ts_close_client(bd, i);
+      continue;
+    }
+
+    if (sent > 0)
+      bd->cons_ts_client_midline[i] =
+        rshim_cons_ts_byte(v, sent - 1) != '\n';
+    bd->cons_ts_client_skip[i] = sent != total;
+  }
+}
+
+/*
+ * Send a chunk of console output to the clients. Called from
+ * rshim_fifo_input() with the ringlock held.
+ */
+void rshim_cons_ts_input(rshim_backend_t *bd, const uint8_t *data, int len)
+{
+  struct iovec iov[RSHIM_CONS_TS_MAX_IOV];
+  const uint8_t *p = data, *end = data + len, *eol;
+  struct timespec ts;
+  char prefix[32];
+  int n = 0, plen;
+
+  /* One timestamp per chunk; all its lines arrived at the same time. */
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  plen = snprintf(prefix, sizeof(prefix), "[%5lu.%06lu] ",
+                  (unsigned long)ts.tv_sec, (unsigned long)ts.tv_nsec / 1000);
+
+  while (p < end) {
+    if (bd->cons_ts_bol) {
+      iov[n].iov_base = prefix;
+      iov[n++].iov_len = plen;
+      bd->cons_ts_bol = false;
+    }
+
+    eol = memchr(p, '\n', end - p);
+    if (eol) {
+      eol++;
+      bd->cons_ts_bol = true;
+    } else {
+      eol = end;
+    }
+
+    iov[n].iov_base = (void *)p;
+    iov[n++].iov_len = eol - p;
+    p = eol;
+
+    if (n >= RSHIM_CONS_TS_MAX_IOV - 1) {
+      rshim_cons_ts_send(bd, iov, n, prefix);
+      n = 0;
+    }
+  }
+
+  if (n)
+    rshim_cons_ts_send(bd, iov, n, prefix);
+}
+
+int rshim_cons_ts_init(rshim_backend_t *bd)
+{
+  struct sockaddr_un addr;
+  int i, rc;
+
+  bd->cons_ts_sock_fd = -1;
+  bd->cons_ts_clients = 0;
+  bd->cons_ts_bol = true;
+  for (i = 0; i < RSHIM_CONS_MAX_CLIENTS; i++) {
+    bd->cons_ts_client_fd[i] = -1;
+    bd->cons_ts_client_skip[i] = false;
+    bd->cons_ts_client_midline[i] = false;
+  }
+
+  if (!rshim_cons_ts_enable)
+    return 0;
+
+  if (mkdir(RSHIM_CONS_SOCK_DIR, 0755) && errno != EEXIST) {
+    RSHIM_ERR("Failed to create %s: %m\n", RSHIM_CONS_SOCK_DIR);
+    return -errno;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  rshim_cons_ts_path(bd, addr.sun_path, sizeof(addr.sun_path));
+  unlink(addr.sun_path);
+
+  bd->cons_ts_sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (bd->cons_ts_sock_fd < 0) {
+    RSHIM_ERR("socket failed: %m\n");
+    return -errno;
+  }
+
+  if (rshim_cons_set_flags(bd->cons_ts_sock_fd) ||
+      bind(bd->cons_ts_sock_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+      chmod(addr.sun_path, 0600) ||
+      listen(bd->cons_ts_sock_fd, RSHIM_CONS_MAX_CLIENTS)) {
+    RSHIM_ERR("Failed to listen on %s: %m\n", addr.sun_path);
+    rc = -errno;
+    close(bd->cons_ts_sock_fd);
+    bd->cons_ts_sock_fd = -1;
+    unlink(addr.sun_path);
+    return rc;
+  }
+
+  rshim_cons_epoll_ctl(bd, EPOLL_CTL_ADD, bd->cons_ts_sock_fd, EPOLLIN);
+
+  return 0;
+}
+
+void rshim_cons_ts_del(rshim_backend_t *bd)
+{
+  char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+  int i;
+
+  if (bd->cons_ts_sock_fd < 0)
+    return;
+
+  pthread_mutex_lock(&bd->ringlock);
+  for (i = 0; i < RSHIM_CONS_MAX_CLIENTS; i++) {
+    if (bd->cons_ts_client_fd[i] >= 0)
+      rshim_cons_ts_close_client(bd, i);
+  }
+  pthread_mutex_unlock(&bd->ringlock);
+
+  rshim_cons_epoll_ctl(bd, EPOLL_CTL_DEL, bd->cons_ts_sock_fd, 0);
+  close(bd->cons_ts_sock_fd);
+  bd->cons_ts_sock_fd = -1;
+
+  rshim_cons_ts_path(bd, path, sizeof(path));
+  unlink(path);
+}
@@ -32,6 +32,7 @@
 #endif
 
 #include "rshim.h"
+#include "rshim_mem.h"
 
 /* Name of the sub-device types. */
 char *rshim_dev_minor_names[RSH_DEV_TYPES] = {
@@ -39,6 +40,7 @@ char *rshim_dev_minor_names[RSH_DEV_TYPES] = {
     [RSH_DEV_TYPE_BOOT] = "boot",
     [RSH_DEV_TYPE_TMFIFO] = "console",
     [RSH_DEV_TYPE_MISC] = "misc",
+    [RSH_DEV_TYPE_MEM] = "mem",
 };
 
 #ifdef __linux__
@@ -159,10 +161,8 @@ static const struct cuse_methods rshim_boot_fops = {
 };
 #endif
 
-void rshim_fuse_input_notify(rshim_backend_t *bd)
+void rshim_fuse_input_notify(rshim_backend_t *bd, int chan)
 {
-  int chan = bd->rx_chan;
-
   RSHIM_DBG("rshim_fifo_input: woke up readable chan %d\n", chan);
 
 #ifdef __linux__
@@ -208,12 +208,27 @@ static int rshim_fuse_console_open(struct cuse_dev *cdev, int fflags)
 #endif
 
 #ifdef __linux__
+struct rshim_fuse_read_ctx {
+  fuse_req_t req;
+  bool replied;
+};
+
+static int rshim_fuse_console_reply(void *arg, const struct iovec *iov,
+                                    int iovcnt)
+{
+  struct rshim_fuse_read_ctx *ctx = arg;
+
+  /* The request is finished by fuse_reply_iov() even if it fails. */
+  ctx->replied = true;
+  return fuse_reply_iov(ctx->req, iov, iovcnt);
+}
+
 static void rshim_fuse_console_read(fuse_req_t req, size_t size, off_t off,
                                     struct fuse_file_info *fi)
 {
   rshim_backend_t *bd = fuse_req_userdata(req);
-  char buf[512];
-  int rc;
+  struct rshim_fuse_read_ctx ctx = { .req = req, .replied = false };
+  ssize_t rc;
 
   if (!bd) {
     fuse_reply_err(req, ENODEV);
@@ -225,15 +240,19 @@ static void rshim_fuse_console_read(fuse_req_t req, size_t size, off_t off,
     return;
   }
 
-  if (size > sizeof(buf))
-    size = sizeof(buf);
+  /*
+   * Reply straight from the ring instead of copying through a bounce
+   * buffer. The size is bounded by the ring occupancy and FUSE max_read.
+   */
+  rc = rshim_fifo_read_iov(bd, size, TMFIFO_CONS_CHAN, fi->flags & O_NONBLOCK,
+                           rshim_fuse_console_reply, &ctx);
+  if (ctx.replied)
+    return;
 
-  rc = rshim_fifo_read(bd, buf, size, TMFIFO_CONS_CHAN,
-                       fi->flags & O_NONBLOCK);
   if (rc < 0)
     fuse_reply_err(req, -rc);
   else
-    fuse_reply_buf(req, buf, rc);
+    fuse_reply_buf(req, NULL, 0);
 }
 #elif defined(__FreeBSD__)
 static int rshim_fuse_console_read(struct cuse_dev *cdev, int fflags,
@@ -467,6 +486,24 @@ static void rshim_fuse_console_poll(fuse_req_t req, struct fuse_file_info *fi,
     return;
   }
 
+  /*
+   * Register the handle before checking the ring. The rx path only notifies
+   * when the ring goes from empty to non-empty, so data arriving between a
+   * check and the registration would otherwise never be reported.
+   */
+  if (ph) {
+    pthread_mutex_lock(&bd->ringlock);
+    if (!bd->fuse_poll_handle[TMFIFO_CONS_CHAN]) {
+      bd->fuse_poll_handle[TMFIFO_CONS_CHAN] = ph;
+      ph = NULL;
+    } else if (ph == bd->fuse_poll_handle[TMFIFO_CONS_CHAN]) {
+      ph = NULL;
+    }
+    pthread_mutex_unlock(&bd->ringlock);
+    if (ph)
+      fuse_pollhandle_destroy(ph);
+  }
+
   rshim_fifo_check_poll(bd, TMFIFO_CONS_CHAN, &poll_rx, &poll_tx, &poll_err);
 
   if (poll_rx)
@@ -478,12 +515,6 @@ static void rshim_fuse_console_poll(fuse_req_t req, struct fuse_file_info *fi,
   if (poll_err)
     revents |= POLLERR;
 
-  if (ph) {
-    if (!bd->fuse_poll_handle[TMFIFO_CONS_CHAN])
-      bd->fuse_poll_handle[TMFIFO_CONS_CHAN] = ph;
-    else if (ph != bd->fuse_poll_handle[TMFIFO_CONS_CHAN])
-      fuse_pollhandle_destroy(ph);
-  }
   fuse_reply_poll(req, revents);
 }
 #elif defined(__FreeBSD__)
@@ -512,10 +543,15 @@ static int rshim_fuse_console_poll(struct cuse_dev *cdev, int fflags,
 #ifdef __linux__
 static void rshim_fuse_poll_handle_destroy(rshim_backend_t *bd, int chan)
 {
-  if (bd->fuse_poll_handle[chan]) {
-    fuse_pollhandle_destroy(bd->fuse_poll_handle[chan]);
-    bd->fuse_poll_handle[chan] = NULL;
-  }
+  void *ph;
+
+  pthread_mutex_lock(&bd->ringlock);
+  ph = bd->fuse_poll_handle[chan];
+  bd->fuse_poll_handle[chan] = NULL;
+  pthread_mutex_unlock(&bd->ringlock);
+
+  if (ph)
+    fuse_pollhandle_destroy(ph);
 }
 
 static void rshim_fuse_console_release(fuse_req_t req,
@@ -616,8 +652,6 @@ static int rshim_fuse_misc_read(struct cuse_dev *cdev, int fflags,
   char opn[RSHIM_YU_BOOT_RECORD_OPN_SIZE + 1] = "";
   uint8_t *mac = bd->peer_mac;
   int rc, len = sizeof(rm->buffer), n;
-  struct timespec ts;
-  struct timeval tp;
   uint64_t value;
   char *p;
 
@@ -699,8 +733,6 @@ static int rshim_fuse_misc_read(struct cuse_dev *cdev, int fflags,
   }
 
   if (bd->display_level == 1) {
-    gettimeofday(&tp, NULL);
-
     /* Skip SW_RESET while pushing boot stream. */
     n = snprintf(p, len, "%-16s%d (1: skip)\n", "BOOT_RESET_SKIP",
                  bd->skip_boot_reset);
@@ -708,20 +740,12 @@ static int rshim_fuse_misc_read(struct cuse_dev *cdev, int fflags,
     len -= n;
 
     /*
-     * Display the target-side information. Send a request and wait for
-     * some time for the response.
+     * Display the cached target-side information without waiting. It's
+     * refreshed periodically, or by this read if that's disabled.
      */
-    bd->peer_ctrl_req = 1;
-    bd->peer_ctrl_resp = 0;
-    memset(mac, 0, 6);
-    bd->has_cons_work = 1;
-    rshim_work_signal(bd);
+    if (!rshim_peer_refresh_interval || !bd->peer_info_time)
+      rshim_peer_refresh(bd);
 
-    ts.tv_sec  = tp.tv_sec + 1;
-    ts.tv_nsec = tp.tv_usec * 1000;
-    rc = pthread_cond_timedwait(&bd->ctrl_wait_cond, &bd->mutex, &ts);
-    if (rc)
-      RSHIM_DBG("Timeout in getting peer response.\n");
     n = snprintf(p, len, "%-16s%02x:%02x:%02x:%02x:%02x:%02x (rw)\n",
                    "PEER_MAC", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
     p += n;
@@ -735,6 +759,38 @@ static int rshim_fuse_misc_read(struct cuse_dev *cdev, int fflags,
     n = snprintf(p, len, "%-16s%d %d (rw)\n",
                    "VLAN_ID", bd->vlan[0], bd->vlan[1]);
     p += n;
+    len -= n;
+
+    n = snprintf(p, len, "%-16s%llu (ms)\n", "NET_TX_PAUSE",
+                 (unsigned long long)bd->net_tx_pause_ms);
+    p += n;
+    len -= n;
+
+    if (bd->peer_info_time)
+      n = snprintf(p, len, "%-16s%lld (seconds)\n", "PEER_INFO_AGE",
+                   (long long)(rshim_mono_time() - bd->peer_info_time));
+    else
+      n = snprintf(p, len, "%-16sN/A\n", "PEER_INFO_AGE");
+    p += n;
+    len -= n;
+
+    if (bd->trace) {
+      n = snprintf(p, len, "%-16s%llu (events)\n", "TRACE",
+                   (unsigned long long)rshim_trace_count(bd));
+      p += n;
+      len -= n;
+    }
+
+    n = rshim_watch_show(bd, p, len);
+    p += n;
+    len -= n;
+
+    n = rshim_mbox_show(bd, p, len);
+    p += n;
+    len -= n;
+
+    n = rshim_lease_show(bd, p, len);
+    p += n;
   } else if (bd->display_level == 2) {
     n = rshim_log_show(bd, p, len);
     p += n;
@@ -780,7 +836,7 @@ static int rshim_fuse_misc_write(struct cuse_dev *cdev, int fflags,
   rshim_backend_t *bd = cuse_dev_get_priv0(cdev);
   const char *p = buf;
 #endif
-  int i, rc = 0, value = 0, mac[6], vlan[2] = {0}, old_value;
+  int i, rc = 0, value = 0, mac[6], vlan[2] = {0};
   char opn[RSHIM_YU_BOOT_RECORD_OPN_SIZE + 1] = "";
   char key[32];
 
@@ -815,6 +871,12 @@ static int rshim_fuse_misc_write(struct cuse_dev *cdev, int fflags,
     if (sscanf(p, "%d", &value) != 1)
       goto invalid;
     bd->display_level = value;
+    /* Get the peer info ready for the next read. */
+    if (value == 1) {
+      pthread_mutex_lock(&bd->mutex);
+      rshim_peer_refresh(bd);
+      pthread_mutex_unlock(&bd->mutex);
+    }
   } else if (strcmp(key, "BOOT_TIMEOUT") == 0) {
     if (sscanf(p, "%d", &value) != 1)
       goto invalid;
@@ -823,36 +885,7 @@ static int rshim_fuse_misc_write(struct cuse_dev *cdev, int fflags,
     if (sscanf(p, "%d", &value) != 1)
       goto invalid;
 
-    pthread_mutex_lock(&bd->mutex);
-    old_value = (int)bd->drop_mode;
-    bd->drop_mode = !!value;
-    if (bd->drop_mode == old_value) {
-      pthread_mutex_unlock(&bd->mutex);
-      goto done;
-    }
-
-    if (bd->enable_device) {
-      if (bd->enable_device(bd, bd->drop_mode ? false : true))
-        bd->drop_mode = 1;
-    }
-
-    if (bd->drop_mode)
-      bd->drop_pkt = 1;
-    pthread_mutex_unlock(&bd->mutex);
-    /*
-     * Check if another endpoint driver has already attached to the
-     * same rshim device before enabling it.
-     */
-    if (!bd->drop_mode) {
-      rshim_lock();
-      pthread_mutex_lock(&bd->mutex);
-      if (rshim_access_check(bd)) {
-        RSHIM_WARN("rshim%d is not accessible\n", bd->index);
-        bd->drop_mode = 1;
-      }
-      pthread_mutex_unlock(&bd->mutex);
-      rshim_unlock();
-    }
+    rshim_set_drop_mode(bd, value);
   } else if (strcmp(key, "BOOT_MODE") == 0) {
     if (sscanf(p, "%x", &value) != 1)
       goto invalid;
@@ -926,6 +959,12 @@ static int rshim_fuse_misc_write(struct cuse_dev *cdev, int fflags,
     bd->has_cons_work = 1;
     rshim_work_signal(bd);
     pthread_mutex_unlock(&bd->mutex);
+  } else if (strcmp(key, "TRACE_DUMP") == 0) {
+    if (sscanf(p, "%d", &value) != 1)
+      goto invalid;
+
+    if (value)
+      rc = rshim_trace_dump(bd);
   } else if (!strcmp(key, "OPN_STR")) {
     if (sscanf(p, "%16s", opn) != 1)
       goto invalid;
@@ -940,7 +979,6 @@ invalid:
 #endif
   }
 
-done:
 #ifdef __linux__
   if (!rc)
     fuse_reply_write(req, size);
@@ -1238,16 +1276,202 @@ static const struct cuse_methods rshim_rshim_fops = {
 };
 #endif
 
+/*
+ * DPU memory file operations routines.
+ *
+ * The DPU memory is accessed through the MEM_ACC widget by rshim_mem_read()
+ * and rshim_mem_write(). CUSE doesn't pass the file offset down, so each
+ * open file has its own DPU physical address, set with RSHIM_IOC_MEM_SEEK
+ * and advanced by the reads and writes. Only the requested range is read,
+ * with no read-ahead, since the address could be MMIO with read side
+ * effects or not backed by anything past the end of the request.
+ */
+#ifdef __linux__
+#define RSHIM_MEM_ADDR_LIMIT    (RSH_MEM_ACC_CTL__ADDRESS_RMASK + 1)
+
+struct rshim_mem_file {
+  uint64_t addr;                        /* DPU physical address */
+};
+
+static void rshim_fuse_mem_open(fuse_req_t req, struct fuse_file_info *fi)
+{
+  rshim_backend_t *bd = fuse_req_userdata(req);
+  struct rshim_mem_file *mf;
+
+  if (!bd) {
+    fuse_reply_err(req, ENODEV);
+    return;
+  }
+
+  mf = calloc(1, sizeof(*mf));
+  if (!mf) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+
+  fi->fh = (uintptr_t)mf;
+  fuse_reply_open(req, fi);
+  rshim_ref(bd);
+}
+
+static void rshim_fuse_mem_read(fuse_req_t req, size_t size, off_t off,
+                                struct fuse_file_info *fi)
+{
+  rshim_backend_t *bd = fuse_req_userdata(req);
+  struct rshim_mem_file *mf = (void *)(uintptr_t)fi->fh;
+  uint64_t addr = mf->addr;
+  uint8_t *buf;
+  ssize_t rc;
+
+  if (!bd) {
+    fuse_reply_err(req, ENODEV);
+    return;
+  }
+
+  if (addr >= RSHIM_MEM_ADDR_LIMIT || !size) {
+    fuse_reply_buf(req, NULL, 0);
+    return;
+  }
+  size = MIN(size, RSHIM_MEM_ADDR_LIMIT - addr);
+
+  buf = malloc(size);
+  if (!buf) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+
+  rc = rshim_mem_read(bd, addr, buf, size);
+  if (rc >= 0) {
+    mf->addr = addr + rc;
+    fuse_reply_buf(req, (char *)buf, rc);
+  } else {
+    fuse_reply_err(req, -rc);
+  }
+
+  free(buf);
+}
+
+static void rshim_fuse_mem_write(fuse_req_t req, const char *buf, size_t size,
+                                 off_t off, struct fuse_file_info *fi)
+{
+  rshim_backend_t *bd = fuse_req_userdata(req);
+  struct rshim_mem_file *mf = (void *)(uintptr_t)fi->fh;
+  uint64_t addr = mf->addr;
+  ssize_t rc;
+
+  if (!bd) {
+    fuse_reply_err(req, ENODEV);
+    return;
+  }
+
+  if (addr >= RSHIM_MEM_ADDR_LIMIT) {
+    fuse_reply_err(req, ENOSPC);
+    return;
+  }
+  size = MIN(size, RSHIM_MEM_ADDR_LIMIT - addr);
+
+  rc = rshim_mem_write(bd, addr, buf, size);
+  if (rc > 0) {
+    mf->addr = addr + rc;
+    fuse_reply_write(req, rc);
+  } else {
+    fuse_reply_err(req, rc ? -rc : EIO);
+  }
+}
+
+static void rshim_fuse_mem_ioctl(fuse_req_t req, int cmd, void *arg,
+                                 struct fuse_file_info *fi, unsigned int flags,
+                                 const void *in_buf, size_t in_bufsz,
+                                 size_t out_bufsz)
+{
+  struct rshim_mem_file *mf = (void *)(uintptr_t)fi->fh;
+  struct iovec iov;
+  uint64_t addr;
+
+  if (cmd != RSHIM_IOC_MEM_SEEK) {
+    fuse_reply_err(req, ENOSYS);
+    return;
+  }
+
+  iov.iov_base = arg;
+  iov.iov_len = sizeof(addr);
+
+  if (!in_bufsz) {
+    fuse_reply_ioctl_retry(req, &iov, 1, NULL, 0);
+    return;
+  }
+
+  if (in_bufsz != sizeof(addr)) {
+    fuse_reply_err(req, EINVAL);
+    return;
+  }
+
+  memcpy(&addr, in_buf, sizeof(addr));
+  mf->addr = addr;
+
+  fuse_reply_ioctl(req, 0, NULL, 0);
+}
+
+static void rshim_fuse_mem_release(fuse_req_t req, struct fuse_file_info *fi)
+{
+  rshim_backend_t *bd = fuse_req_userdata(req);
+
+  free((void *)(uintptr_t)fi->fh);
+  fuse_reply_err(req, 0);
+
+  if (bd)
+    rshim_deref(bd);
+}
+
+static const struct cuse_lowlevel_ops rshim_mem_fops = {
+  .open = rshim_fuse_mem_open,
+  .read = rshim_fuse_mem_read,
+  .write = rshim_fuse_mem_write,
+  .ioctl = rshim_fuse_mem_ioctl,
+  .release = rshim_fuse_mem_release,
+};
+#endif
+
 static void *cuse_worker(void *arg)
 {
 #ifdef __linux__
+  /*
+   * Same as fuse_session_loop(), except that several workers could run it on
+   * the same session so one blocking request (such as a console read waiting
+   * for data or a misc read waiting for the peer) doesn't hold up the others.
+   * The session is destroyed by rshim_fuse_del() after all workers are done.
+   */
   struct fuse_session *se = arg;
-  int rc;
+  struct fuse_chan *ch = fuse_session_next_chan(se, NULL);
+  size_t bufsize = fuse_chan_bufsize(ch);
+  char *buf;
+  int rc = 0;
 
-  rc = fuse_session_loop(se);
-  fuse_session_destroy(se);
+  buf = malloc(bufsize);
+  if (!buf) {
+    RSHIM_ERR("Failed to allocate CUSE buffer\n");
+    return (void *)(unsigned long)-ENOMEM;
+  }
+
+  while (!fuse_session_exited(se)) {
+    struct fuse_chan *tmpch = ch;
+    struct fuse_buf fbuf = {
+      .mem = buf,
+      .size = bufsize,
+    };
+
+    rc = fuse_session_receive_buf(se, &fbuf, &tmpch);
+    if (rc == -EINTR)
+      continue;
+    if (rc <= 0)
+      break;
 
-  return (void *)(unsigned long)rc;
+    fuse_session_process_buf(se, &fbuf, tmpch);
+  }
+
+  free(buf);
+
+  return (void *)(unsigned long)(rc < 0 ? -1 : 0);
 #elif defined(__FreeBSD__)
   signal(SIGHUP, &rshim_sig_hup);
 
@@ -1275,8 +1499,11 @@ int rshim_fuse_init(rshim_backend_t *bd)
                           [RSH_DEV_TYPE_TMFIFO] = &rshim_console_fops,
                           [RSH_DEV_TYPE_RSHIM] = &rshim_rshim_fops,
                           [RSH_DEV_TYPE_MISC] = &rshim_misc_fops,
+#ifdef __linux__
+                          [RSH_DEV_TYPE_MEM] = &rshim_mem_fops,
+#endif
                           };
-  int i, rc;
+  int i, j, rc;
 
 #if defined(__FreeBSD__)
   if (cuse_init() != CUSE_ERR_NONE)
@@ -1313,12 +1540,6 @@ int rshim_fuse_init(rshim_backend_t *bd)
       return -1;
     }
     fuse_remove_signal_handlers(bd->fuse_session[i]);
-    rc = pthread_create(&bd->fuse_thread[i], NULL, cuse_worker,
-                        bd->fuse_session[i]);
-    if (rc) {
-      RSHIM_ERR("Failed to create cuse thread %m\n");
-      return rc;
-    }
 #elif defined(__FreeBSD__)
     name = rshim_dev_minor_names[i];
     snprintf(buf, sizeof(buf), "rshim%d/%s", bd->index, name);
@@ -1331,13 +1552,17 @@ int rshim_fuse_init(rshim_backend_t *bd)
       RSHIM_ERR("Failed to setup CUSE %s\n", name);
       return -1;
     }
-    rc = pthread_create(&bd->fuse_thread[i], NULL, cuse_worker,
-                        bd->fuse_session[i]);
-    if (rc) {
-      RSHIM_ERR("Failed to create cuse thread %m");
-      return rc;
-    }
 #endif
+
+    for (j = 0; j < rshim_fuse_threads; j++) {
+      rc = pthread_create(&bd->fuse_thread[i][j], NULL, cuse_worker,
+                          bd->fuse_session[i]);
+      if (rc) {
+        RSHIM_ERR("Failed to create cuse thread %m\n");
+        return rc;
+      }
+      rshim_set_affinity(bd, bd->fuse_thread[i][j]);
+    }
   }
 
   return 0;
@@ -1345,9 +1570,11 @@ int rshim_fuse_init(rshim_backend_t *bd)
 
 int rshim_fuse_del(rshim_backend_t *bd)
 {
-  int i;
+  void *session[RSH_DEV_TYPES];
+  int i, j;
 
   for (i = 0; i < RSH_DEV_TYPES; i++) {
+    session[i] = bd->fuse_session[i];
     if (bd->fuse_session[i]) {
 #ifdef __linux__
       fuse_session_exit(bd->fuse_session[i]);
@@ -1359,11 +1586,20 @@ int rshim_fuse_del(rshim_backend_t *bd)
   }
 
   for (i = 0; i < RSH_DEV_TYPES; i++) {
-    if (bd->fuse_thread[i]) {
-      pthread_kill(bd->fuse_thread[i], SIGINT);
-      pthread_join(bd->fuse_thread[i], NULL);
-      bd->fuse_thread[i] = 0;
+    for (j = 0; j < RSHIM_FUSE_MAX_THREADS; j++) {
+      if (bd->fuse_thread[i][j]) {
+        pthread_kill(bd->fuse_thread[i][j], SIGINT);
+        pthread_join(bd->fuse_thread[i][j], NULL);
+        bd->fuse_thread[i][j] = 0;
+      }
     }
+
+#ifdef __linux__
+    /* All the workers are gone, safe to destroy the session now. */
+    if (session[i])
+      fuse_session_destroy(session[i]);
+#endif
   }
+
   return 0;
 }
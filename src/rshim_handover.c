@@ -0,0 +1,390 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2019 Mellanox Technologies. All Rights Reserved.
+ *
+ */
+
+#include <poll.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "rshim.h"
+
+/*
+ * Daemon handover.
+ *
+ * A running daemon listens on a Unix-domain socket. When a new daemon is
+ * started with '--handover', it connects to that socket and the old daemon
+ * sends a record of each device: its index, the TMFIFO state and the tap
+ * fd (SCM_RIGHTS). The old daemon then stops and closes the connection
+ * when it exits, after which the new daemon probes the devices, reusing the
+ * same indexes and tap interfaces and resuming the TMFIFO stream where the
+ * old one left it. The CUSE device files are re-created.
+ */
+
+#define RSHIM_HANDOVER_VERSION  1
+
+/* Handover record of one device. */
+typedef struct {
+  uint32_t version;
+  uint32_t size;                        /* size of the record */
+  char dev_name[RSHIM_DEV_NAME_LEN];
+  int32_t index;
+
+  /* TMFIFO state. */
+  int32_t read_buf_bytes;
+  int32_t read_buf_next;
+  int32_t read_buf_pkt_rem;
+  int32_t read_buf_pkt_padding;
+  int32_t write_buf_pkt_rem;
+  int32_t tx_chan;
+  int32_t rx_chan;
+  rshim_tmfifo_msg_hdr_t msg_hdr;
+  uint32_t read_head[TMFIFO_MAX_CHAN];
+  uint32_t read_tail[TMFIFO_MAX_CHAN];
+  uint32_t write_head[TMFIFO_MAX_CHAN];
+  uint32_t write_tail[TMFIFO_MAX_CHAN];
+  uint8_t read_buf[READ_BUF_SIZE];
+  uint8_t read_fifo[TMFIFO_MAX_CHAN][READ_FIFO_SIZE];
+  uint8_t write_fifo[TMFIFO_MAX_CHAN][WRITE_FIFO_SIZE];
+
+  /* Network packets in progress. */
+  rshim_net_pkt_t net_rx_pkt;
+  rshim_net_pkt_t net_tx_pkt;
+  int32_t net_rx_len;
+  int32_t net_tx_len;
+} rshim_handover_rec_t;
+
+/* Records received from the previous daemon, and their tap fds. */
+static rshim_handover_rec_t *rshim_handover_recs[RSHIM_MAX_DEV];
+static int rshim_handover_net_fds[RSHIM_MAX_DEV];
+static int rshim_handover_num;
+
+static int rshim_handover_listen_fd = -1;
+
+static void rshim_handover_path(struct sockaddr_un *addr)
+{
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (rshim_static_dev_name)
+    snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/handover-%s.sock",
+             RSHIM_CONS_SOCK_DIR, rshim_static_dev_name);
+  else
+    snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/handover.sock",
+             RSHIM_CONS_SOCK_DIR);
+}
+
+int rshim_handover_listen(void)
+{
+  struct epoll_event event;
+  struct sockaddr_un addr;
+  int fd;
+
+  if (mkdir(RSHIM_CONS_SOCK_DIR, 0755) && errno != EEXIST) {
+    RSHIM_ERR("Failed to create %s: %m\n", RSHIM_CONS_SOCK_DIR);
+    return -errno;
+  }
+
+  rshim_handover_path(&addr);
+  unlink(addr.sun_path);
+
+  fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (fd < 0) {
+    RSHIM_ERR("socket failed: %m\n");
+    return -errno;
+  }
+
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+      chmod(addr.sun_path, 0600) || listen(fd, 1)) {
+    RSHIM_ERR("Failed to listen on %s: %m\n", addr.sun_path);
+    close(fd);
+    unlink(addr.sun_path);
+    return -errno;
+  }
+
+  memset(&event, 0, sizeof(event));
+  event.data.fd = fd;
+  event.events = EPOLLIN;
+  if (epoll_ctl(rshim_epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+    RSHIM_ERR("epoll_ctl failed: %d %d\n", rshim_epoll_fd, fd);
+    close(fd);
+    unlink(addr.sun_path);
+    return -1;
+  }
+
+  rshim_handover_listen_fd = fd;
+  return fd;
+}
+
+void rshim_handover_close(void)
+{
+  struct sockaddr_un addr;
+
+  if (rshim_handover_listen_fd < 0)
+    return;
+
+  close(rshim_handover_listen_fd);
+  rshim_handover_listen_fd = -1;
+  rshim_handover_path(&addr);
+  unlink(addr.sun_path);
+}
+
+/* Accept a new daemon. The connection stays open until this one exits. */
+int rshim_handover_accept(void)
+{
+  int fd;
+
+  fd = accept(rshim_handover_listen_fd, NULL, NULL);
+  if (fd < 0)
+    return -1;
+
+  /* Only one handover; no more connections from now on. */
+  epoll_ctl(rshim_epoll_fd, EPOLL_CTL_DEL, rshim_handover_listen_fd, NULL);
+
+  RSHIM_INFO("handing over to the new daemon\n");
+  return fd;
+}
+
+/*
+ * Send the state of 'bd', or the end marker if NULL. The device stops any
+ * TMFIFO transfer afterwards so the state isn't changed by this daemon.
+ */
+int rshim_handover_send(int sock, rshim_backend_t *bd)
+{
+  char cbuf[CMSG_SPACE(sizeof(int))];
+  rshim_handover_rec_t *rec;
+  struct cmsghdr *cmsg;
+  struct msghdr msg;
+  struct iovec iov;
+  uint32_t end[2] = { RSHIM_HANDOVER_VERSION, 0 };
+  int i, rc, net_fd = -1;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  if (!bd) {
+    iov.iov_base = end;
+    iov.iov_len = sizeof(end);
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) < 0 ? -errno : 0;
+  }
+
+  rec = calloc(1, sizeof(*rec));
+  if (!rec)
+    return -ENOMEM;
+
+  rec->version = RSHIM_HANDOVER_VERSION;
+  rec->size = sizeof(*rec);
+  snprintf(rec->dev_name, sizeof(rec->dev_name), "%s", bd->dev_name);
+  rec->index = bd->index;
+
+  pthread_mutex_lock(&bd->mutex);
+
+  if (bd->cancel)
+    bd->cancel(bd, RSH_DEV_TYPE_TMFIFO, true);
+
+  pthread_mutex_lock(&bd->ringlock);
+  rec->read_buf_bytes = bd->read_buf_bytes;
+  rec->read_buf_next = bd->read_buf_next;
+  rec->read_buf_pkt_rem = bd->read_buf_pkt_rem;
+  rec->read_buf_pkt_padding = bd->read_buf_pkt_padding;
+  rec->write_buf_pkt_rem = bd->write_buf_pkt_rem;
+  rec->tx_chan = bd->tx_chan;
+  rec->rx_chan = bd->rx_chan;
+  rec->msg_hdr = bd->msg_hdr;
+  memcpy(rec->read_buf, bd->read_buf, READ_BUF_SIZE);
+  for (i = 0; i < TMFIFO_MAX_CHAN; i++) {
+    rec->read_head[i] = bd->read_fifo[i].head;
+    rec->read_tail[i] = bd->read_fifo[i].tail;
+    rec->write_head[i] = bd->write_fifo[i].head;
+    rec->write_tail[i] = bd->write_fifo[i].tail;
+    memcpy(rec->read_fifo[i], bd->read_fifo[i].data, READ_FIFO_SIZE);
+    memcpy(rec->write_fifo[i], bd->write_fifo[i].data, WRITE_FIFO_SIZE);
+  }
+  memcpy(&rec->net_rx_pkt, &bd->net_rx_pkt, sizeof(rec->net_rx_pkt));
+  memcpy(&rec->net_tx_pkt, &bd->net_tx_pkt, sizeof(rec->net_tx_pkt));
+  rec->net_rx_len = bd->net_rx_len;
+  rec->net_tx_len = bd->net_tx_len;
+
+  /* No more TMFIFO output from this daemon. */
+  bd->drop_mode = 1;
+  pthread_mutex_unlock(&bd->ringlock);
+
+  net_fd = bd->net_fd;
+  pthread_mutex_unlock(&bd->mutex);
+
+  iov.iov_base = rec;
+  iov.iov_len = sizeof(*rec);
+  if (net_fd >= 0) {
+    memset(cbuf, 0, sizeof(cbuf));
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &net_fd, sizeof(int));
+  }
+
+  rc = sendmsg(sock, &msg, MSG_NOSIGNAL) < 0 ? -errno : 0;
+  if (rc)
+    RSHIM_ERR("rshim%d handover failed: %d\n", bd->index, rc);
+
+  free(rec);
+  return rc;
+}
+
+/*
+ * Get the devices from the running daemon. Returns after the old daemon
+ * has exited and released the devices, or timed out.
+ */
+int rshim_handover_receive(void)
+{
+  char cbuf[CMSG_SPACE(sizeof(int))];
+  rshim_handover_rec_t *rec = NULL;
+  struct sockaddr_un addr;
+  struct cmsghdr *cmsg;
+  struct pollfd pfd;
+  struct msghdr msg;
+  struct iovec iov;
+  int fd, net_fd;
+  ssize_t len;
+
+  fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -errno;
+
+  rshim_handover_path(&addr);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+    RSHIM_INFO("no daemon to take over from (%m)\n");
+    close(fd);
+    return -ENOENT;
+  }
+
+  for (;;) {
+    if (!rec) {
+      rec = malloc(sizeof(*rec));
+      if (!rec)
+        break;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = rec;
+    iov.iov_len = sizeof(*rec);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    len = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    if (len <= 0)
+      break;
+
+    net_fd = -1;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_RIGHTS)
+      memcpy(&net_fd, CMSG_DATA(cmsg), sizeof(int));
+
+    /* End marker. */
+    if (len >= (ssize_t)(2 * sizeof(uint32_t)) && !rec->size)
+      break;
+
+    if (len != (ssize_t)sizeof(*rec) || rec->version != RSHIM_HANDOVER_VERSION ||
+        rec->size != sizeof(*rec) || rec->index < 0 ||
+        rec->index >= RSHIM_MAX_DEV || rshim_handover_recs[rec->index]) {
+      RSHIM_WARN("ignore incompatible handover record\n");
+      if (net_fd >= 0)
+        close(net_fd);
+      continue;
+    }
+
+    rec->dev_name[sizeof(rec->dev_name) - 1] = 0;
+    rshim_handover_recs[rec->index] = rec;
+    rshim_handover_net_fds[rec->index] = net_fd;
+    rec = NULL;
+    rshim_handover_num++;
+  }
+  free(rec);
+
+  /* Wait for the old daemon to exit. */
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  while (poll(&pfd, 1, RSHIM_HANDOVER_TIMEOUT * 1000) > 0) {
+    if (read(fd, cbuf, sizeof(cbuf)) <= 0)
+      break;
+  }
+  close(fd);
+
+  RSHIM_INFO("took over %d device(s)\n", rshim_handover_num);
+  return rshim_handover_num;
+}
+
+/* Returns the index of a handed-over device, or -1. */
+int rshim_handover_index(const char *dev_name)
+{
+  int i;
+
+  if (!rshim_handover_num)
+    return -1;
+
+  for (i = 0; i < RSHIM_MAX_DEV; i++) {
+    if (rshim_handover_recs[i] &&
+        !strcmp(rshim_handover_recs[i]->dev_name, dev_name))
+      return i;
+  }
+
+  return -1;
+}
+
+/*
+ * Restore the TMFIFO state and take the tap fd. Called from rshim_register()
+ * after the FIFOs are allocated.
+ */
+bool rshim_handover_restore(rshim_backend_t *bd)
+{
+  rshim_handover_rec_t *rec;
+  int i, index;
+
+  index = rshim_handover_index(bd->dev_name);
+  if (index < 0)
+    return false;
+
+  rec = rshim_handover_recs[index];
+
+  pthread_mutex_lock(&bd->ringlock);
+  bd->read_buf_bytes = rec->read_buf_bytes;
+  bd->read_buf_next = rec->read_buf_next;
+  bd->read_buf_pkt_rem = rec->read_buf_pkt_rem;
+  bd->read_buf_pkt_padding = rec->read_buf_pkt_padding;
+  bd->write_buf_pkt_rem = rec->write_buf_pkt_rem;
+  bd->tx_chan = rec->tx_chan;
+  bd->rx_chan = rec->rx_chan;
+  bd->msg_hdr = rec->msg_hdr;
+  memcpy(bd->read_buf, rec->read_buf, READ_BUF_SIZE);
+  for (i = 0; i < TMFIFO_MAX_CHAN; i++) {
+    bd->read_fifo[i].head = rec->read_head[i] & (READ_FIFO_SIZE - 1);
+    bd->read_fifo[i].tail = rec->read_tail[i] & (READ_FIFO_SIZE - 1);
+    bd->write_fifo[i].head = rec->write_head[i] & (WRITE_FIFO_SIZE - 1);
+    bd->write_fifo[i].tail = rec->write_tail[i] & (WRITE_FIFO_SIZE - 1);
+    memcpy(bd->read_fifo[i].data, rec->read_fifo[i], READ_FIFO_SIZE);
+    memcpy(bd->write_fifo[i].data, rec->write_fifo[i], WRITE_FIFO_SIZE);
+  }
+  memcpy(&bd->net_rx_pkt, &rec->net_rx_pkt, sizeof(bd->net_rx_pkt));
+  memcpy(&bd->net_tx_pkt, &rec->net_tx_pkt, sizeof(bd->net_tx_pkt));
+  bd->net_rx_len = rec->net_rx_len;
+  bd->net_tx_len = rec->net_tx_len;
+  pthread_mutex_unlock(&bd->ringlock);
+
+  bd->handover_net_fd = rshim_handover_net_fds[index];
+
+  RSHIM_INFO("rshim%d state restored\n", bd->index);
+
+  rshim_handover_recs[index] = NULL;
+  free(rec);
+
+  return true;
+}
@@ -0,0 +1,691 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2019 Mellanox Technologies. All Rights Reserved.
+ *
+ */
+
+#define _GNU_SOURCE     /* for accept4() */
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/epoll.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "rshim.h"
+
+/*
+ * Register leases for librshim (see rshim_lease.h).
+ *
+ * The registers which could be leased are listed with "LEASE_REG" lines in
+ * the configuration file, except the registers the daemon itself uses,
+ * which are refused. When the list isn't empty, each device whose
+ * backend could hand out its BAR (PCIe on Linux) listens on the
+ * SOCK_SEQPACKET socket RSHIM_CONS_SOCK_DIR/rshim<N>.lease, served by the
+ * main epoll loop. A register could be leased for reading by several
+ * clients, or for writing by one. While a register is leased, the accesses
+ * of the daemon itself to it fail with -EBUSY. The lease states are
+ * protected by the device mutex, which is also held by the daemon around
+ * the register accesses, so no access of the daemon is in flight once a
+ * lease is granted.
+ */
+
+#define RSHIM_LEASE_MAX_CLIENTS 8
+
+/* Registers which could be leased, from the configuration file. */
+typedef struct {
+  char name[RSHIM_LEASE_NAME_LEN];
+  bool write;
+} rshim_lease_allow_t;
+
+static rshim_lease_allow_t rshim_lease_allow[RSHIM_LEASE_MAX_ALLOW];
+static int rshim_lease_allow_num;
+
+typedef struct {
+  const char *name;
+  size_t off;
+} rshim_lease_name_t;
+
+/* Registers known by name; the others are given as "<channel>:<offset>". */
+static const rshim_lease_name_t rshim_lease_names[] = {
+  { "uptime", offsetof(struct rshim_regs, uptime) },
+  { "uptime_por", offsetof(struct rshim_regs, uptime_por) },
+};
+
+/*
+ * Registers used by the daemon (boot stream, reset, TmFifo, memory access,
+ * device state), which are never leased, whether given by name or offset.
+ */
+static const rshim_lease_name_t rshim_lease_reserved[] = {
+  { "boot_fifo_data", offsetof(struct rshim_regs, boot_fifo_data) },
+  { "boot_fifo_count", offsetof(struct rshim_regs, boot_fifo_count) },
+  { "boot_control", offsetof(struct rshim_regs, boot_control) },
+  { "reset_control", offsetof(struct rshim_regs, reset_control) },
+  { "scratchpad1", offsetof(struct rshim_regs, scratchpad1) },
+  { "scratchpad6", offsetof(struct rshim_regs, scratchpad6) },
+  { "tm_htt_sts", offsetof(struct rshim_regs, tm_htt_sts) },
+  { "tm_tth_sts", offsetof(struct rshim_regs, tm_tth_sts) },
+  { "tm_htt_data", offsetof(struct rshim_regs, tm_htt_data) },
+  { "tm_tth_data", offsetof(struct rshim_regs, tm_tth_data) },
+  { "semaphore0", offsetof(struct rshim_regs, semaphore0) },
+  { "mem_acc_ctl", offsetof(struct rshim_regs, mem_acc_ctl) },
+  { "mem_acc_rsp_cnt", offsetof(struct rshim_regs, mem_acc_rsp_cnt) },
+  { "mem_acc_data_first_word",
+    offsetof(struct rshim_regs, mem_acc_data_first_word) },
+  { "device_mstr_priv_lvl", offsetof(struct rshim_regs, device_mstr_priv_lvl) },
+  { "fabric_dim", offsetof(struct rshim_regs, fabric_dim) },
+  { "arm_wdg_control_wcs", offsetof(struct rshim_regs, arm_wdg_control_wcs) },
+  { "scratch_buf_dat", offsetof(struct rshim_regs, scratch_buf_dat) },
+  { "scratch_buf_ctl", offsetof(struct rshim_regs, scratch_buf_ctl) },
+};
+
+#define RSHIM_LEASE_NUM(t)      (sizeof(t) / sizeof((t)[0]))
+
+/* Offset of a register in the register map of a chip. */
+#define RSHIM_LEASE_REG(regs, off) \
+  (*(const uint32_t *)((const uint8_t *)(regs) + (off)))
+
+typedef struct {
+  int fd;
+  uint32_t read_mask;                   /* allow-list entries read */
+  uint32_t write_mask;                  /* allow-list entries written */
+} rshim_lease_client_t;
+
+struct rshim_lease {
+  int sock_fd;
+  rshim_lease_client_t client[RSHIM_LEASE_MAX_CLIENTS];
+
+  /* Allow-list entries resolved for the device. */
+  struct {
+    uint32_t chan;
+    uint32_t addr;
+    bool write;
+  } reg[RSHIM_LEASE_MAX_ALLOW];
+
+  /* Allow-list entries leased by any client. */
+  volatile uint32_t leased;
+
+  uint64_t grants;
+  uint64_t paused;
+
+  /* Backend APIs wrapped to pause the accesses to the leased registers. */
+  int (*read_rshim)(rshim_backend_t *bd, uint32_t chan, uint32_t addr,
+                    uint64_t *value, int size);
+  int (*write_rshim)(rshim_backend_t *bd, uint32_t chan, uint32_t addr,
+                     uint64_t value, int size);
+  int (*write_rshim_posted)(rshim_backend_t *bd, uint32_t chan, uint32_t addr,
+                            uint64_t value, int size);
+};
+
+/* Check whether a register of a chip is used by the daemon. */
+static bool rshim_lease_is_reserved(const struct rshim_regs *regs,
+                                    uint32_t chan, uint32_t addr)
+{
+  uint32_t off;
+  int i;
+
+  if (chan != RSHIM_CHANNEL)
+    return false;
+
+  for (i = 0; i < RSHIM_LEASE_NUM(rshim_lease_reserved); i++) {
+    if (addr == RSHIM_LEASE_REG(regs, rshim_lease_reserved[i].off))
+      return true;
+  }
+
+  /* The scratchpads of the mailbox. */
+  if (rshim_mbox_enable) {
+    off = addr - regs->scratchpad1;
+    if (off >= RSHIM_MBOX_H2D_DATA && off <= RSHIM_MBOX_D2H_CTL)
+      return true;
+  }
+
+  return false;
+}
+
+/*
+ * Resolve a register name of a chip to its channel and offset. Returns
+ * -EPERM for the registers used by the daemon.
+ */
+static int rshim_lease_resolve(const struct rshim_regs *regs,
+                               const char *name, uint32_t *chan,
+                               uint32_t *addr)
+{
+  unsigned long c, a;
+  char *end;
+  int i;
+
+  for (i = 0; i < RSHIM_LEASE_NUM(rshim_lease_reserved); i++) {
+    if (!strcmp(name, rshim_lease_reserved[i].name))
+      return -EPERM;
+  }
+
+  for (i = 0; i < RSHIM_LEASE_NUM(rshim_lease_names); i++) {
+    if (!strcmp(name, rshim_lease_names[i].name)) {
+      c = RSHIM_CHANNEL;
+      a = RSHIM_LEASE_REG(regs, rshim_lease_names[i].off);
+      goto found;
+    }
+  }
+
+  c = strtoul(name, &end, 0);
+  if (end == name || *end != ':')
+    return -EINVAL;
+  name = end + 1;
+  a = strtoul(name, &end, 0);
+  if (end == name || *end || c > 0xffff || a > 0xffff || (a & 7))
+    return -EINVAL;
+
+found:
+  if (rshim_lease_is_reserved(regs, c, a))
+    return -EPERM;
+
+  *chan = c;
+  *addr = a;
+  return 0;
+}
+
+/* Add a register from the configuration file. */
+int rshim_lease_add(const char *name, bool write)
+{
+  uint32_t chan, addr;
+  int rc;
+
+  rc = strlen(name) < RSHIM_LEASE_NAME_LEN ?
+       rshim_lease_resolve(&bf1_bf2_rshim_regs, name, &chan, &addr) : -EINVAL;
+  if (rc == -EPERM) {
+    RSHIM_WARN("lease register '%s': used by the driver\n", name);
+    return rc;
+  } else if (rc) {
+    RSHIM_WARN("lease register '%s': unknown register\n", name);
+    return rc;
+  }
+
+  if (rshim_lease_allow_num == RSHIM_LEASE_MAX_ALLOW) {
+    RSHIM_WARN("lease register '%s': too many registers\n", name);
+    return -ENOSPC;
+  }
+
+  strcpy(rshim_lease_allow[rshim_lease_allow_num].name, name);
+  rshim_lease_allow[rshim_lease_allow_num].write = write;
+  rshim_lease_allow_num++;
+
+  return 0;
+}
+
+/* Check whether an access hits a leased register, and count it if so. */
+static bool rshim_lease_busy(struct rshim_lease *ls, uint32_t chan,
+                             uint32_t addr)
+{
+  uint32_t mask = ls->leased;
+  int i;
+
+  addr &= ~7U;
+  while (mask) {
+    i = __builtin_ctz(mask);
+    mask &= mask - 1;
+    if (ls->reg[i].chan == chan && ls->reg[i].addr == addr) {
+      __sync_fetch_and_add(&ls->paused, 1);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static int rshim_lease_read_rshim(rshim_backend_t *bd, uint32_t chan,
+                                  uint32_t addr, uint64_t *value, int size)
+{
+  struct rshim_lease *ls = bd->lease;
+
+  if (ls->leased && rshim_lease_busy(ls, chan, addr)) {
+    *value = 0;
+    return -EBUSY;
+  }
+
+  return ls->read_rshim(bd, chan, addr, value, size);
+}
+
+static int rshim_lease_write_rshim(rshim_backend_t *bd, uint32_t chan,
+                                   uint32_t addr, uint64_t value, int size)
+{
+  struct rshim_lease *ls = bd->lease;
+
+  if (ls->leased && rshim_lease_busy(ls, chan, addr))
+    return -EBUSY;
+
+  return ls->write_rshim(bd, chan, addr, value, size);
+}
+
+static int rshim_lease_write_rshim_posted(rshim_backend_t *bd, uint32_t chan,
+                                          uint32_t addr, uint64_t value,
+                                          int size)
+{
+  struct rshim_lease *ls = bd->lease;
+
+  if (ls->leased && rshim_lease_busy(ls, chan, addr))
+    return -EBUSY;
+
+  return ls->write_rshim_posted(bd, chan, addr, value, size);
+}
+
+static void rshim_lease_epoll_ctl(rshim_backend_t *bd, int op, int fd,
+                                  uint32_t events)
+{
+  struct epoll_event event;
+
+  memset(&event, 0, sizeof(event));
+  event.data.u64 = RSHIM_EPOLL_DATA(RSHIM_EPOLL_LEASE, bd->index, fd);
+  event.events = events;
+  if (epoll_ctl(rshim_epoll_fd, op, fd, &event) == -1 && op != EPOLL_CTL_DEL)
+    RSHIM_ERR("epoll_ctl failed: %d %d\n", rshim_epoll_fd, fd);
+}
+
+/* Recompute the leased registers. Called with the device mutex held. */
+static void rshim_lease_update(struct rshim_lease *ls)
+{
+  uint32_t leased = 0;
+  int i;
+
+  for (i = 0; i < RSHIM_LEASE_MAX_CLIENTS; i++)
+    leased |= ls->client[i].read_mask | ls->client[i].write_mask;
+
+  ls->leased = leased;
+}
+
+/*
+ * Check a request and take the registers for a client. Called with the
+ * device mutex held.
+ */
+static int rshim_lease_grant(rshim_backend_t *bd, int idx,
+                             const rshim_lease_req_t *req,
+                             rshim_lease_rsp_t *rsp, int *bar_fd)
+{
+  struct rshim_lease *ls = bd->lease;
+  rshim_lease_client_t *cl = &ls->client[idx];
+  uint32_t read_mask = 0, write_mask = 0, others = 0, others_write = 0;
+  uint32_t chan, addr;
+  rshim_bar_info_t bar;
+  char name[RSHIM_LEASE_NAME_LEN];
+  int64_t off;
+  int i, j, rc;
+
+  if (req->magic != RSHIM_LEASE_MAGIC || req->version != RSHIM_LEASE_VERSION ||
+      !req->count || req->count > RSHIM_LEASE_MAX_REGS)
+    return -EINVAL;
+
+  /* One lease per connection. */
+  if (cl->read_mask || cl->write_mask)
+    return -EALREADY;
+
+  if (!bd->get_bar || !bd->bar_offset)
+    return -EOPNOTSUPP;
+
+  if (bd->drop_mode || !bd->has_rshim)
+    return -ENODEV;
+
+  for (i = 0; i < RSHIM_LEASE_MAX_CLIENTS; i++) {
+    if (i == idx)
+      continue;
+    others |= ls->client[i].read_mask | ls->client[i].write_mask;
+    others_write |= ls->client[i].write_mask;
+  }
+
+  for (i = 0; i < req->count; i++) {
+    memcpy(name, req->reg[i].name, sizeof(name));
+    name[sizeof(name) - 1] = 0;
+    rc = rshim_lease_resolve(bd->regs, name, &chan, &addr);
+    if (rc == -EPERM) {
+      RSHIM_DBG("rshim%d lease of '%s' used by the driver\n", bd->index, name);
+      return -EACCES;
+    } else if (rc) {
+      return rc;
+    }
+
+    for (j = 0; j < rshim_lease_allow_num; j++) {
+      if (ls->reg[j].chan == chan && ls->reg[j].addr == addr &&
+          (ls->reg[j].write || !(req->reg[i].flags & RSHIM_LEASE_WRITE)))
+        break;
+    }
+    if (j == rshim_lease_allow_num) {
+      RSHIM_DBG("rshim%d lease of '%s' not allowed\n", bd->index, name);
+      return -EACCES;
+    }
+
+    if (req->reg[i].flags & RSHIM_LEASE_WRITE) {
+      if (others & (1U << j))
+        return -EBUSY;
+      write_mask |= 1U << j;
+    } else {
+      if (others_write & (1U << j))
+        return -EBUSY;
+      read_mask |= 1U << j;
+    }
+
+    off = bd->bar_offset(bd, chan, addr);
+    if (off < 0)
+      return -ERANGE;
+    rsp->offset[i] = off;
+  }
+
+  rc = bd->get_bar(bd, &bar);
+  if (rc)
+    return rc;
+
+  cl->read_mask = read_mask & ~write_mask;
+  cl->write_mask = write_mask;
+  rshim_lease_update(ls);
+  ls->grants++;
+
+  rsp->ver_id = bd->ver_id;
+  rsp->count = req->count;
+  rsp->map_offset = bar.map_offset;
+  rsp->bar_size = bar.size;
+  *bar_fd = bar.fd;
+
+  return 0;
+}
+
+static void rshim_lease_close_client(rshim_backend_t *bd, int idx)
+{
+  struct rshim_lease *ls = bd->lease;
+  rshim_lease_client_t *cl = &ls->client[idx];
+  bool released;
+
+  pthread_mutex_lock(&bd->mutex);
+  released = cl->read_mask || cl->write_mask;
+  cl->read_mask = 0;
+  cl->write_mask = 0;
+  rshim_lease_update(ls);
+  pthread_mutex_unlock(&bd->mutex);
+
+  if (released)
+    RSHIM_INFO("rshim%d register lease released\n", bd->index);
+
+  rshim_lease_epoll_ctl(bd, EPOLL_CTL_DEL, cl->fd, 0);
+  close(cl->fd);
+  cl->fd = -1;
+}
+
+static void rshim_lease_client_rx(rshim_backend_t *bd, int idx)
+{
+  struct rshim_lease *ls = bd->lease;
+  char cbuf[CMSG_SPACE(sizeof(int))];
+  rshim_lease_req_t req;
+  rshim_lease_rsp_t rsp;
+  struct cmsghdr *cmsg;
+  struct msghdr msg;
+  struct iovec iov;
+  int bar_fd = -1;
+  ssize_t len;
+
+  len = recv(ls->client[idx].fd, &req, sizeof(req), MSG_DONTWAIT);
+  if (len < 0 && (errno == EAGAIN || errno == EINTR))
+    return;
+
+  if (len <= 0) {
+    rshim_lease_close_client(bd, idx);
+    return;
+  }
+
+  memset(&rsp, 0, sizeof(rsp));
+  rsp.magic = RSHIM_LEASE_MAGIC;
+  if (len != sizeof(req)) {
+    rsp.status = -EINVAL;
+  } else {
+    pthread_mutex_lock(&bd->mutex);
+    rsp.status = rshim_lease_grant(bd, idx, &req, &rsp, &bar_fd);
+    pthread_mutex_unlock(&bd->mutex);
+  }
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = &rsp;
+  iov.iov_len = sizeof(rsp);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (bar_fd >= 0) {
+    memset(cbuf, 0, sizeof(cbuf));
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &bar_fd, sizeof(int));
+  }
+
+  if (sendmsg(ls->client[idx].fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) !=
+      sizeof(rsp)) {
+    rshim_lease_close_client(bd, idx);
+    return;
+  }
+
+  if (rsp.status)
+    RSHIM_DBG("rshim%d register lease refused: %d\n", bd->index, rsp.status);
+  else
+    RSHIM_INFO("rshim%d register lease granted (%u registers)\n", bd->index,
+               rsp.count);
+}
+
+static void rshim_lease_accept(rshim_backend_t *bd)
+{
+  struct rshim_lease *ls = bd->lease;
+  int fd, i;
+
+  fd = accept4(ls->sock_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (fd < 0)
+    return;
+
+  for (i = 0; i < RSHIM_LEASE_MAX_CLIENTS; i++) {
+    if (ls->client[i].fd < 0) {
+      ls->client[i].fd = fd;
+      rshim_lease_epoll_ctl(bd, EPOLL_CTL_ADD, fd, EPOLLIN | EPOLLRDHUP);
+      return;
+    }
+  }
+
+  RSHIM_WARN("rshim%d too many lease clients\n", bd->index);
+  close(fd);
+}
+
+/* Handle an epoll event. Returns true if the fd belongs to the leases. */
+bool rshim_lease_event(rshim_backend_t *bd, int fd, uint32_t events)
+{
+  struct rshim_lease *ls = bd->lease;
+  int i;
+
+  if (!ls)
+    return false;
+
+  if (fd == ls->sock_fd) {
+    rshim_lease_accept(bd);
+    return true;
+  }
+
+  for (i = 0; i < RSHIM_LEASE_MAX_CLIENTS; i++) {
+    if (fd != ls->client[i].fd)
+      continue;
+
+    if (events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+      rshim_lease_close_client(bd, i);
+    else if (events & EPOLLIN)
+      rshim_lease_client_rx(bd, i);
+    return true;
+  }
+
+  return false;
+}
+
+/*
+ * End all the leases, such as before the BAR is unmapped. The connections
+ * are shut down so the clients see it, and closed by the main loop. Called
+ * with the device mutex held.
+ */
+void rshim_lease_revoke(rshim_backend_t *bd)
+{
+  struct rshim_lease *ls = bd->lease;
+  int i;
+
+  if (!ls || !ls->leased)
+    return;
+
+  for (i = 0; i < RSHIM_LEASE_MAX_CLIENTS; i++) {
+    if (ls->client[i].read_mask || ls->client[i].write_mask)
+      shutdown(ls->client[i].fd, SHUT_RDWR);
+    ls->client[i].read_mask = 0;
+    ls->client[i].write_mask = 0;
+  }
+  ls->leased = 0;
+
+  RSHIM_INFO("rshim%d register leases revoked\n", bd->index);
+}
+
+/* Lease counters for the misc file. */
+int rshim_lease_show(rshim_backend_t *bd, char *buf, int len)
+{
+  struct rshim_lease *ls = bd->lease;
+  int i, n, clients = 0;
+
+  if (!ls || len <= 0)
+    return 0;
+
+  for (i = 0; i < RSHIM_LEASE_MAX_CLIENTS; i++) {
+    if (ls->client[i].read_mask || ls->client[i].write_mask)
+      clients++;
+  }
+
+  n = snprintf(buf, len, "%-16sleases %d regs 0x%x grants %llu paused %llu\n",
+               "LEASE", clients, ls->leased, (unsigned long long)ls->grants,
+               (unsigned long long)ls->paused);
+
+  return MIN(n, len - 1);
+}
+
+static void rshim_lease_path(rshim_backend_t *bd, char *path, int len)
+{
+  snprintf(path, len, "%s/rshim%d.lease", RSHIM_CONS_SOCK_DIR, bd->index);
+}
+
+/*
+ * Listen for the lease requests and wrap the register accessors. Called
+ * from rshim_register() after the other wrappers are installed.
+ */
+int rshim_lease_init(rshim_backend_t *bd)
+{
+  struct sockaddr_un addr;
+  struct rshim_lease *ls;
+  int i, j, rc;
+
+  if (!rshim_lease_allow_num || !bd->get_bar || bd->lease)
+    return 0;
+
+  ls = calloc(1, sizeof(*ls));
+  if (!ls)
+    return -ENOMEM;
+  for (i = 0; i < RSHIM_LEASE_MAX_CLIENTS; i++)
+    ls->client[i].fd = -1;
+
+  /*
+   * Resolve the allow-list for the chip. An entry for a register listed
+   * before, or used by the daemon on this chip, is disabled with an
+   * unaligned offset, which is never matched; the former is merged into
+   * the first one.
+   */
+  for (i = 0; i < rshim_lease_allow_num; i++) {
+    if (rshim_lease_resolve(bd->regs, rshim_lease_allow[i].name,
+                            &ls->reg[i].chan, &ls->reg[i].addr)) {
+      RSHIM_WARN("rshim%d lease register '%s' not available\n", bd->index,
+                 rshim_lease_allow[i].name);
+      ls->reg[i].addr = 1;
+      continue;
+    }
+    ls->reg[i].write = rshim_lease_allow[i].write;
+    for (j = 0; j < i; j++) {
+      if (ls->reg[j].chan == ls->reg[i].chan &&
+          ls->reg[j].addr == ls->reg[i].addr) {
+        ls->reg[j].write |= ls->reg[i].write;
+        ls->reg[i].addr = 1;
+        break;
+      }
+    }
+  }
+
+  if (mkdir(RSHIM_CONS_SOCK_DIR, 0755) && errno != EEXIST) {
+    RSHIM_ERR("Failed to create %s: %m\n", RSHIM_CONS_SOCK_DIR);
+    rc = -errno;
+    goto fail;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  rshim_lease_path(bd, addr.sun_path, sizeof(addr.sun_path));
+  unlink(addr.sun_path);
+
+  ls->sock_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                       0);
+  if (ls->sock_fd < 0) {
+    RSHIM_ERR("socket failed: %m\n");
+    rc = -errno;
+    goto fail;
+  }
+
+  if (bind(ls->sock_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+      chmod(addr.sun_path, 0600) ||
+      listen(ls->sock_fd, RSHIM_LEASE_MAX_CLIENTS)) {
+    RSHIM_ERR("Failed to listen on %s: %m\n", addr.sun_path);
+    rc = -errno;
+    close(ls->sock_fd);
+    unlink(addr.sun_path);
+    goto fail;
+  }
+
+  ls->read_rshim = bd->read_rshim;
+  ls->write_rshim = bd->write_rshim;
+  ls->write_rshim_posted = bd->write_rshim_posted;
+
+  bd->lease = ls;
+  __sync_synchronize();
+
+  bd->read_rshim = rshim_lease_read_rshim;
+  bd->write_rshim = rshim_lease_write_rshim;
+  if (ls->write_rshim_posted)
+    bd->write_rshim_posted = rshim_lease_write_rshim_posted;
+
+  rshim_lease_epoll_ctl(bd, EPOLL_CTL_ADD, ls->sock_fd, EPOLLIN);
+
+  return 0;
+
+fail:
+  free(ls);
+  return rc;
+}
+
+/* Stop the leases. Called from rshim_deregister(). */
+void rshim_lease_del(rshim_backend_t *bd)
+{
+  struct rshim_lease *ls = bd->lease;
+  char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+  int i;
+
+  if (!ls)
+    return;
+
+  bd->read_rshim = ls->read_rshim;
+  bd->write_rshim = ls->write_rshim;
+  bd->write_rshim_posted = ls->write_rshim_posted;
+  __sync_synchronize();
+
+  for (i = 0; i < RSHIM_LEASE_MAX_CLIENTS; i++) {
+    if (ls->client[i].fd >= 0) {
+      rshim_lease_epoll_ctl(bd, EPOLL_CTL_DEL, ls->client[i].fd, 0);
+      close(ls->client[i].fd);
+    }
+  }
+  rshim_lease_epoll_ctl(bd, EPOLL_CTL_DEL, ls->sock_fd, 0);
+  close(ls->sock_fd);
+  rshim_lease_path(bd, path, sizeof(path));
+  unlink(path);
+
+  bd->lease = NULL;
+  free(ls);
+}
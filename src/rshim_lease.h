@@ -0,0 +1,57 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Copyright (C) 2019 Mellanox Technologies. All Rights Reserved.
+ *
+ */
+
+#ifndef _RSHIM_LEASE_H
+#define _RSHIM_LEASE_H
+
+#include <stdint.h>
+
+/*
+ * Register lease protocol, shared by the daemon and librshim.
+ *
+ * A client connects to the SOCK_SEQPACKET socket rshim<N>.lease and sends
+ * one request naming the registers it wants, each either by name (such as
+ * "uptime" or "scratchpad1", resolved for the chip of the device) or as
+ * "<channel>:<offset>". If all of them are on the LEASE_REG allow-list of
+ * the daemon, the reply carries the BAR offset of each register and the
+ * file descriptor of the BAR as SCM_RIGHTS, so the client can map it and
+ * access the registers directly. The daemon doesn't access the leased
+ * registers itself until the lease ends, which is when the client closes
+ * the connection.
+ */
+
+#define RSHIM_LEASE_MAGIC       0x45534c52      /* "RLSE" */
+#define RSHIM_LEASE_VERSION     1
+#define RSHIM_LEASE_MAX_REGS    16
+#define RSHIM_LEASE_NAME_LEN    24
+
+/* Register flags. */
+#define RSHIM_LEASE_WRITE       0x1     /* register is written too */
+
+typedef struct {
+  char name[RSHIM_LEASE_NAME_LEN];      /* name or "<channel>:<offset>" */
+  uint32_t flags;
+  uint32_t rsvd;
+} rshim_lease_reg_t;
+
+typedef struct {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t count;
+  rshim_lease_reg_t reg[RSHIM_LEASE_MAX_REGS];
+} rshim_lease_req_t;
+
+typedef struct {
+  uint32_t magic;
+  int32_t status;                       /* 0 or -errno */
+  uint32_t ver_id;                      /* BlueField version */
+  uint32_t count;
+  uint64_t map_offset;                  /* mmap offset of the BAR in the fd */
+  uint64_t bar_size;
+  uint64_t offset[RSHIM_LEASE_MAX_REGS];        /* BAR offset per register */
+} rshim_lease_rsp_t;
+
+#endif /* _RSHIM_LEASE_H */
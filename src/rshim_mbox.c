@@ -0,0 +1,393 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2019 Mellanox Technologies. All Rights Reserved.
+ *
+ */
+
+#define _GNU_SOURCE     /* for ppoll() */
+#include <poll.h>
+#include <pthread.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "rshim.h"
+
+/*
+ * Host side of the scratchpad mailbox (see rshim_mbox.h).
+ *
+ * With "MAILBOX 1", each device has a thread polling the DPU-to-host
+ * control word every MAILBOX_POLL_INTERVAL microseconds (0 to busy-poll)
+ * and serving the SOCK_SEQPACKET socket RSHIM_CONS_SOCK_DIR/rshim<N>.mbox,
+ * where each packet is a rshim_mbox_msg_t. Messages written by the clients
+ * are sent to the DPU and the messages from the DPU are sent to all the
+ * clients. The registers are only accessed with the device mutex held; the
+ * thread skips a poll instead of waiting while the device is busy, and backs
+ * off while it stays busy. The interval is raised to the backend minimum
+ * (reg_poll_min), as each poll still holds the mutex for a few register
+ * accesses, which are slow control transfers on USB.
+ *
+ * A client too slow to take a message from the DPU loses it, and a client
+ * sending a malformed message is closed. Both, and the messages that could
+ * not be sent to the DPU, are counted in the misc file.
+ */
+
+#define RSHIM_MBOX_MAX_CLIENTS  8
+
+/* Backoff while the device mutex is busy, in us. */
+#define RSHIM_MBOX_MIN_BACKOFF  16
+#define RSHIM_MBOX_MAX_BACKOFF  20000
+
+struct rshim_mbox {
+  pthread_t thread;
+  volatile bool stop;
+
+  int sock_fd;
+  int client_fd[RSHIM_MBOX_MAX_CLIENTS];
+
+  /* Protocol state, protected by the device mutex. */
+  bool synced;
+  rshim_mbox_ep_t ep;
+
+  /* Client message waiting for the DPU to take the previous one. */
+  bool has_pending;
+  rshim_mbox_msg_t pending;
+
+  uint64_t tx_count;
+  uint64_t rx_count;
+  uint64_t tx_errors;             /* Client messages not sent to the DPU. */
+  uint64_t rx_dropped;            /* DPU messages lost by slow clients. */
+  time_t last_rx_time;
+};
+
+bool rshim_mbox_enable;
+int rshim_mbox_poll_interval = 20;
+
+static int rshim_mbox_read_reg(void *ctx, uint32_t off, uint64_t *value)
+{
+  rshim_backend_t *bd = ctx;
+
+  return bd->read_rshim(bd, RSHIM_CHANNEL, off, value, RSHIM_REG_SIZE_8B);
+}
+
+static int rshim_mbox_write_reg(void *ctx, uint32_t off, uint64_t value)
+{
+  rshim_backend_t *bd = ctx;
+
+  return bd->write_rshim(bd, RSHIM_CHANNEL, off, value, RSHIM_REG_SIZE_8B);
+}
+
+/* Set up the host end of the mailbox. Called with the device mutex held. */
+static int rshim_mbox_sync(rshim_backend_t *bd)
+{
+  struct rshim_mbox *mb = bd->mbox;
+  int rc;
+
+  rshim_mbox_ep_init(&mb->ep, false, bd->regs->scratchpad1, bd,
+                     rshim_mbox_read_reg, rshim_mbox_write_reg);
+  rc = rshim_mbox_ep_sync(&mb->ep);
+  if (!rc)
+    mb->synced = true;
+
+  return rc;
+}
+
+/*
+ * Send a message to the DPU. Returns -EBUSY if the previous message hasn't
+ * been taken yet. Called with the device mutex held.
+ */
+int rshim_mbox_send(rshim_backend_t *bd, const rshim_mbox_msg_t *msg)
+{
+  struct rshim_mbox *mb = bd->mbox;
+  int rc;
+
+  if (!mb || !mb->synced)
+    return -ENODEV;
+
+  rc = rshim_mbox_ep_send(&mb->ep, msg);
+  if (!rc)
+    mb->tx_count++;
+
+  return rc;
+}
+
+/*
+ * Receive a message from the DPU and acknowledge it. Returns 1 if a message
+ * was received. Called with the device mutex held.
+ */
+int rshim_mbox_recv(rshim_backend_t *bd, rshim_mbox_msg_t *msg)
+{
+  struct rshim_mbox *mb = bd->mbox;
+  int rc;
+
+  if (!mb || !mb->synced)
+    return -ENODEV;
+
+  rc = rshim_mbox_ep_recv(&mb->ep, msg);
+  if (rc > 0) {
+    mb->rx_count++;
+    mb->last_rx_time = rshim_mono_time();
+  }
+
+  return rc;
+}
+
+static void rshim_mbox_accept(rshim_backend_t *bd)
+{
+  struct rshim_mbox *mb = bd->mbox;
+  int fd, i;
+
+  fd = accept(mb->sock_fd, NULL, NULL);
+  if (fd < 0)
+    return;
+
+  for (i = 0; i < RSHIM_MBOX_MAX_CLIENTS; i++) {
+    if (mb->client_fd[i] < 0) {
+      mb->client_fd[i] = fd;
+      return;
+    }
+  }
+
+  RSHIM_WARN("rshim%d too many mailbox clients\n", bd->index);
+  close(fd);
+}
+
+static void rshim_mbox_client_rx(rshim_backend_t *bd, int idx)
+{
+  struct rshim_mbox *mb = bd->mbox;
+  ssize_t len;
+
+  len = recv(mb->client_fd[idx], &mb->pending, sizeof(mb->pending),
+             MSG_DONTWAIT);
+  if (len < 0 && (errno == EAGAIN || errno == EINTR))
+    return;
+
+  if (len <= 0) {
+    close(mb->client_fd[idx]);
+    mb->client_fd[idx] = -1;
+    return;
+  }
+
+  if (len != sizeof(mb->pending) || mb->pending.len > RSHIM_MBOX_DATA_LEN) {
+    RSHIM_WARN("rshim%d bad mailbox message, closing client\n", bd->index);
+    close(mb->client_fd[idx]);
+    mb->client_fd[idx] = -1;
+    return;
+  }
+
+  mb->has_pending = true;
+}
+
+static void rshim_mbox_deliver(rshim_backend_t *bd, rshim_mbox_msg_t *msg)
+{
+  struct rshim_mbox *mb = bd->mbox;
+  int i;
+
+  for (i = 0; i < RSHIM_MBOX_MAX_CLIENTS; i++) {
+    if (mb->client_fd[i] < 0)
+      continue;
+    if (send(mb->client_fd[i], msg, sizeof(*msg),
+             MSG_DONTWAIT | MSG_NOSIGNAL) >= 0)
+      continue;
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      mb->rx_dropped++;
+      RSHIM_DBG("rshim%d mailbox client %d full, message dropped\n",
+                bd->index, i);
+    } else {
+      RSHIM_DBG("rshim%d mailbox client %d send failed: %m\n", bd->index, i);
+      close(mb->client_fd[i]);
+      mb->client_fd[i] = -1;
+    }
+  }
+}
+
+static void *rshim_mbox_thread(void *arg)
+{
+  rshim_backend_t *bd = arg;
+  struct rshim_mbox *mb = bd->mbox;
+  struct pollfd fds[RSHIM_MBOX_MAX_CLIENTS + 1];
+  int idx[RSHIM_MBOX_MAX_CLIENTS + 1];
+  rshim_mbox_msg_t msg;
+  struct timespec ts;
+  int i, n, rc, got, interval, delay;
+
+  interval = MAX(rshim_mbox_poll_interval, bd->reg_poll_min);
+  delay = interval;
+
+  while (!mb->stop && rshim_run) {
+    ts.tv_sec = delay / 1000000;
+    ts.tv_nsec = (delay % 1000000) * 1000;
+
+    /* Don't take more input until the pending message is sent. */
+    fds[0].fd = mb->sock_fd;
+    fds[0].events = POLLIN;
+    n = 1;
+    for (i = 0; i < RSHIM_MBOX_MAX_CLIENTS; i++) {
+      if (mb->client_fd[i] < 0)
+        continue;
+      fds[n].fd = mb->client_fd[i];
+      fds[n].events = mb->has_pending ? 0 : POLLIN;
+      idx[n++] = i;
+    }
+
+    rc = ppoll(fds, n, &ts, NULL);
+    if (rc > 0) {
+      if (fds[0].revents & POLLIN)
+        rshim_mbox_accept(bd);
+      for (i = 1; i < n; i++) {
+        if (fds[i].revents && !mb->has_pending)
+          rshim_mbox_client_rx(bd, idx[i]);
+        else if (fds[i].revents & (POLLERR | POLLHUP)) {
+          close(mb->client_fd[idx[i]]);
+          mb->client_fd[idx[i]] = -1;
+        }
+      }
+    }
+
+    if (pthread_mutex_trylock(&bd->mutex)) {
+      delay = MIN(MAX(delay * 2, RSHIM_MBOX_MIN_BACKOFF),
+                  MAX(interval, RSHIM_MBOX_MAX_BACKOFF));
+      continue;
+    }
+    delay = interval;
+
+    got = 0;
+    if (bd->has_rshim && !bd->drop_mode &&
+        (mb->synced || !rshim_mbox_sync(bd))) {
+      if (mb->has_pending) {
+        rc = rshim_mbox_send(bd, &mb->pending);
+        if (rc != -EBUSY) {
+          mb->has_pending = false;
+          if (rc) {
+            mb->tx_errors++;
+            RSHIM_WARN("rshim%d mailbox send failed %d\n", bd->index, rc);
+          }
+        }
+      }
+      got = rshim_mbox_recv(bd, &msg);
+    }
+
+    pthread_mutex_unlock(&bd->mutex);
+
+    if (got > 0)
+      rshim_mbox_deliver(bd, &msg);
+  }
+
+  return NULL;
+}
+
+/* Mailbox counters for the misc file. */
+int rshim_mbox_show(rshim_backend_t *bd, char *buf, int len)
+{
+  struct rshim_mbox *mb = bd->mbox;
+  int n;
+
+  if (!mb || len <= 0)
+    return 0;
+
+  n = snprintf(buf, len, "%-16stx %llu rx %llu tx_err %llu rx_drop %llu",
+               "MAILBOX", (unsigned long long)mb->tx_count,
+               (unsigned long long)mb->rx_count,
+               (unsigned long long)mb->tx_errors,
+               (unsigned long long)mb->rx_dropped);
+  if (n < len && mb->last_rx_time)
+    n += snprintf(buf + n, len - n, " (last rx %llds ago)",
+                  (long long)(rshim_mono_time() - mb->last_rx_time));
+  if (n < len)
+    n += snprintf(buf + n, len - n, "\n");
+
+  return MIN(n, len - 1);
+}
+
+static void rshim_mbox_path(rshim_backend_t *bd, char *path, int len)
+{
+  snprintf(path, len, "%s/rshim%d.mbox", RSHIM_CONS_SOCK_DIR, bd->index);
+}
+
+int rshim_mbox_init(rshim_backend_t *bd)
+{
+  struct sockaddr_un addr;
+  struct rshim_mbox *mb;
+  int i, rc;
+
+  if (!rshim_mbox_enable || bd->mbox)
+    return 0;
+
+  mb = calloc(1, sizeof(*mb));
+  if (!mb)
+    return -ENOMEM;
+  for (i = 0; i < RSHIM_MBOX_MAX_CLIENTS; i++)
+    mb->client_fd[i] = -1;
+
+  if (mkdir(RSHIM_CONS_SOCK_DIR, 0755) && errno != EEXIST) {
+    RSHIM_ERR("Failed to create %s: %m\n", RSHIM_CONS_SOCK_DIR);
+    rc = -errno;
+    goto fail;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  rshim_mbox_path(bd, addr.sun_path, sizeof(addr.sun_path));
+  unlink(addr.sun_path);
+
+  mb->sock_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                       0);
+  if (mb->sock_fd < 0) {
+    RSHIM_ERR("socket failed: %m\n");
+    rc = -errno;
+    goto fail;
+  }
+
+  if (bind(mb->sock_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+      chmod(addr.sun_path, 0600) ||
+      listen(mb->sock_fd, RSHIM_MBOX_MAX_CLIENTS)) {
+    RSHIM_ERR("Failed to listen on %s: %m\n", addr.sun_path);
+    rc = -errno;
+    close(mb->sock_fd);
+    unlink(addr.sun_path);
+    goto fail;
+  }
+
+  bd->mbox = mb;
+  rc = pthread_create(&mb->thread, NULL, rshim_mbox_thread, bd);
+  if (rc) {
+    RSHIM_ERR("rshim%d failed to create mailbox thread\n", bd->index);
+    bd->mbox = NULL;
+    close(mb->sock_fd);
+    unlink(addr.sun_path);
+    rc = -rc;
+    goto fail;
+  }
+  rshim_set_affinity(bd, mb->thread);
+
+  return 0;
+
+fail:
+  free(mb);
+  return rc;
+}
+
+void rshim_mbox_del(rshim_backend_t *bd)
+{
+  struct rshim_mbox *mb = bd->mbox;
+  char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+  int i;
+
+  if (!mb)
+    return;
+
+  mb->stop = true;
+  pthread_join(mb->thread, NULL);
+
+  for (i = 0; i < RSHIM_MBOX_MAX_CLIENTS; i++) {
+    if (mb->client_fd[i] >= 0)
+      close(mb->client_fd[i]);
+  }
+  close(mb->sock_fd);
+  rshim_mbox_path(bd, path, sizeof(path));
+  unlink(path);
+
+  bd->mbox = NULL;
+  free(mb);
+}
@@ -0,0 +1,237 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Copyright (C) 2019 Mellanox Technologies. All Rights Reserved.
+ *
+ */
+
+#ifndef _RSHIM_MBOX_H
+#define _RSHIM_MBOX_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef __linux__
+#include <endian.h>
+#else
+#include <sys/endian.h>
+#endif
+
+#include "rshim_regs.h"
+
+/*
+ * Mailbox over the RShim scratchpad registers, shared by the daemon and
+ * the rshim-mbox tool.
+ *
+ * Each direction has a data register carrying up to 8 bytes of payload and
+ * a control word carrying the magic, a sequence number, the sequence number
+ * of the last message consumed from the other side, the message type and
+ * length. A sender writes the data register then the control word, and
+ * could only send again once the other side has acknowledged the previous
+ * message, so one register pair is enough and there's no FIFO framing.
+ * Sequence number 0 means no message.
+ *
+ * The registers are the spare scratchpads 2 to 5, at the same offsets from
+ * scratchpad1 on all BlueField versions.
+ *
+ * The protocol is implemented once by the rshim_mbox_ep_*() helpers below,
+ * which the daemon, rshim-mbox and rshim-bench share with their own register
+ * access.
+ */
+
+#define RSHIM_MBOX_H2D_DATA     0x08    /* scratchpad2, host to DPU data */
+#define RSHIM_MBOX_H2D_CTL      0x10    /* scratchpad3, host to DPU control */
+#define RSHIM_MBOX_D2H_DATA     0x18    /* scratchpad4, DPU to host data */
+#define RSHIM_MBOX_D2H_CTL      0x20    /* scratchpad5, DPU to host control */
+
+#define RSHIM_MBOX_DATA_LEN     8
+
+/* Control word. */
+#define RSHIM_MBOX_MAGIC        0x4d42ULL       /* "MB" */
+#define RSHIM_MBOX_MAGIC_SHIFT  48
+#define RSHIM_MBOX_SEQ_SHIFT    40
+#define RSHIM_MBOX_ACK_SHIFT    32
+#define RSHIM_MBOX_TYPE_SHIFT   24
+#define RSHIM_MBOX_LEN_SHIFT    16
+
+#define RSHIM_MBOX_CTL(seq, ack, type, len) \
+  ((RSHIM_MBOX_MAGIC << RSHIM_MBOX_MAGIC_SHIFT) | \
+   ((uint64_t)(uint8_t)(seq) << RSHIM_MBOX_SEQ_SHIFT) | \
+   ((uint64_t)(uint8_t)(ack) << RSHIM_MBOX_ACK_SHIFT) | \
+   ((uint64_t)(uint8_t)(type) << RSHIM_MBOX_TYPE_SHIFT) | \
+   ((uint64_t)(uint8_t)(len) << RSHIM_MBOX_LEN_SHIFT))
+#define RSHIM_MBOX_CTL_VALID(ctl) \
+  (((ctl) >> RSHIM_MBOX_MAGIC_SHIFT) == RSHIM_MBOX_MAGIC)
+#define RSHIM_MBOX_CTL_SEQ(ctl)   ((uint8_t)((ctl) >> RSHIM_MBOX_SEQ_SHIFT))
+#define RSHIM_MBOX_CTL_ACK(ctl)   ((uint8_t)((ctl) >> RSHIM_MBOX_ACK_SHIFT))
+#define RSHIM_MBOX_CTL_TYPE(ctl)  ((uint8_t)((ctl) >> RSHIM_MBOX_TYPE_SHIFT))
+#define RSHIM_MBOX_CTL_LEN(ctl)   ((uint8_t)((ctl) >> RSHIM_MBOX_LEN_SHIFT))
+
+/* Next sequence number, skipping 0. */
+static inline uint8_t rshim_mbox_next_seq(uint8_t seq)
+{
+  return seq == 0xff ? 1 : seq + 1;
+}
+
+/* Message types; others are free for applications. */
+enum {
+  RSHIM_MBOX_TYPE_HEARTBEAT = 1,        /* data: 64-bit counter */
+  RSHIM_MBOX_TYPE_ECHO_REQ,             /* echoed back as ECHO_RSP */
+  RSHIM_MBOX_TYPE_ECHO_RSP,
+  RSHIM_MBOX_TYPE_USER = 16,
+};
+
+/* Message as exchanged with the clients of the mailbox socket. */
+typedef struct {
+  uint8_t type;
+  uint8_t len;                          /* 0 to RSHIM_MBOX_DATA_LEN */
+  uint8_t rsvd[6];
+  uint8_t data[RSHIM_MBOX_DATA_LEN];
+} rshim_mbox_msg_t;
+
+/* Physical address of the RShim block as seen from the Arm cores. */
+#define RSHIM_MBOX_BF2_BASE     0x00800000UL
+#define RSHIM_MBOX_BF3_BASE     BF3_RSH_BASE_ADDR
+
+/*
+ * One end of the mailbox. The registers are accessed with 'read' and
+ * 'write', which get 'ctx' and the register offset and return 0 or -errno.
+ */
+typedef struct {
+  void *ctx;
+  int (*read)(void *ctx, uint32_t off, uint64_t *value);
+  int (*write)(void *ctx, uint32_t off, uint64_t value);
+
+  /* Registers of this end, addressed like 'read' and 'write' do. */
+  uint32_t tx_data;
+  uint32_t tx_ctl;
+  uint32_t rx_data;
+  uint32_t rx_ctl;
+
+  /* Last message sent, and sequence number of the last one received. */
+  uint8_t tx_seq;
+  uint8_t tx_type;
+  uint8_t tx_len;
+  uint8_t rx_seq;
+} rshim_mbox_ep_t;
+
+/*
+ * Set up the host end, or the DPU end if 'dpu', with the mailbox registers
+ * at 'scratchpad1' plus their offsets.
+ */
+static inline void rshim_mbox_ep_init(rshim_mbox_ep_t *ep, bool dpu,
+                                      uint32_t scratchpad1, void *ctx,
+                                      int (*read)(void *, uint32_t,
+                                                  uint64_t *),
+                                      int (*write)(void *, uint32_t,
+                                                   uint64_t))
+{
+  memset(ep, 0, sizeof(*ep));
+  ep->ctx = ctx;
+  ep->read = read;
+  ep->write = write;
+  ep->tx_data = scratchpad1 + (dpu ? RSHIM_MBOX_D2H_DATA : RSHIM_MBOX_H2D_DATA);
+  ep->tx_ctl = scratchpad1 + (dpu ? RSHIM_MBOX_D2H_CTL : RSHIM_MBOX_H2D_CTL);
+  ep->rx_data = scratchpad1 + (dpu ? RSHIM_MBOX_H2D_DATA : RSHIM_MBOX_D2H_DATA);
+  ep->rx_ctl = scratchpad1 + (dpu ? RSHIM_MBOX_H2D_CTL : RSHIM_MBOX_D2H_CTL);
+}
+
+/*
+ * Pick up the sequence numbers left in the registers, so a restart neither
+ * replays a stale message nor waits for an ack that never comes.
+ */
+static inline int rshim_mbox_ep_sync(rshim_mbox_ep_t *ep)
+{
+  uint64_t ctl;
+  int rc;
+
+  rc = ep->read(ep->ctx, ep->tx_ctl, &ctl);
+  if (rc)
+    return rc;
+  ep->tx_seq = RSHIM_MBOX_CTL_VALID(ctl) ? RSHIM_MBOX_CTL_SEQ(ctl) : 0;
+
+  rc = ep->read(ep->ctx, ep->rx_ctl, &ctl);
+  if (rc)
+    return rc;
+  ep->rx_seq = RSHIM_MBOX_CTL_VALID(ctl) ? RSHIM_MBOX_CTL_SEQ(ctl) : 0;
+
+  ep->tx_type = 0;
+  ep->tx_len = 0;
+  return ep->write(ep->ctx, ep->tx_ctl,
+                   RSHIM_MBOX_CTL(ep->tx_seq, ep->rx_seq, 0, 0));
+}
+
+/* Send a message. Returns -EBUSY if the other end hasn't taken the last one. */
+static inline int rshim_mbox_ep_send(rshim_mbox_ep_t *ep,
+                                     const rshim_mbox_msg_t *msg)
+{
+  uint64_t ctl, data = 0;
+  uint8_t seq;
+  int rc;
+
+  if (msg->len > RSHIM_MBOX_DATA_LEN)
+    return -EINVAL;
+
+  if (ep->tx_seq) {
+    rc = ep->read(ep->ctx, ep->rx_ctl, &ctl);
+    if (rc)
+      return rc;
+    if (!RSHIM_MBOX_CTL_VALID(ctl) || RSHIM_MBOX_CTL_ACK(ctl) != ep->tx_seq)
+      return -EBUSY;
+  }
+
+  memcpy(&data, msg->data, msg->len);
+  rc = ep->write(ep->ctx, ep->tx_data, le64toh(data));
+  if (rc)
+    return rc;
+
+  seq = rshim_mbox_next_seq(ep->tx_seq);
+  rc = ep->write(ep->ctx, ep->tx_ctl,
+                 RSHIM_MBOX_CTL(seq, ep->rx_seq, msg->type, msg->len));
+  if (rc)
+    return rc;
+
+  ep->tx_seq = seq;
+  ep->tx_type = msg->type;
+  ep->tx_len = msg->len;
+  return 0;
+}
+
+/*
+ * Receive a message and acknowledge it, keeping the last message sent as
+ * is. Returns 1 if a message was received and 0 if there's none.
+ */
+static inline int rshim_mbox_ep_recv(rshim_mbox_ep_t *ep,
+                                     rshim_mbox_msg_t *msg)
+{
+  uint64_t ctl, data;
+  int rc;
+
+  rc = ep->read(ep->ctx, ep->rx_ctl, &ctl);
+  if (rc)
+    return rc;
+
+  if (!RSHIM_MBOX_CTL_VALID(ctl) || !RSHIM_MBOX_CTL_SEQ(ctl) ||
+      RSHIM_MBOX_CTL_SEQ(ctl) == ep->rx_seq)
+    return 0;
+
+  rc = ep->read(ep->ctx, ep->rx_data, &data);
+  if (rc)
+    return rc;
+
+  memset(msg, 0, sizeof(*msg));
+  msg->type = RSHIM_MBOX_CTL_TYPE(ctl);
+  msg->len = RSHIM_MBOX_CTL_LEN(ctl);
+  if (msg->len > RSHIM_MBOX_DATA_LEN)
+    msg->len = RSHIM_MBOX_DATA_LEN;
+  data = htole64(data);
+  memcpy(msg->data, &data, msg->len);
+
+  ep->rx_seq = RSHIM_MBOX_CTL_SEQ(ctl);
+  rc = ep->write(ep->ctx, ep->tx_ctl,
+                 RSHIM_MBOX_CTL(ep->tx_seq, ep->rx_seq, ep->tx_type,
+                                ep->tx_len));
+  return rc ? rc : 1;
+}
+
+#endif /* _RSHIM_MBOX_H */
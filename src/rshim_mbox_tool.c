@@ -0,0 +1,311 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2019 Mellanox Technologies. All Rights Reserved.
+ *
+ */
+
+/*
+ * rshim-mbox: send and receive scratchpad mailbox messages.
+ *
+ * On the host it's a client of the daemon's RSHIM_CONS_SOCK_DIR/rshim<N>.mbox
+ * socket. With '-D' it's the DPU side reference implementation of the
+ * protocol in rshim_mbox.h, mapping the RShim block through /dev/mem.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rshim_mbox.h"
+#include "rshim_regs.h"
+
+#ifdef __FreeBSD__
+#define RSHIM_MBOX_SOCK         "/var/run/rshim/rshim0.mbox"
+#else
+#define RSHIM_MBOX_SOCK         "/run/rshim/rshim0.mbox"
+#endif
+
+#define RSHIM_MBOX_SEND_TIMEOUT 1000    /* ms */
+
+/* Transport: the daemon socket on the host or the registers on the DPU. */
+static int (*rshim_mbox_send)(const rshim_mbox_msg_t *msg);
+static int (*rshim_mbox_recv)(rshim_mbox_msg_t *msg, int timeout_ms);
+
+static int rshim_mbox_sock = -1;
+
+static volatile uint8_t *rshim_mbox_regs;
+static int rshim_mbox_poll_us = 10;
+static rshim_mbox_ep_t rshim_mbox_ep;
+
+static uint64_t rshim_mbox_now_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static int rshim_mbox_sock_send(const rshim_mbox_msg_t *msg)
+{
+  return send(rshim_mbox_sock, msg, sizeof(*msg), 0) == sizeof(*msg) ?
+    0 : -errno;
+}
+
+static int rshim_mbox_sock_recv(rshim_mbox_msg_t *msg, int timeout_ms)
+{
+  struct pollfd pfd = { .fd = rshim_mbox_sock, .events = POLLIN };
+  ssize_t len;
+  int rc;
+
+  rc = poll(&pfd, 1, timeout_ms);
+  if (rc <= 0)
+    return rc < 0 ? -errno : 0;
+
+  len = recv(rshim_mbox_sock, msg, sizeof(*msg), 0);
+  if (len == 0)
+    return -EPIPE;
+  if (len != sizeof(*msg))
+    return len < 0 ? -errno : -EPROTO;
+
+  return 1;
+}
+
+static int rshim_mbox_sock_open(const char *path)
+{
+  struct sockaddr_un addr;
+
+  rshim_mbox_sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if (rshim_mbox_sock < 0)
+    return -errno;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+  if (connect(rshim_mbox_sock, (struct sockaddr *)&addr, sizeof(addr)))
+    return -errno;
+
+  rshim_mbox_send = rshim_mbox_sock_send;
+  rshim_mbox_recv = rshim_mbox_sock_recv;
+  return 0;
+}
+
+/* Registers, addressed from scratchpad1. */
+static int rshim_mbox_readq(void *ctx, uint32_t off, uint64_t *value)
+{
+  *value = *(volatile uint64_t *)(rshim_mbox_regs + off);
+  __sync_synchronize();
+  return 0;
+}
+
+static int rshim_mbox_writeq(void *ctx, uint32_t off, uint64_t value)
+{
+  __sync_synchronize();
+  *(volatile uint64_t *)(rshim_mbox_regs + off) = value;
+  return 0;
+}
+
+static void rshim_mbox_wait(void)
+{
+  struct timespec ts = { 0, rshim_mbox_poll_us * 1000L };
+
+  if (rshim_mbox_poll_us)
+    nanosleep(&ts, NULL);
+}
+
+/* DPU side send: wait until the host has taken the previous message. */
+static int rshim_mbox_mem_send(const rshim_mbox_msg_t *msg)
+{
+  uint64_t start = rshim_mbox_now_ms();
+  int rc;
+
+  while ((rc = rshim_mbox_ep_send(&rshim_mbox_ep, msg)) == -EBUSY) {
+    if (rshim_mbox_now_ms() - start > RSHIM_MBOX_SEND_TIMEOUT)
+      return -ETIMEDOUT;
+    rshim_mbox_wait();
+  }
+
+  return rc;
+}
+
+static int rshim_mbox_mem_recv(rshim_mbox_msg_t *msg, int timeout_ms)
+{
+  uint64_t start = rshim_mbox_now_ms();
+  int rc;
+
+  while (!(rc = rshim_mbox_ep_recv(&rshim_mbox_ep, msg))) {
+    if (timeout_ms >= 0 && rshim_mbox_now_ms() - start >= (uint64_t)timeout_ms)
+      return 0;
+    rshim_mbox_wait();
+  }
+
+  return rc;
+}
+
+static int rshim_mbox_mem_open(unsigned long base, unsigned long scratchpad1)
+{
+  unsigned long page = sysconf(_SC_PAGESIZE), addr, off;
+  void *ptr;
+  int fd;
+
+  fd = open("/dev/mem", O_RDWR | O_SYNC);
+  if (fd < 0)
+    return -errno;
+
+  addr = base + scratchpad1;
+  off = addr & (page - 1);
+  ptr = mmap(NULL, page, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+             addr & ~(page - 1));
+  close(fd);
+  if (ptr == MAP_FAILED)
+    return -errno;
+
+  /* Registers are addressed from scratchpad1. */
+  rshim_mbox_regs = (volatile uint8_t *)ptr + off;
+  rshim_mbox_ep_init(&rshim_mbox_ep, true, 0, NULL, rshim_mbox_readq,
+                     rshim_mbox_writeq);
+  rshim_mbox_ep_sync(&rshim_mbox_ep);
+
+  rshim_mbox_send = rshim_mbox_mem_send;
+  rshim_mbox_recv = rshim_mbox_mem_recv;
+  return 0;
+}
+
+static void rshim_mbox_print(const rshim_mbox_msg_t *msg)
+{
+  int i;
+
+  printf("type %u len %u data", msg->type, msg->len);
+  for (i = 0; i < msg->len; i++)
+    printf(" %02x", msg->data[i]);
+  printf("\n");
+  fflush(stdout);
+}
+
+static void print_help(void)
+{
+  printf("Usage: rshim-mbox [options] <command>\n");
+  printf("\n");
+  printf("OPTIONS:\n");
+  printf("  -s <path>  mailbox socket of the daemon (default %s)\n",
+         RSHIM_MBOX_SOCK);
+  printf("  -D         DPU side, access the registers through /dev/mem\n");
+  printf("  -3         BlueField-3 (DPU side)\n");
+  printf("  -a <addr>  physical address of the RShim block (DPU side)\n");
+  printf("  -p <us>    poll interval (DPU side, default 10, 0 to busy-poll)\n");
+  printf("  -h         help\n");
+  printf("\n");
+  printf("COMMANDS:\n");
+  printf("  send <type> <data>  send a message with up to 8 bytes of data\n");
+  printf("  recv                print the received messages\n");
+  printf("  echo                answer the echo requests\n");
+  printf("  heartbeat <ms>      send a heartbeat every <ms> milliseconds\n");
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned long base = RSHIM_MBOX_BF2_BASE, scratchpad1 = RSH_SCRATCHPAD1;
+  const char *sock = RSHIM_MBOX_SOCK;
+  bool dpu = false, bf3 = false, has_base = false;
+  rshim_mbox_msg_t msg;
+  uint64_t count = 0;
+  const char *cmd;
+  int c, rc;
+
+  while ((c = getopt(argc, argv, "3a:Dhp:s:")) != -1) {
+    switch (c) {
+    case '3':
+      bf3 = true;
+      break;
+    case 'a':
+      base = strtoul(optarg, NULL, 0);
+      has_base = true;
+      break;
+    case 'D':
+      dpu = true;
+      break;
+    case 'p':
+      rshim_mbox_poll_us = atoi(optarg);
+      break;
+    case 's':
+      sock = optarg;
+      break;
+    case 'h':
+    default:
+      print_help();
+      return c == 'h' ? 0 : 1;
+    }
+  }
+
+  if (optind >= argc) {
+    print_help();
+    return 1;
+  }
+  cmd = argv[optind];
+
+  if (bf3) {
+    scratchpad1 = BF3_RSH_SCRATCHPAD1;
+    if (!has_base)
+      base = RSHIM_MBOX_BF3_BASE;
+  }
+
+  rc = dpu ? rshim_mbox_mem_open(base, scratchpad1) :
+             rshim_mbox_sock_open(sock);
+  if (rc) {
+    fprintf(stderr, "failed to open the mailbox: %s\n", strerror(-rc));
+    return 1;
+  }
+
+  if (!strcmp(cmd, "send") && optind + 1 < argc) {
+    memset(&msg, 0, sizeof(msg));
+    msg.type = atoi(argv[optind + 1]);
+    if (optind + 2 < argc) {
+      msg.len = strnlen(argv[optind + 2], RSHIM_MBOX_DATA_LEN);
+      memcpy(msg.data, argv[optind + 2], msg.len);
+    }
+    rc = rshim_mbox_send(&msg);
+  } else if (!strcmp(cmd, "recv")) {
+    while ((rc = rshim_mbox_recv(&msg, -1)) > 0)
+      rshim_mbox_print(&msg);
+  } else if (!strcmp(cmd, "echo")) {
+    while ((rc = rshim_mbox_recv(&msg, -1)) > 0) {
+      if (msg.type != RSHIM_MBOX_TYPE_ECHO_REQ)
+        continue;
+      msg.type = RSHIM_MBOX_TYPE_ECHO_RSP;
+      rc = rshim_mbox_send(&msg);
+      if (rc)
+        break;
+    }
+  } else if (!strcmp(cmd, "heartbeat") && optind + 1 < argc) {
+    while (true) {
+      memset(&msg, 0, sizeof(msg));
+      msg.type = RSHIM_MBOX_TYPE_HEARTBEAT;
+      msg.len = sizeof(count);
+      count++;
+      memcpy(msg.data, &count, sizeof(count));
+      rc = rshim_mbox_send(&msg);
+      if (rc)
+        break;
+      usleep(atoi(argv[optind + 1]) * 1000);
+    }
+  } else {
+    print_help();
+    return 1;
+  }
+
+  if (rc < 0) {
+    fprintf(stderr, "%s: %s\n", cmd, strerror(-rc));
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,20 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Copyright (C) 2019 Mellanox Technologies. All Rights Reserved.
+ *
+ */
+
+#ifndef _RSHIM_MEM_H
+#define _RSHIM_MEM_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+/*
+ * Ioctl of the /dev/rshim<N>/mem device file, shared by the daemon and the
+ * rshim-mem tool. The file has no offset since CUSE doesn't pass it down,
+ * so the DPU physical address of the next read or write is set with it.
+ */
+#define RSHIM_IOC_MEM_SEEK      _IOW('R', 2, uint64_t)
+
+#endif /* _RSHIM_MEM_H */
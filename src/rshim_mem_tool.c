@@ -0,0 +1,193 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2019 Mellanox Technologies. All Rights Reserved.
+ *
+ */
+
+/*
+ * rshim-mem: read or write DPU memory through /dev/rshim<N>/mem.
+ *
+ * The device has no file offset (CUSE doesn't pass it down), so the DPU
+ * physical address is set with the RSHIM_IOC_MEM_SEEK ioctl and the reads
+ * and writes continue from there. The transfer rate is printed on stderr.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rshim_mem.h"
+
+#define RSHIM_MEM_DEV           "/dev/rshim0/mem"
+#define RSHIM_MEM_CHUNK         65536
+
+static double rshim_mem_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Write all of <buf>, the device may take less than asked. */
+static ssize_t rshim_mem_write_all(int fd, const char *buf, size_t len)
+{
+  size_t done = 0;
+  ssize_t n;
+
+  while (done < len) {
+    n = write(fd, buf + done, len - done);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+    if (!n)
+      return -ENOSPC;
+    done += n;
+  }
+
+  return done;
+}
+
+static int rshim_mem_xfer(int dev_fd, int file_fd, uint64_t addr,
+                          uint64_t len, bool to_dev)
+{
+  uint64_t total = 0;
+  double start, secs;
+  ssize_t n, m;
+  char *buf;
+  int rc = 0;
+
+  buf = malloc(RSHIM_MEM_CHUNK);
+  if (!buf)
+    return -ENOMEM;
+
+  if (ioctl(dev_fd, RSHIM_IOC_MEM_SEEK, &addr) < 0) {
+    rc = -errno;
+    goto done;
+  }
+
+  start = rshim_mem_now();
+  while (to_dev || total < len) {
+    n = RSHIM_MEM_CHUNK;
+    if (!to_dev && len - total < (uint64_t)n)
+      n = len - total;
+
+    n = read(to_dev ? file_fd : dev_fd, buf, n);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      rc = -errno;
+      break;
+    }
+    if (!n)
+      break;
+
+    m = rshim_mem_write_all(to_dev ? dev_fd : file_fd, buf, n);
+    if (m < 0) {
+      rc = m;
+      break;
+    }
+    total += n;
+  }
+  secs = rshim_mem_now() - start;
+
+  fprintf(stderr, "%" PRIu64 " bytes in %.3f s, %.3f MB/s\n", total, secs,
+          secs > 0 ? total / secs / 1e6 : 0.0);
+
+done:
+  free(buf);
+  return rc;
+}
+
+static void print_help(void)
+{
+  printf("Usage: rshim-mem [options] <command>\n");
+  printf("\n");
+  printf("OPTIONS:\n");
+  printf("  -d <path>  memory device (default %s)\n", RSHIM_MEM_DEV);
+  printf("  -h         help\n");
+  printf("\n");
+  printf("COMMANDS:\n");
+  printf("  read <addr> <len> [file]  read <len> bytes at DPU address <addr>\n"
+         "                            to <file> or stdout\n");
+  printf("  write <addr> [file]       write <file> or stdin at DPU address "
+         "<addr>\n");
+}
+
+int main(int argc, char *argv[])
+{
+  const char *dev = RSHIM_MEM_DEV, *cmd, *file = NULL;
+  int c, rc, dev_fd, file_fd;
+  bool to_dev;
+  uint64_t addr, len = 0;
+
+  while ((c = getopt(argc, argv, "d:h")) != -1) {
+    switch (c) {
+    case 'd':
+      dev = optarg;
+      break;
+    case 'h':
+    default:
+      print_help();
+      return c == 'h' ? 0 : 1;
+    }
+  }
+
+  if (optind + 1 >= argc) {
+    print_help();
+    return 1;
+  }
+  cmd = argv[optind];
+  addr = strtoull(argv[optind + 1], NULL, 0);
+
+  if (!strcmp(cmd, "read") && optind + 2 < argc) {
+    to_dev = false;
+    len = strtoull(argv[optind + 2], NULL, 0);
+    if (optind + 3 < argc)
+      file = argv[optind + 3];
+  } else if (!strcmp(cmd, "write")) {
+    to_dev = true;
+    if (optind + 2 < argc)
+      file = argv[optind + 2];
+  } else {
+    print_help();
+    return 1;
+  }
+
+  dev_fd = open(dev, to_dev ? O_WRONLY : O_RDONLY);
+  if (dev_fd < 0) {
+    fprintf(stderr, "failed to open %s: %m\n", dev);
+    return 1;
+  }
+
+  if (!file)
+    file_fd = to_dev ? STDIN_FILENO : STDOUT_FILENO;
+  else
+    file_fd = to_dev ? open(file, O_RDONLY) :
+                      open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (file_fd < 0) {
+    fprintf(stderr, "failed to open %s: %m\n", file);
+    close(dev_fd);
+    return 1;
+  }
+
+  rc = rshim_mem_xfer(dev_fd, file_fd, addr, len, to_dev);
+  if (rc)
+    fprintf(stderr, "%s failed: %s\n", cmd, strerror(-rc));
+
+  if (file)
+    close(file_fd);
+  close(dev_fd);
+
+  return rc ? 1 : 0;
+}
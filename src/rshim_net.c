@@ -18,6 +18,8 @@
 #include <sys/epoll.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "rshim.h"
 
@@ -264,14 +266,22 @@ int rshim_net_init(rshim_backend_t *bd)
   int rc, fd[2];
 
   snprintf(ifname, sizeof(ifname), "tmfifo_net%d", bd->index);
-  bd->net_fd = rshim_if_open(ifname, bd->index);
+  if (bd->handover_net_fd >= 0) {
+    /* Keep using the tap interface of the previous daemon. */
+    bd->net_fd = bd->handover_net_fd;
+    bd->handover_net_fd = -1;
+  } else {
+    bd->net_fd = rshim_if_open(ifname, bd->index);
+  }
 
   if (bd->net_fd < 0)
     return bd->net_fd;
 
+  bd->net_tx_paused = false;
+
   memset(&event, 0, sizeof(event));
 
-  event.data.fd = bd->net_fd;
+  event.data.u64 = RSHIM_EPOLL_DATA(RSHIM_EPOLL_NET, bd->index, bd->net_fd);
   event.events = EPOLLIN;
   rc = epoll_ctl(rshim_epoll_fd, EPOLL_CTL_ADD, bd->net_fd, &event);
   if (rc == -1) {
@@ -285,7 +295,7 @@ int rshim_net_init(rshim_backend_t *bd)
     goto fail;
   }
 
-  event.data.fd = fd[0];
+  event.data.u64 = RSHIM_EPOLL_DATA(RSHIM_EPOLL_NET, bd->index, fd[0]);
   event.events = EPOLLIN;
   rc = epoll_ctl(rshim_epoll_fd, EPOLL_CTL_ADD, fd[0], &event);
   if (rc == -1) {
@@ -360,6 +370,7 @@ void rshim_net_rx(rshim_backend_t *bd)
     }
 
     if (pkt->hdr.len) {
+      RSHIM_PROBE2(net_rx, bd->index, ntohs(pkt->hdr.len));
       rshim_if_write(bd->net_fd, pkt->buf, ntohs(pkt->hdr.len));
       pkt->hdr.len = 0;
     }
@@ -368,17 +379,69 @@ void rshim_net_rx(rshim_backend_t *bd)
   }
 }
 
+static uint64_t rshim_net_time_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Enable or disable reading from the tap interface. */
+static void rshim_net_tx_arm(rshim_backend_t *bd, bool enable)
+{
+  struct epoll_event event;
+
+  memset(&event, 0, sizeof(event));
+  event.data.u64 = RSHIM_EPOLL_DATA(RSHIM_EPOLL_NET, bd->index, bd->net_fd);
+  event.events = enable ? EPOLLIN : 0;
+  if (epoll_ctl(rshim_epoll_fd, EPOLL_CTL_MOD, bd->net_fd, &event) == -1)
+    RSHIM_ERR("epoll_ctl failed: %d %d\n", rshim_epoll_fd, bd->net_fd);
+}
+
+/*
+ * Stop reading the tap interface if the write FIFO is above the high
+ * watermark, which avoids spinning on a tap fd which is always readable
+ * while the target drains the FIFO slowly.
+ */
+static void rshim_net_tx_pause(rshim_backend_t *bd)
+{
+  pthread_mutex_lock(&bd->ringlock);
+  if (!bd->net_tx_paused && bd->net_fd >= 0 &&
+      rshim_fifo_size(bd, TMFIFO_NET_CHAN, false) > RSHIM_NET_TX_HIGH_WM) {
+    bd->net_tx_paused = true;
+    bd->net_tx_pause_start = rshim_net_time_ms();
+    rshim_net_tx_arm(bd, false);
+  }
+  pthread_mutex_unlock(&bd->ringlock);
+}
+
+/* Re-arm the tap interface. Called with ringlock held. */
+void rshim_net_tx_resume(rshim_backend_t *bd)
+{
+  if (!bd->net_tx_paused || bd->net_fd < 0)
+    return;
+
+  bd->net_tx_paused = false;
+  bd->net_tx_pause_ms += rshim_net_time_ms() - bd->net_tx_pause_start;
+  rshim_net_tx_arm(bd, true);
+}
+
 void rshim_net_tx(rshim_backend_t *bd)
 {
   rshim_net_pkt_t *pkt = &bd->net_tx_pkt;
   int len, written;
 
-  do {
+  for (;;) {
     if (!pkt->hdr.len ||
         bd->net_tx_len >= sizeof(pkt->hdr) + ntohs(pkt->hdr.len)) {
       bd->net_tx_len = 0;
       pkt->hdr.len = 0;
 
+      /* Only finish the pending frame while back-pressured. */
+      if (bd->net_tx_paused)
+        return;
+
       len = rshim_if_read(bd->net_fd, pkt->buf, sizeof(pkt->buf));
       if (len <= 0)
         return;
@@ -386,6 +449,7 @@ void rshim_net_tx(rshim_backend_t *bd)
       pkt->hdr.data = 0;
       pkt->hdr.type = VIRTIO_ID_NET;
       pkt->hdr.len = htons(len);
+      RSHIM_PROBE2(net_tx, bd->index, len);
     }
 
     len = ntohs(pkt->hdr.len) + sizeof(pkt->hdr) - bd->net_tx_len;
@@ -393,5 +457,10 @@ void rshim_net_tx(rshim_backend_t *bd)
                                len, TMFIFO_NET_CHAN, true);
     if (written > 0)
       bd->net_tx_len += written;
-  } while (written == len);
+    if (written != len ||
+        rshim_fifo_size(bd, TMFIFO_NET_CHAN, false) > RSHIM_NET_TX_HIGH_WM) {
+      rshim_net_tx_pause(bd);
+      return;
+    }
+  }
 }
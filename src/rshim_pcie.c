@@ -49,6 +49,9 @@
 #define PCI_RSHIM_WINDOW_SIZE       0x100000
 #define BF3_PCI_RSHIM_WINDOW_SIZE   0x800000
 
+/* Number of channels with a precomputed BAR offset on BlueField-3. */
+#define RSHIM_PCIE_BF3_CHAN_NUM     16
+
 #define VFIO_GET_REGION_ADDR(x)     ((uint64_t) x << 40ULL)
 
 #define SYS_CLASS_IOMMU_PATH        "/sys/class/iommu"
@@ -66,6 +69,9 @@
 #define RSHIM_PCIE_NIC_RESET_WAIT   2
 #define RSHIM_PCIE_NIC_IRQ_RATE     32
 
+/* Default number of accesses per register in the BAR probe. */
+#define RSHIM_PCIE_PROBE_COUNT      10000
+
 /* Different modes of memory map. */
 typedef enum {
   RSHIM_PCIE_MMAP_DIRECT,
@@ -193,6 +199,13 @@ typedef struct {
   /* State to indicate NIC is resetting. */
   volatile bool nic_reset;
 
+  /*
+   * A NIC or DPU reset was requested and the device hasn't been seen out of
+   * it yet; no new leases.
+   */
+  volatile bool in_reset;
+  time_t reset_end;             /* Expected end of the reset. */
+
   /* Last irq time */
   time_t last_intr_time;
 
@@ -205,6 +218,15 @@ typedef struct {
 
   /* BAR size */
   uint32_t bar_size;
+
+  /* mmap offset of the BAR in device_fd. */
+  uint64_t bar_map_offset;
+
+  /*
+   * BAR offset of each channel on BlueField-3, resolved at probe time so
+   * the accessors don't need to convert the address on every access.
+   */
+  int64_t chan_off[RSHIM_PCIE_BF3_CHAN_NUM];
 } rshim_pcie_t;
 
 static const int bf3_rshim_pcie_chan_map[] = {
@@ -402,7 +424,6 @@ static int rshim_pcie_mmap_direct(rshim_pcie_t *dev)
     return -ENODEV;
   }
 
-  /* /sys/bus/pci/devices/0000:98:00.2/resource0 */  
   dev->rshim_regs = mmap(NULL, dev->bar_size,
                          PROT_READ | PROT_WRITE,
                          MAP_SHARED | MAP_LOCKED,
@@ -413,6 +434,7 @@ static int rshim_pcie_mmap_direct(rshim_pcie_t *dev)
     RSHIM_ERR("Failed to map RShim registers\n");
     return -ENOMEM;
   }
+  dev->bar_map_offset = 0;
 
   /* Set PCI bus mastering */
   reg = rshim_pci_read_word(dev, PCI_COMMAND);
@@ -649,6 +671,7 @@ static int rshim_pcie_mmap_vfio(rshim_pcie_t *dev)
       dev->group_fd = group_fd;
       dev->container_fd = container_fd;
       dev->rshim_regs = map;
+      dev->bar_map_offset = region_info.offset;
 
       /* Enable interrupt */
       irq.index = VFIO_PCI_INTX_IRQ_INDEX;
@@ -783,6 +806,12 @@ static void rshim_pcie_intr(rshim_pcie_t *dev)
     (info.rst_type == RSHIM_PCIE_RST_TYPE_NIC_RESET) ? "NIC" :
     ((info.rst_type == RSHIM_PCIE_RST_TYPE_DPU_RESET) ? "DPU" : ""));
 
+  /* The leased registers may not be accessed across the reset. */
+  dev->in_reset = true;
+  dev->reset_end = time(NULL) + RSHIM_PCIE_NIC_RESET_WAIT +
+                   (info.rst_downtime + 99) / 100;
+  rshim_lease_revoke(bd);
+
   if (info.rst_reply == RSHIM_PCIE_RST_REPLY_NONE) {
     RSHIM_INFO("NIC reset ACK\n");
     info.rst_reply = RSHIM_PCIE_RST_REPLY_ACK;
@@ -806,6 +835,7 @@ static void rshim_pcie_intr(rshim_pcie_t *dev)
     info.word &= 0xFFFFFFFFUL;
     bd->write_rshim(bd, RSHIM_CHANNEL, bd->regs->scratchpad6,
                     info.word, RSHIM_REG_SIZE_8B);
+    dev->in_reset = false;
   } else if (info.rst_type == RSHIM_PCIE_RST_TYPE_DPU_RESET) {
     /*
      * Both NIC and ARM reset.
@@ -825,7 +855,8 @@ static void rshim_pcie_intr(rshim_pcie_t *dev)
     rshim_pcie_enable_irq(dev, true);
 
 intr_done:
-    pthread_mutex_unlock(&bd->mutex);
+  /* in_reset is cleared by rshim_pcie_get_bar() once the reset is over. */
+  pthread_mutex_unlock(&bd->mutex);
 }
 
 static void rshim_pcie_intr_poll(rshim_pcie_t *dev)
@@ -937,65 +968,189 @@ rshim_pcie_bf3_chan_addr_convert(uint32_t chan, uint32_t addr)
   return addr;
 }
 
-/* RShim read/write routines */
-static int __attribute__ ((noinline))
-rshim_pcie_read(rshim_backend_t *bd, uint32_t chan, uint32_t addr,
-                uint64_t *result, int size)
+/* Resolve the BAR offset of each BlueField-3 channel. */
+static void rshim_pcie_bf3_chan_init(rshim_pcie_t *dev)
 {
-  rshim_pcie_t *dev = container_of(bd, rshim_pcie_t, bd);
-  int rc = 0;
+  uint32_t chan;
+
+  for (chan = 0; chan < RSHIM_PCIE_BF3_CHAN_NUM; chan++)
+    dev->chan_off[chan] = (int64_t)rshim_pcie_bf3_chan_addr_convert(chan, 0) -
+                          BF3_RSH_BASE_ADDR;
+}
+
+/*
+ * Checks common to all the accessors. Returns 1 if the access should be
+ * dropped, 0 if it could go ahead or a negative error code.
+ */
+static inline int rshim_pcie_access_prep(rshim_pcie_t *dev, uint32_t chan,
+                                         uint32_t addr)
+{
+  rshim_backend_t *bd = &dev->bd;
 
   if (dev->nic_reset &&
       (chan != RSHIM_CHANNEL || addr != bd->regs->scratchpad6))
     sleep(RSHIM_PCIE_NIC_RESET_WAIT);
 
-  if (bd->drop_mode) {
-    *result = 0;
-    return 0;
-  }
+  if (bd->drop_mode)
+    return 1;
 
   if (!bd->has_rshim || !bd->has_tm || !dev->rshim_regs)
     return -ENODEV;
 
-  dev->write_count = 0;
+  return 0;
+}
 
-  if (rshim_is_bluefield3(dev->device_id)) {
-    addr = rshim_pcie_bf3_chan_addr_convert(chan, addr);
-    if (addr < BF3_RSH_BASE_ADDR ||
-        addr >= (BF3_RSH_BASE_ADDR + BF3_PCI_RSHIM_WINDOW_SIZE))
-      return -EINVAL;
-    addr -= BF3_RSH_BASE_ADDR;
-  } else {
-    addr = addr | (chan << 16);
-  }
+/* BAR offset of a BlueField-3 register, or -1 if it's outside the window. */
+static inline int64_t rshim_pcie_bf3_offset(rshim_pcie_t *dev, uint32_t chan,
+                                            uint32_t addr)
+{
+  int64_t off;
+
+  if (chan < RSHIM_PCIE_BF3_CHAN_NUM)
+    off = dev->chan_off[chan] + addr;
+  else
+    off = (int64_t)rshim_pcie_bf3_chan_addr_convert(chan, addr) -
+          BF3_RSH_BASE_ADDR;
+
+  if (off < 0 || off >= BF3_PCI_RSHIM_WINDOW_SIZE)
+    return -1;
+
+  return off;
+}
+
+static inline int rshim_pcie_readx(volatile uint8_t *reg, uint64_t *result,
+                                   int size)
+{
+  if (size == 4)
+    *result = readl(reg);
+  else if (size == 8)
+    *result = readq(reg);
+  else
+    return -EINVAL;
+
+  return 0;
+}
 
+static inline int rshim_pcie_writex(volatile uint8_t *reg, uint64_t value,
+                                    int size)
+{
   if (size == 4)
-    *result = readl(dev->rshim_regs + addr);
+    writel(value, reg);
   else if (size == 8)
-    *result = readq(dev->rshim_regs + addr);
+    writeq(value, reg);
   else
+    return -EINVAL;
+
+  return 0;
+}
+
+/*
+ * RShim read/write routines. One pair is picked per chip at probe time so
+ * the chip type and the address conversion aren't re-evaluated on every
+ * register access.
+ */
+
+/* BlueField-1/2 read. */
+static int __attribute__ ((noinline))
+rshim_pcie_read(rshim_backend_t *bd, uint32_t chan, uint32_t addr,
+                uint64_t *result, int size)
+{
+  rshim_pcie_t *dev = container_of(bd, rshim_pcie_t, bd);
+  int rc;
+
+  RSHIM_PROBE4(read_rshim, bd->index, chan, addr, size);
+
+  rc = rshim_pcie_access_prep(dev, chan, addr);
+  if (rc) {
+    if (rc > 0) {
+      *result = 0;
+      rc = 0;
+    }
+    goto done;
+  }
+
+  dev->write_count = 0;
+  rc = rshim_pcie_readx(dev->rshim_regs + (addr | (chan << 16)), result, size);
+
+done:
+  RSHIM_PROBE4(read_rshim_return, bd->index, chan, rc ? 0 : *result, rc);
+  return rc;
+}
+
+/* BlueField-3 read. */
+static int __attribute__ ((noinline))
+rshim_pcie_read_bf3(rshim_backend_t *bd, uint32_t chan, uint32_t addr,
+                    uint64_t *result, int size)
+{
+  rshim_pcie_t *dev = container_of(bd, rshim_pcie_t, bd);
+  int64_t off;
+  int rc;
+
+  RSHIM_PROBE4(read_rshim, bd->index, chan, addr, size);
+
+  rc = rshim_pcie_access_prep(dev, chan, addr);
+  if (rc) {
+    if (rc > 0) {
+      *result = 0;
+      rc = 0;
+    }
+    goto done;
+  }
+
+  off = rshim_pcie_bf3_offset(dev, chan, addr);
+  if (off < 0) {
     rc = -EINVAL;
+    goto done;
+  }
 
+  rc = rshim_pcie_readx(dev->rshim_regs + off, result, size);
+
+done:
+  RSHIM_PROBE4(read_rshim_return, bd->index, chan, rc ? 0 : *result, rc);
   return rc;
 }
 
+/* BlueField-2 write. */
 static int __attribute__ ((noinline))
 rshim_pcie_write(rshim_backend_t *bd, uint32_t chan, uint32_t addr,
                  uint64_t value, int size)
 {
   rshim_pcie_t *dev = container_of(bd, rshim_pcie_t, bd);
-  uint64_t result;
-  int rc = 0;
+  int rc;
 
-  if (dev->nic_reset &&
-      (chan != RSHIM_CHANNEL || addr != bd->regs->scratchpad6))
-    sleep(RSHIM_PCIE_NIC_RESET_WAIT);
+  RSHIM_PROBE5(write_rshim, bd->index, chan, addr, value, size);
 
-  if (bd->drop_mode)
-    return 0;
+  rc = rshim_pcie_access_prep(dev, chan, addr);
+  if (rc) {
+    if (rc > 0)
+      rc = 0;
+    goto done;
+  }
 
-  if (!bd->has_rshim || !bd->has_tm || !dev->rshim_regs)
-    return -ENODEV;
+  rc = rshim_pcie_writex(dev->rshim_regs + (addr | (chan << 16)), value, size);
+
+done:
+  RSHIM_PROBE2(write_rshim_return, bd->index, rc);
+  return rc;
+}
+
+/* BlueField-1 write. */
+static int __attribute__ ((noinline))
+rshim_pcie_write_bf1(rshim_backend_t *bd, uint32_t chan, uint32_t addr,
+                     uint64_t value, int size)
+{
+  rshim_pcie_t *dev = container_of(bd, rshim_pcie_t, bd);
+  uint64_t result;
+  int rc;
+
+  RSHIM_PROBE5(write_rshim, bd->index, chan, addr, value, size);
+
+  rc = rshim_pcie_access_prep(dev, chan, addr);
+  if (rc) {
+    if (rc > 0)
+      rc = 0;
+    goto done;
+  }
 
   /*
    * We cannot stream large numbers of PCIe writes to the RShim's BAR.
@@ -1003,34 +1158,118 @@ rshim_pcie_write(rshim_backend_t *bd, uint32_t chan, uint32_t addr,
    * doing a read from another register within the BAR,
    * which forces previous writes to drain.
    */
-  if (rshim_is_bluefield1(dev->device_id)) {
-    if (dev->write_count == 15) {
-      __sync_synchronize();
-      rshim_pcie_read(bd, chan, RSH_SCRATCHPAD1, &result, rc);
-    }
-    dev->write_count++;
+  if (dev->write_count == 15) {
+    __sync_synchronize();
+    result = readq(dev->rshim_regs +
+                   (bd->regs->scratchpad1 | (RSHIM_CHANNEL << 16)));
+    (void)result;
+    dev->write_count = 0;
   }
+  dev->write_count++;
 
-  if (rshim_is_bluefield3(dev->device_id)) {
-    addr = rshim_pcie_bf3_chan_addr_convert(chan, addr);
-    if (addr < BF3_RSH_BASE_ADDR ||
-        addr >= (BF3_RSH_BASE_ADDR + BF3_PCI_RSHIM_WINDOW_SIZE))
-      return -EINVAL;
-    addr -= BF3_RSH_BASE_ADDR;
-  } else {
-    addr = addr | (chan << 16);
+  rc = rshim_pcie_writex(dev->rshim_regs + (addr | (chan << 16)), value, size);
+
+done:
+  RSHIM_PROBE2(write_rshim_return, bd->index, rc);
+  return rc;
+}
+
+/* BlueField-3 write. */
+static int __attribute__ ((noinline))
+rshim_pcie_write_bf3(rshim_backend_t *bd, uint32_t chan, uint32_t addr,
+                     uint64_t value, int size)
+{
+  rshim_pcie_t *dev = container_of(bd, rshim_pcie_t, bd);
+  int64_t off;
+  int rc;
+
+  RSHIM_PROBE5(write_rshim, bd->index, chan, addr, value, size);
+
+  rc = rshim_pcie_access_prep(dev, chan, addr);
+  if (rc) {
+    if (rc > 0)
+      rc = 0;
+    goto done;
   }
 
-  if (size == 4)
-    writel(value, dev->rshim_regs + addr);
-  else if (size == 8)
-    writeq(value, dev->rshim_regs + addr);
-  else
+  off = rshim_pcie_bf3_offset(dev, chan, addr);
+  if (off < 0) {
     rc = -EINVAL;
+    goto done;
+  }
 
+  rc = rshim_pcie_writex(dev->rshim_regs + off, value, size);
+
+done:
+  RSHIM_PROBE2(write_rshim_return, bd->index, rc);
   return rc;
 }
 
+#ifdef __linux__
+/*
+ * Check whether a reset is over: the device answers again, and either no
+ * reset is pending in scratchpad6 or the link downtime it announced has
+ * passed, in case the firmware leaves the request there. Called with the
+ * device mutex held.
+ */
+static bool rshim_pcie_reset_done(rshim_pcie_t *dev)
+{
+  rshim_pcie_intr_info_t info = {.word = 0};
+  rshim_backend_t *bd = &dev->bd;
+  int rc;
+
+  if (dev->nic_reset || !dev->rshim_regs)
+    return false;
+
+  rc = bd->read_rshim(bd, RSHIM_CHANNEL, bd->regs->scratchpad6, &info.word,
+                      RSHIM_REG_SIZE_8B);
+
+  if (rc || RSHIM_BAD_CTRL_REG(info.word))
+    return false;
+
+  return info.rst_state == RSHIM_PCIE_RST_STATE_NONE ||
+         time(NULL) >= dev->reset_end;
+}
+
+/* BAR of the device for the register leases. Called with the device mutex. */
+static int rshim_pcie_get_bar(rshim_backend_t *bd, rshim_bar_info_t *info)
+{
+  rshim_pcie_t *dev = container_of(bd, rshim_pcie_t, bd);
+
+  if (dev->in_reset) {
+    if (!rshim_pcie_reset_done(dev))
+      return -EAGAIN;
+    dev->in_reset = false;
+  }
+
+  if (!dev->rshim_regs || dev->device_fd < 0 || dev->nic_reset)
+    return -ENODEV;
+
+  info->fd = dev->device_fd;
+  info->map_offset = dev->bar_map_offset;
+  info->size = dev->bar_size;
+
+  return 0;
+}
+
+/* BAR offset of a register, as used by the accessors of the chip. */
+static int64_t rshim_pcie_bar_offset(rshim_backend_t *bd, uint32_t chan,
+                                     uint32_t addr)
+{
+  rshim_pcie_t *dev = container_of(bd, rshim_pcie_t, bd);
+  int64_t off;
+
+  if (rshim_is_bluefield3(dev->device_id))
+    return rshim_pcie_bf3_offset(dev, chan, addr);
+
+  off = addr | (chan << 16);
+  if (off >= dev->bar_size)
+    return -1;
+
+  return off;
+}
+#endif /* __linux__ */
+
 static void rshim_pcie_delete(rshim_backend_t *bd)
 {
   rshim_pcie_t *dev = container_of(bd, rshim_pcie_t, bd);
@@ -1049,13 +1288,16 @@ static int rshim_pcie_enable(rshim_backend_t *bd, bool enable)
   if (!dev->device_id)
     return -ENODEV;
 
+  /* The clients can't keep using a BAR which is about to be unmapped. */
+  rshim_lease_revoke(bd);
+
   /*
    * Clear scratchpad1 since it's checked by FW for rshim driver.
    * This needs to be done before the resources are unmapped.
    */
   if (!enable) {
-    rshim_pcie_write(bd, RSHIM_CHANNEL, bd->regs->scratchpad1, 0,
-                     RSHIM_REG_SIZE_8B);
+    bd->write_rshim(bd, RSHIM_CHANNEL, bd->regs->scratchpad1, 0,
+                    RSHIM_REG_SIZE_8B);
   }
 
   /* Unmap existing resource first. */
@@ -1102,6 +1344,48 @@ static int rshim_pcie_enable(rshim_backend_t *bd, bool enable)
   return rc;
 }
 
+/* Set the registers, BAR size and accessors of a chip. */
+static void rshim_pcie_set_chip(rshim_pcie_t *dev, uint16_t device_id)
+{
+  int (*read_rshim)(rshim_backend_t *bd, uint32_t chan, uint32_t addr,
+                    uint64_t *value, int size);
+  int (*write_rshim)(rshim_backend_t *bd, uint32_t chan, uint32_t addr,
+                     uint64_t value, int size);
+  rshim_backend_t *bd = &dev->bd;
+
+  switch (device_id) {
+    case BLUEFIELD3_DEVICE_ID:
+    case BLUEFIELD3_DEVICE_ID2:
+      bd->regs = &bf3_rshim_regs;
+      bd->ver_id = RSHIM_BLUEFIELD_3;
+      dev->bar_size = BF3_PCI_RSHIM_WINDOW_SIZE;
+      rshim_pcie_bf3_chan_init(dev);
+      read_rshim = rshim_pcie_read_bf3;
+      write_rshim = rshim_pcie_write_bf3;
+      break;
+    case BLUEFIELD2_DEVICE_ID:
+      bd->regs = &bf1_bf2_rshim_regs;
+      bd->ver_id = RSHIM_BLUEFIELD_2;
+      dev->bar_size = PCI_RSHIM_WINDOW_SIZE;
+      read_rshim = rshim_pcie_read;
+      write_rshim = rshim_pcie_write;
+      break;
+    default:
+      bd->regs = &bf1_bf2_rshim_regs;
+      bd->ver_id = RSHIM_BLUEFIELD_1;
+      dev->bar_size = PCI_RSHIM_WINDOW_SIZE;
+      read_rshim = rshim_pcie_read;
+      write_rshim = rshim_pcie_write_bf1;
+      break;
+  }
+
+  /* Don't replace the APIs (possibly wrapped) of a registered device. */
+  if (!bd->registered) {
+    bd->read_rshim = read_rshim;
+    bd->write_rshim = write_rshim;
+  }
+}
+
 /* Probe routine */
 static int rshim_pcie_probe(struct pci_dev *pci_dev)
 {
@@ -1136,8 +1420,6 @@ static int rshim_pcie_probe(struct pci_dev *pci_dev)
     bd = &dev->bd;
     strcpy(bd->dev_name, dev_name);
     bd->drop_mode = (rshim_drop_mode >= 0) ? rshim_drop_mode : 0;
-    bd->read_rshim = rshim_pcie_read;
-    bd->write_rshim = rshim_pcie_write;
     bd->destroy = rshim_pcie_delete;
     bd->enable_device = rshim_pcie_enable;
     dev->write_count = 0;
@@ -1148,6 +1430,8 @@ static int rshim_pcie_probe(struct pci_dev *pci_dev)
     dev->mmap_mode = rshim_pcie_mmap_mode;
 #ifdef __linux__
     dev->pci_path = rshim_sys_pci_path;
+    bd->get_bar = rshim_pcie_get_bar;
+    bd->bar_offset = rshim_pcie_bar_offset;
 #endif
     time(&dev->last_intr_time);
     pthread_mutex_init(&bd->mutex, NULL);
@@ -1155,24 +1439,7 @@ static int rshim_pcie_probe(struct pci_dev *pci_dev)
 
   rshim_ref(bd);
 
-  switch (pci_dev->device_id) {
-    case BLUEFIELD3_DEVICE_ID:
-    case BLUEFIELD3_DEVICE_ID2:
-      bd->regs = &bf3_rshim_regs;
-      bd->ver_id = RSHIM_BLUEFIELD_3;
-      dev->bar_size = BF3_PCI_RSHIM_WINDOW_SIZE;
-      break;
-    case BLUEFIELD2_DEVICE_ID:
-      bd->regs = &bf1_bf2_rshim_regs;
-      bd->ver_id = RSHIM_BLUEFIELD_2;
-      dev->bar_size = PCI_RSHIM_WINDOW_SIZE;
-      break;
-    default:
-      bd->regs = &bf1_bf2_rshim_regs;
-      bd->ver_id = RSHIM_BLUEFIELD_1;
-      dev->bar_size = PCI_RSHIM_WINDOW_SIZE;
-      break;
-  }
+  rshim_pcie_set_chip(dev, pci_dev->device_id);
   bd->rev_id = pci_read_byte(pci_dev, PCI_REVISION_ID);
 
   if (rshim_has_pcie_reset_delay || bd->ver_id < RSHIM_BLUEFIELD_3)
@@ -1186,6 +1453,7 @@ static int rshim_pcie_probe(struct pci_dev *pci_dev)
   dev->bus = pci_dev->bus;
   dev->dev = pci_dev->dev;
   dev->func = pci_dev->func;
+  rshim_pci_locality(bd, dev->domain, dev->bus, dev->dev, dev->func);
 
   /* Enable the device and setup memory map. */
   if (!bd->drop_mode) {
@@ -1219,6 +1487,8 @@ static int rshim_pcie_probe(struct pci_dev *pci_dev)
     rc = pthread_create(&dev->intr_thread, NULL, rshim_pcie_intr_thread, dev);
     if (rc)
       RSHIM_ERR("Failed to create intr thread\n");
+    else
+      rshim_set_affinity(bd, dev->intr_thread);
   }
 #endif
 
@@ -1294,15 +1564,47 @@ static bool kernel_lock_down_enabled(void)
   return (p != NULL && (strstr(buf, "[integrity]") != NULL ||
           strstr(buf, "[confidentiality]") != NULL));
 }
-#endif /* __linux__ */
 
-int rshim_pcie_init(void)
+/*
+ * Check whether the device is bound to a driver (e.g. vfio-pci for a running
+ * daemon), or mapped directly by a daemon, which sets driver_override (see
+ * rshim_pcie_bind()). The user is put in 'user' if so.
+ */
+static bool rshim_pcie_in_use(rshim_pcie_t *dev, char *user, size_t len)
 {
-  bool dev_present = false;
-  struct pci_access *pci;
-  struct pci_dev *dev;
-  int rc;
+  char path[RSHIM_PATH_MAX], name[RSHIM_PATH_MAX], *p;
+  FILE *file;
+  ssize_t n;
+
+  snprintf(path, sizeof(path), "%s/%04x:%02x:%02x.%1u/driver",
+           SYS_BUS_PCI_PATH, dev->domain, dev->bus, dev->dev, dev->func);
+  n = readlink(path, name, sizeof(name) - 1);
+  if (n > 0) {
+    name[n] = 0;
+    p = strrchr(name, '/');
+    snprintf(user, len, "driver %s", p ? p + 1 : name);
+    return true;
+  }
 
+  snprintf(path, sizeof(path), "%s/%04x:%02x:%02x.%1u/driver_override",
+           SYS_BUS_PCI_PATH, dev->domain, dev->bus, dev->dev, dev->func);
+  file = fopen(path, "r");
+  if (!file)
+    return false;
+  p = fgets(name, sizeof(name), file);
+  fclose(file);
+  if (p && !strncmp(name, "rshim", 5)) {
+    snprintf(user, len, "the rshim driver");
+    return true;
+  }
+
+  return false;
+}
+#endif /* __linux__ */
+
+/* Pick the memory map mode: VFIO, then UIO, then direct. */
+static int rshim_pcie_mmap_mode_init(void)
+{
 #ifdef __linux__
   if (rshim_pcie_has_vfio()) {
     rshim_pcie_mmap_mode = RSHIM_PCIE_MMAP_VFIO;
@@ -1319,9 +1621,22 @@ int rshim_pcie_init(void)
       rshim_sys_pci_path = SYS_UIO_PCI_PATH;
     }
   }
-
 #endif /* __linux__ */
 
+  return 0;
+}
+
+int rshim_pcie_init(void)
+{
+  bool dev_present = false;
+  struct pci_access *pci;
+  struct pci_dev *dev;
+  int rc;
+
+  rc = rshim_pcie_mmap_mode_init();
+  if (rc)
+    return rc;
+
   pci = pci_alloc();
   if (!pci)
     return -ENOMEM;
@@ -1354,3 +1669,194 @@ int rshim_pcie_init(void)
 
   return 0;
 }
+
+static int rshim_pcie_probe_cmp(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+static uint64_t rshim_pcie_probe_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Time 'count' accesses to a register with the accessors of the chip and
+ * print the latency distribution in nanoseconds. Writes put back the value
+ * read first, so the register is left as it was.
+ */
+static int rshim_pcie_probe_reg(rshim_backend_t *bd, const char *name,
+                                uint32_t addr, bool write, uint64_t *ns,
+                                int count)
+{
+  uint64_t value, start, sum = 0;
+  int i, rc;
+
+  rc = bd->read_rshim(bd, RSHIM_CHANNEL, addr, &value, RSHIM_REG_SIZE_8B);
+  if (rc)
+    return rc;
+
+  for (i = 0; i < count; i++) {
+    start = rshim_pcie_probe_now();
+    if (write)
+      rc = bd->write_rshim(bd, RSHIM_CHANNEL, addr, value, RSHIM_REG_SIZE_8B);
+    else
+      rc = bd->read_rshim(bd, RSHIM_CHANNEL, addr, &value,
+                          RSHIM_REG_SIZE_8B);
+    ns[i] = rshim_pcie_probe_now() - start;
+    if (rc)
+      return rc;
+  }
+
+  qsort(ns, count, sizeof(*ns), rshim_pcie_probe_cmp);
+  for (i = 0; i < count; i++)
+    sum += ns[i];
+
+  printf("%-12s %-5s 0x%04x %8llu %8llu %8llu %8llu %8llu %8llu\n", name,
+         write ? "write" : "read", addr, (unsigned long long)ns[0],
+         (unsigned long long)(sum / count),
+         (unsigned long long)ns[count / 2],
+         (unsigned long long)ns[(int64_t)count * 90 / 100],
+         (unsigned long long)ns[(int64_t)count * 99 / 100],
+         (unsigned long long)ns[count - 1]);
+
+  return 0;
+}
+
+/*
+ * Map the BAR of one device and report the latency of its register
+ * accesses, without registering the device. A device bound to a driver or
+ * used by a daemon is refused. The BAR is mapped directly through sysfs, so
+ * the binding of the device is never changed.
+ */
+int rshim_pcie_bar_probe(const char *dev_name, int count)
+{
+  unsigned int domain, bus, devn, func;
+  struct pci_access *pci;
+  struct pci_dev *pci_dev;
+  const struct rshim_regs *regs;
+  rshim_backend_t *bd;
+  rshim_pcie_t *dev = NULL;
+  uint64_t *ns = NULL;
+#ifdef __linux__
+  char user[RSHIM_PATH_MAX];
+#endif
+  int rc;
+
+  domain = 0;
+  if (!dev_name ||
+      (sscanf(dev_name, "pcie-%x:%x:%x.%x", &domain, &bus, &devn,
+              &func) != 4 &&
+       sscanf(dev_name, "pcie-%x:%x.%x", &bus, &devn, &func) != 3)) {
+    RSHIM_ERR("Probe needs a device name pcie-[<domain>:]<bus>:<dev>.<fn>\n");
+    return -EINVAL;
+  }
+
+  if (count <= 0)
+    count = RSHIM_PCIE_PROBE_COUNT;
+
+#ifdef __linux__
+  /* Linux kernel lock_down requires VFIO, which needs the device bound. */
+  if (kernel_lock_down_enabled()) {
+    RSHIM_ERR("Probe needs direct mapping, not allowed by kernel lock-down\n");
+    return -ENOTSUP;
+  }
+#endif
+
+  pci = pci_alloc();
+  if (!pci)
+    return -ENOMEM;
+  pci_init(pci);
+
+  pci_dev = pci_get_dev(pci, domain, bus, devn, func);
+  if (pci_dev)
+    pci_fill_info(pci_dev, PCI_FILL_IDENT);
+  if (!pci_dev || pci_dev->vendor_id != TILERA_VENDOR_ID ||
+      (!rshim_is_bluefield1(pci_dev->device_id) &&
+       !rshim_is_bluefield2(pci_dev->device_id) &&
+       !rshim_is_bluefield3(pci_dev->device_id))) {
+    RSHIM_ERR("%s is not a BlueField rshim device\n", dev_name);
+    rc = -ENODEV;
+    goto done;
+  }
+
+  dev = calloc(1, sizeof(*dev));
+  ns = calloc(count, sizeof(*ns));
+  if (!dev || !ns) {
+    rc = -ENOMEM;
+    goto done;
+  }
+
+  bd = &dev->bd;
+  snprintf(bd->dev_name, sizeof(bd->dev_name), "%s", dev_name);
+  dev->device_fd = -1;
+  dev->group_fd = -1;
+  dev->container_fd = -1;
+  dev->intr_fd = -1;
+  dev->mmap_mode = RSHIM_PCIE_MMAP_DIRECT;
+  pthread_mutex_init(&bd->mutex, NULL);
+
+  rshim_pcie_set_chip(dev, pci_dev->device_id);
+  dev->device_id = pci_dev->device_id;
+  dev->domain = domain;
+  dev->bus = bus;
+  dev->dev = devn;
+  dev->func = func;
+
+#ifdef __linux__
+  if (rshim_pcie_in_use(dev, user, sizeof(user))) {
+    RSHIM_ERR("%s is used by %s\n", dev_name, user);
+    rc = -EBUSY;
+    goto done;
+  }
+#endif
+
+  rc = rshim_pcie_mmap(dev, true);
+  if (rc) {
+    rshim_pcie_mmap(dev, false);
+    goto done;
+  }
+  bd->has_rshim = 1;
+  bd->has_tm = 1;
+
+  printf("%s: BlueField-%d, %s map, BAR size 0x%x, %d accesses (ns)\n",
+         dev_name, bd->ver_id, rshim_pcie_mmap_name[dev->mmap_mode],
+         dev->bar_size, count);
+  printf("%-12s %-5s %-6s %8s %8s %8s %8s %8s %8s\n", "register", "op",
+         "addr", "min", "avg", "p50", "p90", "p99", "max");
+
+  regs = bd->regs;
+  rc = rshim_pcie_probe_reg(bd, "fabric_dim", regs->fabric_dim, false, ns,
+                            count);
+  if (!rc)
+    rc = rshim_pcie_probe_reg(bd, "uptime", regs->uptime, false, ns, count);
+  if (!rc)
+    rc = rshim_pcie_probe_reg(bd, "tm_htt_sts", regs->tm_htt_sts, false, ns,
+                              count);
+  if (!rc)
+    rc = rshim_pcie_probe_reg(bd, "tm_tth_sts", regs->tm_tth_sts, false, ns,
+                              count);
+  if (!rc)
+    rc = rshim_pcie_probe_reg(bd, "scratchpad1", regs->scratchpad1, false,
+                              ns, count);
+  if (!rc)
+    rc = rshim_pcie_probe_reg(bd, "scratchpad1", regs->scratchpad1, true,
+                              ns, count);
+  if (rc)
+    RSHIM_ERR("%s register access failed: %d\n", dev_name, rc);
+
+  rshim_pcie_mmap(dev, false);
+
+done:
+  free(ns);
+  free(dev);
+  if (pci_dev)
+    pci_free_dev(pci_dev);
+  pci_cleanup(pci);
+  return rc;
+}
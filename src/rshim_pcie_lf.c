@@ -653,12 +653,16 @@ rshim_pcie_read(struct rshim_backend *bd, uint32_t chan, uint32_t addr,
   struct pci_dev *pci_dev = dev->pci_dev;
   int rc = 0;
 
-  if (!bd->has_rshim || !bd->has_tm)
-    return -ENODEV;
+  RSHIM_PROBE4(read_rshim, bd->index, chan, addr, size);
+
+  if (!bd->has_rshim || !bd->has_tm) {
+    rc = -ENODEV;
+    goto done;
+  }
 
   if (bd->drop_mode) {
     *result = 0;
-    return 0;
+    goto done;
   }
 
   if (pci_dev->device_id == BLUEFIELD3_DEVICE_ID) {
@@ -670,6 +674,8 @@ rshim_pcie_read(struct rshim_backend *bd, uint32_t chan, uint32_t addr,
     rc = rshim_byte_acc_read(pci_dev, RSH_CHANNEL_BASE(chan) + addr, result);
   }
 
+done:
+  RSHIM_PROBE4(read_rshim_return, bd->index, chan, rc ? 0 : *result, rc);
   return rc;
 }
 
@@ -683,11 +689,15 @@ rshim_pcie_write(struct rshim_backend *bd, uint32_t chan, uint32_t addr,
   uint64_t result;
   int rc = 0;
 
-  if (!bd->has_rshim || !bd->has_tm)
-    return -ENODEV;
+  RSHIM_PROBE5(write_rshim, bd->index, chan, addr, value, size);
+
+  if (!bd->has_rshim || !bd->has_tm) {
+    rc = -ENODEV;
+    goto done;
+  }
 
   if (bd->drop_mode)
-    return 0;
+    goto done;
 
   if (pci_dev->device_id == BLUEFIELD3_DEVICE_ID) {
     rc = msn_gw_write(pci_dev, bf3_rshim_pcie_lf_chan_map[chan] + addr,
@@ -717,6 +727,8 @@ rshim_pcie_write(struct rshim_backend *bd, uint32_t chan, uint32_t addr,
       rc = rshim_byte_acc_write(pci_dev, RSH_CHANNEL_BASE(chan) + addr, value);
   }
 
+done:
+  RSHIM_PROBE2(write_rshim_return, bd->index, rc);
   return rc;
 }
 
@@ -792,6 +804,8 @@ static int rshim_pcie_probe(struct pci_dev *pci_dev)
 
   /* Initialize object */
   dev->pci_dev = pci_dev;
+  rshim_pci_locality(bd, pci_dev->domain, pci_dev->bus, pci_dev->dev,
+                     pci_dev->func);
 
   pthread_mutex_lock(&bd->mutex);
 
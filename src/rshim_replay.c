@@ -0,0 +1,582 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2019 Mellanox Technologies. All Rights Reserved.
+ *
+ */
+
+#include <pthread.h>
+#include <sys/param.h>
+
+#include "rshim.h"
+
+/*
+ * Record and replay of the backend traffic.
+ *
+ * With RECORD_DIR configured, every read_rshim/write_rshim/read/write call
+ * of a device is logged with its result and the time since the previous
+ * call into RECORD_DIR/rshim<N>.rec. Running the driver with
+ * '-d replay-<file>' creates a device on the replay backend instead, which
+ * answers the same calls from the recording at the original pace. A call
+ * which doesn't match the next record is matched against the following
+ * records within RSHIM_REPLAY_LOOKAHEAD, so a changed access pattern (e.g.
+ * fewer status polls) resynchronizes, and the statistics at the end tell
+ * how much the run diverged.
+ *
+ * Bulk transfers are only recorded for a backend with its own (USB), since
+ * otherwise they are made of register accesses which are recorded anyway.
+ * The replay backend replays the bulk transfers of a recording which has
+ * them, and reads the TMFIFO through the register path otherwise. Bulk
+ * writes recorded from USB complete asynchronously and their data is not
+ * replayed.
+ */
+
+#define RSHIM_REC_MAGIC         0x0000434552485352ULL   /* "RSHREC" */
+#define RSHIM_REC_VERSION       1
+
+#define RSHIM_REPLAY_PREFIX     "replay-"
+#define RSHIM_REPLAY_LOOKAHEAD  256
+
+/* Recorded calls. */
+enum {
+  RSHIM_REC_READ_RSHIM = 1,
+  RSHIM_REC_WRITE_RSHIM,
+  RSHIM_REC_WRITE_RSHIM_POSTED,
+  RSHIM_REC_READ,
+  RSHIM_REC_WRITE,
+};
+
+typedef struct {
+  uint64_t magic;
+  uint32_t version;
+  uint16_t ver_id;
+  uint16_t rev_id;
+  char dev_name[RSHIM_DEV_NAME_LEN];
+} rshim_rec_file_hdr_t;
+
+/* A bulk read record is followed by 'rc' bytes of data if rc > 0. */
+typedef struct {
+  uint32_t delta_us;    /* time since the previous record */
+  uint32_t addr;        /* register address, or count of a bulk transfer */
+  uint64_t value;       /* register value */
+  int32_t rc;
+  uint8_t op;
+  uint8_t chan;         /* channel, or devtype of a bulk transfer */
+  uint8_t size;
+  uint8_t rsvd;
+} rshim_rec_t;
+
+/* Directory of the recordings, empty to disable recording. */
+char rshim_record_dir[RSHIM_RECORD_DIR_LEN];
+
+struct rshim_record {
+  FILE *file;
+  pthread_mutex_t lock;
+  uint64_t last_us;
+  bool failed;
+
+  /* Backend APIs wrapped by the recorder. */
+  ssize_t (*write)(rshim_backend_t *bd, int devtype,
+                   const char *buf, size_t count);
+  ssize_t (*read)(rshim_backend_t *bd, int devtype, char *buf, size_t count);
+  int (*read_rshim)(rshim_backend_t *bd, uint32_t chan, uint32_t addr,
+                    uint64_t *value, int size);
+  int (*write_rshim)(rshim_backend_t *bd, uint32_t chan, uint32_t addr,
+                     uint64_t value, int size);
+  int (*write_rshim_posted)(rshim_backend_t *bd, uint32_t chan, uint32_t addr,
+                            uint64_t value, int size);
+};
+
+typedef struct {
+  rshim_backend_t bd;
+
+  /* Protects the replay position and statistics. */
+  pthread_mutex_t lock;
+
+  rshim_rec_t *recs;
+  uint64_t *due_us;     /* time of each record from the start */
+  uint8_t *data;        /* data of the bulk reads */
+  uint32_t num_recs;
+  uint32_t next;
+
+  bool started;
+  struct timespec start;
+  uint64_t start_us;
+  uint64_t served, skipped, missed;
+} rshim_replay_t;
+
+static uint64_t rshim_replay_time_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Recorder */
+
+static void rshim_record_add(rshim_backend_t *bd, int op, int chan,
+                             uint32_t addr, uint64_t value, int size, int rc,
+                             const void *data)
+{
+  struct rshim_record *record = bd->record;
+  rshim_rec_t rec;
+  uint64_t now;
+
+  memset(&rec, 0, sizeof(rec));
+  rec.addr = addr;
+  rec.value = value;
+  rec.rc = rc;
+  rec.op = op;
+  rec.chan = chan;
+  rec.size = size;
+
+  pthread_mutex_lock(&record->lock);
+  if (record->failed)
+    goto done;
+
+  now = rshim_replay_time_us();
+  rec.delta_us = MIN(now - record->last_us, UINT32_MAX);
+  record->last_us = now;
+
+  if (fwrite(&rec, sizeof(rec), 1, record->file) != 1 ||
+      (data && rc > 0 && fwrite(data, rc, 1, record->file) != 1)) {
+    RSHIM_ERR("rshim%d recording failed, stopped\n", bd->index);
+    record->failed = true;
+  }
+
+done:
+  pthread_mutex_unlock(&record->lock);
+}
+
+static int rshim_record_read_rshim(rshim_backend_t *bd, uint32_t chan,
+                                   uint32_t addr, uint64_t *value, int size)
+{
+  int rc;
+
+  rc = bd->record->read_rshim(bd, chan, addr, value, size);
+  rshim_record_add(bd, RSHIM_REC_READ_RSHIM, chan, addr, rc ? 0 : *value,
+                   size, rc, NULL);
+
+  return rc;
+}
+
+static int rshim_record_write_rshim(rshim_backend_t *bd, uint32_t chan,
+                                    uint32_t addr, uint64_t value, int size)
+{
+  int rc;
+
+  rc = bd->record->write_rshim(bd, chan, addr, value, size);
+  rshim_record_add(bd, RSHIM_REC_WRITE_RSHIM, chan, addr, value, size, rc,
+                   NULL);
+
+  return rc;
+}
+
+static int rshim_record_write_rshim_posted(rshim_backend_t *bd, uint32_t chan,
+                                           uint32_t addr, uint64_t value,
+                                           int size)
+{
+  int rc;
+
+  rc = bd->record->write_rshim_posted(bd, chan, addr, value, size);
+  rshim_record_add(bd, RSHIM_REC_WRITE_RSHIM_POSTED, chan, addr, value, size,
+                   rc, NULL);
+
+  return rc;
+}
+
+static ssize_t rshim_record_read(rshim_backend_t *bd, int devtype, char *buf,
+                                 size_t count)
+{
+  ssize_t len;
+
+  len = bd->record->read(bd, devtype, buf, count);
+  rshim_record_add(bd, RSHIM_REC_READ, devtype, count, 0, 0, len, buf);
+
+  return len;
+}
+
+static ssize_t rshim_record_write(rshim_backend_t *bd, int devtype,
+                                  const char *buf, size_t count)
+{
+  ssize_t len;
+
+  len = bd->record->write(bd, devtype, buf, count);
+  rshim_record_add(bd, RSHIM_REC_WRITE, devtype, count, 0, 0, len, NULL);
+
+  return len;
+}
+
+/* Start recording. Called from rshim_register() with the APIs set. */
+int rshim_record_init(rshim_backend_t *bd)
+{
+  struct rshim_record *record;
+  rshim_rec_file_hdr_t hdr;
+  char path[RSHIM_RECORD_DIR_LEN + 32];
+
+  if (!rshim_record_dir[0] || bd->record ||
+      !strncmp(bd->dev_name, RSHIM_REPLAY_PREFIX, strlen(RSHIM_REPLAY_PREFIX)))
+    return 0;
+
+  record = calloc(1, sizeof(*record));
+  if (!record)
+    return -ENOMEM;
+
+  snprintf(path, sizeof(path), "%s/rshim%d.rec", rshim_record_dir, bd->index);
+  record->file = fopen(path, "we");
+  if (!record->file) {
+    RSHIM_ERR("failed to open %s: %m\n", path);
+    free(record);
+    return -errno;
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = RSHIM_REC_MAGIC;
+  hdr.version = RSHIM_REC_VERSION;
+  hdr.ver_id = bd->ver_id;
+  hdr.rev_id = bd->rev_id;
+  snprintf(hdr.dev_name, sizeof(hdr.dev_name), "%s", bd->dev_name);
+  if (fwrite(&hdr, sizeof(hdr), 1, record->file) != 1) {
+    RSHIM_ERR("failed to write %s\n", path);
+    fclose(record->file);
+    free(record);
+    return -EIO;
+  }
+
+  pthread_mutex_init(&record->lock, NULL);
+  record->last_us = rshim_replay_time_us();
+
+  record->read = bd->read;
+  record->write = bd->write;
+  record->read_rshim = bd->read_rshim;
+  record->write_rshim = bd->write_rshim;
+  record->write_rshim_posted = bd->write_rshim_posted;
+
+  bd->record = record;
+  __sync_synchronize();
+
+  /* Bulk transfers on the register path are recorded as register accesses. */
+  if (rshim_has_bulk(bd)) {
+    bd->read = rshim_record_read;
+    bd->write = rshim_record_write;
+  }
+  bd->read_rshim = rshim_record_read_rshim;
+  bd->write_rshim = rshim_record_write_rshim;
+  if (record->write_rshim_posted)
+    bd->write_rshim_posted = rshim_record_write_rshim_posted;
+
+  RSHIM_INFO("rshim%d recording to %s\n", bd->index, path);
+  return 0;
+}
+
+/* Stop recording. Called from rshim_deregister(). */
+void rshim_record_free(rshim_backend_t *bd)
+{
+  struct rshim_record *record = bd->record;
+
+  if (!record)
+    return;
+
+  bd->read = record->read;
+  bd->write = record->write;
+  bd->read_rshim = record->read_rshim;
+  bd->write_rshim = record->write_rshim;
+  bd->write_rshim_posted = record->write_rshim_posted;
+  __sync_synchronize();
+
+  bd->record = NULL;
+  fclose(record->file);
+  pthread_mutex_destroy(&record->lock);
+  free(record);
+}
+
+/* Replay backend */
+
+static int rshim_replay_load(rshim_replay_t *dev, const char *path,
+                             rshim_rec_file_hdr_t *hdr)
+{
+  uint32_t max_recs = 0, data_len = 0;
+  uint64_t due = 0;
+  rshim_rec_t rec;
+  void *ptr;
+  FILE *file;
+  int rc = 0;
+
+  file = fopen(path, "re");
+  if (!file) {
+    RSHIM_ERR("failed to open %s: %m\n", path);
+    return -errno;
+  }
+
+  if (fread(hdr, sizeof(*hdr), 1, file) != 1 ||
+      hdr->magic != RSHIM_REC_MAGIC || hdr->version != RSHIM_REC_VERSION) {
+    RSHIM_ERR("%s is not a rshim recording\n", path);
+    rc = -EINVAL;
+    goto done;
+  }
+  hdr->dev_name[sizeof(hdr->dev_name) - 1] = 0;
+
+  while (fread(&rec, sizeof(rec), 1, file) == 1) {
+    if (dev->num_recs == max_recs) {
+      max_recs = max_recs ? max_recs * 2 : 4096;
+      ptr = realloc(dev->recs, max_recs * sizeof(*dev->recs));
+      if (!ptr) {
+        rc = -ENOMEM;
+        goto done;
+      }
+      dev->recs = ptr;
+      ptr = realloc(dev->due_us, max_recs * sizeof(*dev->due_us));
+      if (!ptr) {
+        rc = -ENOMEM;
+        goto done;
+      }
+      dev->due_us = ptr;
+    }
+
+    /* Keep the data of bulk reads in one buffer; 'value' is the offset. */
+    if (rec.op == RSHIM_REC_READ && rec.rc > 0) {
+      ptr = realloc(dev->data, data_len + rec.rc);
+      if (!ptr) {
+        rc = -ENOMEM;
+        goto done;
+      }
+      dev->data = ptr;
+      if (fread(dev->data + data_len, rec.rc, 1, file) != 1)
+        break;
+      rec.value = data_len;
+      data_len += rec.rc;
+    }
+
+    due += rec.delta_us;
+    dev->due_us[dev->num_recs] = due;
+    dev->recs[dev->num_recs++] = rec;
+  }
+
+  RSHIM_INFO("%s: %u records of %s, %llu ms\n", path, dev->num_recs,
+             hdr->dev_name, (unsigned long long)due / 1000);
+
+done:
+  fclose(file);
+  return rc;
+}
+
+static bool rshim_replay_match(rshim_rec_t *rec, int op, int chan,
+                               uint32_t addr)
+{
+  int rec_op = rec->op;
+
+  /* Posted and non-posted writes are interchangeable. */
+  if (rec_op == RSHIM_REC_WRITE_RSHIM_POSTED)
+    rec_op = RSHIM_REC_WRITE_RSHIM;
+
+  if (rec_op != op || rec->chan != chan)
+    return false;
+
+  return op == RSHIM_REC_READ || op == RSHIM_REC_WRITE || rec->addr == addr;
+}
+
+/*
+ * Find the record answering a call and wait until its time, relative to
+ * the first call. Returns NULL if there is no matching record.
+ */
+static rshim_rec_t *rshim_replay_next(rshim_replay_t *dev, int op, int chan,
+                                      uint32_t addr)
+{
+  uint64_t elapsed_us, due_us;
+  struct timespec ts;
+  uint32_t i, end;
+
+  pthread_mutex_lock(&dev->lock);
+
+  if (!dev->started) {
+    dev->started = true;
+    clock_gettime(CLOCK_MONOTONIC, &dev->start);
+    dev->start_us = dev->num_recs ? dev->due_us[0] : 0;
+  }
+
+  end = MIN(dev->num_recs, dev->next + RSHIM_REPLAY_LOOKAHEAD);
+  for (i = dev->next; i < end; i++) {
+    if (rshim_replay_match(&dev->recs[i], op, chan, addr))
+      break;
+  }
+
+  if (i == end) {
+    dev->missed++;
+    pthread_mutex_unlock(&dev->lock);
+    return NULL;
+  }
+
+  dev->skipped += i - dev->next;
+  dev->served++;
+  dev->next = i + 1;
+  due_us = dev->due_us[i] - dev->start_us;
+
+  if (dev->next == dev->num_recs) {
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    elapsed_us = (ts.tv_sec - dev->start.tv_sec) * 1000000 +
+                 (ts.tv_nsec - dev->start.tv_nsec) / 1000;
+    RSHIM_INFO("rshim%d replay done in %llu ms (recorded %llu ms): "
+               "%llu served, %llu skipped, %llu missed\n",
+               dev->bd.index, (unsigned long long)elapsed_us / 1000,
+               (unsigned long long)due_us / 1000,
+               (unsigned long long)dev->served,
+               (unsigned long long)dev->skipped,
+               (unsigned long long)dev->missed);
+  }
+
+  pthread_mutex_unlock(&dev->lock);
+
+  /* Keep the original pace. */
+  ts.tv_sec = dev->start.tv_sec + due_us / 1000000;
+  ts.tv_nsec = dev->start.tv_nsec + (due_us % 1000000) * 1000;
+  if (ts.tv_nsec >= 1000000000) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000;
+  }
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    ;
+
+  return &dev->recs[i];
+}
+
+static int rshim_replay_read_rshim(rshim_backend_t *bd, uint32_t chan,
+                                   uint32_t addr, uint64_t *value, int size)
+{
+  rshim_replay_t *dev = container_of(bd, rshim_replay_t, bd);
+  rshim_rec_t *rec;
+
+  rec = rshim_replay_next(dev, RSHIM_REC_READ_RSHIM, chan, addr);
+  if (!rec) {
+    *value = 0;
+    return 0;
+  }
+
+  *value = rec->value;
+  return rec->rc;
+}
+
+static int rshim_replay_write_rshim(rshim_backend_t *bd, uint32_t chan,
+                                    uint32_t addr, uint64_t value, int size)
+{
+  rshim_replay_t *dev = container_of(bd, rshim_replay_t, bd);
+  rshim_rec_t *rec;
+
+  rec = rshim_replay_next(dev, RSHIM_REC_WRITE_RSHIM, chan, addr);
+
+  return rec ? rec->rc : 0;
+}
+
+static ssize_t rshim_replay_read(rshim_backend_t *bd, int devtype, char *buf,
+                                 size_t count)
+{
+  rshim_replay_t *dev = container_of(bd, rshim_replay_t, bd);
+  rshim_rec_t *rec;
+
+  rec = rshim_replay_next(dev, RSHIM_REC_READ, devtype, 0);
+  if (!rec)
+    return 0;
+
+  if (rec->rc > 0)
+    memcpy(buf, dev->data + rec->value, MIN((size_t)rec->rc, count));
+
+  return rec->rc > 0 ? (ssize_t)MIN((size_t)rec->rc, count) : rec->rc;
+}
+
+static ssize_t rshim_replay_write(rshim_backend_t *bd, int devtype,
+                                  const char *buf, size_t count)
+{
+  rshim_replay_t *dev = container_of(bd, rshim_replay_t, bd);
+  rshim_rec_t *rec;
+
+  rec = rshim_replay_next(dev, RSHIM_REC_WRITE, devtype, 0);
+
+  return rec ? rec->rc : (ssize_t)count;
+}
+
+static void rshim_replay_delete(rshim_backend_t *bd)
+{
+  rshim_replay_t *dev = container_of(bd, rshim_replay_t, bd);
+
+  rshim_deregister(bd);
+  free(dev->recs);
+  free(dev->due_us);
+  free(dev->data);
+  free(dev);
+}
+
+/* Create the device of '-d replay-<file>'. */
+int rshim_replay_init(void)
+{
+  const char *dev_name = rshim_static_dev_name;
+  rshim_rec_file_hdr_t hdr;
+  rshim_backend_t *bd;
+  rshim_replay_t *dev;
+  bool has_bulk = false;
+  uint32_t i;
+  int rc;
+
+  if (!dev_name ||
+      strncmp(dev_name, RSHIM_REPLAY_PREFIX, strlen(RSHIM_REPLAY_PREFIX))) {
+    RSHIM_ERR("replay needs '-d %s<file>'\n", RSHIM_REPLAY_PREFIX);
+    return -EINVAL;
+  }
+
+  if (strlen(dev_name) >= RSHIM_DEV_NAME_LEN) {
+    RSHIM_ERR("replay file name too long\n");
+    return -ENAMETOOLONG;
+  }
+
+  if (!rshim_allow_device(dev_name))
+    return -EACCES;
+
+  dev = calloc(1, sizeof(*dev));
+  if (!dev)
+    return -ENOMEM;
+
+  rc = rshim_replay_load(dev, dev_name + strlen(RSHIM_REPLAY_PREFIX), &hdr);
+  if (rc) {
+    free(dev->recs);
+    free(dev->due_us);
+    free(dev->data);
+    free(dev);
+    return rc;
+  }
+
+  for (i = 0; i < dev->num_recs && !has_bulk; i++)
+    has_bulk = dev->recs[i].op == RSHIM_REC_READ ||
+               dev->recs[i].op == RSHIM_REC_WRITE;
+
+  bd = &dev->bd;
+  strcpy(bd->dev_name, dev_name);
+  bd->read_rshim = rshim_replay_read_rshim;
+  bd->write_rshim = rshim_replay_write_rshim;
+  if (has_bulk) {
+    bd->read = rshim_replay_read;
+    bd->write = rshim_replay_write;
+  }
+  bd->destroy = rshim_replay_delete;
+  bd->ver_id = hdr.ver_id;
+  bd->rev_id = hdr.rev_id;
+  bd->regs = (bd->ver_id == RSHIM_BLUEFIELD_3) ? &bf3_rshim_regs :
+                                                 &bf1_bf2_rshim_regs;
+  bd->reset_delay = 1;
+  pthread_mutex_init(&bd->mutex, NULL);
+  pthread_mutex_init(&dev->lock, NULL);
+
+  rshim_lock();
+  rshim_ref(bd);
+
+  pthread_mutex_lock(&bd->mutex);
+  bd->has_rshim = 1;
+  bd->has_tm = 1;
+  rc = rshim_register(bd);
+  if (!rc)
+    rc = rshim_notify(bd, RSH_EVENT_ATTACH, 0);
+  pthread_mutex_unlock(&bd->mutex);
+
+  if (rc)
+    rshim_deref(bd);
+  rshim_unlock();
+
+  return rc;
+}
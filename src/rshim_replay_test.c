@@ -0,0 +1,244 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2019 Mellanox Technologies. All Rights Reserved.
+ *
+ */
+
+/*
+ * Record and replay test, run by 'make check'.
+ *
+ * A device without its own bulk transfers (like PCIe) is recorded while it
+ * sends and receives TMFIFO data through the register path, and the
+ * recording is then replayed with the same calls. The replay has to answer
+ * every call from the recording, in order, with the recorded data.
+ *
+ * The recorder and the replay backend are included directly so their
+ * statistics can be checked; the driver APIs they use are stubbed below.
+ */
+
+#define _GNU_SOURCE     /* for asprintf() */
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "rshim_replay.c"
+
+#define TEST_STS        0x100   /* words in the tile-to-host FIFO */
+#define TEST_DATA       0x108   /* tile-to-host FIFO data */
+#define TEST_TX_DATA    0x110   /* host-to-tile FIFO data */
+#define TEST_SCRATCH    0x118
+
+#define TEST_ROUNDS     8
+#define TEST_WORDS      4
+
+int rshim_log_level = LOG_ERR;
+bool rshim_daemon_mode;
+char *rshim_static_dev_name;
+
+static rshim_backend_t *test_bd;
+static uint64_t test_next_word = 0x1122334455667788ULL;
+
+/* Registers of the recorded device. */
+static int test_dev_read_rshim(rshim_backend_t *bd, uint32_t chan,
+                               uint32_t addr, uint64_t *value, int size)
+{
+  switch (addr) {
+  case TEST_STS:
+    *value = TEST_WORDS;
+    break;
+  case TEST_DATA:
+    *value = test_next_word;
+    test_next_word = test_next_word * 6364136223846793005ULL + 1;
+    break;
+  default:
+    *value = 0;
+    break;
+  }
+
+  return 0;
+}
+
+static int test_dev_write_rshim(rshim_backend_t *bd, uint32_t chan,
+                                uint32_t addr, uint64_t value, int size)
+{
+  return 0;
+}
+
+/* Bulk transfers through the register path, like rshim_read_default(). */
+static ssize_t test_read_default(rshim_backend_t *bd, int devtype, char *buf,
+                                 size_t count)
+{
+  uint64_t avail, word;
+  size_t len = 0;
+  int rc;
+
+  rc = bd->read_rshim(bd, 0, TEST_STS, &avail, RSHIM_REG_SIZE_8B);
+  if (rc)
+    return rc;
+
+  while (avail-- && len + sizeof(word) <= count) {
+    rc = bd->read_rshim(bd, 0, TEST_DATA, &word, RSHIM_REG_SIZE_8B);
+    if (rc)
+      return rc;
+    memcpy(buf + len, &word, sizeof(word));
+    len += sizeof(word);
+  }
+
+  return len;
+}
+
+static ssize_t test_write_default(rshim_backend_t *bd, int devtype,
+                                  const char *buf, size_t count)
+{
+  uint64_t word;
+  size_t len;
+  int rc;
+
+  for (len = 0; len + sizeof(word) <= count; len += sizeof(word)) {
+    memcpy(&word, buf + len, sizeof(word));
+    rc = bd->write_rshim(bd, 0, TEST_TX_DATA, word, RSHIM_REG_SIZE_8B);
+    if (rc)
+      return rc;
+  }
+
+  return len;
+}
+
+/* Driver APIs used by the recorder and the replay backend. */
+
+bool rshim_has_bulk(rshim_backend_t *bd)
+{
+  return bd->read && bd->read != test_read_default;
+}
+
+int rshim_register(rshim_backend_t *bd)
+{
+  if (!bd->write)
+    bd->write = test_write_default;
+  if (!bd->read)
+    bd->read = test_read_default;
+
+  test_bd = bd;
+  return 0;
+}
+
+void rshim_deregister(rshim_backend_t *bd)
+{
+  test_bd = NULL;
+}
+
+int rshim_notify(rshim_backend_t *bd, int event, int code)
+{
+  return 0;
+}
+
+bool rshim_allow_device(const char *devname)
+{
+  return true;
+}
+
+void rshim_lock(void)
+{
+}
+
+void rshim_unlock(void)
+{
+}
+
+void rshim_ref(rshim_backend_t *bd)
+{
+}
+
+void rshim_deref(rshim_backend_t *bd)
+{
+}
+
+/* The same traffic for the recording and the replay. */
+static int test_run(rshim_backend_t *bd, uint8_t data[][TEST_WORDS * 8])
+{
+  char tx[TEST_WORDS * 8];
+  uint64_t value;
+  int i;
+
+  memset(tx, 0x5a, sizeof(tx));
+
+  for (i = 0; i < TEST_ROUNDS; i++) {
+    if (bd->write(bd, RSH_DEV_TYPE_TMFIFO, tx, sizeof(tx)) != sizeof(tx) ||
+        bd->read(bd, RSH_DEV_TYPE_TMFIFO, (char *)data[i],
+                 TEST_WORDS * 8) != TEST_WORDS * 8 ||
+        bd->write_rshim(bd, 0, TEST_SCRATCH, i, RSHIM_REG_SIZE_8B) ||
+        bd->read_rshim(bd, 0, TEST_SCRATCH, &value, RSHIM_REG_SIZE_8B)) {
+      fprintf(stderr, "round %d failed\n", i);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+int main(void)
+{
+  static uint8_t recorded[TEST_ROUNDS][TEST_WORDS * 8];
+  static uint8_t replayed[TEST_ROUNDS][TEST_WORDS * 8];
+  char dir[] = "/tmp/rshim-replay-XXXXXX";
+  char path[RSHIM_RECORD_DIR_LEN + 32];
+  static rshim_backend_t dev;
+  rshim_replay_t *replay;
+  int rc = 1;
+
+  if (!mkdtemp(dir)) {
+    perror("mkdtemp");
+    return 1;
+  }
+  snprintf(rshim_record_dir, sizeof(rshim_record_dir), "%s", dir);
+  snprintf(path, sizeof(path), "%s/rshim0.rec", dir);
+
+  /* Record a device which has only the register APIs. */
+  strcpy(dev.dev_name, "pcie-test");
+  dev.read_rshim = test_dev_read_rshim;
+  dev.write_rshim = test_dev_write_rshim;
+  rshim_register(&dev);
+  if (rshim_record_init(&dev) || !dev.record) {
+    fprintf(stderr, "failed to start recording\n");
+    goto done;
+  }
+  if (test_run(&dev, recorded))
+    goto done;
+  rshim_record_free(&dev);
+  rshim_deregister(&dev);
+
+  /* Replay it. */
+  rshim_record_dir[0] = 0;
+  if (asprintf(&rshim_static_dev_name, "%s%s", RSHIM_REPLAY_PREFIX,
+               path) < 0 ||
+      rshim_replay_init() || !test_bd) {
+    fprintf(stderr, "failed to replay %s\n", path);
+    goto done;
+  }
+  replay = container_of(test_bd, rshim_replay_t, bd);
+  if (test_run(test_bd, replayed))
+    goto done;
+
+  if (replay->next != replay->num_recs || replay->skipped ||
+      replay->missed) {
+    fprintf(stderr, "replay diverged: %u of %u records, %llu skipped, "
+            "%llu missed\n", replay->next, replay->num_recs,
+            (unsigned long long)replay->skipped,
+            (unsigned long long)replay->missed);
+    goto done;
+  }
+  if (memcmp(recorded, replayed, sizeof(recorded))) {
+    fprintf(stderr, "replayed data differs\n");
+    goto done;
+  }
+
+  printf("%u records replayed\n", replay->num_recs);
+  rc = 0;
+
+done:
+  if (test_bd && test_bd->destroy)
+    test_bd->destroy(test_bd);
+  free(rshim_static_dev_name);
+  unlink(path);
+  rmdir(dir);
+  return rc;
+}
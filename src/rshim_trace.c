@@ -0,0 +1,344 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2019 Mellanox Technologies. All Rights Reserved.
+ *
+ */
+
+#include <pthread.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#include "rshim.h"
+
+/*
+ * Flight recorder.
+ *
+ * Each device could have a ring of fixed-size binary records of the
+ * register accesses, bulk FIFO transfers, TMFIFO packet boundaries and FIFO
+ * head/tail snapshots, timestamped with the TSC. Writers only take a slot
+ * with an atomic increment, so recording doesn't take any lock and costs
+ * tens of nanoseconds. The ring is dumped to a file on SIGUSR1 or with
+ * 'TRACE_DUMP 1' in the misc file and decoded offline by rshim-trace.
+ *
+ * The register and bulk accesses are recorded by wrapping the backend APIs
+ * while the recorder is enabled, so nothing changes when it isn't.
+ */
+
+/* Number of records per device, 0 to disable the recorder. */
+int rshim_trace_size;
+
+/* Serializes writing the dump files. */
+static pthread_mutex_t rshim_trace_file_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct rshim_trace {
+  uint32_t mask;
+  volatile uint64_t next;
+
+  /* Start time for the TSC frequency estimate. */
+  uint64_t tsc_start;
+  struct timespec ts_start;
+
+  /* Backend APIs wrapped by the recorder. */
+  ssize_t (*write)(rshim_backend_t *bd, int devtype,
+                   const char *buf, size_t count);
+  ssize_t (*read)(rshim_backend_t *bd, int devtype, char *buf, size_t count);
+  int (*read_rshim)(rshim_backend_t *bd, uint32_t chan, uint32_t addr,
+                    uint64_t *value, int size);
+  int (*write_rshim)(rshim_backend_t *bd, uint32_t chan, uint32_t addr,
+                     uint64_t value, int size);
+  int (*write_rshim_posted)(rshim_backend_t *bd, uint32_t chan, uint32_t addr,
+                            uint64_t value, int size);
+
+  rshim_trace_rec_t recs[];
+};
+
+void rshim_trace_add(rshim_backend_t *bd, int type, int chan, uint32_t addr,
+                     uint64_t value, uint64_t start, int rc)
+{
+  struct rshim_trace *tr = bd->trace;
+  rshim_trace_rec_t *rec;
+  uint64_t now, seq;
+
+  now = rshim_trace_tsc();
+  if (!start)
+    start = now;
+
+  seq = __sync_fetch_and_add(&tr->next, 1);
+  rec = &tr->recs[seq & tr->mask];
+
+  /* Invalidate the slot first so a dump never mixes two records. */
+  rec->seq = 0;
+  __sync_synchronize();
+  rec->tsc = start;
+  rec->value = value;
+  rec->addr = addr;
+  rec->latency = (uint32_t)MIN(now - start, UINT32_MAX);
+  rec->rc = rc;
+  rec->type = type;
+  rec->chan = chan;
+  __sync_synchronize();
+  rec->seq = (uint32_t)seq + 1;
+}
+
+static int rshim_trace_read_rshim(rshim_backend_t *bd, uint32_t chan,
+                                  uint32_t addr, uint64_t *value, int size)
+{
+  uint64_t start = rshim_trace_tsc();
+  int rc;
+
+  rc = bd->trace->read_rshim(bd, chan, addr, value, size);
+  rshim_trace_add(bd, RSHIM_TRACE_REG_READ, chan, addr, rc ? 0 : *value,
+                  start, rc);
+
+  return rc;
+}
+
+static int rshim_trace_write_rshim(rshim_backend_t *bd, uint32_t chan,
+                                   uint32_t addr, uint64_t value, int size)
+{
+  uint64_t start = rshim_trace_tsc();
+  int rc;
+
+  rc = bd->trace->write_rshim(bd, chan, addr, value, size);
+  rshim_trace_add(bd, RSHIM_TRACE_REG_WRITE, chan, addr, value, start, rc);
+
+  return rc;
+}
+
+static int rshim_trace_write_rshim_posted(rshim_backend_t *bd, uint32_t chan,
+                                          uint32_t addr, uint64_t value,
+                                          int size)
+{
+  uint64_t start = rshim_trace_tsc();
+  int rc;
+
+  rc = bd->trace->write_rshim_posted(bd, chan, addr, value, size);
+  rshim_trace_add(bd, RSHIM_TRACE_REG_WRITE_POSTED, chan, addr, value, start,
+                  rc);
+
+  return rc;
+}
+
+static ssize_t rshim_trace_read(rshim_backend_t *bd, int devtype, char *buf,
+                                size_t count)
+{
+  uint64_t start = rshim_trace_tsc();
+  ssize_t len;
+
+  len = bd->trace->read(bd, devtype, buf, count);
+  rshim_trace_add(bd, RSHIM_TRACE_BULK_READ, devtype, count, len, start,
+                  len < 0 ? len : 0);
+
+  return len;
+}
+
+static ssize_t rshim_trace_write(rshim_backend_t *bd, int devtype,
+                                 const char *buf, size_t count)
+{
+  uint64_t start = rshim_trace_tsc();
+  ssize_t len;
+
+  len = bd->trace->write(bd, devtype, buf, count);
+  rshim_trace_add(bd, RSHIM_TRACE_BULK_WRITE, devtype, count, len, start,
+                  len < 0 ? len : 0);
+
+  return len;
+}
+
+/* Start the recorder. Called from rshim_register() with the APIs set. */
+int rshim_trace_init(rshim_backend_t *bd)
+{
+  struct rshim_trace *tr;
+  uint32_t size = 1;
+
+  if (rshim_trace_size <= 0 || bd->trace)
+    return 0;
+
+  while (size < (uint32_t)rshim_trace_size && size < (1U << 24))
+    size <<= 1;
+
+  tr = rshim_dev_alloc(bd, sizeof(*tr) + size * sizeof(rshim_trace_rec_t));
+  if (!tr)
+    return -ENOMEM;
+
+  tr->mask = size - 1;
+  tr->tsc_start = rshim_trace_tsc();
+  clock_gettime(CLOCK_MONOTONIC, &tr->ts_start);
+
+  tr->read = bd->read;
+  tr->write = bd->write;
+  tr->read_rshim = bd->read_rshim;
+  tr->write_rshim = bd->write_rshim;
+  tr->write_rshim_posted = bd->write_rshim_posted;
+
+  bd->trace = tr;
+  __sync_synchronize();
+
+  bd->read = rshim_trace_read;
+  bd->write = rshim_trace_write;
+  bd->read_rshim = rshim_trace_read_rshim;
+  bd->write_rshim = rshim_trace_write_rshim;
+  if (tr->write_rshim_posted)
+    bd->write_rshim_posted = rshim_trace_write_rshim_posted;
+
+  RSHIM_INFO("rshim%d flight recorder: %u records\n", bd->index, size);
+  return 0;
+}
+
+/* Stop the recorder. Called from rshim_deregister(). */
+void rshim_trace_free(rshim_backend_t *bd)
+{
+  struct rshim_trace *tr = bd->trace;
+
+  if (!tr)
+    return;
+
+  bd->read = tr->read;
+  bd->write = tr->write;
+  bd->read_rshim = tr->read_rshim;
+  bd->write_rshim = tr->write_rshim;
+  bd->write_rshim_posted = tr->write_rshim_posted;
+  __sync_synchronize();
+
+  bd->trace = NULL;
+  rshim_dev_free(tr, sizeof(*tr) +
+                     (tr->mask + 1) * sizeof(rshim_trace_rec_t));
+}
+
+static int rshim_trace_write_all(int fd, const void *data, size_t len)
+{
+  const char *p = data;
+  ssize_t n;
+
+  while (len) {
+    n = write(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -EIO;
+    p += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+uint64_t rshim_trace_count(rshim_backend_t *bd)
+{
+  return bd->trace ? bd->trace->next : 0;
+}
+
+/*
+ * Copy the valid records of the ring, oldest first. Each slot is read like
+ * a seqlock: its sequence number is checked before and after the copy, so
+ * a record which rshim_trace_add() overwrote meanwhile is skipped rather
+ * than dumped torn. Returns the number of records copied.
+ */
+static uint32_t rshim_trace_copy(struct rshim_trace *tr, uint64_t first,
+                                 uint64_t last, rshim_trace_rec_t *recs)
+{
+  rshim_trace_rec_t *rec;
+  uint32_t n = 0, tag;
+  uint64_t seq;
+
+  for (seq = first; seq < last; seq++) {
+    rec = &tr->recs[seq & tr->mask];
+
+    tag = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+    if (tag != (uint32_t)seq + 1)
+      continue;
+
+    memcpy(&recs[n], rec, sizeof(*rec));
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&rec->seq, __ATOMIC_RELAXED) != tag)
+      continue;
+
+    recs[n++].seq = tag;
+  }
+
+  return n;
+}
+
+/*
+ * Write the ring to RSHIM_CONS_SOCK_DIR/rshim<N>.trace. Recording continues
+ * during the dump; records overwritten in the meantime are skipped. Called
+ * without any lock held; bd->mutex is only held while the ring is copied,
+ * and the file is written from the copy.
+ */
+int rshim_trace_dump(rshim_backend_t *bd)
+{
+  struct rshim_trace *tr;
+  rshim_trace_file_hdr_t hdr;
+  rshim_trace_rec_t *recs;
+  uint64_t first, last, ns, tsc;
+  struct timespec ts;
+  char path[128];
+  int fd, rc = 0;
+  uint32_t n;
+
+  pthread_mutex_lock(&bd->mutex);
+
+  tr = bd->trace;
+  if (!tr) {
+    pthread_mutex_unlock(&bd->mutex);
+    return -ENODEV;
+  }
+
+  last = tr->next;
+  first = last > tr->mask ? last - tr->mask - 1 : 0;
+
+  recs = malloc((last - first) * sizeof(*recs) + 1);
+  if (!recs) {
+    pthread_mutex_unlock(&bd->mutex);
+    return -ENOMEM;
+  }
+
+  n = rshim_trace_copy(tr, first, last, recs);
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = RSHIM_TRACE_MAGIC;
+  hdr.version = RSHIM_TRACE_VERSION;
+  hdr.rec_size = sizeof(rshim_trace_rec_t);
+  hdr.num_recs = n;
+  hdr.index = bd->index;
+  snprintf(hdr.dev_name, sizeof(hdr.dev_name), "%s", bd->dev_name);
+  hdr.tsc_start = tr->tsc_start;
+  hdr.lost = last - n;
+
+  tsc = rshim_trace_tsc();
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  ns = (ts.tv_sec - tr->ts_start.tv_sec) * 1000000000ULL +
+       ts.tv_nsec - tr->ts_start.tv_nsec;
+  if (ns)
+    hdr.tsc_hz = (uint64_t)((double)(tsc - tr->tsc_start) * 1e9 / ns);
+
+  pthread_mutex_unlock(&bd->mutex);
+
+  /* Dumps of the same device from the misc file and SIGUSR1 could race. */
+  pthread_mutex_lock(&rshim_trace_file_lock);
+  mkdir(RSHIM_CONS_SOCK_DIR, 0755);
+  snprintf(path, sizeof(path), "%s/rshim%d.trace", RSHIM_CONS_SOCK_DIR,
+           hdr.index);
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    rc = -errno;
+    RSHIM_ERR("failed to open %s: %m\n", path);
+    goto done;
+  }
+
+  if (rshim_trace_write_all(fd, &hdr, sizeof(hdr)) ||
+      rshim_trace_write_all(fd, recs, n * sizeof(*recs))) {
+    rc = -EIO;
+    RSHIM_ERR("failed to write %s\n", path);
+  } else {
+    RSHIM_INFO("rshim%d: %u trace records dumped to %s\n", hdr.index, n,
+               path);
+  }
+
+  close(fd);
+done:
+  pthread_mutex_unlock(&rshim_trace_file_lock);
+  free(recs);
+  return rc;
+}
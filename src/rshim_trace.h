@@ -0,0 +1,77 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Copyright (C) 2019 Mellanox Technologies. All Rights Reserved.
+ *
+ */
+
+#ifndef _RSHIM_TRACE_H
+#define _RSHIM_TRACE_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Flight recorder records and dump file format, shared by the daemon and
+ * the rshim-trace decoder. A dump file is a rshim_trace_file_hdr_t followed
+ * by 'num_recs' records, oldest first.
+ */
+
+#define RSHIM_TRACE_MAGIC       0x4543415254485352ULL   /* "RSHTRACE" */
+#define RSHIM_TRACE_VERSION     1
+
+/* Event types and how the record fields are used. */
+enum {
+  RSHIM_TRACE_REG_READ = 1,     /* chan, addr, value, latency, rc */
+  RSHIM_TRACE_REG_WRITE,        /* chan, addr, value, latency, rc */
+  RSHIM_TRACE_REG_WRITE_POSTED, /* chan, addr, value, latency, rc */
+  RSHIM_TRACE_BULK_READ,        /* chan=devtype, addr=count, value=result */
+  RSHIM_TRACE_BULK_WRITE,       /* chan=devtype, addr=count, value=result */
+  RSHIM_TRACE_RX_PKT,           /* chan, addr=msg type, value=msg length */
+  RSHIM_TRACE_TX_PKT,           /* chan, addr=msg type, value=msg length */
+  RSHIM_TRACE_RX_FIFO,          /* chan, addr=head, value=tail */
+  RSHIM_TRACE_TX_FIFO,          /* chan, addr=head, value=tail */
+  RSHIM_TRACE_TYPES
+};
+
+typedef struct {
+  uint64_t tsc;                 /* timestamp, in TSC ticks */
+  uint64_t value;
+  uint32_t addr;
+  uint32_t latency;             /* in TSC ticks */
+  uint32_t seq;                 /* low 32 bits of the sequence number + 1 */
+  int16_t rc;
+  uint8_t type;
+  uint8_t chan;
+} rshim_trace_rec_t;
+
+typedef struct {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t rec_size;
+  uint32_t num_recs;
+  int32_t index;
+  char dev_name[64];
+  uint64_t tsc_hz;              /* TSC frequency, 0 if unknown */
+  uint64_t tsc_start;           /* TSC when the recorder was started */
+  uint64_t lost;                /* records overwritten or incomplete */
+} rshim_trace_file_hdr_t;
+
+/* Cheap timestamp: TSC on x86, the virtual counter on Arm, ns otherwise. */
+static inline uint64_t rshim_trace_tsc(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+  uint64_t v;
+
+  __asm__ __volatile__("mrs %0, cntvct_el0" : "=r" (v));
+  return v;
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+#endif /* _RSHIM_TRACE_H */
@@ -0,0 +1,183 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2019 Mellanox Technologies. All Rights Reserved.
+ *
+ */
+
+/*
+ * rshim-trace: decode a flight recorder dump of the rshim daemon
+ * (RSHIM_CONS_SOCK_DIR/rshim<N>.trace) into text, with a per-event summary
+ * of the counts and latencies.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "rshim_trace.h"
+
+static const char *rshim_trace_names[RSHIM_TRACE_TYPES] = {
+  [RSHIM_TRACE_REG_READ] = "REG_READ",
+  [RSHIM_TRACE_REG_WRITE] = "REG_WRITE",
+  [RSHIM_TRACE_REG_WRITE_POSTED] = "REG_WRITE_POSTED",
+  [RSHIM_TRACE_BULK_READ] = "BULK_READ",
+  [RSHIM_TRACE_BULK_WRITE] = "BULK_WRITE",
+  [RSHIM_TRACE_RX_PKT] = "RX_PKT",
+  [RSHIM_TRACE_TX_PKT] = "TX_PKT",
+  [RSHIM_TRACE_RX_FIFO] = "RX_FIFO",
+  [RSHIM_TRACE_TX_FIFO] = "TX_FIFO",
+};
+
+static struct {
+  uint64_t count;
+  double total_ns;
+  double max_ns;
+} rshim_trace_stats[RSHIM_TRACE_TYPES];
+
+static double rshim_trace_ns(const rshim_trace_file_hdr_t *hdr, uint64_t tsc)
+{
+  return hdr->tsc_hz ? (double)tsc * 1e9 / hdr->tsc_hz : (double)tsc;
+}
+
+static void rshim_trace_print(const rshim_trace_file_hdr_t *hdr,
+                              const rshim_trace_rec_t *rec)
+{
+  double t = rshim_trace_ns(hdr, rec->tsc - hdr->tsc_start) / 1000;
+  double lat = rshim_trace_ns(hdr, rec->latency);
+
+  printf("%14.3f %-16s ", t, rshim_trace_names[rec->type]);
+
+  switch (rec->type) {
+  case RSHIM_TRACE_REG_READ:
+  case RSHIM_TRACE_REG_WRITE:
+  case RSHIM_TRACE_REG_WRITE_POSTED:
+    printf("chan %u addr 0x%04x value 0x%016" PRIx64 " lat %.0fns",
+           rec->chan, rec->addr, rec->value, lat);
+    break;
+  case RSHIM_TRACE_BULK_READ:
+  case RSHIM_TRACE_BULK_WRITE:
+    printf("devtype %u count %u result %" PRId64 " lat %.0fns",
+           rec->chan, rec->addr, (int64_t)rec->value, lat);
+    break;
+  case RSHIM_TRACE_RX_PKT:
+  case RSHIM_TRACE_TX_PKT:
+    printf("chan %u type %u len %" PRIu64, rec->chan, rec->addr, rec->value);
+    break;
+  case RSHIM_TRACE_RX_FIFO:
+  case RSHIM_TRACE_TX_FIFO:
+    printf("chan %u head %u tail %" PRIu64, rec->chan, rec->addr, rec->value);
+    break;
+  }
+
+  if (rec->rc)
+    printf(" rc %d", rec->rc);
+  printf("\n");
+}
+
+static void print_help(void)
+{
+  printf("Usage: rshim-trace [options] <file>\n");
+  printf("\n");
+  printf("OPTIONS:\n");
+  printf("  -s  print the summary only\n");
+  printf("  -h  help\n");
+}
+
+int main(int argc, char *argv[])
+{
+  rshim_trace_file_hdr_t hdr;
+  rshim_trace_rec_t rec;
+  bool summary_only = false;
+  uint64_t prev = 0, gap_tsc = 0;
+  double ns;
+  uint32_t i;
+  FILE *file;
+  int c;
+
+  while ((c = getopt(argc, argv, "sh")) != -1) {
+    switch (c) {
+    case 's':
+      summary_only = true;
+      break;
+    case 'h':
+    default:
+      print_help();
+      return c == 'h' ? 0 : 1;
+    }
+  }
+
+  if (optind != argc - 1) {
+    print_help();
+    return 1;
+  }
+
+  file = fopen(argv[optind], "rb");
+  if (!file) {
+    perror(argv[optind]);
+    return 1;
+  }
+
+  if (fread(&hdr, sizeof(hdr), 1, file) != 1 ||
+      hdr.magic != RSHIM_TRACE_MAGIC) {
+    fprintf(stderr, "%s: not a rshim trace file\n", argv[optind]);
+    fclose(file);
+    return 1;
+  }
+
+  if (hdr.version != RSHIM_TRACE_VERSION ||
+      hdr.rec_size != sizeof(rshim_trace_rec_t)) {
+    fprintf(stderr, "%s: unsupported version %u\n", argv[optind],
+            hdr.version);
+    fclose(file);
+    return 1;
+  }
+
+  hdr.dev_name[sizeof(hdr.dev_name) - 1] = 0;
+  printf("rshim%d (%s): %u records, %" PRIu64 " lost, TSC %.3f MHz\n",
+         hdr.index, hdr.dev_name, hdr.num_recs, hdr.lost,
+         hdr.tsc_hz / 1e6);
+  if (!summary_only)
+    printf("%14s %-16s\n", "time(us)", "event");
+
+  for (i = 0; i < hdr.num_recs; i++) {
+    if (fread(&rec, sizeof(rec), 1, file) != 1) {
+      fprintf(stderr, "%s: truncated\n", argv[optind]);
+      break;
+    }
+
+    if (!rec.type || rec.type >= RSHIM_TRACE_TYPES)
+      continue;
+
+    if (!summary_only)
+      rshim_trace_print(&hdr, &rec);
+
+    ns = rshim_trace_ns(&hdr, rec.latency);
+    rshim_trace_stats[rec.type].count++;
+    rshim_trace_stats[rec.type].total_ns += ns;
+    if (ns > rshim_trace_stats[rec.type].max_ns)
+      rshim_trace_stats[rec.type].max_ns = ns;
+
+    if (prev && rec.tsc > prev && rec.tsc - prev > gap_tsc)
+      gap_tsc = rec.tsc - prev;
+    prev = rec.tsc;
+  }
+
+  fclose(file);
+
+  printf("\n%-16s %10s %12s %12s\n", "event", "count", "avg(ns)", "max(ns)");
+  for (i = 1; i < RSHIM_TRACE_TYPES; i++) {
+    if (!rshim_trace_stats[i].count)
+      continue;
+    printf("%-16s %10" PRIu64 " %12.0f %12.0f\n", rshim_trace_names[i],
+           rshim_trace_stats[i].count,
+           rshim_trace_stats[i].total_ns / rshim_trace_stats[i].count,
+           rshim_trace_stats[i].max_ns);
+  }
+  printf("longest gap between events: %.3f us\n",
+         rshim_trace_ns(&hdr, gap_tsc) / 1000);
+
+  return 0;
+}
@@ -6,8 +6,6 @@
 
 #include <libusb.h>
 #include <string.h>
-#include <poll.h>
-#include <sys/epoll.h>
 #include <pthread.h>
 
 #include "rshim.h"
@@ -22,6 +20,41 @@
 #define WRITE_RETRIES      5
 #define RSHIM_USB_TIMEOUT  20000
 
+/* Max number of posted control writes in flight per device. */
+#define RSHIM_USB_MAX_POSTED_WRITES  16
+
+/* Max number of posted control writes waiting to be submitted. */
+#define RSHIM_USB_POSTED_QUEUE_SIZE  64
+
+/* Max number of device departures waiting for the main loop. */
+#define RSHIM_USB_MAX_LEFT  16
+
+/*
+ * Min interval of background register polls. Each access is a control
+ * transfer, so polling faster would starve the other users of the device.
+ */
+#define RSHIM_USB_REG_POLL_MIN  5000
+
+/* Number of cached register values per device. */
+#define RSHIM_USB_CACHE_SIZE  16
+
+/* Register cache policies. Registers not in the policy table are volatile. */
+enum {
+  RSHIM_USB_CACHE_VOLATILE,   /* Always read from the device. */
+  RSHIM_USB_CACHE_STATIC,     /* Read once per device attach. */
+  RSHIM_USB_CACHE_RESET       /* Like static, also invalidated on reset. */
+};
+
+/* Cached register value. */
+typedef struct {
+  uint32_t chan;
+  uint32_t addr;
+  uint64_t value;
+  uint8_t size;
+  uint8_t policy;
+  bool valid;
+} rshim_usb_cache_t;
+
 #define BF_MMIO_BASE 0x1000
 
 /* Structure to hold all of our device specific stuff. */
@@ -31,8 +64,23 @@ typedef struct {
 
   libusb_device_handle *handle;
 
-  /* Control data. */
-  uint64_t ctrl_data;
+  /*
+   * Posted control writes, protected by posted_lock. Up to
+   * RSHIM_USB_MAX_POSTED_WRITES are submitted, the others wait in the
+   * queue and are submitted as the earlier ones complete.
+   */
+  int posted_writes;
+  struct libusb_transfer *posted_queue[RSHIM_USB_POSTED_QUEUE_SIZE];
+  int posted_head;
+  int posted_count;
+  pthread_mutex_t posted_lock;
+
+  /* The device left; close the handle once the posted writes are done. */
+  bool gone;
+
+  /* Register cache, protected by cache_lock. */
+  rshim_usb_cache_t cache[RSHIM_USB_CACHE_SIZE];
+  pthread_mutex_t cache_lock;
 
   /* Interrupt data buffer.  This is a USB DMA'able buffer. */
   uint64_t *intr_buf;
@@ -57,9 +105,57 @@ typedef struct {
 } rshim_usb_t;
 
 static libusb_context *rshim_usb_ctx;
-static int rshim_usb_epoll_fd;
+static pthread_t rshim_usb_thread;
 static bool rshim_usb_need_probe;
 
+/*
+ * Devices which left, reported by the hotplug callback and disconnected by
+ * rshim_usb_poll() in the main loop, which is the only thread that frees
+ * devices or walks rshim_devs[] without rshim_lock.
+ */
+static libusb_device *rshim_usb_left[RSHIM_USB_MAX_LEFT];
+static int rshim_usb_num_left;
+static pthread_mutex_t rshim_usb_left_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Devices whose last reference was dropped by a transfer completion on the
+ * event thread, destroyed by rshim_usb_poll() in the main loop. Protected
+ * by rshim_usb_left_lock.
+ */
+static rshim_backend_t *rshim_usb_dead[RSHIM_MAX_DEV];
+static int rshim_usb_num_dead;
+
+/* A device which left has no posted write in flight anymore. */
+static volatile bool rshim_usb_need_close;
+
+/* Drop a reference off the main loop, deferring the destroy to it. */
+static void rshim_usb_deref(rshim_backend_t *bd)
+{
+  if (__sync_sub_and_fetch(&bd->ref, 1))
+    return;
+
+  pthread_mutex_lock(&rshim_usb_left_lock);
+  rshim_usb_dead[rshim_usb_num_dead++] = bd;
+  pthread_mutex_unlock(&rshim_usb_left_lock);
+  rshim_work_signal(NULL);
+}
+
+/* Destroy the devices queued by rshim_usb_deref(), with rshim_lock held. */
+static void rshim_usb_reap(void)
+{
+  rshim_backend_t *dead[RSHIM_MAX_DEV];
+  int i, num;
+
+  pthread_mutex_lock(&rshim_usb_left_lock);
+  num = rshim_usb_num_dead;
+  memcpy(dead, rshim_usb_dead, num * sizeof(dead[0]));
+  rshim_usb_num_dead = 0;
+  pthread_mutex_unlock(&rshim_usb_left_lock);
+
+  for (i = 0; i < num; i++)
+    dead[i]->destroy(dead[i]);
+}
+
 static int rshim_usb_product_ids[] = {
   USB_BLUEFIELD_1_PRODUCT_ID,
   USB_BLUEFIELD_2_PRODUCT_ID,
@@ -156,6 +252,234 @@ static struct rshim_usb_addr get_wvalue_windex(int chan, int addr,
   return rsh_usb_addr;
 }
 
+/*
+ * Register cache policy table. An entry matches either the register at
+ * 'reg' (offset in struct rshim_regs) or a fixed 'addr' range. Only list
+ * registers which nothing but a reset changes; boot_control for example
+ * stays volatile since the DPU updates it at runtime (mlxbf-bootctl).
+ */
+static const struct {
+  uint32_t chan;
+  int reg;
+  uint32_t addr;
+  uint32_t len;
+  uint16_t ver_id;            /* 0 for all the versions */
+  uint8_t policy;
+} rshim_usb_cache_policies[] = {
+  {
+    .chan = RSHIM_CHANNEL,
+    .reg = offsetof(struct rshim_regs, fabric_dim),
+    .policy = RSHIM_USB_CACHE_STATIC,
+  },
+  {
+    .chan = YU_CHANNEL,
+    .reg = -1,
+    .addr = RSHIM_YU_BF3_BOOT_RECORD_OPN,
+    .len = RSHIM_YU_BOOT_RECORD_OPN_SIZE,
+    .ver_id = RSHIM_BLUEFIELD_3,
+    .policy = RSHIM_USB_CACHE_STATIC,
+  },
+};
+
+static int rshim_usb_cache_policy(rshim_backend_t *bd, uint32_t chan,
+                                  uint32_t addr)
+{
+  uint32_t reg_addr;
+  int i;
+
+  for (i = 0; i < (int)(sizeof(rshim_usb_cache_policies) /
+                        sizeof(rshim_usb_cache_policies[0])); i++) {
+    if (rshim_usb_cache_policies[i].chan != chan)
+      continue;
+    if (rshim_usb_cache_policies[i].ver_id &&
+        rshim_usb_cache_policies[i].ver_id != bd->ver_id)
+      continue;
+    if (rshim_usb_cache_policies[i].reg >= 0) {
+      reg_addr = *(const uint32_t *)((const char *)bd->regs +
+                                     rshim_usb_cache_policies[i].reg);
+      if (addr == reg_addr)
+        return rshim_usb_cache_policies[i].policy;
+    } else if (addr >= rshim_usb_cache_policies[i].addr &&
+               addr < rshim_usb_cache_policies[i].addr +
+                      rshim_usb_cache_policies[i].len) {
+      return rshim_usb_cache_policies[i].policy;
+    }
+  }
+
+  return RSHIM_USB_CACHE_VOLATILE;
+}
+
+/* Find the cache entry, called with cache_lock held. */
+static rshim_usb_cache_t *rshim_usb_cache_find(rshim_usb_t *dev, uint32_t chan,
+                                               uint32_t addr, int size)
+{
+  int i;
+
+  for (i = 0; i < RSHIM_USB_CACHE_SIZE; i++) {
+    if (dev->cache[i].valid && dev->cache[i].chan == chan &&
+        dev->cache[i].addr == addr && dev->cache[i].size == size)
+      return &dev->cache[i];
+  }
+
+  return NULL;
+}
+
+static bool rshim_usb_cache_get(rshim_usb_t *dev, uint32_t chan,
+                                uint32_t addr, int size, uint64_t *value)
+{
+  rshim_usb_cache_t *entry;
+
+  pthread_mutex_lock(&dev->cache_lock);
+  entry = rshim_usb_cache_find(dev, chan, addr, size);
+  if (entry)
+    *value = entry->value;
+  pthread_mutex_unlock(&dev->cache_lock);
+
+  return entry != NULL;
+}
+
+static void rshim_usb_cache_put(rshim_usb_t *dev, uint32_t chan, uint32_t addr,
+                                int size, uint64_t value, int policy)
+{
+  rshim_usb_cache_t *entry;
+  int i;
+
+  /*
+   * Zero or all-ones values are also what a device which isn't ready yet
+   * returns, so don't cache them for the static registers.
+   */
+  if (RSHIM_BAD_CTRL_REG(value) ||
+      (policy == RSHIM_USB_CACHE_STATIC && !value))
+    return;
+
+  pthread_mutex_lock(&dev->cache_lock);
+
+  /* Another thread might have missed and filled the same entry meanwhile. */
+  entry = rshim_usb_cache_find(dev, chan, addr, size);
+  if (entry) {
+    entry->value = value;
+    pthread_mutex_unlock(&dev->cache_lock);
+    return;
+  }
+
+  for (i = 0; i < RSHIM_USB_CACHE_SIZE; i++) {
+    if (!dev->cache[i].valid) {
+      dev->cache[i].chan = chan;
+      dev->cache[i].addr = addr;
+      dev->cache[i].size = size;
+      dev->cache[i].value = value;
+      dev->cache[i].policy = policy;
+      dev->cache[i].valid = true;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&dev->cache_lock);
+}
+
+/*
+ * Invalidate the cache. A write invalidates the entries of the written
+ * register, a SW reset the entries with the RESET policy, and a (re)attach
+ * everything.
+ */
+static void rshim_usb_cache_invalidate(rshim_backend_t *bd, uint32_t chan,
+                                       uint32_t addr, int policy)
+{
+  rshim_usb_t *dev = container_of(bd, rshim_usb_t, bd);
+  rshim_usb_cache_t *entry;
+  int i;
+
+  pthread_mutex_lock(&dev->cache_lock);
+  for (i = 0; i < RSHIM_USB_CACHE_SIZE; i++) {
+    entry = &dev->cache[i];
+    if (!entry->valid)
+      continue;
+    if (policy == RSHIM_USB_CACHE_VOLATILE) {
+      if (entry->chan == chan && entry->addr == addr)
+        entry->valid = false;
+    } else if (entry->policy >= policy) {
+      entry->valid = false;
+    }
+  }
+  pthread_mutex_unlock(&dev->cache_lock);
+}
+
+/* Invalidate cached values affected by a write. */
+static void rshim_usb_cache_write(rshim_backend_t *bd, uint32_t chan,
+                                  uint32_t addr)
+{
+  if (chan == RSHIM_CHANNEL && addr == bd->regs->reset_control)
+    rshim_usb_cache_invalidate(bd, 0, 0, RSHIM_USB_CACHE_RESET);
+  else if (rshim_usb_cache_policy(bd, chan, addr) != RSHIM_USB_CACHE_VOLATILE)
+    rshim_usb_cache_invalidate(bd, chan, addr, RSHIM_USB_CACHE_VOLATILE);
+}
+
+/* Submit a posted write, called with posted_lock held. */
+static int rshim_usb_posted_submit(rshim_usb_t *dev,
+                                   struct libusb_transfer *urb)
+{
+  int rc;
+
+  rc = libusb_submit_transfer(urb);
+  if (rc) {
+    RSHIM_DBG("rshim%d posted write submit failed, rc=%d\n", dev->bd.index,
+              rc);
+    return rc;
+  }
+
+  dev->posted_writes++;
+  return 0;
+}
+
+/*
+ * Submit the queued posted writes, all of them if <all> or else up to the
+ * in-flight limit. Called with posted_lock held. A write which can't be
+ * submitted is dropped, which also drops the device reference it holds;
+ * the caller holds another one.
+ */
+static void rshim_usb_posted_kick(rshim_usb_t *dev, bool all)
+{
+  struct libusb_transfer *urb;
+
+  while (dev->posted_count &&
+         (all || dev->posted_writes < RSHIM_USB_MAX_POSTED_WRITES)) {
+    urb = dev->posted_queue[dev->posted_head];
+    dev->posted_head = (dev->posted_head + 1) % RSHIM_USB_POSTED_QUEUE_SIZE;
+    dev->posted_count--;
+
+    if (rshim_usb_posted_submit(dev, urb)) {
+      libusb_free_transfer(urb);
+      rshim_deref(&dev->bd);
+    }
+  }
+}
+
+/*
+ * Submit the queued posted writes before a blocking transfer, so that it's
+ * still ordered after them.
+ */
+static void rshim_usb_posted_flush(rshim_usb_t *dev)
+{
+  pthread_mutex_lock(&dev->posted_lock);
+  rshim_usb_posted_kick(dev, true);
+  pthread_mutex_unlock(&dev->posted_lock);
+}
+
+/* Drop the queued posted writes when the device goes away. */
+static void rshim_usb_posted_drop(rshim_usb_t *dev)
+{
+  struct libusb_transfer *urb;
+
+  pthread_mutex_lock(&dev->posted_lock);
+  while (dev->posted_count) {
+    urb = dev->posted_queue[dev->posted_head];
+    dev->posted_head = (dev->posted_head + 1) % RSHIM_USB_POSTED_QUEUE_SIZE;
+    dev->posted_count--;
+    libusb_free_transfer(urb);
+    rshim_deref(&dev->bd);
+  }
+  pthread_mutex_unlock(&dev->posted_lock);
+}
+
 /* Rshim read/write routines */
 
 static int rshim_usb_read_rshim(rshim_backend_t *bd, uint32_t chan,
@@ -163,26 +487,41 @@ static int rshim_usb_read_rshim(rshim_backend_t *bd, uint32_t chan,
 {
   rshim_usb_t *dev = container_of(bd, rshim_usb_t, bd);
   struct rshim_usb_addr rsh_usb_addr;
-  int rc;
+  uint64_t ctrl_data = 0;
+  int rc, policy;
 
-  if (!bd->has_rshim)
-    return -ENODEV;
+  RSHIM_PROBE4(read_rshim, bd->index, chan, addr, size);
+
+  if (!bd->has_rshim) {
+    rc = -ENODEV;
+    goto done;
+  }
 
   if ((bd->ver_id == RSHIM_BLUEFIELD_3) && (size <= RSHIM_REG_SIZE_4B))
     size = RSHIM_REG_SIZE_4B;
   else
     size = RSHIM_REG_SIZE_8B;
 
+  policy = rshim_usb_cache_policy(bd, chan, addr);
+  if (policy != RSHIM_USB_CACHE_VOLATILE &&
+      rshim_usb_cache_get(dev, chan, addr, size, result)) {
+    rc = 0;
+    goto done;
+  }
+
+  rshim_usb_posted_flush(dev);
   rsh_usb_addr = get_wvalue_windex(chan, addr, bd->ver_id);
 
-  /* Do a blocking control read and endian conversion. */
-  dev->ctrl_data = 0;
+  /*
+   * Do a blocking control read and endian conversion. The data buffer is on
+   * the stack since this could be called from multiple threads.
+   */
   rc = libusb_control_transfer(dev->handle,
                                LIBUSB_ENDPOINT_IN |
                                LIBUSB_REQUEST_TYPE_VENDOR |
                                LIBUSB_RECIPIENT_ENDPOINT,
                                0, rsh_usb_addr.wvalue, rsh_usb_addr.windex,
-                               (unsigned char *)&dev->ctrl_data, size,
+                               (unsigned char *)&ctrl_data, size,
                                RSHIM_USB_TIMEOUT);
 
   /*
@@ -190,16 +529,23 @@ static int rshim_usb_read_rshim(rshim_backend_t *bd, uint32_t chan,
    * regardless of endianness settings either in the host or the ARM
    * cores.
    */
-  *result = le64toh(dev->ctrl_data);
-  if (rc == size)
-    return 0;
+  *result = le64toh(ctrl_data);
+  if (rc == size) {
+    if (policy != RSHIM_USB_CACHE_VOLATILE)
+      rshim_usb_cache_put(dev, chan, addr, size, *result, policy);
+    rc = 0;
+  } else {
+    /*
+     * These are weird error codes, but we want to use something
+     * the USB stack doesn't use so that we can identify short/long
+     * reads.
+     */
+    rc = rc >= 0 ? (rc > size ? -EINVAL : -ENXIO) : rc;
+  }
 
-  /*
-   * These are weird error codes, but we want to use something
-   * the USB stack doesn't use so that we can identify short/long
-   * reads.
-   */
-  return rc >= 0 ? (rc > size ? -EINVAL : -ENXIO) : rc;
+done:
+  RSHIM_PROBE4(read_rshim_return, bd->index, chan, rc ? 0 : *result, rc);
+  return rc;
 }
 
 static int rshim_usb_write_rshim(rshim_backend_t *bd, uint32_t chan,
@@ -207,10 +553,15 @@ static int rshim_usb_write_rshim(rshim_backend_t *bd, uint32_t chan,
 {
   rshim_usb_t *dev = container_of(bd, rshim_usb_t, bd);
   struct rshim_usb_addr rsh_usb_addr;
+  uint64_t ctrl_data;
   int rc;
 
-  if (!bd->has_rshim)
-    return -ENODEV;
+  RSHIM_PROBE5(write_rshim, bd->index, chan, addr, value, size);
+
+  if (!bd->has_rshim) {
+    rc = -ENODEV;
+    goto done;
+  }
 
   if ((bd->ver_id == RSHIM_BLUEFIELD_3) && (size <= RSHIM_REG_SIZE_4B))
     size = RSHIM_REG_SIZE_4B;
@@ -218,26 +569,135 @@ static int rshim_usb_write_rshim(rshim_backend_t *bd, uint32_t chan,
     size = RSHIM_REG_SIZE_8B;
 
   rsh_usb_addr = get_wvalue_windex(chan, addr, bd->ver_id);
+  rshim_usb_cache_write(bd, chan, addr);
+  rshim_usb_posted_flush(dev);
 
   /* Convert the word to little endian and do blocking control write. */
-  dev->ctrl_data = htole64(value);
+  ctrl_data = htole64(value);
   rc = libusb_control_transfer(dev->handle,
                                LIBUSB_ENDPOINT_OUT |
                                LIBUSB_REQUEST_TYPE_VENDOR |
                                LIBUSB_RECIPIENT_ENDPOINT,
                                0, rsh_usb_addr.wvalue, rsh_usb_addr.windex,
-                               (unsigned char *)&dev->ctrl_data, size,
+                               (unsigned char *)&ctrl_data, size,
                                RSHIM_USB_TIMEOUT);
 
-  if (rc == size)
-    return 0;
-
   /*
    * These are weird error codes, but we want to use something
    * the USB stack doesn't use so that we can identify short/long
    * writes.
    */
-  return rc >= 0 ? (rc > size ? -EINVAL : -ENXIO) : rc;
+  if (rc == size)
+    rc = 0;
+  else
+    rc = rc >= 0 ? (rc > size ? -EINVAL : -ENXIO) : rc;
+
+done:
+  RSHIM_PROBE2(write_rshim_return, bd->index, rc);
+  return rc;
+}
+
+static void rshim_usb_posted_write_callback(struct libusb_transfer *urb)
+{
+  rshim_usb_t *dev = urb->user_data;
+  rshim_backend_t *bd = &dev->bd;
+
+  if (urb->status != LIBUSB_TRANSFER_COMPLETED ||
+      urb->actual_length != urb->length - LIBUSB_CONTROL_SETUP_SIZE)
+    RSHIM_DBG("rshim%d posted write failed, status %d, length %d\n",
+              bd->index, urb->status, urb->actual_length);
+
+  /* The buffer is freed together with the transfer. */
+  libusb_free_transfer(urb);
+
+  /* Submit the next queued write in its place. */
+  pthread_mutex_lock(&dev->posted_lock);
+  dev->posted_writes--;
+  rshim_usb_posted_kick(dev, false);
+  if (dev->gone && !dev->posted_writes) {
+    rshim_usb_need_close = true;
+    rshim_work_signal(NULL);
+  }
+  pthread_mutex_unlock(&dev->posted_lock);
+
+  /*
+   * Drop the reference taken at submission. If it's the last one, the
+   * device is freed by the main loop.
+   */
+  rshim_usb_deref(bd);
+}
+
+/*
+ * Post a control write without waiting for its completion, which is handled
+ * by the libusb event thread. Requests to the control endpoint complete in
+ * the order they are submitted, and the blocking reads/writes submit the
+ * queued writes first, so posted writes stay ordered against them. Returns
+ * -EBUSY if the queue is full, e.g. when the device or the hub stops
+ * responding.
+ */
+static int rshim_usb_write_rshim_posted(rshim_backend_t *bd, uint32_t chan,
+                                        uint32_t addr, uint64_t value,
+                                        int size)
+{
+  rshim_usb_t *dev = container_of(bd, rshim_usb_t, bd);
+  struct rshim_usb_addr rsh_usb_addr;
+  struct libusb_transfer *urb;
+  unsigned char *buf;
+  int rc = 0;
+
+  if (!bd->has_rshim || !dev->handle)
+    return -ENODEV;
+
+  if ((bd->ver_id == RSHIM_BLUEFIELD_3) && (size <= RSHIM_REG_SIZE_4B))
+    size = RSHIM_REG_SIZE_4B;
+  else
+    size = RSHIM_REG_SIZE_8B;
+
+  urb = libusb_alloc_transfer(0);
+  buf = malloc(LIBUSB_CONTROL_SETUP_SIZE + sizeof(value));
+  if (!urb || !buf) {
+    libusb_free_transfer(urb);
+    free(buf);
+    return -ENOMEM;
+  }
+
+  rsh_usb_addr = get_wvalue_windex(chan, addr, bd->ver_id);
+  rshim_usb_cache_write(bd, chan, addr);
+  libusb_fill_control_setup(buf,
+                            LIBUSB_ENDPOINT_OUT |
+                            LIBUSB_REQUEST_TYPE_VENDOR |
+                            LIBUSB_RECIPIENT_ENDPOINT,
+                            0, rsh_usb_addr.wvalue, rsh_usb_addr.windex,
+                            size);
+  value = htole64(value);
+  memcpy(buf + LIBUSB_CONTROL_SETUP_SIZE, &value, size);
+  libusb_fill_control_transfer(urb, dev->handle, buf,
+                               rshim_usb_posted_write_callback, dev,
+                               RSHIM_USB_TIMEOUT);
+  urb->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+
+  /* Keep the device around until the transfer completes. */
+  rshim_ref(bd);
+
+  pthread_mutex_lock(&dev->posted_lock);
+  if (!dev->posted_count &&
+      dev->posted_writes < RSHIM_USB_MAX_POSTED_WRITES) {
+    rc = rshim_usb_posted_submit(dev, urb);
+  } else if (dev->posted_count < RSHIM_USB_POSTED_QUEUE_SIZE) {
+    dev->posted_queue[(dev->posted_head + dev->posted_count) %
+                      RSHIM_USB_POSTED_QUEUE_SIZE] = urb;
+    dev->posted_count++;
+  } else {
+    rc = -EBUSY;
+  }
+  pthread_mutex_unlock(&dev->posted_lock);
+
+  if (rc) {
+    libusb_free_transfer(urb);
+    rshim_deref(bd);
+  }
+
+  return rc;
 }
 
 static ssize_t rshim_usb_bf3_boot_write(rshim_backend_t *bd, const char *buf,
@@ -785,12 +1245,25 @@ static int rshim_usb_probe_one(libusb_context *ctx, libusb_device *usb_dev,
     bd->destroy = rshim_usb_delete;
     bd->read_rshim = rshim_usb_read_rshim;
     bd->write_rshim = rshim_usb_write_rshim;
+    bd->write_rshim_posted = rshim_usb_write_rshim_posted;
     bd->has_reprobe = 1;
+    bd->reg_poll_min = RSHIM_USB_REG_POLL_MIN;
     pthread_mutex_init(&bd->mutex, NULL);
+    pthread_mutex_init(&dev->cache_lock, NULL);
+    pthread_mutex_init(&dev->posted_lock, NULL);
   }
 
+  /* It might be a different device (or firmware) after re-attach. */
+  rshim_usb_cache_invalidate(bd, 0, 0, RSHIM_USB_CACHE_STATIC);
+
   rshim_ref(bd);
   bd->dev = usb_dev;
+
+  /* The transfers on the handle of the device which left are done by now. */
+  if (dev->gone) {
+    dev->gone = false;
+    libusb_close(dev->handle);
+  }
   dev->handle = handle;
   switch (desc->idProduct) {
     case USB_BLUEFIELD_2_PRODUCT_ID:
@@ -945,15 +1418,13 @@ error:
   return rc;
 }
 
+/* Disconnect a device which left, called from the main loop. */
 static void rshim_usb_disconnect(struct libusb_device *usb_dev)
 {
   rshim_backend_t *bd;
   rshim_usb_t *dev;
 
-  if (rshim_trylock()) {
-    RSHIM_ERR("rshim_trylock failed\n");
-    return;
-  }
+  rshim_lock();
 
   bd = rshim_find_by_dev(usb_dev);
   if (!bd) {
@@ -967,12 +1438,10 @@ static void rshim_usb_disconnect(struct libusb_device *usb_dev)
 
   /*
    * Clear this interface so we don't unregister our devices next
-   * time.
+   * time. A thread holding the mutex for a transfer to the device which
+   * left gets an error soon, so it's fine to wait for it here.
    */
-  if (pthread_mutex_trylock(&bd->mutex)) {
-    rshim_unlock();
-    return;
-  }
+  pthread_mutex_lock(&bd->mutex);
 
   bd->has_rshim = 0;
 
@@ -1016,62 +1485,46 @@ static void rshim_usb_disconnect(struct libusb_device *usb_dev)
 
   pthread_mutex_unlock(&bd->mutex);
 
-  if (dev->handle) {
+  rshim_usb_posted_drop(dev);
+
+  /*
+   * The posted writes in flight hold references and fail quickly now, so
+   * rather than waiting for them here, the handle is closed by
+   * rshim_usb_poll() after the last completion.
+   */
+  pthread_mutex_lock(&dev->posted_lock);
+  if (dev->posted_writes) {
+    dev->gone = true;
+  } else if (dev->handle) {
     libusb_close(dev->handle);
     dev->handle = NULL;
   }
+  pthread_mutex_unlock(&dev->posted_lock);
 
   rshim_deref(bd);
   rshim_unlock();
 }
 
-static int rshim_usb_add_poll(libusb_context *ctx)
+/* Close the handles of the devices which left, with rshim_lock held. */
+static void rshim_usb_close_gone(void)
 {
-  const struct libusb_pollfd **usb_pollfd = libusb_get_pollfds(ctx);
-  struct epoll_event event;
-  int i = 0, rc = -ENODEV;
-
-  if (!usb_pollfd)
-    return rc;
-
-  memset(&event, 0, sizeof(event));
-
-  while (usb_pollfd[i]) {
-    event.data.fd = usb_pollfd[i]->fd;
-    event.events = 0;
-
-#define	RSHIM_CONVERT(flag) do { \
-  if (usb_pollfd[i]->events & flag) \
-    event.events |= E##flag; \
-} while (0)
-
-  RSHIM_CONVERT(POLLIN);
-  RSHIM_CONVERT(POLLOUT);
-#ifdef __linux__
-  RSHIM_CONVERT(POLLRDNORM);
-  RSHIM_CONVERT(POLLRDBAND);
-  RSHIM_CONVERT(POLLWRNORM);
-  RSHIM_CONVERT(POLLWRBAND);
-  RSHIM_CONVERT(POLLWRBAND);
-#endif
-  RSHIM_CONVERT(POLLERR);
-  RSHIM_CONVERT(POLLHUP);
-
-#undef RSHIM_CONVERT
+  rshim_backend_t *bd;
+  rshim_usb_t *dev;
+  int i;
 
-    rc = epoll_ctl(rshim_usb_epoll_fd, EPOLL_CTL_ADD, usb_pollfd[i]->fd,
-                   &event);
-    if (rc == -1 && errno != EEXIST)
-      RSHIM_ERR("epoll_ctl failed; %m\n");
-    i++;
+  for (i = 0; i < RSHIM_MAX_DEV; i++) {
+    bd = rshim_devs[i];
+    if (!bd || bd->destroy != rshim_usb_delete)
+      continue;
+    dev = container_of(bd, rshim_usb_t, bd);
+    pthread_mutex_lock(&dev->posted_lock);
+    if (dev->gone && !dev->posted_writes) {
+      dev->gone = false;
+      libusb_close(dev->handle);
+      dev->handle = NULL;
+    }
+    pthread_mutex_unlock(&dev->posted_lock);
   }
-
-  free(usb_pollfd);
-
-  /* Notify the polling thread. */
-  rshim_work_signal(NULL);
-
-  return rc;
 }
 
 #if LIBUSB_API_VERSION >= 0x01000102
@@ -1091,19 +1544,29 @@ static int rshim_hotplug_callback(struct libusb_context *ctx,
      */
     RSHIM_INFO("USB device detected\n");
     rshim_usb_need_probe = true;
+    __sync_synchronize();
+    rshim_work_signal(NULL);
     break;
 
   case LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT:
+    /*
+     * Freeing the device here would race with the main loop, so hand it
+     * over to rshim_usb_poll().
+     */
     RSHIM_INFO("USB device leaving\n");
-    rshim_usb_disconnect(dev);
+    pthread_mutex_lock(&rshim_usb_left_lock);
+    if (rshim_usb_num_left < RSHIM_USB_MAX_LEFT)
+      rshim_usb_left[rshim_usb_num_left++] = libusb_ref_device(dev);
+    else
+      RSHIM_WARN("too many USB devices leaving\n");
+    pthread_mutex_unlock(&rshim_usb_left_lock);
+    rshim_work_signal(NULL);
     break;
 
   default:
     break;
   }
 
-  rshim_usb_add_poll(ctx);
-
   return 0;	/* keep filter registered */
 }
 #endif
@@ -1137,14 +1600,30 @@ static bool rshim_usb_probe(void)
     }
   }
 
-  rc = rshim_usb_add_poll(ctx);
-  if (rc)
-    return false;
-
   return true;
 }
 
-int rshim_usb_init(int epoll_fd)
+/*
+ * USB event thread. URB completions and hotplug events are handled here as
+ * soon as they arrive instead of from the tail of the main loop. Note that
+ * the callbacks could still run in other threads which wait for a blocking
+ * transfer, so they should not assume any particular thread context.
+ */
+static void *rshim_usb_event_thread(void *arg)
+{
+  struct timeval tv;
+
+  while (rshim_run) {
+    /* Use a timeout so the thread notices when the driver stops. */
+    tv.tv_sec = 1;
+    tv.tv_usec = 0;
+    libusb_handle_events_timeout_completed(rshim_usb_ctx, &tv, NULL);
+  }
+
+  return NULL;
+}
+
+int rshim_usb_init(void)
 {
   libusb_context *ctx = NULL;
   int rc, i, num;
@@ -1161,7 +1640,6 @@ int rshim_usb_init(int epoll_fd)
 #endif
 
   rshim_usb_ctx = ctx;
-  rshim_usb_epoll_fd = epoll_fd;
 
 #if LIBUSB_API_VERSION >= 0x01000102
   num = sizeof(rshim_usb_product_ids) / sizeof(rshim_usb_product_ids[0]);
@@ -1206,30 +1684,111 @@ int rshim_usb_init(int epoll_fd)
   rshim_usb_probe();
 #endif
 
+  rc = pthread_create(&rshim_usb_thread, NULL, rshim_usb_event_thread, NULL);
+  if (rc) {
+    RSHIM_ERR("Failed to create USB event thread\n");
+    libusb_exit(ctx);
+    rshim_usb_ctx = NULL;
+    return -rc;
+  }
+
   return 0;
 }
 
-void rshim_usb_poll(bool blocking)
+/* Disconnect the devices which left and probe new ones from the main loop. */
+void rshim_usb_poll(void)
 {
-  bool found = false;
-  struct timeval tv = {0, 0};
+  libusb_device *left[RSHIM_USB_MAX_LEFT];
+  int i, num;
 
   if (!rshim_usb_ctx)
     return;
 
+  pthread_mutex_lock(&rshim_usb_left_lock);
+  num = rshim_usb_num_left;
+  memcpy(left, rshim_usb_left, num * sizeof(left[0]));
+  rshim_usb_num_left = 0;
+  pthread_mutex_unlock(&rshim_usb_left_lock);
+
+  for (i = 0; i < num; i++) {
+    rshim_usb_disconnect(left[i]);
+    libusb_unref_device(left[i]);
+  }
+
+  if (rshim_usb_need_close || rshim_usb_num_dead) {
+    rshim_lock();
+    if (rshim_usb_need_close) {
+      rshim_usb_need_close = false;
+      rshim_usb_close_gone();
+    }
+    rshim_usb_reap();
+    rshim_unlock();
+  }
+
   if (rshim_usb_need_probe) {
     rshim_usb_need_probe = false;
     __sync_synchronize();
-    found = rshim_usb_probe();
+    rshim_usb_probe();
   }
+}
 
-  if (blocking && !found) {
-    /* Handle USB events (like hot-plugin) in blocking mode. */
-    libusb_handle_events_completed(rshim_usb_ctx, NULL);
+/*
+ * Stop the event thread, which exits once rshim_run is cleared, and release
+ * the USB devices and libusb. Called before rshim_stop() so that no URB or
+ * hotplug callback runs while the devices are deregistered.
+ */
+void rshim_usb_exit(void)
+{
+  struct timeval tv = { .tv_sec = 0, .tv_usec = 100000 };
+  rshim_backend_t *bd;
+  rshim_usb_t *dev;
+  int i;
 
-    /* Wake up the main thread. */
-    rshim_work_signal(NULL);
-  } else {
-    libusb_handle_events_timeout_completed(rshim_usb_ctx, &tv, NULL);
+  if (!rshim_usb_ctx)
+    return;
+
+  pthread_join(rshim_usb_thread, NULL);
+
+  rshim_lock();
+  for (i = 0; i < RSHIM_MAX_DEV; i++) {
+    bd = rshim_devs[i];
+    if (!bd || bd->destroy != rshim_usb_delete)
+      continue;
+    dev = container_of(bd, rshim_usb_t, bd);
+    if (!dev->handle)
+      continue;
+    bd->has_rshim = 0;
+    if (dev->read_or_intr_urb)
+      libusb_cancel_transfer(dev->read_or_intr_urb);
+    if (dev->write_urb)
+      libusb_cancel_transfer(dev->write_urb);
+    rshim_usb_posted_drop(dev);
   }
+  rshim_unlock();
+
+  /* Reap the cancelled and posted transfers. */
+  libusb_handle_events_timeout_completed(rshim_usb_ctx, &tv, NULL);
+
+  rshim_lock();
+  for (i = 0; i < RSHIM_MAX_DEV; i++) {
+    bd = rshim_devs[i];
+    if (!bd || bd->destroy != rshim_usb_delete)
+      continue;
+    dev = container_of(bd, rshim_usb_t, bd);
+    if (dev->handle) {
+      libusb_close(dev->handle);
+      dev->handle = NULL;
+    }
+  }
+  rshim_usb_reap();
+  rshim_unlock();
+
+  pthread_mutex_lock(&rshim_usb_left_lock);
+  for (i = 0; i < rshim_usb_num_left; i++)
+    libusb_unref_device(rshim_usb_left[i]);
+  rshim_usb_num_left = 0;
+  pthread_mutex_unlock(&rshim_usb_left_lock);
+
+  libusb_exit(rshim_usb_ctx);
+  rshim_usb_ctx = NULL;
 }
@@ -0,0 +1,487 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2019 Mellanox Technologies. All Rights Reserved.
+ *
+ */
+
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "rshim.h"
+
+/*
+ * Console pattern watcher.
+ *
+ * The console stream of every device is matched against the patterns of
+ * the 'CONSOLE_WATCH <name> <text>' lines in rshim.conf while it's being
+ * demultiplexed, whether or not anyone has the console open. A match bumps
+ * a per-device counter and wakes up the device worker, which logs it,
+ * sends a "rshim<N> <name> <count> <line>" message to the clients of
+ * RSHIM_CONS_SOCK_DIR/watch.sock and, with CONSOLE_WATCH_SNAPSHOT set,
+ * saves the rshim log to RSHIM_CONS_SOCK_DIR/rshim<N>-<name>.log.
+ *
+ * The scan runs in rshim_fifo_input() with the ringlock held, so it has to
+ * be much faster than the FIFO itself. Each pattern is anchored on its first
+ * two bytes; 16 bytes are checked for all the anchors at once with vector
+ * compares and only the positions which pass the filter are compared with
+ * the patterns. Matches spanning two chunks are found by keeping the tail
+ * of the previous chunk.
+ *
+ * The patterns are read at startup only, so the scanner never changes while
+ * the devices are running.
+ */
+
+#define RSHIM_WATCH_MAX_CLIENTS   8
+#define RSHIM_WATCH_SNAPSHOT_SIZE 16384
+
+typedef uint8_t rshim_watch_vec_t __attribute__ ((vector_size(16)));
+typedef int8_t rshim_watch_mask_t __attribute__ ((vector_size(16)));
+
+typedef struct {
+  char name[RSHIM_WATCH_NAME_LEN];
+  char text[RSHIM_WATCH_PATTERN_LEN];
+  int len;
+} rshim_watch_pattern_t;
+
+/* Per-device state. */
+struct rshim_watch {
+  /* Last bytes of the previous chunk, for matches across chunks. */
+  uint8_t tail[RSHIM_WATCH_PATTERN_LEN];
+  int tail_len;
+
+  /* Patterns matched but not reported yet. */
+  volatile uint32_t pending;
+
+  uint64_t count[RSHIM_WATCH_MAX];
+  char line[RSHIM_WATCH_MAX][RSHIM_WATCH_LINE_LEN];
+};
+
+bool rshim_watch_snapshot;
+
+static rshim_watch_pattern_t rshim_watch_patterns[RSHIM_WATCH_MAX];
+static int rshim_watch_num;
+static int rshim_watch_max_len;
+
+/* Distinct two-byte anchors and the patterns starting with each of them. */
+static rshim_watch_vec_t rshim_watch_b0[RSHIM_WATCH_MAX];
+static rshim_watch_vec_t rshim_watch_b1[RSHIM_WATCH_MAX];
+static uint32_t rshim_watch_anchor_mask[RSHIM_WATCH_MAX];
+static int rshim_watch_num_anchors;
+
+static int rshim_watch_listen_fd = -1;
+static int rshim_watch_client_fd[RSHIM_WATCH_MAX_CLIENTS] = {
+  [0 ... RSHIM_WATCH_MAX_CLIENTS - 1] = -1
+};
+
+/* Add a pattern from the configuration file. */
+int rshim_watch_add(const char *name, const char *text)
+{
+  rshim_watch_pattern_t *pat;
+  uint8_t b0, b1;
+  int i, len;
+
+  len = strlen(text);
+  if (len < 2 || len >= RSHIM_WATCH_PATTERN_LEN) {
+    RSHIM_WARN("console watch '%s': pattern must be 2 to %d bytes\n", name,
+               RSHIM_WATCH_PATTERN_LEN - 1);
+    return -EINVAL;
+  }
+
+  if (rshim_watch_num == RSHIM_WATCH_MAX) {
+    RSHIM_WARN("console watch '%s': too many patterns\n", name);
+    return -ENOSPC;
+  }
+
+  pat = &rshim_watch_patterns[rshim_watch_num];
+  snprintf(pat->name, sizeof(pat->name), "%s", name);
+  memcpy(pat->text, text, len + 1);
+  pat->len = len;
+
+  b0 = text[0];
+  b1 = text[1];
+  for (i = 0; i < rshim_watch_num_anchors; i++) {
+    if (rshim_watch_b0[i][0] == b0 && rshim_watch_b1[i][0] == b1)
+      break;
+  }
+  if (i == rshim_watch_num_anchors) {
+    /* Zero-initialized vectors plus a scalar splat. */
+    rshim_watch_b0[i] = rshim_watch_b0[i] + b0;
+    rshim_watch_b1[i] = rshim_watch_b1[i] + b1;
+    rshim_watch_num_anchors++;
+  }
+  rshim_watch_anchor_mask[i] |= 1U << rshim_watch_num;
+
+  rshim_watch_num++;
+  if (len > rshim_watch_max_len)
+    rshim_watch_max_len = len;
+
+  return 0;
+}
+
+int rshim_watch_init(rshim_backend_t *bd)
+{
+  if (!rshim_watch_num || bd->watch)
+    return 0;
+
+  bd->watch = calloc(1, sizeof(*bd->watch));
+  if (!bd->watch)
+    return -ENOMEM;
+
+  return 0;
+}
+
+void rshim_watch_free(rshim_backend_t *bd)
+{
+  free(bd->watch);
+  bd->watch = NULL;
+}
+
+/* Save the line of a match, up to the end of the available data. */
+static void rshim_watch_save_line(struct rshim_watch *w, int i,
+                                  const uint8_t *p, const uint8_t *end)
+{
+  char *line = w->line[i];
+  int n = 0;
+
+  for (; p < end && n < RSHIM_WATCH_LINE_LEN - 1; p++) {
+    if (*p == '\n' || *p == '\r')
+      break;
+    line[n++] = (*p >= ' ' && *p < 0x7f) ? *p : '.';
+  }
+  line[n] = 0;
+}
+
+static void rshim_watch_hit(struct rshim_watch *w, int i, const uint8_t *p,
+                            const uint8_t *end)
+{
+  w->count[i]++;
+  rshim_watch_save_line(w, i, p, end);
+  __sync_fetch_and_or(&w->pending, 1U << i);
+}
+
+/*
+ * Check the patterns of the anchors in 'mask' at 'p'. Only matches ending
+ * after 'min_end' are counted.
+ */
+static uint32_t rshim_watch_verify(struct rshim_watch *w, uint32_t mask,
+                                   const uint8_t *p, const uint8_t *end,
+                                   const uint8_t *min_end)
+{
+  uint32_t hits = 0;
+  int i;
+
+  while (mask) {
+    i = __builtin_ctz(mask);
+    mask &= mask - 1;
+
+    if (p + rshim_watch_patterns[i].len <= end &&
+        p + rshim_watch_patterns[i].len > min_end &&
+        !memcmp(p, rshim_watch_patterns[i].text, rshim_watch_patterns[i].len)) {
+      rshim_watch_hit(w, i, p, end);
+      hits |= 1U << i;
+    }
+  }
+
+  return hits;
+}
+
+/* Scalar scan, for the block boundaries and the last bytes of a chunk. */
+static uint32_t rshim_watch_scan_scalar(struct rshim_watch *w,
+                                        const uint8_t *p, const uint8_t *stop,
+                                        const uint8_t *end,
+                                        const uint8_t *min_end)
+{
+  uint32_t hits = 0;
+  int i;
+
+  for (; p < stop && p + 1 < end; p++) {
+    for (i = 0; i < rshim_watch_num_anchors; i++) {
+      if (p[0] == rshim_watch_b0[i][0] && p[1] == rshim_watch_b1[i][0])
+        hits |= rshim_watch_verify(w, rshim_watch_anchor_mask[i], p, end,
+                                   min_end);
+    }
+  }
+
+  return hits;
+}
+
+/* Vector scan of [p, end), 16 candidate positions at a time. */
+static uint32_t rshim_watch_scan(struct rshim_watch *w, const uint8_t *p,
+                                 const uint8_t *end)
+{
+  rshim_watch_vec_t v0, v1;
+  rshim_watch_mask_t m;
+  uint64_t word[2];
+  uint32_t hits = 0;
+  int i, j;
+
+  /* v1 is loaded at p + 1, so keep one byte beyond the block. */
+  for (; p + sizeof(v0) < end; p += sizeof(v0)) {
+    memcpy(&v0, p, sizeof(v0));
+    memcpy(&v1, p + 1, sizeof(v1));
+
+    m = (rshim_watch_mask_t)(v0 == rshim_watch_b0[0]) &
+        (rshim_watch_mask_t)(v1 == rshim_watch_b1[0]);
+    for (i = 1; i < rshim_watch_num_anchors; i++)
+      m |= (rshim_watch_mask_t)(v0 == rshim_watch_b0[i]) &
+           (rshim_watch_mask_t)(v1 == rshim_watch_b1[i]);
+
+    memcpy(word, &m, sizeof(word));
+    if (!(word[0] | word[1]))
+      continue;
+
+    /* Rare: find the candidates and their anchors. */
+    for (j = 0; j < (int)sizeof(v0); j++) {
+      if (!m[j])
+        continue;
+      for (i = 0; i < rshim_watch_num_anchors; i++) {
+        if (p[j] == rshim_watch_b0[i][0] && p[j + 1] == rshim_watch_b1[i][0])
+          hits |= rshim_watch_verify(w, rshim_watch_anchor_mask[i], p + j,
+                                     end, p + j);
+      }
+    }
+  }
+
+  return hits | rshim_watch_scan_scalar(w, p, end, end, p);
+}
+
+/*
+ * Scan a chunk of console output. Called from rshim_fifo_input() with the
+ * ringlock held.
+ */
+void rshim_watch_input(rshim_backend_t *bd, const uint8_t *data, int len)
+{
+  struct rshim_watch *w = bd->watch;
+  uint8_t buf[RSHIM_WATCH_PATTERN_LEN * 2];
+  uint32_t hits = 0;
+  int n, keep;
+
+  if (len <= 0)
+    return;
+
+  /* Matches which start in the tail of the previous chunk. */
+  if (w->tail_len) {
+    n = MIN(len, rshim_watch_max_len - 1);
+    memcpy(buf, w->tail, w->tail_len);
+    memcpy(buf + w->tail_len, data, n);
+    hits = rshim_watch_scan_scalar(w, buf, buf + w->tail_len,
+                                   buf + w->tail_len + n, buf + w->tail_len);
+  }
+
+  hits |= rshim_watch_scan(w, data, data + len);
+  if (hits)
+    RSHIM_PROBE3(console_match, bd->index, hits, len);
+
+  /* Keep the last bytes which could start a match. */
+  keep = rshim_watch_max_len - 1;
+  if (len >= keep) {
+    memcpy(w->tail, data + len - keep, keep);
+  } else {
+    n = MIN(w->tail_len, keep - len);
+    memmove(w->tail, w->tail + w->tail_len - n, n);
+    memcpy(w->tail + n, data, len);
+    len += n;
+  }
+  w->tail_len = MIN(len, keep);
+
+  if (w->pending)
+    rshim_work_signal(bd);
+}
+
+/* Send a message to all the watch clients; drop the ones which fail. */
+static void rshim_watch_send(const char *msg, int len)
+{
+  int i;
+
+  for (i = 0; i < RSHIM_WATCH_MAX_CLIENTS; i++) {
+    if (rshim_watch_client_fd[i] < 0)
+      continue;
+    if (send(rshim_watch_client_fd[i], msg, len,
+             MSG_DONTWAIT | MSG_NOSIGNAL) < 0 && errno != EAGAIN) {
+      close(rshim_watch_client_fd[i]);
+      rshim_watch_client_fd[i] = -1;
+    }
+  }
+}
+
+static void rshim_watch_save_log(rshim_backend_t *bd, const char *name)
+{
+  char path[128], *buf;
+  int fd, len;
+
+  if (!bd->has_rshim || bd->drop_mode)
+    return;
+
+  buf = malloc(RSHIM_WATCH_SNAPSHOT_SIZE);
+  if (!buf)
+    return;
+
+  len = rshim_log_show(bd, buf, RSHIM_WATCH_SNAPSHOT_SIZE);
+
+  snprintf(path, sizeof(path), "%s/rshim%d-%s.log", RSHIM_CONS_SOCK_DIR,
+           bd->index, name);
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    RSHIM_ERR("failed to open %s: %m\n", path);
+  } else {
+    if (write(fd, buf, len) != len)
+      RSHIM_ERR("failed to write %s\n", path);
+    close(fd);
+  }
+
+  free(buf);
+}
+
+/* Report the pending matches. Called from the device worker. */
+void rshim_watch_work(rshim_backend_t *bd)
+{
+  struct rshim_watch *w = bd->watch;
+  char msg[RSHIM_WATCH_LINE_LEN + 64];
+  uint32_t pending;
+  uint64_t count;
+  int i, len;
+
+  if (!w || !w->pending)
+    return;
+
+  pending = __sync_fetch_and_and(&w->pending, 0);
+
+  while (pending) {
+    i = __builtin_ctz(pending);
+    pending &= pending - 1;
+
+    pthread_mutex_lock(&bd->ringlock);
+    count = w->count[i];
+    len = snprintf(msg, sizeof(msg), "rshim%d %s %llu %s\n", bd->index,
+                   rshim_watch_patterns[i].name, (unsigned long long)count,
+                   w->line[i]);
+    pthread_mutex_unlock(&bd->ringlock);
+    len = MIN(len, (int)sizeof(msg) - 1);
+
+    /* The line could change once ringlock is dropped, so log the copy. */
+    RSHIM_INFO("console match: %.*s\n", len - (msg[len - 1] == '\n'), msg);
+    rshim_watch_send(msg, len);
+
+    if (rshim_watch_snapshot)
+      rshim_watch_save_log(bd, rshim_watch_patterns[i].name);
+  }
+}
+
+/* Match counters for the misc file. */
+int rshim_watch_show(rshim_backend_t *bd, char *buf, int len)
+{
+  char *p = buf;
+  int i, n;
+
+  if (!bd->watch || len <= 0)
+    return 0;
+
+  n = snprintf(p, len, "%-16s", "CONSOLE_WATCH");
+  for (i = 0; i < rshim_watch_num && n < len; i++)
+    n += snprintf(p + n, len - n, "%s%s=%llu", i ? " " : "",
+                  rshim_watch_patterns[i].name,
+                  (unsigned long long)bd->watch->count[i]);
+  if (n < len)
+    n += snprintf(p + n, len - n, "\n");
+
+  return MIN(n, len - 1);
+}
+
+static void rshim_watch_path(struct sockaddr_un *addr)
+{
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/watch.sock",
+           RSHIM_CONS_SOCK_DIR);
+}
+
+/* Listen for notification clients if any pattern is configured. */
+int rshim_watch_listen(void)
+{
+  struct epoll_event event;
+  struct sockaddr_un addr;
+  int fd;
+
+  if (!rshim_watch_num)
+    return -1;
+
+  if (mkdir(RSHIM_CONS_SOCK_DIR, 0755) && errno != EEXIST) {
+    RSHIM_ERR("Failed to create %s: %m\n", RSHIM_CONS_SOCK_DIR);
+    return -errno;
+  }
+
+  rshim_watch_path(&addr);
+  unlink(addr.sun_path);
+
+  fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (fd < 0) {
+    RSHIM_ERR("socket failed: %m\n");
+    return -errno;
+  }
+
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+      chmod(addr.sun_path, 0600) || listen(fd, RSHIM_WATCH_MAX_CLIENTS)) {
+    RSHIM_ERR("Failed to listen on %s: %m\n", addr.sun_path);
+    close(fd);
+    unlink(addr.sun_path);
+    return -errno;
+  }
+
+  memset(&event, 0, sizeof(event));
+  event.data.fd = fd;
+  event.events = EPOLLIN;
+  if (epoll_ctl(rshim_epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+    RSHIM_ERR("epoll_ctl failed: %d %d\n", rshim_epoll_fd, fd);
+    close(fd);
+    unlink(addr.sun_path);
+    return -1;
+  }
+
+  RSHIM_INFO("watching the console for %d patterns\n", rshim_watch_num);
+  rshim_watch_listen_fd = fd;
+  return fd;
+}
+
+void rshim_watch_accept(void)
+{
+  int fd, i;
+
+  fd = accept(rshim_watch_listen_fd, NULL, NULL);
+  if (fd < 0)
+    return;
+
+  for (i = 0; i < RSHIM_WATCH_MAX_CLIENTS; i++) {
+    if (rshim_watch_client_fd[i] < 0) {
+      rshim_watch_client_fd[i] = fd;
+      return;
+    }
+  }
+
+  RSHIM_WARN("too many console watch clients\n");
+  close(fd);
+}
+
+void rshim_watch_close(void)
+{
+  struct sockaddr_un addr;
+  int i;
+
+  if (rshim_watch_listen_fd < 0)
+    return;
+
+  for (i = 0; i < RSHIM_WATCH_MAX_CLIENTS; i++) {
+    if (rshim_watch_client_fd[i] >= 0) {
+      close(rshim_watch_client_fd[i]);
+      rshim_watch_client_fd[i] = -1;
+    }
+  }
+
+  close(rshim_watch_listen_fd);
+  rshim_watch_listen_fd = -1;
+  rshim_watch_path(&addr);
+  unlink(addr.sun_path);
+}